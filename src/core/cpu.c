@@ -0,0 +1,206 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#include "cpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CPU_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(CPU_X86)
+#include <cpuid.h>
+#endif
+
+/* Marks the cached feature set as not yet detected. */
+#define CPU_UNKNOWN 0x80000000
+
+/**
+ * The detected features. Detection is idempotent, so racing threads will all
+ * store the same value.
+ */
+static volatile uint32_t detected = CPU_UNKNOWN;
+
+/**
+ * The features CPU_features is allowed to report.
+ */
+static volatile uint32_t allowed = CPU_ALL;
+
+/**
+ * The names of the features accepted in the CPU_ENVIRONMENT variable.
+ */
+static const struct {
+    const char* name;
+    uint32_t features;
+} featureNames[] = {
+    { "sse2",   CPU_SSE2 },
+    { "ssse3",  CPU_SSSE3 },
+    { "sse4.1", CPU_SSE41 },
+    { "pclmul", CPU_PCLMUL },
+    { "avx2",   CPU_AVX2 },
+    { "sha",    CPU_SHA },
+    { "bmi2",   CPU_BMI2 },
+    { "all",    CPU_ALL },
+    { "none",   0 }
+};
+
+#if defined(CPU_X86)
+/**
+ * Executes the CPUID instruction.
+ * @param leaf    The leaf (EAX) to query.
+ * @param subleaf The sub-leaf (ECX) to query.
+ * @param regs    Receives EAX, EBX, ECX and EDX in that order.
+ */
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, (int)leaf, (int)subleaf);
+    regs[0] = (uint32_t)info[0];
+    regs[1] = (uint32_t)info[1];
+    regs[2] = (uint32_t)info[2];
+    regs[3] = (uint32_t)info[3];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/**
+ * Reads the XCR0 register to find out which register states the operating
+ * system saves on a context switch. Must only be called if OSXSAVE is set.
+ * @returns The low 32-bits of XCR0.
+ */
+static uint32_t xgetbv(void) {
+#if defined(_MSC_VER)
+    return (uint32_t)_xgetbv(0);
+#else
+    uint32_t eax;
+    uint32_t edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+#endif
+}
+
+/**
+ * Queries CPUID for the features used by the accelerated kernels.
+ * @returns The supported features as a combination of the CPU_* flags.
+ */
+static uint32_t detect(void) {
+    uint32_t regs[4];
+    uint32_t maxLeaf;
+    uint32_t features = 0;
+
+    cpuid(0, 0, regs);
+    maxLeaf = regs[0];
+    if (maxLeaf < 1) {
+        return 0;
+    }
+
+    cpuid(1, 0, regs);
+    if (regs[3] & (1 << 26)) { features |= CPU_SSE2; }
+    if (regs[2] & (1 << 9))  { features |= CPU_SSSE3; }
+    if (regs[2] & (1 << 19)) { features |= CPU_SSE41; }
+    if (regs[2] & (1 << 1))  { features |= CPU_PCLMUL; }
+
+    if (maxLeaf >= 7) {
+        /* AVX2 also needs the OS to preserve the YMM registers (OSXSAVE set
+         * and XCR0 bits 1 and 2 enabled). */
+        int osYmm = (regs[2] & (1 << 27)) && (xgetbv() & 0x06) == 0x06;
+
+        cpuid(7, 0, regs);
+        if (osYmm && (regs[1] & (1 << 5))) { features |= CPU_AVX2; }
+        if (regs[1] & (1 << 29)) { features |= CPU_SHA; }
+        if (regs[1] & (1 << 8))  { features |= CPU_BMI2; }
+    }
+
+    return features;
+}
+#endif
+
+/**
+ * Reads the features allowed by the CPU_ENVIRONMENT variable. Unknown names are
+ * ignored.
+ * @returns The allowed features, or CPU_ALL if the variable isn't set.
+ */
+static uint32_t environment(void) {
+    uint32_t features = 0;
+    const char* start;
+    size_t length;
+    size_t idx;
+#if defined(_MSC_VER)
+    char* value = NULL;
+    size_t size = 0;
+
+    if (_dupenv_s(&value, &size, CPU_ENVIRONMENT) != 0 || value == NULL) {
+        return CPU_ALL;
+    }
+#else
+    const char* value = getenv(CPU_ENVIRONMENT);
+
+    if (value == NULL) {
+        return CPU_ALL;
+    }
+#endif
+
+    for (start = value; *start; start += length) {
+        start += strspn(start, ", ");
+        length = strcspn(start, ", ");
+
+        for (idx = 0; idx < sizeof(featureNames) / sizeof(featureNames[0]); ++idx) {
+            if (strlen(featureNames[idx].name) == length &&
+                strncmp(featureNames[idx].name, start, length) == 0) {
+                features |= featureNames[idx].features;
+            }
+        }
+    }
+
+#if defined(_MSC_VER)
+    free(value);
+#endif
+    return features;
+}
+
+/**
+ * Returns the instruction set extensions supported by the CPU (and operating
+ * system) as a combination of the CPU_* flags. The CPU is only queried on the
+ * first call, subsequent calls return the cached result.
+ * @returns The supported features, masked by the value set with CPU_restrict.
+ */
+uint32_t CPU_features(void) {
+    uint32_t features = detected;
+
+    if (features == CPU_UNKNOWN) {
+#if defined(CPU_X86)
+        features = detect() & environment();
+#else
+        features = 0;
+#endif
+        detected = features;
+    }
+
+    return features & allowed;
+}
+
+/**
+ * Restricts the features reported by CPU_features to the ones in mask. This is
+ * used to exercise the portable code paths on capable CPUs. Pass CPU_ALL to
+ * report every detected feature again.
+ * @param mask The CPU_* flags CPU_features is allowed to report.
+ */
+void CPU_restrict(uint32_t mask) {
+    allowed = mask & CPU_ALL;
+}
@@ -0,0 +1,86 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_CPU_H_
+#define __JMMHASHER_CPU_H_
+
+#include <stdint.h>
+
+/* CPU_X86 is defined when building for an x86 or x86-64 target with a compiler
+ * that provides the SSE/AVX intrinsics headers. Accelerated kernels are only
+ * compiled when it is defined. */
+#if defined(__i386__) || defined(__x86_64__) || \
+    defined(_M_IX86) || defined(_M_X64)
+#define CPU_X86 1
+#endif
+
+/* CPU_TARGET enables an instruction set for a single function so kernels can
+ * be compiled without raising the baseline of the whole library. MSVC doesn't
+ * need (or support) the attribute and always allows the intrinsics. */
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_TARGET(x) __attribute__((target(x)))
+#else
+#define CPU_TARGET(x)
+#endif
+
+/* CPU_INLINE forces a function into every caller, so a body shared by kernels
+ * built for different instruction sets is compiled again for each of them
+ * instead of being called as a single out of line copy. */
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CPU_INLINE __forceinline
+#else
+#define CPU_INLINE inline
+#endif
+
+/* Feature flags reported by CPU_features. */
+#define CPU_SSSE3  0x01
+#define CPU_SSE41  0x02
+#define CPU_PCLMUL 0x04
+#define CPU_AVX2   0x08
+#define CPU_SHA    0x10
+#define CPU_BMI2   0x20
+#define CPU_SSE2   0x40
+#define CPU_ALL    0x7F
+
+/* The environment variable that restricts the detected features, mostly for
+ * testing the portable kernels on capable machines. It holds a comma separated
+ * list of the features that may be used: sse2, ssse3, sse4.1, pclmul, avx2,
+ * sha and bmi2. "none" allows no features and "all" every feature. Features
+ * the CPU doesn't support are never reported, whatever the list says. */
+#define CPU_ENVIRONMENT "JMMHASHER_CPU"
+
+/**
+ * Returns the instruction set extensions supported by the CPU (and operating
+ * system) as a combination of the CPU_* flags. The CPU (and the CPU_ENVIRONMENT
+ * variable) is only queried on the first call, subsequent calls return the
+ * cached result.
+ * @returns The supported features, masked by the value set with CPU_restrict.
+ */
+uint32_t CPU_features(void);
+
+/**
+ * Restricts the features reported by CPU_features to the ones in mask. This is
+ * used to exercise the portable code paths on capable CPUs. Pass CPU_ALL to
+ * report every detected feature again.
+ * @param mask The CPU_* flags CPU_features is allowed to report.
+ */
+void CPU_restrict(uint32_t mask);
+
+#endif
@@ -19,6 +19,7 @@
 #ifndef __JMMHASHER_CRC32_H_
 #define __JMMHASHER_CRC32_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -29,6 +30,23 @@ typedef struct {
     uint32_t digest;
 } CRC32_Context;
 
+/* The slicing-by-16 lookup tables. CRC32_table[0] is the classic byte-at-a-time
+ * table, CRC32_table[n] advances a byte past n more zero bytes. */
+extern const uint32_t CRC32_table[16][256];
+
+/**
+ * Combines the CRC32 of two consecutive pieces of data into the CRC32 of the
+ * pieces concatenated, without needing the data itself. This allows separate
+ * ranges of a file to be processed independently and merged afterwards.
+ * @param crcA    The final CRC32 of the first piece of data.
+ * @param crcB    The final CRC32 of the second piece of data.
+ * @param lengthB The length of the second piece of data.
+ * @returns The final CRC32 of the first piece followed by the second piece.
+ * @remarks The values are the final (inverted) CRC32 digests, in the same
+ *          order as the bytes written by CRC32_final.
+ */
+uint32_t CRC32_combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
+
 /**
  * Performs the final operation on the CRC32_Context structure and copies the
  * result to the hash char buffer. The result stored in hash is converted for
@@ -54,4 +72,24 @@ void CRC32_init(CRC32_Context* crc);
  */
 void CRC32_update(CRC32_Context* crc, const void* buf, uint32_t length);
 
+/**
+ * Updates the CRC digest with data of any size, such as a whole mapped file. The
+ * data is handed to CRC32_update in pieces of at most 256MB. The CRC is a
+ * running register over the bytes, so splitting the data anywhere gives the
+ * same digest as a single CRC32_update call over all of it.
+ * @param crc    The structure containing the CRC digest to update.
+ * @param data   The data used to update the CRC digest.
+ * @param length The length of the data to digest.
+ */
+void CRC32_update_large(CRC32_Context* crc, const void* data, size_t length);
+
+/**
+ * Updates the CRC digest as if length zero bytes were passed to CRC32_update.
+ * A run of zeros only shifts the digest, so this takes logarithmic time in the
+ * length instead of reading any data.
+ * @param crc    The structure containing the CRC digest to update.
+ * @param length The number of zero bytes to digest.
+ */
+void CRC32_update_zeros(CRC32_Context* crc, uint64_t length);
+
 #endif
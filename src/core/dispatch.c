@@ -0,0 +1,342 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#include "dispatch.h"
+#include "cpu.h"
+#include "crc32.h"
+#include "md4.h"
+#include "md5.h"
+#include "sha1.h"
+#include "stitch.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Marks the selection as not yet made for any set of features. */
+#define DISPATCH_UNSELECTED 0xFFFFFFFF
+
+/* The size of the data the kernels are checked with. */
+#define CHECK_SIZE 1000
+
+/**
+ * A kernel that can be selected for an algorithm.
+ * @field kernel   The DISPATCH_* kernel.
+ * @field features The CPU_* flags the kernel needs.
+ */
+typedef struct {
+    uint32_t kernel;
+    uint32_t features;
+} Candidate;
+
+/**
+ * The kernels of every algorithm from the fastest to the slowest. Every list
+ * ends with the scalar kernel, which needs no features and always matches.
+ */
+static const Candidate candidates[DISPATCH_ALGORITHMS][4] = {
+    /* DISPATCH_CRC32 */
+    { { DISPATCH_PCLMUL, CPU_PCLMUL | CPU_SSE41 }, { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD4 */
+    { { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD4_MULTI */
+    { { DISPATCH_AVX2, CPU_AVX2 }, { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD5 */
+    { { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD5_MULTI */
+    { { DISPATCH_AVX2, CPU_SSE2 | CPU_AVX2 }, { DISPATCH_SSE2, CPU_SSE2 },
+      { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_SHA1 */
+    { { DISPATCH_SHANI, CPU_SHA | CPU_SSE41 | CPU_SSSE3 }, { DISPATCH_AVX2, CPU_AVX2 | CPU_BMI2 },
+      { DISPATCH_SSSE3, CPU_SSSE3 }, { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD5_SHA1 */
+    { { DISPATCH_SHANI, CPU_SHA | CPU_SSE41 | CPU_SSSE3 }, { DISPATCH_SCALAR, 0 } },
+    /* DISPATCH_MD4_CRC32 (PCLMUL means the two are updated separately) */
+    { { DISPATCH_PCLMUL, CPU_PCLMUL | CPU_SSE41 }, { DISPATCH_SCALAR, 0 } }
+};
+
+static const char* algorithmNames[DISPATCH_ALGORITHMS] = {
+    "crc32", "md4", "md4-lanes", "md5", "md5-lanes", "sha1", "md5+sha1", "md4+crc32"
+};
+
+static const char* kernelNames[DISPATCH_KERNELS] = {
+    "scalar", "sse2", "ssse3", "avx2", "sha-ni", "pclmul"
+};
+
+/* The known results for the check data. */
+static const unsigned char expectedCRC32[4] = { 0x81, 0xa7, 0x6a, 0x55 };
+static const unsigned char expectedMD4[16] = {
+    0xcc, 0x2a, 0x6b, 0x61, 0x9a, 0xdb, 0x1c, 0x3e,
+    0xfb, 0xc9, 0x59, 0x6d, 0x70, 0x73, 0xd0, 0xd4
+};
+static const unsigned char expectedMD5[16] = {
+    0xab, 0x2d, 0x9e, 0x9f, 0x4a, 0x24, 0x1f, 0x82,
+    0x74, 0xc3, 0x13, 0x2a, 0x64, 0xab, 0x8a, 0xbc
+};
+static const unsigned char expectedSHA1[20] = {
+    0xf8, 0xe2, 0x64, 0xc8, 0x02, 0xc3, 0x14, 0x2d, 0x9a, 0xb4,
+    0x07, 0x1f, 0x46, 0x9b, 0x2b, 0x16, 0xac, 0x65, 0x5a, 0xaf
+};
+
+/**
+ * The kernel selected for every algorithm, for the features in selectedFor.
+ * Selection is idempotent, so racing threads will all store the same values.
+ */
+static volatile uint32_t selected[DISPATCH_ALGORITHMS];
+static volatile uint32_t selectedFor = DISPATCH_UNSELECTED;
+
+/**
+ * The kernels of every algorithm that failed the check, as 1 << kernel.
+ */
+static volatile uint32_t disabled[DISPATCH_ALGORITHMS];
+
+/**
+ * Selects the fastest enabled kernel of every algorithm that the features
+ * allow.
+ * @param features The CPU_* flags to select the kernels for.
+ */
+static void select_kernels(uint32_t features) {
+    uint32_t algorithm;
+    uint32_t idx;
+
+    for (algorithm = 0; algorithm < DISPATCH_ALGORITHMS; ++algorithm) {
+        for (idx = 0; idx < 4; ++idx) {
+            const Candidate* candidate = &candidates[algorithm][idx];
+
+            if ((features & candidate->features) == candidate->features &&
+                (candidate->kernel == DISPATCH_SCALAR ||
+                 !(disabled[algorithm] & (1 << candidate->kernel)))) {
+                selected[algorithm] = candidate->kernel;
+                break;
+            }
+        }
+    }
+
+    selectedFor = features;
+}
+
+/**
+ * Checks the kernel selected for an algorithm against the known results. The
+ * lanes and stitched kernels are checked against the plain updates, which are
+ * checked first.
+ * @param algorithm The DISPATCH_* algorithm to check.
+ * @param data      CHECK_SIZE bytes of check data.
+ * @returns Returns 1 if the kernel calculated the right results, 0 if not.
+ */
+static int check(uint32_t algorithm, const unsigned char* data) {
+    unsigned char result[20];
+    unsigned char expected[20];
+    CRC32_Context crc32;
+    MD4_Context md4;
+    MD5_Context md5;
+    SHA1_Context sha1;
+    uint32_t idx;
+
+    switch (algorithm) {
+    case DISPATCH_CRC32:
+        CRC32_init(&crc32);
+        CRC32_update(&crc32, data, CHECK_SIZE);
+        CRC32_final(&crc32, result);
+        return memcmp(result, expectedCRC32, 4) == 0;
+
+    case DISPATCH_MD4:
+        MD4_init(&md4);
+        MD4_update(&md4, data, CHECK_SIZE);
+        MD4_final(&md4, result);
+        return memcmp(result, expectedMD4, 16) == 0;
+
+    case DISPATCH_MD4_MULTI: {
+        MD4_MultiContext multi;
+        const unsigned char* lanes[MD4_LANES];
+
+        for (idx = 0; idx < MD4_LANES; ++idx) {
+            lanes[idx] = data + idx * 64;
+        }
+
+        MD4_multi_init(&multi);
+        MD4_multi_update(&multi, lanes, 320);
+        for (idx = 0; idx < MD4_LANES; ++idx) {
+            MD4_init(&md4);
+            MD4_update(&md4, lanes[idx], 320);
+            MD4_final(&md4, expected);
+            MD4_multi_final(&multi, idx, result);
+            if (memcmp(result, expected, 16) != 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    case DISPATCH_MD5:
+        MD5_init(&md5);
+        MD5_update(&md5, data, CHECK_SIZE);
+        MD5_final(&md5, result);
+        return memcmp(result, expectedMD5, 16) == 0;
+
+    case DISPATCH_MD5_MULTI: {
+        /* More inputs than lanes, of different lengths, so lanes get refilled. */
+        MD5_Context contexts[10];
+        MD5_Context* md5s[10];
+        const void* inputs[10];
+        uint32_t lengths[10];
+
+        for (idx = 0; idx < 10; ++idx) {
+            md5s[idx] = &contexts[idx];
+            inputs[idx] = data + idx * 13;
+            lengths[idx] = CHECK_SIZE - idx * 50;
+            MD5_init(md5s[idx]);
+        }
+
+        MD5_update_multi(md5s, inputs, lengths, 10);
+        for (idx = 0; idx < 10; ++idx) {
+            MD5_init(&md5);
+            MD5_update(&md5, inputs[idx], lengths[idx]);
+            MD5_final(&md5, expected);
+            MD5_final(md5s[idx], result);
+            if (memcmp(result, expected, 16) != 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    case DISPATCH_SHA1:
+        SHA1_init(&sha1);
+        SHA1_update(&sha1, data, CHECK_SIZE);
+        SHA1_final(&sha1, result);
+        return memcmp(result, expectedSHA1, 20) == 0;
+
+    case DISPATCH_MD5_SHA1:
+        MD5_init(&md5);
+        SHA1_init(&sha1);
+        Stitch_MD5_SHA1_update(&md5, &sha1, data, CHECK_SIZE);
+        MD5_final(&md5, result);
+        if (memcmp(result, expectedMD5, 16) != 0) {
+            return 0;
+        }
+        SHA1_final(&sha1, result);
+        return memcmp(result, expectedSHA1, 20) == 0;
+
+    case DISPATCH_MD4_CRC32:
+        MD4_init(&md4);
+        CRC32_init(&crc32);
+        Stitch_MD4_CRC32_update(&md4, &crc32, data, CHECK_SIZE);
+        MD4_final(&md4, result);
+        if (memcmp(result, expectedMD4, 16) != 0) {
+            return 0;
+        }
+        CRC32_final(&crc32, result);
+        return memcmp(result, expectedCRC32, 4) == 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a line describing the kernel selected for every algorithm to buffer.
+ * @param buffer The buffer that receives the description.
+ * @param size   The size of the buffer in bytes.
+ * @returns The length of the full description, not counting the terminator.
+ */
+uint32_t Dispatch_describe(char* buffer, uint32_t size) {
+    uint32_t algorithm;
+    uint32_t length = 0;
+    int written;
+
+    if (buffer && size) {
+        buffer[0] = '\0';
+    }
+
+    for (algorithm = 0; algorithm < DISPATCH_ALGORITHMS; ++algorithm) {
+        written = snprintf(
+            buffer && length < size ? buffer + length : NULL,
+            buffer && length < size ? size - length : 0,
+            "%s%s=%s", algorithm ? " " : "", algorithmNames[algorithm],
+            kernelNames[Dispatch_kernel(algorithm)]);
+        if (written > 0) {
+            length += (uint32_t)written;
+        }
+    }
+
+    return length;
+}
+
+/**
+ * Selects the kernel of every algorithm and checks each selected kernel
+ * against known results, disabling the kernels that fail.
+ * @returns The number of kernels that failed the check and were disabled.
+ */
+uint32_t Dispatch_init(void) {
+    unsigned char data[CHECK_SIZE];
+    uint32_t failures = 0;
+    uint32_t algorithm;
+    uint32_t kernel;
+    uint32_t idx;
+
+    for (idx = 0; idx < CHECK_SIZE; ++idx) {
+        data[idx] = (unsigned char)(idx * 167 + 13);
+    }
+
+    for (algorithm = 0; algorithm < DISPATCH_ALGORITHMS; ++algorithm) {
+        while (!check(algorithm, data)) {
+            kernel = Dispatch_kernel(algorithm);
+            ++failures;
+
+            /* There's nothing left to fall back to. */
+            if (kernel == DISPATCH_SCALAR) {
+                break;
+            }
+
+            disabled[algorithm] |= 1 << kernel;
+            selectedFor = DISPATCH_UNSELECTED;
+        }
+    }
+
+    return failures;
+}
+
+/**
+ * Returns the kernel selected for an algorithm, selecting the kernels again if
+ * the features reported by CPU_features changed.
+ * @param algorithm One of the DISPATCH_* algorithms.
+ * @returns One of the DISPATCH_* kernels.
+ */
+uint32_t Dispatch_kernel(uint32_t algorithm) {
+    uint32_t features = CPU_features();
+
+    if (features != selectedFor) {
+        select_kernels(features);
+    }
+
+    return algorithm < DISPATCH_ALGORITHMS ? selected[algorithm] : DISPATCH_SCALAR;
+}
+
+/**
+ * Returns the name of an algorithm.
+ * @param algorithm One of the DISPATCH_* algorithms.
+ * @returns The name of the algorithm, or "unknown".
+ */
+const char* Dispatch_algorithm_name(uint32_t algorithm) {
+    return algorithm < DISPATCH_ALGORITHMS ? algorithmNames[algorithm] : "unknown";
+}
+
+/**
+ * Returns the name of a kernel.
+ * @param kernel One of the DISPATCH_* kernels.
+ * @returns The name of the kernel, or "unknown".
+ */
+const char* Dispatch_kernel_name(uint32_t kernel) {
+    return kernel < DISPATCH_KERNELS ? kernelNames[kernel] : "unknown";
+}
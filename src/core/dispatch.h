@@ -0,0 +1,88 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_DISPATCH_H_
+#define __JMMHASHER_DISPATCH_H_
+
+#include <stdint.h>
+
+/* The algorithms that can select between kernels. */
+#define DISPATCH_CRC32      0
+#define DISPATCH_MD4        1
+#define DISPATCH_MD4_MULTI  2
+#define DISPATCH_MD5        3
+#define DISPATCH_MD5_MULTI  4
+#define DISPATCH_SHA1       5
+#define DISPATCH_MD5_SHA1   6
+#define DISPATCH_MD4_CRC32  7
+#define DISPATCH_ALGORITHMS 8
+
+/* The kernels, named after the instruction set they are built on. The portable
+ * C kernel of every algorithm is DISPATCH_SCALAR. */
+#define DISPATCH_SCALAR 0
+#define DISPATCH_SSE2   1
+#define DISPATCH_SSSE3  2
+#define DISPATCH_AVX2   3
+#define DISPATCH_SHANI  4
+#define DISPATCH_PCLMUL 5
+#define DISPATCH_KERNELS 6
+
+/**
+ * Writes a line describing the kernel selected for every algorithm to buffer,
+ * such as "crc32=pclmul md4=scalar ...". The output is truncated (but still
+ * terminated) if the buffer is too small.
+ * @param buffer The buffer that receives the description.
+ * @param size   The size of the buffer in bytes.
+ * @returns The length of the full description, not counting the terminator.
+ */
+uint32_t Dispatch_describe(char* buffer, uint32_t size);
+
+/**
+ * Selects the kernel of every algorithm for the features reported by
+ * CPU_features and checks each selected kernel against known results. A kernel
+ * that fails is disabled for good and the next best kernel is selected and
+ * checked in its place. Should be called once before hashing starts, although
+ * Dispatch_kernel selects the kernels (without the check) on its own.
+ * @returns The number of kernels that failed the check and were disabled.
+ */
+uint32_t Dispatch_init(void);
+
+/**
+ * Returns the kernel selected for an algorithm. The selection is made once and
+ * only made again when the features reported by CPU_features change (through
+ * CPU_restrict), so this is cheap enough to call for every update.
+ * @param algorithm One of the DISPATCH_* algorithms.
+ * @returns One of the DISPATCH_* kernels.
+ */
+uint32_t Dispatch_kernel(uint32_t algorithm);
+
+/**
+ * Returns the name of an algorithm, such as "md5+sha1".
+ * @param algorithm One of the DISPATCH_* algorithms.
+ * @returns The name of the algorithm, or "unknown".
+ */
+const char* Dispatch_algorithm_name(uint32_t algorithm);
+
+/**
+ * Returns the name of a kernel, such as "avx2".
+ * @param kernel One of the DISPATCH_* kernels.
+ * @returns The name of the kernel, or "unknown".
+ */
+const char* Dispatch_kernel_name(uint32_t kernel);
+
+#endif
@@ -0,0 +1,278 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#include "hashes.h"
+#include "large.h"
+#include "stitch.h"
+#include <string.h>
+
+/* The MD4 hash of a whole ED2k block of zeros. */
+static const unsigned char zeroBlock[16] = {
+    0xd7, 0xde, 0xf2, 0x62, 0xa1, 0x27, 0xcd, 0x79,
+    0x09, 0x6a, 0x10, 0x8e, 0x7a, 0x9f, 0xc1, 0x38
+};
+
+/* Fed to MD4 for the zeros that only cover part of an ED2k block. */
+static const unsigned char zeros[HASHES_TILESIZE];
+
+/**
+ * Finishes the current ED2k block and adds its hash to the hash of the block
+ * hashes. The first block's hash is held back until a second block shows up,
+ * since a file with a single block uses it as the ED2k hash directly.
+ * @param hashes The context containing the ED2k state.
+ */
+static void finish_block(Hashes_Context* hashes) {
+    unsigned char hash[16];
+
+    if (hashes->ed2kZero) {
+        memcpy(hash, zeroBlock, 16);
+        hashes->ed2kZero = 0;
+    } else {
+        MD4_final(&hashes->ed2k, hash);
+    }
+
+    if (hashes->ed2kBlocks == 0) {
+        memcpy(hashes->ed2kFirst, hash, 16);
+    } else {
+        if (hashes->ed2kBlocks == 1) {
+            MD4_init(&hashes->ed2kRoot);
+            MD4_update(&hashes->ed2kRoot, hashes->ed2kFirst, 16);
+        }
+
+        MD4_update(&hashes->ed2kRoot, hash, 16);
+    }
+
+    ++hashes->ed2kBlocks;
+    hashes->ed2kUsed = 0;
+    MD4_init(&hashes->ed2k);
+}
+
+/**
+ * Updates the ED2k state with the data provided, finishing blocks as the data
+ * crosses them. A full block is only finished once more data arrives, so a file
+ * that is an exact multiple of the block size doesn't end with an empty block.
+ * @param hashes The context containing the ED2k state.
+ * @param data   The data used to update the ED2k state.
+ * @param length The length of the data to digest.
+ * @param crc    The CRC32 state to stitch into the MD4 updates, or NULL if the
+ *               CRC32 isn't being calculated.
+ */
+static void update_ed2k(Hashes_Context* hashes, const unsigned char* data,
+    uint32_t length, CRC32_Context* crc) {
+    uint32_t available;
+
+    while (length > 0) {
+        if (hashes->ed2kUsed == HASHES_ED2K_BLOCKSIZE) {
+            finish_block(hashes);
+        }
+
+        available = HASHES_ED2K_BLOCKSIZE - hashes->ed2kUsed;
+        if (available > length) {
+            available = length;
+        }
+
+        if (crc) {
+            Stitch_MD4_CRC32_update(&hashes->ed2k, crc, data, available);
+        } else {
+            MD4_update(&hashes->ed2k, data, available);
+        }
+        hashes->ed2kUsed += available;
+        data += available;
+        length -= available;
+    }
+}
+
+/**
+ * Updates the ED2k state as if length zero bytes were passed to update_ed2k.
+ * Whole blocks of zeros are marked so finish_block uses their known hash.
+ * @param hashes The context containing the ED2k state.
+ * @param length The number of zero bytes to digest.
+ */
+static void update_ed2k_zeros(Hashes_Context* hashes, uint64_t length) {
+    uint32_t available;
+
+    while (length > 0) {
+        if (hashes->ed2kUsed == HASHES_ED2K_BLOCKSIZE) {
+            finish_block(hashes);
+        }
+
+        if (hashes->ed2kUsed == 0 && length >= HASHES_ED2K_BLOCKSIZE) {
+            hashes->ed2kZero = 1;
+            hashes->ed2kUsed = HASHES_ED2K_BLOCKSIZE;
+            length -= HASHES_ED2K_BLOCKSIZE;
+            continue;
+        }
+
+        available = HASHES_ED2K_BLOCKSIZE - hashes->ed2kUsed;
+        if (available > length) {
+            available = (uint32_t)length;
+        }
+
+        hashes->ed2kUsed += available;
+        length -= available;
+        while (available > 0) {
+            uint32_t piece = available < HASHES_TILESIZE ? available : HASHES_TILESIZE;
+            MD4_update(&hashes->ed2k, zeros, piece);
+            available -= piece;
+        }
+    }
+}
+
+/**
+ * Feeds the data to every hash in options, one tile of HASHES_TILESIZE bytes at
+ * a time. Pairs of hashes with a stitched kernel are updated together. Every
+ * caller passes a constant for options, so the copy of this function inlined
+ * into each caller has all of the option tests folded away.
+ * @param hashes  The structure containing the intermediate state to update.
+ * @param ptr     The data used to update the hashes.
+ * @param length  The length of the data to digest.
+ * @param options The HASHES_* flags of the hashes to update.
+ */
+static inline void update_tiles(Hashes_Context* hashes, const unsigned char* ptr,
+    uint32_t length, const uint32_t options) {
+    uint32_t tileSize = HASHES_TILESIZE;
+    uint32_t tile;
+
+    /* A single hash has nothing to share the cache with. */
+    if ((options & (options - 1)) == 0) {
+        tileSize = length;
+    }
+
+    while (length > 0) {
+        tile = length < tileSize ? length : tileSize;
+
+        if ((options & (HASHES_ED2K | HASHES_CRC32)) == (HASHES_ED2K | HASHES_CRC32)) {
+            update_ed2k(hashes, ptr, tile, &hashes->crc32);
+        } else {
+            if (options & HASHES_ED2K) { update_ed2k(hashes, ptr, tile, NULL); }
+            if (options & HASHES_CRC32) { CRC32_update(&hashes->crc32, ptr, tile); }
+        }
+
+        if ((options & (HASHES_MD5 | HASHES_SHA1)) == (HASHES_MD5 | HASHES_SHA1)) {
+            Stitch_MD5_SHA1_update(&hashes->md5, &hashes->sha1, ptr, tile);
+        } else {
+            if (options & HASHES_MD5) { MD5_update(&hashes->md5, ptr, tile); }
+            if (options & HASHES_SHA1) { SHA1_update(&hashes->sha1, ptr, tile); }
+        }
+
+        ptr += tile;
+        length -= tile;
+    }
+}
+
+/* Defines update_N, the update loop specialized for the HASHES_* flags N. */
+#define SPECIALIZE(n) \
+    static void update_##n(Hashes_Context* hashes, const unsigned char* ptr, uint32_t length) { \
+        update_tiles(hashes, ptr, length, n); \
+    }
+
+SPECIALIZE(0)  SPECIALIZE(1)  SPECIALIZE(2)  SPECIALIZE(3)
+SPECIALIZE(4)  SPECIALIZE(5)  SPECIALIZE(6)  SPECIALIZE(7)
+SPECIALIZE(8)  SPECIALIZE(9)  SPECIALIZE(10) SPECIALIZE(11)
+SPECIALIZE(12) SPECIALIZE(13) SPECIALIZE(14) SPECIALIZE(15)
+
+/**
+ * The specialized update loop of every combination of the HASHES_* flags,
+ * indexed by the flags.
+ */
+static void (* const updates[16])(Hashes_Context*, const unsigned char*, uint32_t) = {
+    update_0,  update_1,  update_2,  update_3,
+    update_4,  update_5,  update_6,  update_7,
+    update_8,  update_9,  update_10, update_11,
+    update_12, update_13, update_14, update_15
+};
+
+/**
+ * Finalizes every selected hash and copies the results to the array pointed to
+ * by result. The structure needs to be initialized again to be reused.
+ * @param hashes The Hashes_Context structure to finalize.
+ * @param result Pointer to an array of at least 56 bytes used to hold the
+ *               results. Hashes that weren't selected are set to zero.
+ */
+void Hashes_final(Hashes_Context* hashes, unsigned char* result) {
+    memset(result, 0, 56);
+
+    if (hashes->options & HASHES_ED2K) {
+        finish_block(hashes);
+
+        if (hashes->ed2kBlocks == 1) {
+            memcpy(&result[0], hashes->ed2kFirst, 16);
+        } else {
+            MD4_final(&hashes->ed2kRoot, &result[0]);
+        }
+    }
+    if (hashes->options & HASHES_CRC32) { CRC32_final(&hashes->crc32, &result[16]); }
+    if (hashes->options & HASHES_MD5) { MD5_final(&hashes->md5, &result[20]); }
+    if (hashes->options & HASHES_SHA1) { SHA1_final(&hashes->sha1, &result[36]); }
+
+    memset(hashes, 0, sizeof(*hashes));
+}
+
+/**
+ * Initializes a Hashes_Context structure for use with Hashes_update.
+ * @param hashes  The structure to initialize.
+ * @param options The HASHES_* flags of the hashes to calculate.
+ */
+void Hashes_init(Hashes_Context* hashes, uint32_t options) {
+    hashes->options = options &
+        (HASHES_ED2K | HASHES_CRC32 | HASHES_MD5 | HASHES_SHA1);
+    hashes->ed2kUsed = 0;
+    hashes->ed2kBlocks = 0;
+    hashes->ed2kZero = 0;
+
+    if (options & HASHES_ED2K) { MD4_init(&hashes->ed2k); }
+    if (options & HASHES_CRC32) { CRC32_init(&hashes->crc32); }
+    if (options & HASHES_MD5) { MD5_init(&hashes->md5); }
+    if (options & HASHES_SHA1) { SHA1_init(&hashes->sha1); }
+}
+
+/**
+ * Updates every selected hash with the data provided through the update loop
+ * specialized for the selected hashes.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param data   The data used to update the hashes.
+ * @param length The length of the data to digest.
+ */
+void Hashes_update(Hashes_Context* hashes, const void* data, uint32_t length) {
+    updates[hashes->options](hashes, (const unsigned char*)data, length);
+}
+
+/**
+ * Updates every selected hash with data of any size, such as a whole mapped
+ * file. The data is handed to Hashes_update in pieces of at most LARGE_PIECE
+ * bytes.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param data   The data used to update the hashes.
+ * @param length The length of the data to digest.
+ */
+void Hashes_update_large(Hashes_Context* hashes, const void* data, size_t length) {
+    UPDATE_LARGE(Hashes_update, hashes, data, length);
+}
+
+/**
+ * Updates every selected hash as if length zero bytes were passed to
+ * Hashes_update.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param length The number of zero bytes to digest.
+ */
+void Hashes_update_zeros(Hashes_Context* hashes, uint64_t length) {
+    if (hashes->options & HASHES_ED2K) { update_ed2k_zeros(hashes, length); }
+    if (hashes->options & HASHES_CRC32) { CRC32_update_zeros(&hashes->crc32, length); }
+    if (hashes->options & HASHES_MD5) { MD5_update_zeros(&hashes->md5, length); }
+    if (hashes->options & HASHES_SHA1) { SHA1_update_zeros(&hashes->sha1, length); }
+}
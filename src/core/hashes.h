@@ -0,0 +1,134 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_HASHES_H_
+#define __JMMHASHER_HASHES_H_
+
+#include "crc32.h"
+#include "md4.h"
+#include "md5.h"
+#include "sha1.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* The hashes Hashes_Context can calculate. The values match the OPTION_* flags
+ * of libhasher so request options can be passed straight through. */
+#define HASHES_ED2K  0x01
+#define HASHES_CRC32 0x02
+#define HASHES_MD5   0x04
+#define HASHES_SHA1  0x08
+
+/* The size of each ED2k block. */
+#define HASHES_ED2K_BLOCKSIZE 9728000
+
+/* The size of the tiles Hashes_update walks the data in. Each tile is fed to
+ * every selected hash while it's still in the L1 cache. */
+#ifndef HASHES_TILESIZE
+#define HASHES_TILESIZE 8192
+#endif
+
+/**
+ * Structure containing the intermediate state for calculating any combination
+ * of the ED2k, CRC32, MD5 and SHA1 hashes in a single pass over the data.
+ * @field options    The HASHES_* flags of the hashes being calculated.
+ * @field ed2kUsed   The number of bytes hashed into the current ED2k block.
+ * @field ed2kBlocks The number of ED2k blocks that have been finished.
+ * @field ed2kZero   Set when the current ED2k block is a whole block of zeros
+ *                   added by Hashes_update_zeros, which has a known hash.
+ * @field ed2kFirst  The hash of the first ED2k block. A file with a single
+ *                   block uses it as the ED2k hash directly.
+ * @field ed2k       The MD4 hash of the current ED2k block.
+ * @field ed2kRoot   The MD4 hash of the hashes of every finished ED2k block.
+ * @field crc32      The CRC32 state.
+ * @field md5        The MD5 state.
+ * @field sha1       The SHA1 state.
+ */
+typedef struct {
+    uint32_t options;
+    uint32_t ed2kUsed;
+    uint32_t ed2kBlocks;
+    uint32_t ed2kZero;
+    unsigned char ed2kFirst[16];
+    MD4_Context ed2k;
+    MD4_Context ed2kRoot;
+    CRC32_Context crc32;
+    MD5_Context md5;
+    SHA1_Context sha1;
+} Hashes_Context;
+
+/**
+ * Finalizes every selected hash and copies the results to the array pointed to
+ * by result. The structure needs to be initialized again to be reused.
+ * @param hashes The Hashes_Context structure to finalize.
+ * @param result Pointer to an array of at least 56 bytes used to hold the
+ *               results. Hashes that weren't selected are set to zero. The
+ *               layout of the results is:
+ *                  0 - 15: ED2k
+ *                 16 - 19: CRC32
+ *                 20 - 35: MD5
+ *                 36 - 55: SHA1
+ */
+void Hashes_final(Hashes_Context* hashes, unsigned char* result);
+
+/**
+ * Initializes a Hashes_Context structure for use with Hashes_update.
+ * @param hashes  The structure to initialize.
+ * @param options The HASHES_* flags of the hashes to calculate. Any other bits
+ *                are ignored.
+ */
+void Hashes_init(Hashes_Context* hashes, uint32_t options);
+
+/**
+ * Updates every selected hash with the data provided. The data is walked in
+ * tiles of HASHES_TILESIZE bytes and each tile is fed to every selected hash
+ * before moving on, so the data only streams through the cache once instead
+ * of once per hash. ED2k blocks are finished as the data crosses them, so the
+ * data can be provided in pieces of any size. When both MD5 and SHA1 (or both
+ * ED2k and CRC32) are selected they are calculated together by the stitched
+ * kernels in stitch.h. The loop is specialized at compile time for every
+ * combination of hashes, so the selected hashes aren't tested again for every
+ * tile.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param data   The data used to update the hashes.
+ * @param length The length of the data to digest.
+ */
+void Hashes_update(Hashes_Context* hashes, const void* data, uint32_t length);
+
+/**
+ * Updates every selected hash with data of any size, such as a whole mapped
+ * file. The data is handed to Hashes_update in pieces of at most 256MB and,
+ * as Hashes_update accepts pieces of any size, the result is the same as a
+ * single Hashes_update call over all of the data.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param data   The data used to update the hashes.
+ * @param length The length of the data to digest.
+ */
+void Hashes_update_large(Hashes_Context* hashes, const void* data, size_t length);
+
+/**
+ * Updates every selected hash as if length zero bytes were passed to
+ * Hashes_update, such as for the holes of a sparse file, without reading any
+ * data. Whole ED2k blocks of zeros use their known MD4 hash, the CRC32 is
+ * shifted over the zeros in logarithmic time, and MD5 and SHA1 transform the
+ * zero blocks with their message words fixed at zero.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param length The number of zero bytes to digest.
+ */
+void Hashes_update_zeros(Hashes_Context* hashes, uint64_t length);
+
+#endif
@@ -0,0 +1,50 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_LARGE_H_
+#define __JMMHASHER_LARGE_H_
+
+/* The update functions of every hash take a uint32_t length, so the
+ * *_update_large functions hand them data of any size in pieces of at most
+ * LARGE_PIECE bytes. It's a whole number of 64 byte blocks, which the zero
+ * runs of MD5 and SHA1 rely on as well. */
+#define LARGE_PIECE 0x10000000
+
+/**
+ * Passes length bytes of data to update (called as update(context, pointer,
+ * length)) in pieces of at most LARGE_PIECE bytes. Every update function
+ * accepts pieces of any size, so the result is the same as a single call over
+ * all of the data.
+ * @param update  The update function.
+ * @param context The context passed to update.
+ * @param data    The data.
+ * @param length  The length of the data, as a size_t.
+ */
+#define UPDATE_LARGE(update, context, data, length) \
+    do { \
+        const unsigned char* large_ptr = (const unsigned char*)(data); \
+        size_t large_length = (length); \
+        while (large_length > LARGE_PIECE) { \
+            update((context), large_ptr, LARGE_PIECE); \
+            large_ptr += LARGE_PIECE; \
+            large_length -= LARGE_PIECE; \
+        } \
+        update((context), large_ptr, (uint32_t)large_length); \
+    } while (0)
+
+#endif
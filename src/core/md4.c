@@ -21,8 +21,15 @@
  */
 
 #include "md4.h"
+#include "cpu.h"
+#include "dispatch.h"
+#include "large.h"
 #include <string.h>
 
+#if defined(CPU_X86)
+#include <immintrin.h> /* AVX2 */
+#endif
+
 /* The basic MD4 functions.
  *
  * F and G are optimized compared to their RFC 1320 definitions, with the
@@ -157,6 +164,138 @@ static const void* transform(MD4_Context* md4, const void* data, uint32_t length
     return ptr;
 }
 
+#if defined(CPU_X86)
+/* The basic MD4 functions and step on 8 lanes at once. */
+#define VF(x, y, z) _mm256_xor_si256((z), _mm256_and_si256((x), _mm256_xor_si256((y), (z))))
+#define VG(x, y, z) _mm256_or_si256(_mm256_and_si256((x), _mm256_or_si256((y), (z))), \
+    _mm256_and_si256((y), (z)))
+#define VH(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+
+#define VSTEP(f, a, b, c, d, x, k, s) \
+    (a) = _mm256_add_epi32(_mm256_add_epi32((a), f((b), (c), (d))), \
+        _mm256_add_epi32((x), (k))); \
+    (a) = _mm256_or_si256(_mm256_slli_epi32((a), (s)), _mm256_srli_epi32((a), 32 - (s)));
+
+/**
+ * Transposes eight rows of eight 32-bit words so that column i of the input
+ * ends up in out[i].
+ * @param in  The rows to transpose.
+ * @param out Receives the transposed rows.
+ */
+CPU_TARGET("avx2")
+static inline void transpose(const __m256i in[8], __m256i out[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(in[0], in[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(in[0], in[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(in[2], in[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(in[2], in[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(in[4], in[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(in[4], in[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(in[6], in[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(in[6], in[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/**
+ * Performs the MD4 transformation on 8 lanes at once with AVX2. Each 64-byte
+ * block is loaded from every lane and transposed so that X[i] holds word i of
+ * the block of every lane.
+ * @param md4    The MD4 multi-buffer context to update.
+ * @param data   The data for each lane.
+ * @param length The length of the data for each lane. Must be a multiple of 64.
+ */
+CPU_TARGET("avx2")
+static void transform_avx2(
+    MD4_MultiContext* md4, const unsigned char* const data[MD4_LANES], uint32_t length) {
+    const __m256i k0 = _mm256_setzero_si256();
+    const __m256i k1 = _mm256_set1_epi32(0x5a827999);
+    const __m256i k2 = _mm256_set1_epi32(0x6ed9eba1);
+    __m256i rows[8];
+    __m256i X[16];
+    __m256i a, b, c, d;
+    __m256i saved_a, saved_b, saved_c, saved_d;
+    uint32_t offset;
+    uint32_t lane;
+
+    a = _mm256_loadu_si256((const __m256i*)md4->state[0]);
+    b = _mm256_loadu_si256((const __m256i*)md4->state[1]);
+    c = _mm256_loadu_si256((const __m256i*)md4->state[2]);
+    d = _mm256_loadu_si256((const __m256i*)md4->state[3]);
+
+    for (offset = 0; offset < length; offset += 64) {
+        for (lane = 0; lane < MD4_LANES; ++lane) {
+            rows[lane] = _mm256_loadu_si256((const __m256i*)(data[lane] + offset));
+        }
+        transpose(rows, &X[0]);
+
+        for (lane = 0; lane < MD4_LANES; ++lane) {
+            rows[lane] = _mm256_loadu_si256((const __m256i*)(data[lane] + offset + 32));
+        }
+        transpose(rows, &X[8]);
+
+        saved_a = a;
+        saved_b = b;
+        saved_c = c;
+        saved_d = d;
+
+        /* Round 1 */
+        VSTEP(VF, a, b, c, d, X[ 0], k0,  3) VSTEP(VF, d, a, b, c, X[ 1], k0,  7)
+        VSTEP(VF, c, d, a, b, X[ 2], k0, 11) VSTEP(VF, b, c, d, a, X[ 3], k0, 19)
+        VSTEP(VF, a, b, c, d, X[ 4], k0,  3) VSTEP(VF, d, a, b, c, X[ 5], k0,  7)
+        VSTEP(VF, c, d, a, b, X[ 6], k0, 11) VSTEP(VF, b, c, d, a, X[ 7], k0, 19)
+        VSTEP(VF, a, b, c, d, X[ 8], k0,  3) VSTEP(VF, d, a, b, c, X[ 9], k0,  7)
+        VSTEP(VF, c, d, a, b, X[10], k0, 11) VSTEP(VF, b, c, d, a, X[11], k0, 19)
+        VSTEP(VF, a, b, c, d, X[12], k0,  3) VSTEP(VF, d, a, b, c, X[13], k0,  7)
+        VSTEP(VF, c, d, a, b, X[14], k0, 11) VSTEP(VF, b, c, d, a, X[15], k0, 19)
+
+        /* Round 2 */
+        VSTEP(VG, a, b, c, d, X[ 0], k1,  3) VSTEP(VG, d, a, b, c, X[ 4], k1,  5)
+        VSTEP(VG, c, d, a, b, X[ 8], k1,  9) VSTEP(VG, b, c, d, a, X[12], k1, 13)
+        VSTEP(VG, a, b, c, d, X[ 1], k1,  3) VSTEP(VG, d, a, b, c, X[ 5], k1,  5)
+        VSTEP(VG, c, d, a, b, X[ 9], k1,  9) VSTEP(VG, b, c, d, a, X[13], k1, 13)
+        VSTEP(VG, a, b, c, d, X[ 2], k1,  3) VSTEP(VG, d, a, b, c, X[ 6], k1,  5)
+        VSTEP(VG, c, d, a, b, X[10], k1,  9) VSTEP(VG, b, c, d, a, X[14], k1, 13)
+        VSTEP(VG, a, b, c, d, X[ 3], k1,  3) VSTEP(VG, d, a, b, c, X[ 7], k1,  5)
+        VSTEP(VG, c, d, a, b, X[11], k1,  9) VSTEP(VG, b, c, d, a, X[15], k1, 13)
+
+        /* Round 3 */
+        VSTEP(VH, a, b, c, d, X[ 0], k2,  3) VSTEP(VH, d, a, b, c, X[ 8], k2,  9)
+        VSTEP(VH, c, d, a, b, X[ 4], k2, 11) VSTEP(VH, b, c, d, a, X[12], k2, 15)
+        VSTEP(VH, a, b, c, d, X[ 2], k2,  3) VSTEP(VH, d, a, b, c, X[10], k2,  9)
+        VSTEP(VH, c, d, a, b, X[ 6], k2, 11) VSTEP(VH, b, c, d, a, X[14], k2, 15)
+        VSTEP(VH, a, b, c, d, X[ 1], k2,  3) VSTEP(VH, d, a, b, c, X[ 9], k2,  9)
+        VSTEP(VH, c, d, a, b, X[ 5], k2, 11) VSTEP(VH, b, c, d, a, X[13], k2, 15)
+        VSTEP(VH, a, b, c, d, X[ 3], k2,  3) VSTEP(VH, d, a, b, c, X[11], k2,  9)
+        VSTEP(VH, c, d, a, b, X[ 7], k2, 11) VSTEP(VH, b, c, d, a, X[15], k2, 15)
+
+        a = _mm256_add_epi32(a, saved_a);
+        b = _mm256_add_epi32(b, saved_b);
+        c = _mm256_add_epi32(c, saved_c);
+        d = _mm256_add_epi32(d, saved_d);
+    }
+
+    _mm256_storeu_si256((__m256i*)md4->state[0], a);
+    _mm256_storeu_si256((__m256i*)md4->state[1], b);
+    _mm256_storeu_si256((__m256i*)md4->state[2], c);
+    _mm256_storeu_si256((__m256i*)md4->state[3], d);
+}
+#endif
+
 /**
  * Performs the final operation on the MD4_Context structure, copies the
  * resulting hash to the array pointed to by result and clears the structure. If
@@ -230,6 +369,90 @@ void MD4_init(MD4_Context* md4) {
     md4->state[3] = 0x10325476;
 }
 
+/**
+ * Performs the final operation for a single lane of the MD4_MultiContext
+ * structure and copies the resulting hash to the array pointed to by result.
+ * Each lane is finalized independently and the structure is left untouched.
+ * @param md4    The MD4_MultiContext structure containing the lane.
+ * @param lane   The lane to finalize, from 0 to MD4_LANES - 1.
+ * @param result Pointer to an array of at least 16 bytes used to hold the
+ *               resulting hash.
+ */
+void MD4_multi_final(MD4_MultiContext* md4, uint32_t lane, unsigned char* result) {
+    MD4_Context single;
+
+    /* Every lane has consumed whole blocks, so the lane's state along with the
+     * length is all a regular context needs to apply the padding. */
+    single.lo = (uint32_t)(md4->length & 0x1FFFFFFF);
+    single.hi = (uint32_t)(md4->length >> 29);
+    single.state[0] = md4->state[0][lane];
+    single.state[1] = md4->state[1][lane];
+    single.state[2] = md4->state[2][lane];
+    single.state[3] = md4->state[3][lane];
+
+    MD4_final(&single, result);
+}
+
+/**
+ * Initializes every lane of a MD4_MultiContext structure for use with
+ * MD4_multi_update.
+ * @param md4 The structure to initialize.
+ */
+void MD4_multi_init(MD4_MultiContext* md4) {
+    uint32_t lane;
+
+    md4->length = 0;
+    for (lane = 0; lane < MD4_LANES; ++lane) {
+        md4->state[0][lane] = 0x67452301;
+        md4->state[1][lane] = 0xefcdab89;
+        md4->state[2][lane] = 0x98badcfe;
+        md4->state[3][lane] = 0x10325476;
+    }
+}
+
+/**
+ * Updates every lane of the MD4_MultiContext with the data provided for it.
+ * Uses AVX2 to process all of the lanes at once when the CPU supports it.
+ * @param md4    The structure containing the intermediate state of each lane.
+ * @param data   The data for each lane. Lanes that aren't needed can point at
+ *               any valid data (such as another lane's) and have their result
+ *               ignored.
+ * @param length The length of the data for each lane. Must be a multiple of 64.
+ */
+void MD4_multi_update(
+    MD4_MultiContext* md4, const unsigned char* const data[MD4_LANES], uint32_t length) {
+    MD4_Context single;
+    uint32_t lane;
+
+    if (length == 0) {
+        return;
+    }
+
+    md4->length += length;
+
+#if defined(CPU_X86)
+    if (Dispatch_kernel(DISPATCH_MD4_MULTI) == DISPATCH_AVX2) {
+        transform_avx2(md4, data, length);
+        return;
+    }
+#endif
+
+    /* Fall back to transforming one lane at a time. */
+    for (lane = 0; lane < MD4_LANES; ++lane) {
+        single.state[0] = md4->state[0][lane];
+        single.state[1] = md4->state[1][lane];
+        single.state[2] = md4->state[2][lane];
+        single.state[3] = md4->state[3][lane];
+
+        transform(&single, data[lane], length);
+
+        md4->state[0][lane] = single.state[0];
+        md4->state[1][lane] = single.state[1];
+        md4->state[2][lane] = single.state[2];
+        md4->state[3][lane] = single.state[3];
+    }
+}
+
 /**
  * Updates the MD4 state with the data provided. The MD4_Context structure
  * should be initialized using the MD4_init function before calling this
@@ -249,6 +472,7 @@ void MD4_update(MD4_Context* md4, const void* data, uint32_t length) {
         md4->hi++;
     }
 
+    md4->hi += length >> 29;
     used = saved_lo & 0x3F;
 
     if (used) {
@@ -273,3 +497,14 @@ void MD4_update(MD4_Context* md4, const void* data, uint32_t length) {
 
     memcpy(md4->buffer, data, length);
 }
+
+/**
+ * Updates the MD4 state with data of any size, such as a whole mapped file. The
+ * data is handed to MD4_update in pieces of at most LARGE_PIECE bytes.
+ * @param md4    The structure containing the intermediate MD4 information to update.
+ * @param data   The data used to update the MD4 state.
+ * @param length The length of the data to digest.
+ */
+void MD4_update_large(MD4_Context* md4, const void* data, size_t length) {
+    UPDATE_LARGE(MD4_update, md4, data, length);
+}
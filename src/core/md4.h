@@ -23,6 +23,7 @@
  * http://openwall.info/wiki/people/solar/software/public-domain-source-code/md4
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -46,6 +47,23 @@ typedef struct {
     #endif
 } MD4_Context;
 
+/* The number of independent MD4 hashes advanced together by MD4_multi_update. */
+#define MD4_LANES 8
+
+/**
+ * Structure containing the intermediate state information for calculating up
+ * to MD4_LANES independent MD4 hashes of equal length in lock step. The state
+ * is stored as a structure of arrays so the same word of every lane can be
+ * loaded into a single vector register.
+ * @field state  state[word][lane] holds each word of the transformation state
+ *               of every lane.
+ * @field length Holds the number of bytes processed by each lane.
+ */
+typedef struct {
+    uint32_t state[4][MD4_LANES];
+    uint64_t length;
+} MD4_MultiContext;
+
 /**
  * Performs the final operation on the MD4_Context structure, copies the
  * resulting hash to the array pointed to by result and clears the structure. If
@@ -64,6 +82,36 @@ void MD4_final(MD4_Context* md4, unsigned char* result);
  */
 void MD4_init(MD4_Context* md4);
 
+/**
+ * Performs the final operation for a single lane of the MD4_MultiContext
+ * structure and copies the resulting hash to the array pointed to by result.
+ * Each lane is finalized independently and the structure is left untouched.
+ * @param md4    The MD4_MultiContext structure containing the lane.
+ * @param lane   The lane to finalize, from 0 to MD4_LANES - 1.
+ * @param result Pointer to an array of at least 16 bytes used to hold the
+ *               resulting hash.
+ */
+void MD4_multi_final(MD4_MultiContext* md4, uint32_t lane, unsigned char* result);
+
+/**
+ * Initializes every lane of a MD4_MultiContext structure for use with
+ * MD4_multi_update.
+ * @param md4 The structure to initialize.
+ */
+void MD4_multi_init(MD4_MultiContext* md4);
+
+/**
+ * Updates every lane of the MD4_MultiContext with the data provided for it.
+ * Uses AVX2 to process all of the lanes at once when the CPU supports it.
+ * @param md4    The structure containing the intermediate state of each lane.
+ * @param data   The data for each lane. Lanes that aren't needed can point at
+ *               any valid data (such as another lane's) and have their result
+ *               ignored.
+ * @param length The length of the data for each lane. Must be a multiple of 64.
+ */
+void MD4_multi_update(
+    MD4_MultiContext* md4, const unsigned char* const data[MD4_LANES], uint32_t length);
+
 /**
  * Updates the MD4 state with the data provided. The MD4_Context structure
  * should be initialized using the MD4_init function before calling this
@@ -75,4 +123,15 @@ void MD4_init(MD4_Context* md4);
  */
 void MD4_update(MD4_Context* md4, const void* data, uint32_t length);
 
+/**
+ * Updates the MD4 state with data of any size, such as a whole mapped file. The
+ * data is handed to MD4_update in pieces of at most 256MB. MD4_update buffers
+ * partial blocks and carries the length counters past 2^32 bits, so the result
+ * is the same as a single MD4_update call over all of the data.
+ * @param md4    The structure containing the intermediate MD4 information to update.
+ * @param data   The data used to update the MD4 state.
+ * @param length The length of the data to digest.
+ */
+void MD4_update_large(MD4_Context* md4, const void* data, size_t length);
+
 #endif
@@ -21,8 +21,22 @@
  */
 
 #include "md5.h"
+#include "cpu.h"
+#include "dispatch.h"
+#include "large.h"
 #include "string.h"
 
+#if defined(CPU_X86)
+#include <emmintrin.h> /* SSE2 */
+#include <immintrin.h> /* AVX2 */
+#endif
+
+/* The most contexts MD5_update_multi transforms at once. */
+#define MAX_LANES 8
+
+/* Fills the partial blocks at either end of a run of zeros. */
+static const unsigned char zeros[64];
+
 /* The basic MD5 functions.
  *
  * F and G are optimized compared to their RFC 1321 definitions for
@@ -180,6 +194,292 @@ static const void* transform(MD5_Context* md5, const void* data, uint32_t length
     return ptr;
 }
 
+/**
+ * Updates the length of the MD5_Context and completes any partially buffered
+ * block, then buffers the bytes past the last whole block of the data. Only
+ * the whole blocks are left for the caller to transform.
+ * @param md5    The MD5 context to update.
+ * @param data   The data used to update the MD5 state. Advanced to the first
+ *               whole block that still needs to be transformed.
+ * @param length The length of the data to digest.
+ * @returns The number of whole 64-byte blocks at data left to transform.
+ */
+static uint32_t prepare(MD5_Context* md5, const unsigned char** data, uint32_t length) {
+    uint32_t saved_lo;
+    uint32_t used;
+    uint32_t available;
+
+    saved_lo = md5->lo;
+    if ((md5->lo = (saved_lo + length) & 0x1FFFFFFF) < saved_lo) {
+        ++md5->hi;
+    }
+
+    md5->hi += length >> 29;
+    used = saved_lo & 0x3F;
+
+    if (used) {
+        available = 64 - used;
+        if (length < available) {
+            memcpy(&md5->buffer[used], *data, length);
+            return 0;
+        }
+
+        memcpy(&md5->buffer[used], *data, available);
+        *data += available;
+        length -= available;
+        transform(md5, md5->buffer, 64);
+    }
+
+    memcpy(md5->buffer, *data + (length & ~(uint32_t)0x3F), length & 0x3F);
+    return length >> 6;
+}
+
+/* Lists the 64 steps of the MD5 transformation for the vector kernels and
+ * transform_zeros. The caller provides the step and the four basic functions
+ * for its vector width, and the message words of every lane in X. */
+#define VROUNDS(VSTEP, F, G, H, I) \
+    VSTEP(F, a, b, c, d, X[ 0], 0xd76aa478,  7) VSTEP(F, d, a, b, c, X[ 1], 0xe8c7b756, 12) \
+    VSTEP(F, c, d, a, b, X[ 2], 0x242070db, 17) VSTEP(F, b, c, d, a, X[ 3], 0xc1bdceee, 22) \
+    VSTEP(F, a, b, c, d, X[ 4], 0xf57c0faf,  7) VSTEP(F, d, a, b, c, X[ 5], 0x4787c62a, 12) \
+    VSTEP(F, c, d, a, b, X[ 6], 0xa8304613, 17) VSTEP(F, b, c, d, a, X[ 7], 0xfd469501, 22) \
+    VSTEP(F, a, b, c, d, X[ 8], 0x698098d8,  7) VSTEP(F, d, a, b, c, X[ 9], 0x8b44f7af, 12) \
+    VSTEP(F, c, d, a, b, X[10], 0xffff5bb1, 17) VSTEP(F, b, c, d, a, X[11], 0x895cd7be, 22) \
+    VSTEP(F, a, b, c, d, X[12], 0x6b901122,  7) VSTEP(F, d, a, b, c, X[13], 0xfd987193, 12) \
+    VSTEP(F, c, d, a, b, X[14], 0xa679438e, 17) VSTEP(F, b, c, d, a, X[15], 0x49b40821, 22) \
+    VSTEP(G, a, b, c, d, X[ 1], 0xf61e2562,  5) VSTEP(G, d, a, b, c, X[ 6], 0xc040b340,  9) \
+    VSTEP(G, c, d, a, b, X[11], 0x265e5a51, 14) VSTEP(G, b, c, d, a, X[ 0], 0xe9b6c7aa, 20) \
+    VSTEP(G, a, b, c, d, X[ 5], 0xd62f105d,  5) VSTEP(G, d, a, b, c, X[10], 0x02441453,  9) \
+    VSTEP(G, c, d, a, b, X[15], 0xd8a1e681, 14) VSTEP(G, b, c, d, a, X[ 4], 0xe7d3fbc8, 20) \
+    VSTEP(G, a, b, c, d, X[ 9], 0x21e1cde6,  5) VSTEP(G, d, a, b, c, X[14], 0xc33707d6,  9) \
+    VSTEP(G, c, d, a, b, X[ 3], 0xf4d50d87, 14) VSTEP(G, b, c, d, a, X[ 8], 0x455a14ed, 20) \
+    VSTEP(G, a, b, c, d, X[13], 0xa9e3e905,  5) VSTEP(G, d, a, b, c, X[ 2], 0xfcefa3f8,  9) \
+    VSTEP(G, c, d, a, b, X[ 7], 0x676f02d9, 14) VSTEP(G, b, c, d, a, X[12], 0x8d2a4c8a, 20) \
+    VSTEP(H, a, b, c, d, X[ 5], 0xfffa3942,  4) VSTEP(H, d, a, b, c, X[ 8], 0x8771f681, 11) \
+    VSTEP(H, c, d, a, b, X[11], 0x6d9d6122, 16) VSTEP(H, b, c, d, a, X[14], 0xfde5380c, 23) \
+    VSTEP(H, a, b, c, d, X[ 1], 0xa4beea44,  4) VSTEP(H, d, a, b, c, X[ 4], 0x4bdecfa9, 11) \
+    VSTEP(H, c, d, a, b, X[ 7], 0xf6bb4b60, 16) VSTEP(H, b, c, d, a, X[10], 0xbebfbc70, 23) \
+    VSTEP(H, a, b, c, d, X[13], 0x289b7ec6,  4) VSTEP(H, d, a, b, c, X[ 0], 0xeaa127fa, 11) \
+    VSTEP(H, c, d, a, b, X[ 3], 0xd4ef3085, 16) VSTEP(H, b, c, d, a, X[ 6], 0x04881d05, 23) \
+    VSTEP(H, a, b, c, d, X[ 9], 0xd9d4d039,  4) VSTEP(H, d, a, b, c, X[12], 0xe6db99e5, 11) \
+    VSTEP(H, c, d, a, b, X[15], 0x1fa27cf8, 16) VSTEP(H, b, c, d, a, X[ 2], 0xc4ac5665, 23) \
+    VSTEP(I, a, b, c, d, X[ 0], 0xf4292244,  6) VSTEP(I, d, a, b, c, X[ 7], 0x432aff97, 10) \
+    VSTEP(I, c, d, a, b, X[14], 0xab9423a7, 15) VSTEP(I, b, c, d, a, X[ 5], 0xfc93a039, 21) \
+    VSTEP(I, a, b, c, d, X[12], 0x655b59c3,  6) VSTEP(I, d, a, b, c, X[ 3], 0x8f0ccc92, 10) \
+    VSTEP(I, c, d, a, b, X[10], 0xffeff47d, 15) VSTEP(I, b, c, d, a, X[ 1], 0x85845dd1, 21) \
+    VSTEP(I, a, b, c, d, X[ 8], 0x6fa87e4f,  6) VSTEP(I, d, a, b, c, X[15], 0xfe2ce6e0, 10) \
+    VSTEP(I, c, d, a, b, X[ 6], 0xa3014314, 15) VSTEP(I, b, c, d, a, X[13], 0x4e0811a1, 21) \
+    VSTEP(I, a, b, c, d, X[ 4], 0xf7537e82,  6) VSTEP(I, d, a, b, c, X[11], 0xbd3af235, 10) \
+    VSTEP(I, c, d, a, b, X[ 2], 0x2ad7d2bb, 15) VSTEP(I, b, c, d, a, X[ 9], 0xeb86d391, 21)
+
+/**
+ * Transforms blocks of 64 zero bytes. Every message word is a constant zero,
+ * so the steps are left with nothing to load and fewer additions.
+ * @param md5    The MD5 context to update.
+ * @param blocks The number of zero blocks to transform.
+ */
+static void transform_zeros(MD5_Context* md5, uint32_t blocks) {
+    const uint32_t X[16] = { 0 };
+    uint32_t a = md5->state[0];
+    uint32_t b = md5->state[1];
+    uint32_t c = md5->state[2];
+    uint32_t d = md5->state[3];
+    uint32_t saved_a;
+    uint32_t saved_b;
+    uint32_t saved_c;
+    uint32_t saved_d;
+
+    while (blocks--) {
+        saved_a = a;
+        saved_b = b;
+        saved_c = c;
+        saved_d = d;
+
+        VROUNDS(STEP, F, G, H, I)
+
+        a += saved_a;
+        b += saved_b;
+        c += saved_c;
+        d += saved_d;
+    }
+
+    md5->state[0] = a;
+    md5->state[1] = b;
+    md5->state[2] = c;
+    md5->state[3] = d;
+}
+
+#if defined(CPU_X86)
+/* The basic MD5 functions and step on 4 lanes with SSE2. */
+#define F4(x, y, z) _mm_xor_si128((z), _mm_and_si128((x), _mm_xor_si128((y), (z))))
+#define G4(x, y, z) _mm_xor_si128((y), _mm_and_si128((z), _mm_xor_si128((x), (y))))
+#define H4(x, y, z) _mm_xor_si128(_mm_xor_si128((x), (y)), (z))
+#define I4(x, y, z) _mm_xor_si128((y), _mm_or_si128((x), _mm_xor_si128((z), ones)))
+
+#define VSTEP4(f, a, b, c, d, x, t, s) \
+    (a) = _mm_add_epi32(_mm_add_epi32((a), f((b), (c), (d))), \
+        _mm_add_epi32((x), _mm_set1_epi32((int)(t)))); \
+    (a) = _mm_or_si128(_mm_slli_epi32((a), (s)), _mm_srli_epi32((a), 32 - (s))); \
+    (a) = _mm_add_epi32((a), (b));
+
+/* The basic MD5 functions and step on 8 lanes with AVX2. */
+#define F8(x, y, z) _mm256_xor_si256((z), _mm256_and_si256((x), _mm256_xor_si256((y), (z))))
+#define G8(x, y, z) _mm256_xor_si256((y), _mm256_and_si256((z), _mm256_xor_si256((x), (y))))
+#define H8(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define I8(x, y, z) _mm256_xor_si256((y), _mm256_or_si256((x), _mm256_xor_si256((z), ones)))
+
+#define VSTEP8(f, a, b, c, d, x, t, s) \
+    (a) = _mm256_add_epi32(_mm256_add_epi32((a), f((b), (c), (d))), \
+        _mm256_add_epi32((x), _mm256_set1_epi32((int)(t)))); \
+    (a) = _mm256_or_si256(_mm256_slli_epi32((a), (s)), _mm256_srli_epi32((a), 32 - (s))); \
+    (a) = _mm256_add_epi32((a), (b));
+
+/**
+ * Transforms the given number of blocks for the first 4 lanes with SSE2. Each
+ * 16 bytes of the block are loaded from every lane and transposed so that X[i]
+ * holds word i of the block of every lane.
+ * @param state  state[word][lane] holds the transformation state of each lane.
+ * @param ptr    The data for each lane.
+ * @param blocks The number of 64-byte blocks to transform in every lane.
+ */
+CPU_TARGET("sse2")
+static void transform_sse2(uint32_t state[4][MAX_LANES],
+    const unsigned char* const ptr[MAX_LANES], uint32_t blocks) {
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i X[16];
+    __m128i a, b, c, d;
+    __m128i saved_a, saved_b, saved_c, saved_d;
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+    uint32_t offset;
+    uint32_t quarter;
+
+    a = _mm_loadu_si128((const __m128i*)state[0]);
+    b = _mm_loadu_si128((const __m128i*)state[1]);
+    c = _mm_loadu_si128((const __m128i*)state[2]);
+    d = _mm_loadu_si128((const __m128i*)state[3]);
+
+    for (offset = 0; offset < blocks * 64; offset += 64) {
+        for (quarter = 0; quarter < 4; ++quarter) {
+            r0 = _mm_loadu_si128((const __m128i*)(ptr[0] + offset + quarter * 16));
+            r1 = _mm_loadu_si128((const __m128i*)(ptr[1] + offset + quarter * 16));
+            r2 = _mm_loadu_si128((const __m128i*)(ptr[2] + offset + quarter * 16));
+            r3 = _mm_loadu_si128((const __m128i*)(ptr[3] + offset + quarter * 16));
+            t0 = _mm_unpacklo_epi32(r0, r1);
+            t1 = _mm_unpackhi_epi32(r0, r1);
+            t2 = _mm_unpacklo_epi32(r2, r3);
+            t3 = _mm_unpackhi_epi32(r2, r3);
+            X[quarter * 4 + 0] = _mm_unpacklo_epi64(t0, t2);
+            X[quarter * 4 + 1] = _mm_unpackhi_epi64(t0, t2);
+            X[quarter * 4 + 2] = _mm_unpacklo_epi64(t1, t3);
+            X[quarter * 4 + 3] = _mm_unpackhi_epi64(t1, t3);
+        }
+
+        saved_a = a;
+        saved_b = b;
+        saved_c = c;
+        saved_d = d;
+
+        VROUNDS(VSTEP4, F4, G4, H4, I4)
+
+        a = _mm_add_epi32(a, saved_a);
+        b = _mm_add_epi32(b, saved_b);
+        c = _mm_add_epi32(c, saved_c);
+        d = _mm_add_epi32(d, saved_d);
+    }
+
+    _mm_storeu_si128((__m128i*)state[0], a);
+    _mm_storeu_si128((__m128i*)state[1], b);
+    _mm_storeu_si128((__m128i*)state[2], c);
+    _mm_storeu_si128((__m128i*)state[3], d);
+}
+
+/**
+ * Transposes eight rows of eight 32-bit words so that column i of the input
+ * ends up in out[i].
+ * @param in  The rows to transpose.
+ * @param out Receives the transposed rows.
+ */
+CPU_TARGET("avx2")
+static inline void transpose8(const __m256i in[8], __m256i out[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(in[0], in[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(in[0], in[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(in[2], in[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(in[2], in[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(in[4], in[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(in[4], in[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(in[6], in[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(in[6], in[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/**
+ * Transforms the given number of blocks for all 8 lanes with AVX2.
+ * @param state  state[word][lane] holds the transformation state of each lane.
+ * @param ptr    The data for each lane.
+ * @param blocks The number of 64-byte blocks to transform in every lane.
+ */
+CPU_TARGET("avx2")
+static void transform_avx2(uint32_t state[4][MAX_LANES],
+    const unsigned char* const ptr[MAX_LANES], uint32_t blocks) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i rows[8];
+    __m256i X[16];
+    __m256i a, b, c, d;
+    __m256i saved_a, saved_b, saved_c, saved_d;
+    uint32_t offset;
+    uint32_t lane;
+
+    a = _mm256_loadu_si256((const __m256i*)state[0]);
+    b = _mm256_loadu_si256((const __m256i*)state[1]);
+    c = _mm256_loadu_si256((const __m256i*)state[2]);
+    d = _mm256_loadu_si256((const __m256i*)state[3]);
+
+    for (offset = 0; offset < blocks * 64; offset += 64) {
+        for (lane = 0; lane < 8; ++lane) {
+            rows[lane] = _mm256_loadu_si256((const __m256i*)(ptr[lane] + offset));
+        }
+        transpose8(rows, &X[0]);
+
+        for (lane = 0; lane < 8; ++lane) {
+            rows[lane] = _mm256_loadu_si256((const __m256i*)(ptr[lane] + offset + 32));
+        }
+        transpose8(rows, &X[8]);
+
+        saved_a = a;
+        saved_b = b;
+        saved_c = c;
+        saved_d = d;
+
+        VROUNDS(VSTEP8, F8, G8, H8, I8)
+
+        a = _mm256_add_epi32(a, saved_a);
+        b = _mm256_add_epi32(b, saved_b);
+        c = _mm256_add_epi32(c, saved_c);
+        d = _mm256_add_epi32(d, saved_d);
+    }
+
+    _mm256_storeu_si256((__m256i*)state[0], a);
+    _mm256_storeu_si256((__m256i*)state[1], b);
+    _mm256_storeu_si256((__m256i*)state[2], c);
+    _mm256_storeu_si256((__m256i*)state[3], d);
+}
+#endif
+
 /**
  * Performs the final operation on the MD5_Context structure, copies the
  * resulting hash to the array pointed to by result and clears the structure. If
@@ -268,35 +568,180 @@ void MD5_init(MD5_Context* md5) {
  * for processing.
  */
 void MD5_update(MD5_Context* md5, const void* data, uint32_t length) {
-    uint32_t saved_lo;
-    uint32_t used;
-    uint32_t available;
+    const unsigned char* ptr = (const unsigned char*)data;
+    uint32_t blocks;
 
-    saved_lo = md5->lo;
-    if ((md5->lo = (saved_lo + length) & 0x1FFFFFFF) < saved_lo) {
-        ++md5->hi;
+    blocks = prepare(md5, &ptr, length);
+    if (blocks) {
+        transform(md5, ptr, blocks * 64);
     }
+}
 
-    md5->hi += length >> 29;
-    used = saved_lo & 0x3F;
+/**
+ * Updates the MD5 state with data of any size, such as a whole mapped file. The
+ * data is handed to MD5_update in pieces of at most LARGE_PIECE bytes.
+ * @param md5    The structure containing the intermediate MD5 information to update.
+ * @param data   The data used to update the MD5 state.
+ * @param length The length of the data to digest.
+ */
+void MD5_update_large(MD5_Context* md5, const void* data, size_t length) {
+    UPDATE_LARGE(MD5_update, md5, data, length);
+}
 
-    if (used) {
-        available = 64 - used;
-        if (length < available) {
-            memcpy(&md5->buffer[used], data, length);
-            return;
+/**
+ * Updates the MD5 state as if length zero bytes were passed to MD5_update. The
+ * whole blocks are transformed by transform_zeros without reading any data.
+ * @param md5    The structure containing the intermediate MD5 information to update.
+ * @param length The number of zero bytes to digest.
+ */
+void MD5_update_zeros(MD5_Context* md5, uint64_t length) {
+    uint32_t available = (64 - (md5->lo & 0x3F)) & 0x3F;
+    uint32_t saved_lo;
+    uint32_t piece;
+
+    /* Complete the partially buffered block first. */
+    if (available) {
+        if (available > length) {
+            available = (uint32_t)length;
         }
 
-        memcpy(&md5->buffer[used], data, available);
-        data = (const unsigned char*)data + available;
+        MD5_update(md5, zeros, available);
         length -= available;
-        transform(md5, md5->buffer, 64);
     }
 
-    if (length >= 64) {
-        data = transform(md5, data, length & ~(uint32_t)0x3F);
-        length &= 0x3F;
+    while (length >= 64) {
+        piece = length > LARGE_PIECE ? LARGE_PIECE : (uint32_t)(length & ~(uint64_t)0x3F);
+
+        saved_lo = md5->lo;
+        if ((md5->lo = (saved_lo + piece) & 0x1FFFFFFF) < saved_lo) {
+            ++md5->hi;
+        }
+
+        md5->hi += piece >> 29;
+        transform_zeros(md5, piece >> 6);
+        length -= piece;
+    }
+
+    if (length) {
+        MD5_update(md5, zeros, (uint32_t)length);
+    }
+}
+
+/**
+ * Updates several independent MD5_Context structures at once. The result is
+ * the same as calling MD5_update(md5[i], data[i], length[i]) for every i, but
+ * the whole 64-byte blocks of up to 8 (AVX2) or 4 (SSE2) contexts are
+ * transformed together in vector lanes. A lane that runs out of data is handed
+ * the next context with data left, so the lengths can differ freely.
+ * @param md5    The structures containing the intermediate MD5 information to
+ *               update. Every structure must be distinct.
+ * @param data   The data used to update each MD5 state.
+ * @param length The length of the data to digest for each MD5 state.
+ * @param count  The number of entries in md5, data and length.
+ */
+void MD5_update_multi(MD5_Context* const md5[], const void* const data[],
+    const uint32_t length[], uint32_t count) {
+#if defined(CPU_X86)
+    uint32_t state[4][MAX_LANES];
+    const unsigned char* ptr[MAX_LANES];
+    uint32_t blocks[MAX_LANES];
+    MD5_Context* owner[MAX_LANES];
+    uint32_t kernel = Dispatch_kernel(DISPATCH_MD5_MULTI);
+    uint32_t lanes = kernel == DISPATCH_AVX2 ? 8 : kernel == DISPATCH_SSE2 ? 4 : 0;
+    uint32_t active = 0;
+    uint32_t next = 0;
+    uint32_t run;
+    uint32_t lane;
+    uint32_t busy;
+    uint32_t word;
+
+    for (lane = 0; lane < MAX_LANES; ++lane) {
+        owner[lane] = NULL;
+    }
+
+    while (lanes > 0) {
+        /* Hand every idle lane the next context that has whole blocks left
+         * after its buffered bytes have been dealt with. */
+        for (lane = 0; lane < lanes; ++lane) {
+            while (owner[lane] == NULL && next < count) {
+                ptr[lane] = (const unsigned char*)data[next];
+                blocks[lane] = prepare(md5[next], &ptr[lane], length[next]);
+                if (blocks[lane] > 0) {
+                    owner[lane] = md5[next];
+                    for (word = 0; word < 4; ++word) {
+                        state[word][lane] = md5[next]->state[word];
+                    }
+                    ++active;
+                }
+                ++next;
+            }
+        }
+
+        /* A single context gains nothing from the lanes. */
+        if (active <= 1) {
+            break;
+        }
+
+        /* Run every lane until the shortest one is done. Idle lanes hash a
+         * copy of a busy lane's state and data, so they never work on
+         * uninitialized values, and their result is ignored. */
+        run = 0;
+        for (lane = 0; lane < lanes; ++lane) {
+            if (owner[lane] != NULL && (run == 0 || blocks[lane] < run)) {
+                run = blocks[lane];
+            }
+        }
+        for (lane = 0; lane < lanes; ++lane) {
+            if (owner[lane] == NULL) {
+                for (busy = lane + 1; owner[busy % lanes] == NULL; ++busy) {}
+                ptr[lane] = ptr[busy % lanes];
+                for (word = 0; word < 4; ++word) {
+                    state[word][lane] = state[word][busy % lanes];
+                }
+            }
+        }
+
+        if (lanes == 8) {
+            transform_avx2(state, ptr, run);
+        } else {
+            transform_sse2(state, ptr, run);
+        }
+
+        for (lane = 0; lane < lanes; ++lane) {
+            if (owner[lane] == NULL) {
+                continue;
+            }
+
+            ptr[lane] += run * 64;
+            blocks[lane] -= run;
+            if (blocks[lane] == 0) {
+                for (word = 0; word < 4; ++word) {
+                    owner[lane]->state[word] = state[word][lane];
+                }
+                owner[lane] = NULL;
+                --active;
+            }
+        }
     }
 
-    memcpy(md5->buffer, data, length);
+    /* Finish whatever is left in a lane one context at a time. */
+    for (lane = 0; lane < lanes; ++lane) {
+        if (owner[lane] != NULL) {
+            for (word = 0; word < 4; ++word) {
+                owner[lane]->state[word] = state[word][lane];
+            }
+            transform(owner[lane], ptr[lane], blocks[lane] * 64);
+        }
+    }
+
+    for (; next < count; ++next) {
+        MD5_update(md5[next], data[next], length[next]);
+    }
+#else
+    uint32_t idx;
+
+    for (idx = 0; idx < count; ++idx) {
+        MD5_update(md5[idx], data[idx], length[idx]);
+    }
+#endif
 }
@@ -23,6 +23,7 @@
  * http://openwall.info/wiki/people/solar/software/public-domain-source-code/md5
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -79,4 +80,43 @@ void MD5_init(MD5_Context* md5);
  */
 void MD5_update(MD5_Context* md5, const void* data, uint32_t length);
 
+/**
+ * Updates the MD5 state with data of any size, such as a whole mapped file. The
+ * data is handed to MD5_update in pieces of at most 256MB. MD5_update keeps
+ * any partial 64 byte block for the next call and counts the bytes across
+ * calls, so the digest matches a single MD5_update call over all of the data.
+ * @param md5    The structure containing the intermediate MD5 information to update.
+ * @param data   The data used to update the MD5 state.
+ * @param length The length of the data to digest.
+ */
+void MD5_update_large(MD5_Context* md5, const void* data, size_t length);
+
+/**
+ * Updates the MD5 state as if length zero bytes were passed to MD5_update,
+ * such as for the holes of a sparse file. The whole blocks are transformed by
+ * a variant of the transformation with the message words fixed at zero, so
+ * nothing has to be read.
+ * @param md5    The structure containing the intermediate MD5 information to update.
+ * @param length The number of zero bytes to digest.
+ */
+void MD5_update_zeros(MD5_Context* md5, uint64_t length);
+
+/**
+ * Updates several independent MD5_Context structures at once. The result is
+ * the same as calling MD5_update(md5[i], data[i], length[i]) for every i, but
+ * the whole 64-byte blocks of up to 8 (AVX2) or 4 (SSE2) contexts are
+ * transformed together in vector lanes. A lane that runs out of data is handed
+ * the next context with data left, so the lengths can differ freely.
+ * @param md5    The structures containing the intermediate MD5 information to
+ *               update. Every structure must be distinct.
+ * @param data   The data used to update each MD5 state.
+ * @param length The length of the data to digest for each MD5 state.
+ * @param count  The number of entries in md5, data and length.
+ * @remarks
+ * This is meant for hashing many small, independent inputs whose speed is
+ * bound by the latency of a single MD5 stream rather than by bandwidth.
+ */
+void MD5_update_multi(MD5_Context* const md5[], const void* const data[],
+    const uint32_t length[], uint32_t count);
+
 #endif
@@ -21,11 +21,24 @@
  */
 
 #include "sha1.h"
+#include "cpu.h"
+#include "dispatch.h"
+#include "large.h"
 #include <memory.h>
 
-/* blk0() and blk() perform the initial expand. */
+#if defined(CPU_X86)
+#include <emmintrin.h> /* SSE2 */
+#include <tmmintrin.h> /* SSSE3 */
+#include <smmintrin.h> /* SSE4.1 */
+#include <immintrin.h> /* SHA */
+#endif
+
+/* blk0() and blk() perform the initial expand. blk0() loads the big endian
+ * words straight from the source data. */
 #define rol(x, y) (((x) << (y)) | ((x) >> (32 - (y))))
-#define blk0(i) (block[i] = (rol(block[i], 24) & 0xFF00FF00) | (rol(block[i], 8) & 0x00FF00FF))
+#define blk0(i) (block[i] = \
+    ((uint32_t)ptr[4 * i] << 24) | ((uint32_t)ptr[4 * i + 1] << 16) | \
+    ((uint32_t)ptr[4 * i + 2] << 8) | (uint32_t)ptr[4 * i + 3])
 #define blk(i) (block[i & 15] = rol(block[(i + 13) & 15] ^ block[(i + 8) & 15] ^ block[(i + 2) & 15] ^ block[i & 15], 1))
 
 /* (R0+R1), R2, R3, R4 are the different operations used in SHA1 */
@@ -35,6 +48,46 @@
 #define R3(v, w, x, y, z, i) z += (((w | x) & y)|(w & x)) + blk(i) + 0x8F1BBCDC + rol(v, 5); w=rol(w, 30);
 #define R4(v, w, x, y, z, i) z += (w ^ x ^ y) + blk(i) + 0xCA62C1D6 + rol(v, 5); w=rol(w, 30);
 
+/* The same operations on a block of zeros, where every expanded word is zero
+ * as well. */
+#define Z1(v, w, x, y, z, i) z += ((w & (x ^ y)) ^ y) + 0x5A827999 + rol(v, 5); w=rol(w, 30);
+#define Z2(v, w, x, y, z, i) z += (w ^ x ^ y) + 0x6ED9EBA1 + rol(v, 5); w=rol(w, 30);
+#define Z3(v, w, x, y, z, i) z += (((w | x) & y)|(w & x)) + 0x8F1BBCDC + rol(v, 5); w=rol(w, 30);
+#define Z4(v, w, x, y, z, i) z += (w ^ x ^ y) + 0xCA62C1D6 + rol(v, 5); w=rol(w, 30);
+
+/* The 80 operations of the transformation, 4 rounds of 20 each. Loop
+ * unrolled. */
+#define ROUNDS(R0, R1, R2, R3, R4) \
+    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3); \
+    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7); \
+    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11); \
+    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15); \
+    \
+    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19); \
+    \
+    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23); \
+    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27); \
+    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31); \
+    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35); \
+    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39); \
+    \
+    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43); \
+    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47); \
+    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51); \
+    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55); \
+    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59); \
+    \
+    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63); \
+    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67); \
+    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71); \
+    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75); \
+    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+
+/* Fills the partial blocks at either end of a run of zeros, and is handed to
+ * the vector kernels a ZERO_BLOCKS blocks at a time. */
+#define ZERO_BLOCKS 64
+static const unsigned char zeros[ZERO_BLOCKS * 64];
+
 /**
  * Performs the actual transformation of the data for SHA1 hashing.
  * @param sha1 The SHA1 context to update.
@@ -50,11 +103,8 @@ static void transform(SHA1_Context* sha1, const void* data) {
     uint32_t c;
     uint32_t d;
     uint32_t e;
-    uint32_t block[16] = { 0 };
-
-    /* Copy the block of data we're going to work on. It might be a small
-     * performance hit (untested) but we modify the data during the rounds. */
-    memcpy(&block, data, 64);
+    uint32_t block[16];
+    const unsigned char* ptr = (const unsigned char*)data;
 
     a = sha1->state[0];
     b = sha1->state[1];
@@ -62,31 +112,7 @@ static void transform(SHA1_Context* sha1, const void* data) {
     d = sha1->state[3];
     e = sha1->state[4];
 
-    /* 4 rounds of 20 operations each. Loop unrolled. */
-    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
-    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
-    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
-    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
-
-    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
-
-    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
-    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
-    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
-    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
-    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
-
-    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
-    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
-    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
-    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
-    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
-
-    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
-    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
-    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
-    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
-    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+    ROUNDS(R0, R1, R2, R3, R4)
 
     sha1->state[0] += a;
     sha1->state[1] += b;
@@ -95,6 +121,322 @@ static void transform(SHA1_Context* sha1, const void* data) {
     sha1->state[4] += e;
 }
 
+/**
+ * Transforms blocks of 64 zero bytes with the scalar transformation. The whole
+ * message schedule is zero, so it's neither loaded nor expanded.
+ * @param sha1   The SHA1 context to update.
+ * @param blocks The number of zero blocks to transform.
+ */
+static void transform_zeros(SHA1_Context* sha1, uint32_t blocks) {
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+
+    while (blocks--) {
+        a = sha1->state[0];
+        b = sha1->state[1];
+        c = sha1->state[2];
+        d = sha1->state[3];
+        e = sha1->state[4];
+
+        ROUNDS(Z1, Z1, Z2, Z3, Z4)
+
+        sha1->state[0] += a;
+        sha1->state[1] += b;
+        sha1->state[2] += c;
+        sha1->state[3] += d;
+        sha1->state[4] += e;
+    }
+}
+
+#if defined(CPU_X86)
+/* Four rounds of the SHA-NI transform once the message schedule is running.
+ * ea holds E (plus the schedule words) for these rounds and eb receives ABCD
+ * for the next four. m0 is consumed while m1, m2 and m3 are advanced. */
+#define SHANI4(ea, eb, m0, m1, m2, m3, f) \
+    ea = _mm_sha1nexte_epu32(ea, m0); \
+    eb = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+/**
+ * Performs the transformation for a run of 64-byte blocks using the Intel SHA
+ * extensions. The state is only loaded and stored once for the whole run.
+ * @param sha1   The SHA1 context to update.
+ * @param data   The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+CPU_TARGET("sha,sse4.1,ssse3")
+static void transform_shani(SHA1_Context* sha1, const unsigned char* data, uint32_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i abcd, abcd_saved, e0, e0_saved, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)sha1->state), 0x1B);
+    e0 = _mm_set_epi32((int)sha1->state[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcd_saved = abcd;
+        e0_saved = e0;
+
+        /* Rounds 0-15 load and byte swap the message. */
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 16-67 */
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 0)
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 1)
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 1)
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 1)
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 2)
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 2)
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 2)
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 3)
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 3)
+
+        /* Rounds 68-79 wind down the message schedule. */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        /* Add this block's result to the running state. */
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)sha1->state, _mm_shuffle_epi32(abcd, 0x1B));
+    sha1->state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+#if defined(CPU_X86)
+/* Rotates each 32-bit lane of a vector left. */
+#define vrol(x, y) _mm_or_si128(_mm_slli_epi32((x), (y)), _mm_srli_epi32((x), 32 - (y)))
+
+/* VR1-VR4 are the SHA1 round operations, reading precomputed W[t]+K words. */
+#define VR1(v, w, x, y, z, i) z += ((w & (x ^ y)) ^ y) + wk[i] + rol(v, 5); w = rol(w, 30);
+#define VR2(v, w, x, y, z, i) z += (w ^ x ^ y) + wk[i] + rol(v, 5); w = rol(w, 30);
+#define VR3(v, w, x, y, z, i) z += (((w | x) & y) | (w & x)) + wk[i] + rol(v, 5); w = rol(w, 30);
+#define VR4(v, w, x, y, z, i) VR2(v, w, x, y, z, i)
+
+/* Four rounds followed by one vector step of the next block's schedule. The
+ * rounds only depend on each other and the schedule only on itself, so the
+ * CPU can overlap the two. */
+#define VROUNDS(R, v, w, x, y, z, i) \
+    R(v, w, x, y, z, i); R(z, v, w, x, y, i + 1); \
+    R(y, z, v, w, x, i + 2); R(x, y, z, v, w, i + 3); \
+    schedule(vw, nextwk, (i) / 4, next);
+
+/**
+ * Calculates four words of the SHA1 message schedule with SSSE3, using the
+ * approach from Intel's "Improving the Performance of the Secure Hash
+ * Algorithm (SHA-1)". Words 16-31 use the standard recurrence, with the
+ * dependency of the last lane on the first fixed up afterwards. Words 32-79 use
+ * the equivalent W[t] = (W[t-6] ^ W[t-16] ^ W[t-28] ^ W[t-32]) rol 2, which has
+ * no dependencies within a vector.
+ * @param w    The schedule words W[0..79], four per vector.
+ * @param wk   Receives W[t]+K for the four words calculated.
+ * @param step Which four words to calculate (0 to 19).
+ * @param data The 64-byte block the schedule is for.
+ */
+CPU_TARGET("ssse3")
+static CPU_INLINE void schedule(__m128i* w, __m128i* wk, int step, const unsigned char* data) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i k;
+    __m128i t;
+
+    if (step < 4) {
+        w[step] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + step * 16)), swap);
+    } else if (step < 8) {
+        t = _mm_xor_si128(
+            _mm_xor_si128(_mm_srli_si128(w[step - 1], 4), w[step - 2]),
+            _mm_xor_si128(_mm_alignr_epi8(w[step - 3], w[step - 4], 8), w[step - 4]));
+        w[step] = _mm_xor_si128(vrol(t, 1), vrol(_mm_slli_si128(t, 12), 2));
+    } else {
+        t = _mm_xor_si128(
+            _mm_xor_si128(_mm_alignr_epi8(w[step - 1], w[step - 2], 8), w[step - 4]),
+            _mm_xor_si128(w[step - 7], w[step - 8]));
+        w[step] = vrol(t, 2);
+    }
+
+    if (step < 5) {
+        k = _mm_set1_epi32(0x5A827999);
+    } else if (step < 10) {
+        k = _mm_set1_epi32(0x6ED9EBA1);
+    } else if (step < 15) {
+        k = _mm_set1_epi32((int)0x8F1BBCDC);
+    } else {
+        k = _mm_set1_epi32((int)0xCA62C1D6);
+    }
+
+    wk[step] = _mm_add_epi32(w[step], k);
+}
+
+/**
+ * Performs the transformation for a run of 64-byte blocks with the message
+ * schedule vectorized. The schedule for the next block is calculated four
+ * words at a time in between groups of four scalar rounds of the current one.
+ * @param sha1   The SHA1 context to update.
+ * @param data   The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+CPU_TARGET("ssse3")
+static CPU_INLINE void transform_vector(SHA1_Context* sha1, const unsigned char* data, uint32_t blocks) {
+    union {
+        __m128i v[20];
+        uint32_t w[80];
+    } schedules[2];
+    __m128i vw[20];
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+    int step;
+    int current = 0;
+
+    for (step = 0; step < 20; ++step) {
+        schedule(vw, schedules[0].v, step, data);
+    }
+
+    while (blocks--) {
+        const uint32_t* wk = schedules[current].w;
+        __m128i* nextwk = schedules[current ^ 1].v;
+
+        /* The last block schedules itself again rather than reading past the
+         * end of the data. The result is simply never used. */
+        const unsigned char* next = blocks ? data + 64 : data;
+
+        a = sha1->state[0];
+        b = sha1->state[1];
+        c = sha1->state[2];
+        d = sha1->state[3];
+        e = sha1->state[4];
+
+        VROUNDS(VR1, a, b, c, d, e,  0) VROUNDS(VR1, b, c, d, e, a,  4)
+        VROUNDS(VR1, c, d, e, a, b,  8) VROUNDS(VR1, d, e, a, b, c, 12)
+        VROUNDS(VR1, e, a, b, c, d, 16)
+
+        VROUNDS(VR2, a, b, c, d, e, 20) VROUNDS(VR2, b, c, d, e, a, 24)
+        VROUNDS(VR2, c, d, e, a, b, 28) VROUNDS(VR2, d, e, a, b, c, 32)
+        VROUNDS(VR2, e, a, b, c, d, 36)
+
+        VROUNDS(VR3, a, b, c, d, e, 40) VROUNDS(VR3, b, c, d, e, a, 44)
+        VROUNDS(VR3, c, d, e, a, b, 48) VROUNDS(VR3, d, e, a, b, c, 52)
+        VROUNDS(VR3, e, a, b, c, d, 56)
+
+        VROUNDS(VR4, a, b, c, d, e, 60) VROUNDS(VR4, b, c, d, e, a, 64)
+        VROUNDS(VR4, c, d, e, a, b, 68) VROUNDS(VR4, d, e, a, b, c, 72)
+        VROUNDS(VR4, e, a, b, c, d, 76)
+
+        sha1->state[0] += a;
+        sha1->state[1] += b;
+        sha1->state[2] += c;
+        sha1->state[3] += d;
+        sha1->state[4] += e;
+
+        data = next;
+        current ^= 1;
+    }
+}
+
+/**
+ * SSSE3 build of transform_vector.
+ * @param sha1   The SHA1 context to update.
+ * @param data   The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+CPU_TARGET("ssse3")
+static void transform_ssse3(SHA1_Context* sha1, const unsigned char* data, uint32_t blocks) {
+    transform_vector(sha1, data, blocks);
+}
+
+/**
+ * AVX2 build of transform_vector. The VEX encoded three operand forms save
+ * the register copies the SSSE3 build needs, and BMI2 provides rorx for the
+ * scalar rotates.
+ * @param sha1   The SHA1 context to update.
+ * @param data   The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+CPU_TARGET("avx2,bmi2")
+static void transform_avx2(SHA1_Context* sha1, const unsigned char* data, uint32_t blocks) {
+    transform_vector(sha1, data, blocks);
+}
+#endif
+
+/**
+ * Transforms a run of 64-byte blocks using the fastest transform supported by
+ * the CPU.
+ * @param sha1   The SHA1 context to update.
+ * @param data   The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+static void transform_blocks(SHA1_Context* sha1, const unsigned char* data, uint32_t blocks) {
+#if defined(CPU_X86)
+    switch (Dispatch_kernel(DISPATCH_SHA1)) {
+    case DISPATCH_SHANI:
+        transform_shani(sha1, data, blocks);
+        return;
+    case DISPATCH_AVX2:
+        transform_avx2(sha1, data, blocks);
+        return;
+    case DISPATCH_SSSE3:
+        transform_ssse3(sha1, data, blocks);
+        return;
+    }
+#endif
+
+    while (blocks--) {
+        transform(sha1, data);
+        data += 64;
+    }
+}
+
 /**
  * Performs the final operation on the SHA1_Context structure, copies the
  * resulting hash to the array pointed to by result and clears the structure. If
@@ -106,23 +448,32 @@ static void transform(SHA1_Context* sha1, const void* data) {
  *          architectures.
  */
 void SHA1_final(SHA1_Context* sha1, unsigned char* result) {
-    unsigned char finalcount[8];
-
-    finalcount[0] = (sha1->hi >> 24) & 0xFF;
-    finalcount[1] = (sha1->hi >> 16) & 0xFF;
-    finalcount[2] = (sha1->hi >>  8) & 0xFF;
-    finalcount[3] =  sha1->hi & 0xFF;
-    finalcount[4] = (sha1->lo >> 24) & 0xFF;
-    finalcount[5] = (sha1->lo >> 16) & 0xFF;
-    finalcount[6] = (sha1->lo >>  8) & 0xFF;
-    finalcount[7] =  sha1->lo & 0xFF;
-
-    SHA1_update(sha1, "\x80", 1);
-    while ((sha1->lo & 504) != 448) {
-        SHA1_update(sha1, "\0", 1);
+    uint32_t used;
+    uint32_t available;
+
+    used = (sha1->lo >> 3) & 0x3F;
+    sha1->buffer[used++] = 0x80;
+    available = 64 - used;
+
+    if (available < 8) {
+        memset(&sha1->buffer[used], 0, available);
+        transform_blocks(sha1, sha1->buffer, 1);
+        used = 0;
+        available = 64;
     }
 
-    SHA1_update(sha1, finalcount, 8);
+    memset(&sha1->buffer[used], 0, available - 8);
+
+    sha1->buffer[56] = (sha1->hi >> 24) & 0xFF;
+    sha1->buffer[57] = (sha1->hi >> 16) & 0xFF;
+    sha1->buffer[58] = (sha1->hi >>  8) & 0xFF;
+    sha1->buffer[59] =  sha1->hi & 0xFF;
+    sha1->buffer[60] = (sha1->lo >> 24) & 0xFF;
+    sha1->buffer[61] = (sha1->lo >> 16) & 0xFF;
+    sha1->buffer[62] = (sha1->lo >>  8) & 0xFF;
+    sha1->buffer[63] =  sha1->lo & 0xFF;
+
+    transform_blocks(sha1, sha1->buffer, 1);
 
     result[0]  = (sha1->state[0] >> 24) & 0xFF;
     result[1]  = (sha1->state[0] >> 16) & 0xFF;
@@ -189,9 +540,10 @@ void SHA1_update(SHA1_Context* sha1, const void* data, uint32_t length) {
     if (j + length > 63) {
         i = 64 - j;
         memcpy(&sha1->buffer[j], data, i);
-        transform(sha1, sha1->buffer);
-        for (; i + 63 < length; i += 64) {
-            transform(sha1, (const unsigned char*)data + i);
+        transform_blocks(sha1, sha1->buffer, 1);
+        if (length - i >= 64) {
+            transform_blocks(sha1, (const unsigned char*)data + i, (length - i) / 64);
+            i += (length - i) & ~(uint32_t)0x3F;
         }
         j = 0;
     } else {
@@ -200,3 +552,66 @@ void SHA1_update(SHA1_Context* sha1, const void* data, uint32_t length) {
 
     memcpy(&sha1->buffer[j], (const unsigned char*)data + i, length - i);
 }
+
+/**
+ * Updates the SHA1 state with data of any size, such as a whole mapped file. The
+ * data is handed to SHA1_update in pieces of at most LARGE_PIECE bytes.
+ * @param sha1   The structure containing the intermediate SHA1 information to update.
+ * @param data   The data used to update the SHA1 state.
+ * @param length The length of the data to digest.
+ */
+void SHA1_update_large(SHA1_Context* sha1, const void* data, size_t length) {
+    UPDATE_LARGE(SHA1_update, sha1, data, length);
+}
+
+/**
+ * Updates the SHA1 state as if length zero bytes were passed to SHA1_update.
+ * The SHA-NI kernel beats any scalar code even when it has to load the zeros,
+ * so it's handed them ZERO_BLOCKS at a time. Every other kernel is replaced by
+ * transform_zeros.
+ * @param sha1   The structure containing the intermediate SHA1 information to update.
+ * @param length The number of zero bytes to digest.
+ */
+void SHA1_update_zeros(SHA1_Context* sha1, uint64_t length) {
+    uint32_t available = (64 - ((sha1->lo >> 3) & 0x3F)) & 0x3F;
+    uint32_t blocks;
+    uint32_t piece;
+
+    /* Complete the partially buffered block first. */
+    if (available) {
+        if (available > length) {
+            available = (uint32_t)length;
+        }
+
+        SHA1_update(sha1, zeros, available);
+        length -= available;
+    }
+
+    while (length >= 64) {
+        piece = length > LARGE_PIECE ? LARGE_PIECE : (uint32_t)(length & ~(uint64_t)0x3F);
+
+        if ((sha1->lo += piece << 3) < (piece << 3)) {
+            ++sha1->hi;
+        }
+
+        sha1->hi += (piece >> 29);
+        blocks = piece >> 6;
+
+#if defined(CPU_X86)
+        if (Dispatch_kernel(DISPATCH_SHA1) == DISPATCH_SHANI) {
+            while (blocks > 0) {
+                uint32_t count = blocks < ZERO_BLOCKS ? blocks : ZERO_BLOCKS;
+                transform_shani(sha1, zeros, count);
+                blocks -= count;
+            }
+        }
+#endif
+
+        transform_zeros(sha1, blocks);
+        length -= piece;
+    }
+
+    if (length) {
+        SHA1_update(sha1, zeros, (uint32_t)length);
+    }
+}
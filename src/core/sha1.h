@@ -23,6 +23,7 @@
  * https://github.com/WaterJuice/CryptLib
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -74,4 +75,26 @@ void SHA1_init(SHA1_Context* sha1);
  */
 void SHA1_update(SHA1_Context* sha1, const void* data, uint32_t length);
 
+/**
+ * Updates the SHA1 state with data of any size, such as a whole mapped file. The
+ * data is handed to SHA1_update in pieces of at most 256MB. Its message length
+ * is counted in 64 bits, so the result is the same as a single SHA1_update call
+ * over all of the data, however large.
+ * @param sha1   The structure containing the intermediate SHA1 information to update.
+ * @param data   The data used to update the SHA1 state.
+ * @param length The length of the data to digest.
+ */
+void SHA1_update_large(SHA1_Context* sha1, const void* data, size_t length);
+
+/**
+ * Updates the SHA1 state as if length zero bytes were passed to SHA1_update,
+ * such as for the holes of a sparse file. Unless the CPU has the SHA
+ * extensions, the whole blocks are transformed by a variant of the
+ * transformation with the message schedule fixed at zero, so nothing has to be
+ * read or expanded.
+ * @param sha1   The structure containing the intermediate SHA1 information to update.
+ * @param length The number of zero bytes to digest.
+ */
+void SHA1_update_zeros(SHA1_Context* sha1, uint64_t length);
+
 #endif
@@ -0,0 +1,651 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#include "stitch.h"
+#include "cpu.h"
+#include "dispatch.h"
+
+#if defined(CPU_X86)
+#include <emmintrin.h> /* SSE2 */
+#include <tmmintrin.h> /* SSSE3 */
+#include <smmintrin.h> /* SSE4.1 */
+#include <immintrin.h> /* SHA */
+#endif
+
+/* LE and BE read 4 input bytes in little-endian and big-endian byte order.
+ * Compilers turn both into a single (byte swapping) load. */
+#define LE(p) \
+    ((uint32_t)(p)[0] | \
+    ((uint32_t)(p)[1] << 8) | \
+    ((uint32_t)(p)[2] << 16) | \
+    ((uint32_t)(p)[3] << 24))
+#define BE(p) \
+    (((uint32_t)(p)[0] << 24) | \
+    ((uint32_t)(p)[1] << 16) | \
+    ((uint32_t)(p)[2] << 8) | \
+     (uint32_t)(p)[3])
+
+#define rol(x, y) (((x) << (y)) | ((x) >> (32 - (y))))
+
+/* The MD4 and MD5 basic functions. MG4 is the MD4 majority function. */
+#define MF(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MG(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
+#define MG4(x, y, z) (((x) & ((y) | (z))) | ((y) & (z)))
+#define MH(x, y, z)  ((x) ^ (y) ^ (z))
+#define MI(x, y, z)  ((y) ^ ((x) | ~(z)))
+
+/* A single MD4 or MD5 step. */
+#define MD4STEP(f, a, b, c, d, x, k, s) \
+    (a) += f((b), (c), (d)) + (x) + (k); \
+    (a) = rol((a), (s));
+#define MD5STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = rol((a), (s)); \
+    (a) += (b);
+
+/* The SHA1 rounds with the message schedule kept in a ring of 16 words. */
+#define W0(i) (W[i] = BE(ptr + (i) * 4))
+#define W1(i) (W[(i) & 15] = rol(W[((i) + 13) & 15] ^ W[((i) + 8) & 15] ^ \
+    W[((i) + 2) & 15] ^ W[(i) & 15], 1))
+#define R0(v, w, x, y, z, i) z += ((w & (x ^ y)) ^ y) + W0(i) + 0x5A827999 + rol(v, 5); w = rol(w, 30);
+#define R1(v, w, x, y, z, i) z += ((w & (x ^ y)) ^ y) + W1(i) + 0x5A827999 + rol(v, 5); w = rol(w, 30);
+#define R2(v, w, x, y, z, i) z += (w ^ x ^ y) + W1(i) + 0x6ED9EBA1 + rol(v, 5); w = rol(w, 30);
+#define R3(v, w, x, y, z, i) z += (((w | x) & y) | (w & x)) + W1(i) + 0x8F1BBCDC + rol(v, 5); w = rol(w, 30);
+#define R4(v, w, x, y, z, i) z += (w ^ x ^ y) + W1(i) + 0xCA62C1D6 + rol(v, 5); w = rol(w, 30);
+
+/* Folds the n-th 16 bytes of the block into the CRC32 with slicing-by-16. */
+#define CRC32SLICE(n) \
+    one = LE(ptr + (n) * 16) ^ digest; \
+    two = LE(ptr + (n) * 16 + 4); \
+    three = LE(ptr + (n) * 16 + 8); \
+    four = LE(ptr + (n) * 16 + 12); \
+    digest = \
+        CRC32_table[15][ one         & 0xFF] ^ \
+        CRC32_table[14][(one   >>  8) & 0xFF] ^ \
+        CRC32_table[13][(one   >> 16) & 0xFF] ^ \
+        CRC32_table[12][(one   >> 24) & 0xFF] ^ \
+        CRC32_table[11][ two         & 0xFF] ^ \
+        CRC32_table[10][(two   >>  8) & 0xFF] ^ \
+        CRC32_table[ 9][(two   >> 16) & 0xFF] ^ \
+        CRC32_table[ 8][(two   >> 24) & 0xFF] ^ \
+        CRC32_table[ 7][ three       & 0xFF] ^ \
+        CRC32_table[ 6][(three >>  8) & 0xFF] ^ \
+        CRC32_table[ 5][(three >> 16) & 0xFF] ^ \
+        CRC32_table[ 4][(three >> 24) & 0xFF] ^ \
+        CRC32_table[ 3][ four        & 0xFF] ^ \
+        CRC32_table[ 2][(four  >>  8) & 0xFF] ^ \
+        CRC32_table[ 1][(four  >> 16) & 0xFF] ^ \
+        CRC32_table[ 0][(four  >> 24) & 0xFF];
+
+/**
+ * Calculates the MD4 and the CRC32 of a run of 64-byte blocks. The four
+ * slicing-by-16 iterations of each block are spread over the MD4 steps.
+ * @param md4    The MD4 context to update.
+ * @param crc    The CRC32 context to update.
+ * @param ptr    The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+static void md4_crc32_sliced(
+    MD4_Context* md4, CRC32_Context* crc, const unsigned char* ptr, uint32_t blocks) {
+    uint32_t X[16];
+    uint32_t ma = md4->state[0];
+    uint32_t mb = md4->state[1];
+    uint32_t mc = md4->state[2];
+    uint32_t md = md4->state[3];
+    uint32_t digest = crc->digest;
+    uint32_t one;
+    uint32_t two;
+    uint32_t three;
+    uint32_t four;
+    int i;
+
+    while (blocks--) {
+        for (i = 0; i < 16; ++i) {
+            X[i] = LE(ptr + i * 4);
+        }
+
+        CRC32SLICE(0)
+        MD4STEP(MF, ma, mb, mc, md, X[ 0], 0x00000000,  3)
+        MD4STEP(MF, md, ma, mb, mc, X[ 1], 0x00000000,  7)
+        MD4STEP(MF, mc, md, ma, mb, X[ 2], 0x00000000, 11)
+        MD4STEP(MF, mb, mc, md, ma, X[ 3], 0x00000000, 19)
+        MD4STEP(MF, ma, mb, mc, md, X[ 4], 0x00000000,  3)
+        MD4STEP(MF, md, ma, mb, mc, X[ 5], 0x00000000,  7)
+        MD4STEP(MF, mc, md, ma, mb, X[ 6], 0x00000000, 11)
+        MD4STEP(MF, mb, mc, md, ma, X[ 7], 0x00000000, 19)
+        MD4STEP(MF, ma, mb, mc, md, X[ 8], 0x00000000,  3)
+        MD4STEP(MF, md, ma, mb, mc, X[ 9], 0x00000000,  7)
+        MD4STEP(MF, mc, md, ma, mb, X[10], 0x00000000, 11)
+        MD4STEP(MF, mb, mc, md, ma, X[11], 0x00000000, 19)
+
+        CRC32SLICE(1)
+        MD4STEP(MF, ma, mb, mc, md, X[12], 0x00000000,  3)
+        MD4STEP(MF, md, ma, mb, mc, X[13], 0x00000000,  7)
+        MD4STEP(MF, mc, md, ma, mb, X[14], 0x00000000, 11)
+        MD4STEP(MF, mb, mc, md, ma, X[15], 0x00000000, 19)
+        MD4STEP(MG4, ma, mb, mc, md, X[ 0], 0x5a827999,  3)
+        MD4STEP(MG4, md, ma, mb, mc, X[ 4], 0x5a827999,  5)
+        MD4STEP(MG4, mc, md, ma, mb, X[ 8], 0x5a827999,  9)
+        MD4STEP(MG4, mb, mc, md, ma, X[12], 0x5a827999, 13)
+        MD4STEP(MG4, ma, mb, mc, md, X[ 1], 0x5a827999,  3)
+        MD4STEP(MG4, md, ma, mb, mc, X[ 5], 0x5a827999,  5)
+        MD4STEP(MG4, mc, md, ma, mb, X[ 9], 0x5a827999,  9)
+        MD4STEP(MG4, mb, mc, md, ma, X[13], 0x5a827999, 13)
+
+        CRC32SLICE(2)
+        MD4STEP(MG4, ma, mb, mc, md, X[ 2], 0x5a827999,  3)
+        MD4STEP(MG4, md, ma, mb, mc, X[ 6], 0x5a827999,  5)
+        MD4STEP(MG4, mc, md, ma, mb, X[10], 0x5a827999,  9)
+        MD4STEP(MG4, mb, mc, md, ma, X[14], 0x5a827999, 13)
+        MD4STEP(MG4, ma, mb, mc, md, X[ 3], 0x5a827999,  3)
+        MD4STEP(MG4, md, ma, mb, mc, X[ 7], 0x5a827999,  5)
+        MD4STEP(MG4, mc, md, ma, mb, X[11], 0x5a827999,  9)
+        MD4STEP(MG4, mb, mc, md, ma, X[15], 0x5a827999, 13)
+        MD4STEP(MH, ma, mb, mc, md, X[ 0], 0x6ed9eba1,  3)
+        MD4STEP(MH, md, ma, mb, mc, X[ 8], 0x6ed9eba1,  9)
+        MD4STEP(MH, mc, md, ma, mb, X[ 4], 0x6ed9eba1, 11)
+        MD4STEP(MH, mb, mc, md, ma, X[12], 0x6ed9eba1, 15)
+
+        CRC32SLICE(3)
+        MD4STEP(MH, ma, mb, mc, md, X[ 2], 0x6ed9eba1,  3)
+        MD4STEP(MH, md, ma, mb, mc, X[10], 0x6ed9eba1,  9)
+        MD4STEP(MH, mc, md, ma, mb, X[ 6], 0x6ed9eba1, 11)
+        MD4STEP(MH, mb, mc, md, ma, X[14], 0x6ed9eba1, 15)
+        MD4STEP(MH, ma, mb, mc, md, X[ 1], 0x6ed9eba1,  3)
+        MD4STEP(MH, md, ma, mb, mc, X[ 9], 0x6ed9eba1,  9)
+        MD4STEP(MH, mc, md, ma, mb, X[ 5], 0x6ed9eba1, 11)
+        MD4STEP(MH, mb, mc, md, ma, X[13], 0x6ed9eba1, 15)
+        MD4STEP(MH, ma, mb, mc, md, X[ 3], 0x6ed9eba1,  3)
+        MD4STEP(MH, md, ma, mb, mc, X[11], 0x6ed9eba1,  9)
+        MD4STEP(MH, mc, md, ma, mb, X[ 7], 0x6ed9eba1, 11)
+        MD4STEP(MH, mb, mc, md, ma, X[15], 0x6ed9eba1, 15)
+
+        ma = md4->state[0] += ma;
+        mb = md4->state[1] += mb;
+        mc = md4->state[2] += mc;
+        md = md4->state[3] += md;
+
+        ptr += 64;
+    }
+
+    crc->digest = digest;
+}
+
+/**
+ * Calculates the MD5 and the SHA1 of a run of 64-byte blocks. Each group of
+ * four MD5 steps is followed by five SHA1 rounds so both dependency chains
+ * are in flight at once.
+ * @param md5    The MD5 context to update.
+ * @param sha1   The SHA1 context to update.
+ * @param ptr    The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+static void md5_sha1_scalar(
+    MD5_Context* md5, SHA1_Context* sha1, const unsigned char* ptr, uint32_t blocks) {
+    uint32_t X[16];
+    uint32_t W[16];
+    uint32_t ma;
+    uint32_t mb;
+    uint32_t mc;
+    uint32_t md;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+    int i;
+
+    while (blocks--) {
+        for (i = 0; i < 16; ++i) {
+            X[i] = LE(ptr + i * 4);
+        }
+
+        ma = md5->state[0];
+        mb = md5->state[1];
+        mc = md5->state[2];
+        md = md5->state[3];
+        a = sha1->state[0];
+        b = sha1->state[1];
+        c = sha1->state[2];
+        d = sha1->state[3];
+        e = sha1->state[4];
+
+        /* MD5 round 1, SHA1 rounds 0-19 */
+        MD5STEP(MF, ma, mb, mc, md, X[ 0], 0xd76aa478,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[ 1], 0xe8c7b756, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[ 2], 0x242070db, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[ 3], 0xc1bdceee, 22)
+        R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3); R0(b,c,d,e,a, 4);
+
+        MD5STEP(MF, ma, mb, mc, md, X[ 4], 0xf57c0faf,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[ 5], 0x4787c62a, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[ 6], 0xa8304613, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[ 7], 0xfd469501, 22)
+        R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7); R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9);
+
+        MD5STEP(MF, ma, mb, mc, md, X[ 8], 0x698098d8,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[ 9], 0x8b44f7af, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[10], 0xffff5bb1, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[11], 0x895cd7be, 22)
+        R0(a,b,c,d,e,10); R0(e,a,b,c,d,11); R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14);
+
+        MD5STEP(MF, ma, mb, mc, md, X[12], 0x6b901122,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[13], 0xfd987193, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[14], 0xa679438e, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[15], 0x49b40821, 22)
+        R0(a,b,c,d,e,15); R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+
+        /* MD5 round 2, SHA1 rounds 20-39 */
+        MD5STEP(MG, ma, mb, mc, md, X[ 1], 0xf61e2562,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[ 6], 0xc040b340,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[11], 0x265e5a51, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[ 0], 0xe9b6c7aa, 20)
+        R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23); R2(b,c,d,e,a,24);
+
+        MD5STEP(MG, ma, mb, mc, md, X[ 5], 0xd62f105d,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[10], 0x02441453,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[15], 0xd8a1e681, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[ 4], 0xe7d3fbc8, 20)
+        R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27); R2(c,d,e,a,b,28); R2(b,c,d,e,a,29);
+
+        MD5STEP(MG, ma, mb, mc, md, X[ 9], 0x21e1cde6,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[14], 0xc33707d6,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[ 3], 0xf4d50d87, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[ 8], 0x455a14ed, 20)
+        R2(a,b,c,d,e,30); R2(e,a,b,c,d,31); R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34);
+
+        MD5STEP(MG, ma, mb, mc, md, X[13], 0xa9e3e905,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[ 2], 0xfcefa3f8,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[ 7], 0x676f02d9, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[12], 0x8d2a4c8a, 20)
+        R2(a,b,c,d,e,35); R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+
+        /* MD5 round 3, SHA1 rounds 40-59 */
+        MD5STEP(MH, ma, mb, mc, md, X[ 5], 0xfffa3942,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[ 8], 0x8771f681, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[11], 0x6d9d6122, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[14], 0xfde5380c, 23)
+        R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43); R3(b,c,d,e,a,44);
+
+        MD5STEP(MH, ma, mb, mc, md, X[ 1], 0xa4beea44,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[ 4], 0x4bdecfa9, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[ 7], 0xf6bb4b60, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[10], 0xbebfbc70, 23)
+        R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47); R3(c,d,e,a,b,48); R3(b,c,d,e,a,49);
+
+        MD5STEP(MH, ma, mb, mc, md, X[13], 0x289b7ec6,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[ 0], 0xeaa127fa, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[ 3], 0xd4ef3085, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[ 6], 0x04881d05, 23)
+        R3(a,b,c,d,e,50); R3(e,a,b,c,d,51); R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54);
+
+        MD5STEP(MH, ma, mb, mc, md, X[ 9], 0xd9d4d039,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[12], 0xe6db99e5, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[15], 0x1fa27cf8, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[ 2], 0xc4ac5665, 23)
+        R3(a,b,c,d,e,55); R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+
+        /* MD5 round 4, SHA1 rounds 60-79 */
+        MD5STEP(MI, ma, mb, mc, md, X[ 0], 0xf4292244,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[ 7], 0x432aff97, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[14], 0xab9423a7, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[ 5], 0xfc93a039, 21)
+        R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63); R4(b,c,d,e,a,64);
+
+        MD5STEP(MI, ma, mb, mc, md, X[12], 0x655b59c3,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[ 3], 0x8f0ccc92, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[10], 0xffeff47d, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[ 1], 0x85845dd1, 21)
+        R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67); R4(c,d,e,a,b,68); R4(b,c,d,e,a,69);
+
+        MD5STEP(MI, ma, mb, mc, md, X[ 8], 0x6fa87e4f,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[15], 0xfe2ce6e0, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[ 6], 0xa3014314, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[13], 0x4e0811a1, 21)
+        R4(a,b,c,d,e,70); R4(e,a,b,c,d,71); R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74);
+
+        MD5STEP(MI, ma, mb, mc, md, X[ 4], 0xf7537e82,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[11], 0xbd3af235, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[ 2], 0x2ad7d2bb, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[ 9], 0xeb86d391, 21)
+        R4(a,b,c,d,e,75); R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+
+        md5->state[0] += ma;
+        md5->state[1] += mb;
+        md5->state[2] += mc;
+        md5->state[3] += md;
+        sha1->state[0] += a;
+        sha1->state[1] += b;
+        sha1->state[2] += c;
+        sha1->state[3] += d;
+        sha1->state[4] += e;
+
+        ptr += 64;
+    }
+}
+
+#if defined(CPU_X86)
+/* Four rounds of the SHA-NI transform once the message schedule is running,
+ * the same as in sha1.c. */
+#define SHANI4(ea, eb, m0, m1, m2, m3, f) \
+    ea = _mm_sha1nexte_epu32(ea, m0); \
+    eb = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+/**
+ * Calculates the MD5 and the SHA1 of a run of 64-byte blocks, with the SHA1
+ * calculated using the Intel SHA extensions. Three or four MD5 steps follow
+ * every sha1rnds4, which keeps the scalar ports busy while the SHA unit works.
+ * @param md5    The MD5 context to update.
+ * @param sha1   The SHA1 context to update.
+ * @param ptr    The data to process.
+ * @param blocks The number of 64-byte blocks to process.
+ */
+CPU_TARGET("sha,sse4.1,ssse3")
+static void md5_sha1_shani(
+    MD5_Context* md5, SHA1_Context* sha1, const unsigned char* ptr, uint32_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i abcd, abcd_saved, e0, e0_saved, e1;
+    __m128i msg0, msg1, msg2, msg3;
+    uint32_t X[16];
+    uint32_t ma = md5->state[0];
+    uint32_t mb = md5->state[1];
+    uint32_t mc = md5->state[2];
+    uint32_t md = md5->state[3];
+    int i;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)sha1->state), 0x1B);
+    e0 = _mm_set_epi32((int)sha1->state[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcd_saved = abcd;
+        e0_saved = e0;
+
+        for (i = 0; i < 16; ++i) {
+            X[i] = LE(ptr + i * 4);
+        }
+
+        /* SHA1 rounds 0-15 load and byte swap the message. */
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        MD5STEP(MF, ma, mb, mc, md, X[ 0], 0xd76aa478,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[ 1], 0xe8c7b756, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[ 2], 0x242070db, 17)
+
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        MD5STEP(MF, mb, mc, md, ma, X[ 3], 0xc1bdceee, 22)
+        MD5STEP(MF, ma, mb, mc, md, X[ 4], 0xf57c0faf,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[ 5], 0x4787c62a, 12)
+
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+        MD5STEP(MF, mc, md, ma, mb, X[ 6], 0xa8304613, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[ 7], 0xfd469501, 22)
+        MD5STEP(MF, ma, mb, mc, md, X[ 8], 0x698098d8,  7)
+
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+        MD5STEP(MF, md, ma, mb, mc, X[ 9], 0x8b44f7af, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[10], 0xffff5bb1, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[11], 0x895cd7be, 22)
+
+        /* SHA1 rounds 16-67 */
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 0)
+        MD5STEP(MF, ma, mb, mc, md, X[12], 0x6b901122,  7)
+        MD5STEP(MF, md, ma, mb, mc, X[13], 0xfd987193, 12)
+        MD5STEP(MF, mc, md, ma, mb, X[14], 0xa679438e, 17)
+        MD5STEP(MF, mb, mc, md, ma, X[15], 0x49b40821, 22)
+
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        MD5STEP(MG, ma, mb, mc, md, X[ 1], 0xf61e2562,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[ 6], 0xc040b340,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[11], 0x265e5a51, 14)
+
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 1)
+        MD5STEP(MG, mb, mc, md, ma, X[ 0], 0xe9b6c7aa, 20)
+        MD5STEP(MG, ma, mb, mc, md, X[ 5], 0xd62f105d,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[10], 0x02441453,  9)
+
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 1)
+        MD5STEP(MG, mc, md, ma, mb, X[15], 0xd8a1e681, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[ 4], 0xe7d3fbc8, 20)
+        MD5STEP(MG, ma, mb, mc, md, X[ 9], 0x21e1cde6,  5)
+
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 1)
+        MD5STEP(MG, md, ma, mb, mc, X[14], 0xc33707d6,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[ 3], 0xf4d50d87, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[ 8], 0x455a14ed, 20)
+
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        MD5STEP(MG, ma, mb, mc, md, X[13], 0xa9e3e905,  5)
+        MD5STEP(MG, md, ma, mb, mc, X[ 2], 0xfcefa3f8,  9)
+        MD5STEP(MG, mc, md, ma, mb, X[ 7], 0x676f02d9, 14)
+        MD5STEP(MG, mb, mc, md, ma, X[12], 0x8d2a4c8a, 20)
+
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        MD5STEP(MH, ma, mb, mc, md, X[ 5], 0xfffa3942,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[ 8], 0x8771f681, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[11], 0x6d9d6122, 16)
+
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 2)
+        MD5STEP(MH, mb, mc, md, ma, X[14], 0xfde5380c, 23)
+        MD5STEP(MH, ma, mb, mc, md, X[ 1], 0xa4beea44,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[ 4], 0x4bdecfa9, 11)
+
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 2)
+        MD5STEP(MH, mc, md, ma, mb, X[ 7], 0xf6bb4b60, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[10], 0xbebfbc70, 23)
+        MD5STEP(MH, ma, mb, mc, md, X[13], 0x289b7ec6,  4)
+
+        SHANI4(e1, e0, msg1, msg2, msg3, msg0, 2)
+        MD5STEP(MH, md, ma, mb, mc, X[ 0], 0xeaa127fa, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[ 3], 0xd4ef3085, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[ 6], 0x04881d05, 23)
+
+        SHANI4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        MD5STEP(MH, ma, mb, mc, md, X[ 9], 0xd9d4d039,  4)
+        MD5STEP(MH, md, ma, mb, mc, X[12], 0xe6db99e5, 11)
+        MD5STEP(MH, mc, md, ma, mb, X[15], 0x1fa27cf8, 16)
+        MD5STEP(MH, mb, mc, md, ma, X[ 2], 0xc4ac5665, 23)
+
+        SHANI4(e1, e0, msg3, msg0, msg1, msg2, 3)
+        MD5STEP(MI, ma, mb, mc, md, X[ 0], 0xf4292244,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[ 7], 0x432aff97, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[14], 0xab9423a7, 15)
+
+        SHANI4(e0, e1, msg0, msg1, msg2, msg3, 3)
+        MD5STEP(MI, mb, mc, md, ma, X[ 5], 0xfc93a039, 21)
+        MD5STEP(MI, ma, mb, mc, md, X[12], 0x655b59c3,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[ 3], 0x8f0ccc92, 10)
+
+        /* SHA1 rounds 68-79 wind down the message schedule. */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+        MD5STEP(MI, mc, md, ma, mb, X[10], 0xffeff47d, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[ 1], 0x85845dd1, 21)
+        MD5STEP(MI, ma, mb, mc, md, X[ 8], 0x6fa87e4f,  6)
+
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        MD5STEP(MI, md, ma, mb, mc, X[15], 0xfe2ce6e0, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[ 6], 0xa3014314, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[13], 0x4e0811a1, 21)
+
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        MD5STEP(MI, ma, mb, mc, md, X[ 4], 0xf7537e82,  6)
+        MD5STEP(MI, md, ma, mb, mc, X[11], 0xbd3af235, 10)
+        MD5STEP(MI, mc, md, ma, mb, X[ 2], 0x2ad7d2bb, 15)
+        MD5STEP(MI, mb, mc, md, ma, X[ 9], 0xeb86d391, 21)
+
+        /* Add this block's result to the running states. */
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+        ma = md5->state[0] += ma;
+        mb = md5->state[1] += mb;
+        mc = md5->state[2] += mc;
+        md = md5->state[3] += md;
+
+        ptr += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)sha1->state, _mm_shuffle_epi32(abcd, 0x1B));
+    sha1->state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+/**
+ * Updates a MD4 and a CRC32 state with the same data, interleaving the CRC32
+ * with the MD4 steps when the CPU can't fold it with PCLMULQDQ.
+ * @param md4    The MD4 state to update.
+ * @param crc    The CRC32 state to update.
+ * @param data   The data used to update both states.
+ * @param length The length of the data to digest.
+ */
+void Stitch_MD4_CRC32_update(
+    MD4_Context* md4, CRC32_Context* crc, const void* data, uint32_t length) {
+    const unsigned char* ptr = (const unsigned char*)data;
+    uint32_t head;
+    uint32_t blocks;
+    uint32_t saved_lo;
+
+    /* Folding is several times faster than any table lookup. */
+    if (Dispatch_kernel(DISPATCH_MD4_CRC32) == DISPATCH_PCLMUL) {
+        MD4_update(md4, ptr, length);
+        CRC32_update(crc, ptr, length);
+        return;
+    }
+
+    /* Bring the MD4 to a block boundary. The CRC32 has no blocks. */
+    head = (64 - (md4->lo & 0x3F)) & 0x3F;
+    if (head > length) {
+        head = length;
+    }
+
+    MD4_update(md4, ptr, head);
+    CRC32_update(crc, ptr, head);
+    ptr += head;
+    length -= head;
+
+    blocks = length >> 6;
+    if (blocks) {
+        /* Count the blocks the same way MD4_update does. */
+        saved_lo = md4->lo;
+        if ((md4->lo = (saved_lo + (blocks << 6)) & 0x1FFFFFFF) < saved_lo) {
+            md4->hi++;
+        }
+        md4->hi += blocks >> 23;
+
+        md4_crc32_sliced(md4, crc, ptr, blocks);
+        ptr += blocks << 6;
+        length &= 0x3F;
+    }
+
+    MD4_update(md4, ptr, length);
+    CRC32_update(crc, ptr, length);
+}
+
+/**
+ * Updates a MD5 and a SHA1 state with the same data, calculating both in a
+ * single pass over the whole blocks.
+ * @param md5    The MD5 state to update.
+ * @param sha1   The SHA1 state to update.
+ * @param data   The data used to update both states.
+ * @param length The length of the data to digest.
+ */
+void Stitch_MD5_SHA1_update(
+    MD5_Context* md5, SHA1_Context* sha1, const void* data, uint32_t length) {
+    const unsigned char* ptr = (const unsigned char*)data;
+    uint32_t head;
+    uint32_t blocks;
+    uint32_t bytes;
+    uint32_t saved_lo;
+
+    /* Both states need to be at the same offset in their block, which is
+     * always the case when they're only ever updated together. */
+    if ((md5->lo & 0x3F) != ((sha1->lo >> 3) & 0x3F)) {
+        MD5_update(md5, ptr, length);
+        SHA1_update(sha1, ptr, length);
+        return;
+    }
+
+    head = (64 - (md5->lo & 0x3F)) & 0x3F;
+    if (head > length) {
+        head = length;
+    }
+
+    MD5_update(md5, ptr, head);
+    SHA1_update(sha1, ptr, head);
+    ptr += head;
+    length -= head;
+
+    blocks = length >> 6;
+    if (blocks) {
+        /* Count the blocks the same way MD5_update and SHA1_update do. */
+        bytes = blocks << 6;
+        saved_lo = md5->lo;
+        if ((md5->lo = (saved_lo + bytes) & 0x1FFFFFFF) < saved_lo) {
+            ++md5->hi;
+        }
+        md5->hi += bytes >> 29;
+
+        if ((sha1->lo += bytes << 3) < (bytes << 3)) {
+            ++sha1->hi;
+        }
+        sha1->hi += bytes >> 29;
+
+#if defined(CPU_X86)
+        if (Dispatch_kernel(DISPATCH_MD5_SHA1) == DISPATCH_SHANI) {
+            md5_sha1_shani(md5, sha1, ptr, blocks);
+        } else
+#endif
+        {
+            md5_sha1_scalar(md5, sha1, ptr, blocks);
+        }
+
+        ptr += bytes;
+        length &= 0x3F;
+    }
+
+    MD5_update(md5, ptr, length);
+    SHA1_update(sha1, ptr, length);
+}
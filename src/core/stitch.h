@@ -0,0 +1,58 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_STITCH_H_
+#define __JMMHASHER_STITCH_H_
+
+#include "crc32.h"
+#include "md4.h"
+#include "md5.h"
+#include "sha1.h"
+#include <stdint.h>
+
+/**
+ * Updates a MD4 and a CRC32 state with the same data. The result is the same
+ * as calling MD4_update and CRC32_update separately, but when the CPU can't
+ * fold the CRC32 with PCLMULQDQ the table lookups of the CRC32 are interleaved
+ * with the MD4 steps of each block. MD4 is a single chain of dependent
+ * additions that leaves most of the execution ports idle, which the CRC32
+ * loads and XORs can use for free.
+ * @param md4    The MD4 state to update.
+ * @param crc    The CRC32 state to update.
+ * @param data   The data used to update both states.
+ * @param length The length of the data to digest.
+ */
+void Stitch_MD4_CRC32_update(
+    MD4_Context* md4, CRC32_Context* crc, const void* data, uint32_t length);
+
+/**
+ * Updates a MD5 and a SHA1 state with the same data. The result is the same as
+ * calling MD5_update and SHA1_update separately, but both hashes are
+ * calculated in a single pass over each block with their steps interleaved.
+ * MD5 is bound by the latency of its dependency chain, so the SHA1 rounds
+ * (calculated with the Intel SHA extensions when available) mostly run in the
+ * gaps it leaves.
+ * @param md5    The MD5 state to update.
+ * @param sha1   The SHA1 state to update.
+ * @param data   The data used to update both states.
+ * @param length The length of the data to digest.
+ */
+void Stitch_MD5_SHA1_update(
+    MD5_Context* md5, SHA1_Context* sha1, const void* data, uint32_t length);
+
+#endif
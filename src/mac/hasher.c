@@ -23,10 +23,18 @@
 #include <stdlib.h> /* malloc */
 #include <string.h> /* memset */
 
+#include <sys/ioctl.h> /* ioctl */
 #include <sys/stat.h>  /* stat */
 #include <unistd.h>    /* read */
 
+#if defined(__linux__)
+#include <linux/fiemap.h> /* struct fiemap */
+#include <linux/fs.h>     /* FS_IOC_FIEMAP, FIBMAP */
+#endif
+
 #include "core/crc32.h"
+#include "core/dispatch.h"
+#include "core/hashes.h"
 #include "core/md4.h"
 #include "core/md5.h"
 #include "core/sha1.h"
@@ -38,6 +46,7 @@
 #define OPTION_MD4   0x04
 #define OPTION_MD5   0x08
 #define OPTION_SHA1  0x10
+#define OPTION_ORDER 0x20
 #define OPTION_ALL \
     OPTION_CRC32 | OPTION_ED2K | OPTION_MD4 | \
     OPTION_MD5 | OPTION_SHA1
@@ -47,11 +56,64 @@
 #define DO_MD4   (options & OPTION_MD4)   == OPTION_MD4
 #define DO_MD5   (options & OPTION_MD5)   == OPTION_MD5
 #define DO_SHA1  (options & OPTION_SHA1)  == OPTION_SHA1
+#define DO_ORDER (options & OPTION_ORDER) == OPTION_ORDER
 
 #define BLOCKSIZE  9728000
-#define BUFFERSIZE BLOCKSIZE / 10
+#define BUFFERSIZE (BLOCKSIZE / 10)
+
+/* The physical offset of files the file system can't locate on the disk. */
+#define UNKNOWN_OFFSET UINT64_MAX
+
+/***** Structures *****/
+/**
+ * Where a file is stored, used to hash a list of files in the order they're
+ * laid out on the disk.
+ * @field name     The name of the file.
+ * @field device   The device holding the file.
+ * @field physical The offset of the first extent of the file on the device,
+ *                 or UNKNOWN_OFFSET if the file system can't tell.
+ * @field inode    The inode of the file, used to order the files without a
+ *                 known physical offset.
+ */
+typedef struct {
+    char* name;
+    uint64_t device;
+    uint64_t physical;
+    uint64_t inode;
+} FileLocation;
 
 /***** Forward declarations *****/
+/**
+ * Compares two FileLocations for qsort, by device, then physical offset, then
+ * inode. Files without a known physical offset sort after the others on the
+ * same device.
+ * @param  left  The first FileLocation.
+ * @param  right The second FileLocation.
+ * @return       Returns a negative value, 0 or a positive value if left is
+ *               before, at the same place as or after right.
+ */
+static int compare_locations(const void* left, const void* right);
+
+/**
+ * Reorders a list of files so they're hashed in the order they're laid out on
+ * their disks, which saves spinning disks from seeking back and forth between
+ * them. Files are ordered by the physical offset of their first extent where
+ * the file system reports it (through FIEMAP or FIBMAP on Linux and
+ * F_LOG2PHYS_EXT on Mac OS X) and by inode otherwise. NULL items and files
+ * that can't be opened keep their relative order at the end of the list.
+ * @param files     The names of the files to reorder.
+ * @param fileCount The length of the files array, including any NULL items.
+ */
+static void order_files(char** files, uint32_t fileCount);
+
+/**
+ * Finds the offset on its device of the first extent of a file.
+ * @param  file The open file.
+ * @return      The physical offset in bytes, or UNKNOWN_OFFSET if the file is
+ *              empty or the file system can't tell.
+ */
+static uint64_t physical_offset(int file);
+
 /**
  * Simple helper method used to print the name of the hash and the results of
  * the hash in hex format.
@@ -112,6 +174,18 @@ int main(int argc, char** argv) {
             return 0;
         }
 
+        if (strcmp("-k", argv[idx]) == 0 || strcmp("--kernels", argv[idx]) == 0) {
+            char kernels[256];
+            uint32_t failures = Dispatch_init();
+
+            Dispatch_describe(kernels, sizeof(kernels));
+            printf("  Kernels: %s\n", kernels);
+            if (failures) {
+                printf("  WARNING: %u kernel(s) failed the self-test and were disabled.\n", failures);
+            }
+            return 0;
+        }
+
         if (strcmp("-4", argv[idx]) == 0 || strcmp("--md4", argv[idx]) == 0) {
             options |= OPTION_MD4;
             continue;
@@ -137,6 +211,11 @@ int main(int argc, char** argv) {
             continue;
         }
 
+        if (strcmp("-o", argv[idx]) == 0 || strcmp("--order", argv[idx]) == 0) {
+            options |= OPTION_ORDER;
+            continue;
+        }
+
         if (strcmp("--", argv[idx]) == 0) {
             ++idx;
             break;
@@ -146,9 +225,9 @@ int main(int argc, char** argv) {
         ++fileCount;
     }
 
-    /* If they didn't set any options, default to OPTION_ALL. */
-    if (options == OPTION_NONE) {
-        options = OPTION_ALL;
+    /* If they didn't select any hashes, default to OPTION_ALL. */
+    if ((options & ~OPTION_ORDER) == OPTION_NONE) {
+        options |= OPTION_ALL;
     }
 
     /* Print the selected options. */
@@ -194,6 +273,13 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (DO_ORDER) {
+        order_files(files, fileCount);
+    }
+
+    /* Select the kernels (and check them) up front rather than while hashing
+     * the first file. */
+    Dispatch_init();
     process_files(options, files, fileCount);
 
     free(files);
@@ -217,6 +303,144 @@ static void print_hash(char* hash, unsigned char* result, uint32_t length) {
     printf("\n");
 }
 
+/**
+ * Compares two FileLocations for qsort, by device, then physical offset, then
+ * inode. Files without a known physical offset sort after the others on the
+ * same device.
+ * @param  left  The first FileLocation.
+ * @param  right The second FileLocation.
+ * @return       Returns a negative value, 0 or a positive value if left is
+ *               before, at the same place as or after right.
+ */
+static int compare_locations(const void* left, const void* right) {
+    const FileLocation* first = (const FileLocation*)left;
+    const FileLocation* second = (const FileLocation*)right;
+
+    if (first->device != second->device) {
+        return first->device < second->device ? -1 : 1;
+    }
+
+    if (first->physical != second->physical) {
+        return first->physical < second->physical ? -1 : 1;
+    }
+
+    if (first->inode != second->inode) {
+        return first->inode < second->inode ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reorders a list of files so they're hashed in the order they're laid out on
+ * their disks, which saves spinning disks from seeking back and forth between
+ * them. Files are ordered by the physical offset of their first extent where
+ * the file system reports it (through FIEMAP or FIBMAP on Linux and
+ * F_LOG2PHYS_EXT on Mac OS X) and by inode otherwise. NULL items and files
+ * that can't be opened keep their relative order at the end of the list.
+ * @param files     The names of the files to reorder.
+ * @param fileCount The length of the files array, including any NULL items.
+ */
+static void order_files(char** files, uint32_t fileCount) {
+    FileLocation* locations;
+    uint32_t located = 0;
+    uint32_t skipped = 0;
+    uint32_t idx;
+
+    locations = (FileLocation*)malloc(sizeof(FileLocation) * fileCount);
+    if (!locations) {
+        return;
+    }
+
+    /* The files that can't be located are moved to the front of the list for
+     * now, and after the located ones once those are sorted. */
+    for (idx = 0; idx < fileCount; ++idx) {
+        struct stat filestats;
+        int file;
+
+        if (!files[idx]) {
+            files[skipped++] = NULL;
+            continue;
+        }
+
+        file = open(files[idx], O_RDONLY);
+        memset(&filestats, 0, sizeof(struct stat));
+        if (file == -1 || fstat(file, &filestats) != 0) {
+            if (file != -1) {
+                close(file);
+            }
+
+            files[skipped++] = files[idx];
+            continue;
+        }
+
+        locations[located].name = files[idx];
+        locations[located].device = (uint64_t)filestats.st_dev;
+        locations[located].physical = S_ISREG(filestats.st_mode) ?
+            physical_offset(file) : UNKNOWN_OFFSET;
+        locations[located].inode = (uint64_t)filestats.st_ino;
+        ++located;
+
+        close(file);
+    }
+
+    qsort(locations, located, sizeof(FileLocation), compare_locations);
+
+    memmove(&files[located], &files[0], sizeof(char*) * skipped);
+    for (idx = 0; idx < located; ++idx) {
+        files[idx] = locations[idx].name;
+    }
+
+    free(locations);
+}
+
+/**
+ * Finds the offset on its device of the first extent of a file.
+ * @param  file The open file.
+ * @return      The physical offset in bytes, or UNKNOWN_OFFSET if the file is
+ *              empty or the file system can't tell.
+ */
+static uint64_t physical_offset(int file) {
+#if defined(FS_IOC_FIEMAP)
+    /* Room for a struct fiemap followed by a single extent. */
+    uint64_t buffer[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+        sizeof(uint64_t) + 1];
+    struct fiemap* map = (struct fiemap*)buffer;
+    int blockSize = 0;
+    int block = 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(file, FS_IOC_FIEMAP, map) == 0) {
+        if (map->fm_mapped_extents == 0 ||
+            (map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+            return UNKNOWN_OFFSET;
+        }
+
+        return map->fm_extents[0].fe_physical;
+    }
+
+    /* Older file systems only support FIBMAP, which needs CAP_SYS_RAWIO. */
+    if (ioctl(file, FIGETBSZ, &blockSize) == 0 &&
+        ioctl(file, FIBMAP, &block) == 0 && block > 0) {
+        return (uint64_t)block * (uint64_t)blockSize;
+    }
+#elif defined(F_LOG2PHYS_EXT)
+    struct log2phys location;
+
+    memset(&location, 0, sizeof(struct log2phys));
+    location.l2p_contigbytes = 1;
+    location.l2p_devoffset = 0;
+    if (fcntl(file, F_LOG2PHYS_EXT, &location) != -1) {
+        return (uint64_t)location.l2p_devoffset;
+    }
+#endif
+
+    return UNKNOWN_OFFSET;
+}
+
 /**
  * Prints the available options and usage information for the program.
  */
@@ -229,6 +453,10 @@ static void print_usage() {
     printf(" -c, --crc32  Calculate the CRC32 hash of the input file(s).\n");
     printf(" -e, --ed2k   Calculate the ED2k hash of the input file(s).\n");
     printf(" -h, --help   Display this help screen.\n");
+    printf(" -k, --kernels Check and display the hash kernels selected for this CPU.\n");
+    printf("              Set JMMHASHER_CPU (such as \"sse2,ssse3\") to restrict them.\n");
+    printf(" -o, --order  Hash the input files in the order they're stored on the disk\n");
+    printf("              rather than the order they're listed in.\n");
     printf(" -s, --sha1   Calculate the SHA1 hash of the input files.\n");
     printf("\n");
     printf("It is recommended you specify the command options first followed by two\n");
@@ -258,20 +486,21 @@ static void print_usage() {
  */
 static void process_files(uint8_t options, char** files, uint32_t fileCount) {
     struct stat filestats = { 0 };
-    CRC32_Context crc32 = { 0 };
-    MD4_Context ed2k = { 0 };
+    Hashes_Context hashes;
     MD4_Context md4 = { 0 };
-    MD5_Context md5 = { 0 };
-    SHA1_Context sha1 = { 0 };
-    uint32_t bytesRead = 0;
-    uint32_t ed2kHashLength = 0;
-    uint32_t ed2kBlockIdx = 0;
-    uint32_t ed2kBlocks = 0;
-    uint8_t  ed2kLoopIdx = 0;
+    ssize_t bytesRead = 0;
+    uint32_t hashesOptions = 0;
     uint32_t loopIdx = 0;
     unsigned char result[72] = { 0 };
+    unsigned char hashesResult[56];
     unsigned char* fileData = NULL;
-    unsigned char* ed2kHashes = NULL;
+
+    /* Everything but MD4 is calculated by Hashes_update, which runs an update
+     * loop specialized for the selected hashes. */
+    if (DO_CRC32) { hashesOptions |= HASHES_CRC32; }
+    if (DO_ED2K) { hashesOptions |= HASHES_ED2K; }
+    if (DO_MD5) { hashesOptions |= HASHES_MD5; }
+    if (DO_SHA1) { hashesOptions |= HASHES_SHA1; }
 
     for (loopIdx = 0; loopIdx < fileCount; ++loopIdx) {
         /* Reset errno back to zero for the next loop. */
@@ -291,7 +520,7 @@ static void process_files(uint8_t options, char** files, uint32_t fileCount) {
             continue;
         }
 
-        /* Read the stats of the file, we use the size and the mode flag. */
+        /* Read the stats of the file, we use the mode flag. */
         memset(&filestats, 0, sizeof(struct stat));
         if (fstat(file, &filestats) != 0) {
             printf("unable to read file. %s\n", strerror(errno));
@@ -306,33 +535,10 @@ static void process_files(uint8_t options, char** files, uint32_t fileCount) {
             continue;
         }
 
-        /* Initialize our hashes based on the options provided. */
-        if (DO_CRC32) { CRC32_init(&crc32); }
+        /* Initialize our hashes based on the options provided. Every file
+         * starts from a clean state, including its ED2k blocks. */
+        Hashes_init(&hashes, hashesOptions);
         if (DO_MD4) { MD4_init(&md4); }
-        if (DO_MD5) { MD5_init(&md5); }
-        if (DO_SHA1) { SHA1_init(&sha1); }
-        if (DO_ED2K) {
-            /* Determine the number of blocks needed for calculating the file's
-             * ED2k hash. If the file isn't an even multiple of BLOCKSIZE then
-             * we add one more block. */
-            ed2kBlocks = filestats.st_size / BLOCKSIZE;
-            if (filestats.st_size % BLOCKSIZE > 0) {
-                ++ed2kBlocks;
-            }
-
-            /* Only allocate an array if we have more than one block to hash.
-             * Files that are smaller in size than BLOCKSIZE simply use the
-             * normal computed MD4 hash. */
-            if (ed2kBlocks > 1) {
-                ed2kHashLength = ed2kBlocks * 16;
-                ed2kHashes = (unsigned char*)malloc(ed2kHashLength);
-                if (ed2kHashes == NULL && errno == ENOMEM) {
-                    printf("unable to allocate buffer.\n");
-                    close(file);
-                    continue;
-                }
-            }
-        }
 
         /* Allocate our file buffer. BUFFERSIZE is a clean multiple of the ED2k
          * BLOCKSIZE for easier ED2k hashing. */
@@ -340,12 +546,6 @@ static void process_files(uint8_t options, char** files, uint32_t fileCount) {
         if (fileData == NULL && errno == ENOMEM) {
             printf("unable to allocate buffer.\n");
             close(file);
-
-            if (DO_ED2K) {
-                free(ed2kHashes);
-                ed2kHashes = NULL;
-            }
-
             continue;
         }
 
@@ -358,42 +558,16 @@ static void process_files(uint8_t options, char** files, uint32_t fileCount) {
                     continue;
                 }
 
-                /* It's an unexpected error. Free the ED2k hash (if one was
-                 * allocated), close the file, and break out of the loop. We
-                 * Don't need to free the data buffer as that's taken care of
-                 * after the loop exits. */
+                /* It's an unexpected error. Break out of the loop. We don't
+                 * need to free the data buffer as that's taken care of after
+                 * the loop exits. */
                 printf("error reading file. %s\n", strerror(errno));
-                if (DO_CRC32) {
-                    free(ed2kHashes);
-                    ed2kHashes = NULL;
-                }
-
                 break;
             }
 
             /* Update the hashes */
-            if (DO_CRC32) { CRC32_update(&crc32, fileData, bytesRead); }
-            if (DO_MD4) { MD4_update(&md4, fileData, bytesRead); }
-            if (DO_MD5) { MD5_update(&md5, fileData, bytesRead); }
-            if (DO_SHA1) { SHA1_update(&sha1, fileData, bytesRead); }
-            if (DO_ED2K) {
-                /* If we've looped 10 times, finish the current MD4 hash, update
-                 * the block counter and set the hash to be initialized again. */
-                if (ed2kLoopIdx == 10) {
-                    MD4_final(&ed2k, &ed2kHashes[ed2kBlockIdx * 16]);
-                    ++ed2kBlockIdx;
-                    ed2kLoopIdx = 0;
-                }
-
-                /* If this is the first loop (or we just finished a hash)
-                 * initialize the MD4 hash for the next block. */
-                if (ed2kLoopIdx == 0) {
-                    MD4_init(&ed2k);
-                }
-
-                ++ed2kLoopIdx;
-                MD4_update(&ed2k, fileData, bytesRead);
-            }
+            Hashes_update(&hashes, fileData, (uint32_t)bytesRead);
+            if (DO_MD4) { MD4_update(&md4, fileData, (uint32_t)bytesRead); }
         }
 
         /* Close our file descriptor since we're done reading (whether or not
@@ -415,34 +589,15 @@ static void process_files(uint8_t options, char** files, uint32_t fileCount) {
          *  4 - 19: MD4
          * 20 - 35: MD5
          * 36 - 55: SHA1
-         * 56 - 71: ED2k */
+         * 56 - 71: ED2k
+         * Hashes_final uses the libhasher layout instead, with the ED2k hash
+         * first and the CRC32 at 16 - 19. */
         memset(&result, 0, 72);
-        if (DO_CRC32) { CRC32_final(&crc32, &result[0]); }
+        Hashes_final(&hashes, hashesResult);
+        memcpy(&result[0], &hashesResult[16], 4);
+        memcpy(&result[20], &hashesResult[20], 36);
+        memcpy(&result[56], &hashesResult[0], 16);
         if (DO_MD4) { MD4_final(&md4, &result[4]); }
-        if (DO_MD5) { MD5_final(&md5, &result[20]); }
-        if (DO_SHA1) { SHA1_final(&sha1, &result[36]); }
-        if (DO_ED2K) {
-            /* If we just had one block. Store the result of the block directly
-             * in the result buffer. */
-            if (ed2kBlocks == 1) {
-                MD4_final(&ed2k, &result[56]);
-            } else {
-                /* If we didn't finish a loop, finalize the final block. */
-                if (ed2kLoopIdx > 0) {
-                    MD4_final(&ed2k, &ed2kHashes[ed2kBlockIdx * 16]);
-                }
-
-                /* Calculate the MD4 hash of the hashes from the block. This is
-                 * the final ED2k hash. */
-                MD4_init(&ed2k);
-                MD4_update(&ed2k, ed2kHashes, ed2kHashLength);
-                MD4_final(&ed2k, &result[56]);
-
-                /* Free the ED2k hash result buffer. */
-                free(ed2kHashes);
-                ed2kHashes = NULL;
-            }
-        }
 
         /* Print the hashes for the user. */
         printf("\n");
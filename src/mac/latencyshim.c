@@ -0,0 +1,93 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+/* A stand-in for a high latency mount when benchmarking libhasher. Preloading
+ * it (LD_PRELOAD on Linux) delays every read and pread of a regular file by
+ * the number of microseconds in JMMHASHER_LATENCY (5000 by default), like the
+ * round trip to a file server would. Reads on separate threads are delayed
+ * independently of each other, the same as requests in flight to a server. */
+
+#include <dlfcn.h>    /* dlsym */
+#include <stdlib.h>   /* getenv, strtol */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h>   /* read, pread, usleep */
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define LATENCY_DEFAULT     5000
+#define LATENCY_ENVIRONMENT "JMMHASHER_LATENCY"
+
+typedef ssize_t (ReadFunction)(int, void*, size_t);
+typedef ssize_t (PreadFunction)(int, void*, size_t, off_t);
+
+/**
+ * Waits for the configured latency if the file is a regular file.
+ * @param file The file about to be read.
+ */
+static void Delay(int file) {
+    static long latency = -1;
+    struct stat filestats;
+
+    if (latency < 0) {
+        const char* value = getenv(LATENCY_ENVIRONMENT);
+        latency = value != NULL ? strtol(value, NULL, 10) : LATENCY_DEFAULT;
+        if (latency < 0) {
+            latency = 0;
+        }
+    }
+
+    if (latency > 0 && fstat(file, &filestats) == 0 &&
+        S_ISREG(filestats.st_mode)) {
+        usleep((useconds_t)latency);
+    }
+}
+
+/**
+ * Delays and then reads the file like read does.
+ * @param  file   The file to read.
+ * @param  buffer The buffer receiving the data.
+ * @param  length The number of bytes to read.
+ * @return        The same values as read.
+ */
+EXPORT ssize_t read(int file, void* buffer, size_t length) {
+    static ReadFunction* next = NULL;
+    if (next == NULL) {
+        next = (ReadFunction*)dlsym(RTLD_NEXT, "read");
+    }
+
+    Delay(file);
+    return next(file, buffer, length);
+}
+
+/**
+ * Delays and then reads the file like pread does.
+ * @param  file   The file to read.
+ * @param  buffer The buffer receiving the data.
+ * @param  length The number of bytes to read.
+ * @param  offset The offset in the file to read from.
+ * @return        The same values as pread.
+ */
+EXPORT ssize_t pread(int file, void* buffer, size_t length, off_t offset) {
+    static PreadFunction* next = NULL;
+    if (next == NULL) {
+        next = (PreadFunction*)dlsym(RTLD_NEXT, "pread");
+    }
+
+    Delay(file);
+    return next(file, buffer, length, offset);
+}
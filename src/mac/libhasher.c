@@ -17,235 +17,4554 @@
  */
 
 #include "libhasher.h"
+#include "core/dispatch.h"
 #include "core/crc32.h"
+#include "core/hashes.h"
 #include "core/md4.h"
 #include "core/md5.h"
 #include "core/sha1.h"
 
 #include <errno.h>    /* errno */
 #include <fcntl.h>    /* open, close */
+#include <pthread.h>  /* pthread_create, pthread_mutex_lock, ... */
+#include <setjmp.h>   /* sigsetjmp, siglongjmp */
+#include <signal.h>   /* sigaction */
 #include <stdint.h>   /* standard data types */
 #include <stdlib.h>   /* malloc, wcstombs_l */
 #include <string.h>   /* memset */
+#include <sys/mman.h> /* mmap, madvise, mincore */
 #include <sys/stat.h> /* stat */
+#include <time.h>     /* clock_gettime */
 #include <unistd.h>   /* read */
-#include <xlocale.h>  /* for locale awesomeness */
+
+#if defined(__APPLE__)
+#include <sys/mount.h> /* fstatfs */
+#include <xlocale.h>   /* for locale awesomeness */
+#else
+#include <locale.h>    /* newlocale, uselocale */
+#include <sys/vfs.h>   /* fstatfs */
+#endif
+
+#if defined(__linux__)
+#include <dirent.h>        /* opendir, readdir */
+#include <limits.h>        /* PATH_MAX */
+#include <stdio.h>         /* snprintf, sscanf */
+#include <sys/eventfd.h>   /* eventfd */
+#include <sys/sysmacros.h> /* major, minor, makedev */
+#include "uring.h"    /* Uring_init, Uring_read_fixed, ... */
+#endif
 
 #define BLOCKSIZE  9728000
-#define BUFFERSIZE BLOCKSIZE / 10
+#define BUFFERSIZE (BLOCKSIZE / 10)
+
+/* Files that only need a CRC32 and are at least this large are split into
+ * ranges that are hashed on separate cores. */
+#define PARALLEL_CRC32_MINSIZE (BLOCKSIZE * 4)
+
+/* Maximum number of threads used to calculate the CRC32 of a single file. */
+#define PARALLEL_CRC32_THREADS 16
+
+/* Files that only need an ED2k hash and span more than one block have
+ * MD4_LANES blocks hashed at once when the CPU supports AVX2. */
+#define LANES_ED2K_MINSIZE (BLOCKSIZE + 1)
+
+/* Files requesting the MD5 hash that are at most this large are hashed together
+ * by HashFilesWithSyncIO. At most BATCH_FILES files that fit in BATCH_BUFFERSIZE
+ * bytes are hashed at once. */
+#define BATCH_FILE_MAXSIZE (256 * 1024)
+#define BATCH_FILES        64
+#define BATCH_BUFFERSIZE   (BUFFERSIZE * 4)
+
+/* While HashFilesWithSyncIO hashes a file, the start of the next
+ * PREFETCH_FILES files (at most PREFETCH_LENGTH bytes of each, and no more
+ * than PREFETCH_BUDGET bytes in all) is read into the page cache, so the device
+ * isn't left idle between files. The environment variable overrides the number
+ * of files with a value from 0 (no prefetching) to PREFETCH_MAXFILES. */
+#define PREFETCH_FILES       4
+#define PREFETCH_MAXFILES    16
+#define PREFETCH_LENGTH      MAPPED_WINDOW
+#define PREFETCH_BUDGET      (MAPPED_WINDOW * 2)
+#define PREFETCH_ENVIRONMENT "JMMHASHER_PREFETCH"
+
+/* The number of BUFFERSIZE reads HashFileWithAsyncIO keeps in flight. The
+ * environment variable overrides the default with a value from 1 to
+ * QUEUE_MAXDEPTH. */
+#define QUEUE_DEPTH       8
+#define QUEUE_MAXDEPTH    64
+#define QUEUE_ENVIRONMENT "JMMHASHER_QUEUE_DEPTH"
+
+/* Files at least MAPPED_MINSIZE bytes large are hashed straight out of a
+ * mapping when at least MAPPED_RESIDENCY percent of their first window is in
+ * the page cache already. The file is mapped MAPPED_WINDOW bytes (a whole
+ * number of ED2k blocks) at a time. */
+#define MAPPED_MINSIZE   (BUFFERSIZE * 4)
+#define MAPPED_RESIDENCY 75
+#define MAPPED_WINDOW    (BLOCKSIZE * 4)
+
+/* OPTION_DIRECTIO reads bypass the page cache, so the buffer, the length of
+ * every read and every offset have to be aligned to the logical block size of
+ * the device. 4KB covers every common device. */
+#define DIRECT_ALIGNMENT  4096
+#define DIRECT_BUFFERSIZE (1024 * 1024)
+
+/* OPTION_DROPBEHIND drops the range just hashed along with this much before
+ * it, which catches the pages the previous calls couldn't drop yet. */
+#define DROPBEHIND_WINDOW (BUFFERSIZE * 8)
+
+/* Regular files larger than a buffer are read by a separate thread into a ring
+ * of READER_BUFFERS buffers, so the next reads overlap hashing the current
+ * one. */
+#define READER_BUFFERS 3
+
+/* Regular files larger than a buffer that request more than one hash are read
+ * into a ring of PIPELINE_BUFFERS buffers, which a thread per hash updates its
+ * hash from, when there's more than one core. The environment variable set to
+ * "0" or "1" turns this off or on regardless of the cores. */
+#define PIPELINE_BUFFERS     4
+#define PIPELINE_ENVIRONMENT "JMMHASHER_PIPELINE"
+
+/* Files on network mounts are read by NETWORK_STRIPES threads, with up to
+ * NETWORK_DEPTH buffers read ahead of the one being hashed. The environment
+ * variable overrides both per mount (see HashFileWithSyncIO in the header). */
+#define NETWORK_STRIPES     4
+#define NETWORK_DEPTH       8
+#define NETWORK_MAXSTRIPES  16
+#define NETWORK_MAXDEPTH    32
+#define NETWORK_ENVIRONMENT "JMMHASHER_STRIPES"
+
+/* Regular files with at least SPARSE_MINHOLES percent of their size in holes
+ * (found with SEEK_HOLE and SEEK_DATA) are hashed without reading the holes. */
+#define SPARSE_MINHOLES 10
+
+/* The most worker threads a HasherEngine runs. */
+#define ENGINE_MAXTHREADS 64
+
+/* The clock the timeouts of WaitCompletions are measured against, so setting
+ * the wall clock doesn't stretch or cut them short. Mac OS X can only time a
+ * condition variable against the wall clock. */
+#if defined(__APPLE__)
+#define ENGINE_CLOCK CLOCK_REALTIME
+#else
+#define ENGINE_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* HashFilesByDevice reads one file at a time from each rotational disk (or
+ * one per member disk of a rotational array), and one per core, up to
+ * DEVICE_MAXTHREADS, from any other device. At most DEVICE_MAXDEPTH layers of
+ * md and dm devices are resolved to the disks under them. */
+#define DEVICE_MAXTHREADS 16
+#define DEVICE_MAXDEPTH   8
+
+/* Files of at least ENGINE_CHUNK_MINSIZE that only need the ED2k and CRC32
+ * hashes are split by a HasherEngine into runs of ED2k blocks, which idle
+ * workers steal from the back while the worker that opened the file hashes
+ * them from the front. */
+#define ENGINE_CHUNK_MINSIZE (BLOCKSIZE * 4)
+
+/* Returned by the alternative ways of hashing a file (such as through io_uring
+ * or a mapping) when they can't be used for the file, in which case it's read
+ * with the regular read loop instead. */
+#define NOT_HASHED 1
+
+/**
+ * A window of a file mapped by MapWindow.
+ * @field mapping       The start of the mapping, which is page aligned.
+ * @field mappingLength The length of the mapping.
+ * @field data          The data of the window within the mapping.
+ * @field length        The length of the window.
+ */
+typedef struct MappedWindow {
+    unsigned char* mapping;
+    size_t mappingLength;
+    const unsigned char* data;
+    uint32_t length;
+} MappedWindow;
+
+/**
+ * Shared state of a CRC32 calculated in parallel over ranges of a single file.
+ * @field file        The open file being hashed.
+ * @field lock        Protects the rest of the fields in the structure.
+ * @field progressed  Signaled whenever a range reads a buffer or finishes.
+ * @field bytesRead   The total number of bytes read by all ranges.
+ * @field buffersRead The total number of buffers read by all ranges.
+ * @field running     The number of ranges still being hashed.
+ * @field status      The first failure reported by a range (or the caller
+ *                    cancelling the request). 0 while everything succeeds.
+ */
+typedef struct CRC32Job {
+    int file;
+    pthread_mutex_t lock;
+    pthread_cond_t progressed;
+    uint64_t bytesRead;
+    uint32_t buffersRead;
+    uint32_t running;
+    int status;
+} CRC32Job;
+
+/**
+ * A single range of the file hashed by one thread.
+ * @field job    The job the range belongs to.
+ * @field thread The thread hashing the range.
+ * @field offset The offset in the file the range starts at.
+ * @field length The length of the range.
+ * @field crc32  The CRC32 of the range.
+ */
+typedef struct CRC32Range {
+    CRC32Job* job;
+    pthread_t thread;
+    uint64_t offset;
+    uint64_t length;
+    CRC32_Context crc32;
+} CRC32Range;
+
+/**
+ * Shared state of a file read by a reader thread and hashed by the caller.
+ * Buffer n of the file is read into slot n % READER_BUFFERS of the ring.
+ * @field file     The open file being read.
+ * @field ring     The READER_BUFFERS buffers of BUFFERSIZE bytes.
+ * @field lengths  The number of bytes read into each slot.
+ * @field lock     Protects the rest of the fields in the structure.
+ * @field filled   Signaled whenever the reader fills a slot or stops.
+ * @field emptied  Signaled whenever the caller frees a slot or stops.
+ * @field read     The number of buffers read so far.
+ * @field hashed   The number of buffers hashed so far.
+ * @field finished Set by the reader at the end of the file or on a failure.
+ * @field stop     Set by the caller to stop the reader early.
+ * @field status   0, or -8 if the reader encountered a read error.
+ */
+typedef struct ReaderJob {
+    int file;
+    unsigned char* ring;
+    uint32_t lengths[READER_BUFFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    uint64_t read;
+    uint64_t hashed;
+    char finished;
+    char stop;
+    int status;
+} ReaderJob;
+
+/**
+ * Shared state of a file read by the caller into a ring of buffers and hashed
+ * by a consumer thread per hash. Buffer n of the file is read into slot
+ * n % PIPELINE_BUFFERS of the ring, and read again once every consumer has
+ * released it.
+ * @field file       The open file being read.
+ * @field dropBehind Set to drop every buffer from the cache once it's hashed.
+ * @field ring       The PIPELINE_BUFFERS buffers of BUFFERSIZE bytes.
+ * @field lengths    The number of bytes read into each slot.
+ * @field offsets    The offset in the file of each slot.
+ * @field references The number of consumers that haven't hashed each slot yet.
+ * @field consumers  The number of consumer threads.
+ * @field lock       Protects the rest of the fields in the structure.
+ * @field filled     Signaled whenever the caller fills a slot or stops.
+ * @field emptied    Signaled whenever the last consumer releases a slot.
+ * @field read       The number of buffers read so far.
+ * @field finished   Set by the caller at the end of the file or on a failure.
+ * @field stop       Set by the caller to stop the consumers early.
+ */
+typedef struct PipelineJob {
+    int file;
+    char dropBehind;
+    unsigned char* ring;
+    uint32_t lengths[PIPELINE_BUFFERS];
+    uint64_t offsets[PIPELINE_BUFFERS];
+    uint32_t references[PIPELINE_BUFFERS];
+    uint32_t consumers;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    uint64_t read;
+    char finished;
+    char stop;
+} PipelineJob;
+
+/**
+ * A consumer thread of a PipelineJob.
+ * @field job    The job the consumer belongs to.
+ * @field thread The thread running the consumer.
+ * @field hashes The state of the single hash the consumer calculates.
+ */
+typedef struct PipelineConsumer {
+    PipelineJob* job;
+    pthread_t thread;
+    Hashes_Context hashes;
+} PipelineConsumer;
+
+/**
+ * Shared state of a file read by a pool of stripe threads and hashed in order
+ * by the caller. Buffer n of the file is read into slot n % depth of the
+ * ring, which doubles as the reorder buffer.
+ * @field file     The open file being read.
+ * @field size     The size of the file.
+ * @field buffers  The number of BUFFERSIZE buffers in the file.
+ * @field depth    The number of slots in the ring.
+ * @field ring     The depth buffers of BUFFERSIZE bytes.
+ * @field lock     Protects the rest of the fields in the structure.
+ * @field filled   Signaled whenever a stripe thread fills a slot.
+ * @field emptied  Signaled whenever the caller frees a slot or stops.
+ * @field ready    Set for the slots that were read but not hashed yet.
+ * @field next     The next buffer to be claimed by a stripe thread.
+ * @field hashed   The number of buffers hashed so far.
+ * @field stop     Set by the caller to stop the stripe threads.
+ * @field status   The first failure (-8, or -9 if the caller cancelled). 0
+ *                 while everything succeeds.
+ */
+typedef struct StripeJob {
+    int file;
+    uint64_t size;
+    uint64_t buffers;
+    uint32_t depth;
+    unsigned char* ring;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    char ready[NETWORK_MAXDEPTH];
+    uint64_t next;
+    uint64_t hashed;
+    char stop;
+    int status;
+} StripeJob;
+
+/**
+ * A batch of requests passed to HashFilesBatch, or a single request passed to
+ * SubmitHash (a job). The workers of the engine claim the requests of a batch
+ * one at a time, in order.
+ * @field requests  The requests of the batch.
+ * @field results   Receives the return value of each request.
+ * @field count     The number of requests.
+ * @field callback  The optional progress callback.
+ * @field next      The next request to be claimed by a worker.
+ * @field remaining The number of requests that haven't finished yet.
+ * @field following The batch queued after this one, or the job completed
+ *                  after this one once it's on the completion queue.
+ * @field job       The id of the job, or 0 for a batch.
+ * @field status    The result of a job, which results points to.
+ * @field cancelled Set by CancelHash. Read by the worker hashing the job
+ *                  without the lock, so it's volatile.
+ */
+typedef struct EngineBatch {
+    HashRequest* requests;
+    int32_t* results;
+    uint32_t count;
+    HashProgressCallback* callback;
+    uint32_t next;
+    uint32_t remaining;
+    struct EngineBatch* following;
+    uint64_t job;
+    int32_t status;
+    volatile char cancelled;
+} EngineBatch;
+
+/**
+ * The requests of a HashFilesByDevice batch whose files are on one device.
+ * @field device   The device, after resolving it to its disk.
+ * @field threads  The number of threads hashing the requests at once.
+ * @field requests Copies of the requests, in their original order.
+ * @field results  Receives the return value of each request.
+ * @field count    The number of requests.
+ * @field callback The optional progress callback.
+ * @field lock     Protects next.
+ * @field next     The next request to be claimed by a thread.
+ * @field orphaned Set when no thread could be started for the group, so the
+ *                 caller hashes it instead.
+ */
+typedef struct DeviceGroup {
+    dev_t device;
+    uint32_t threads;
+    HashRequest* requests;
+    int32_t* results;
+    uint32_t count;
+    HashProgressCallback* callback;
+    pthread_mutex_t lock;
+    uint32_t next;
+    char orphaned;
+} DeviceGroup;
+
+/**
+ * A large file split by a HasherEngine into runs of ED2k blocks hashed by
+ * several workers. Every field but progress is protected by the lock of the
+ * engine.
+ * @field batch     The batch of the request.
+ * @field index     The index of the request in the batch.
+ * @field file      The open file.
+ * @field size      The size of the file.
+ * @field blocks    The number of ED2k blocks in the file.
+ * @field span      The most blocks claimed in a single run, MD4_LANES when
+ *                  only the ED2k hash is needed and the vector MD4 kernel is
+ *                  available, otherwise 1.
+ * @field front     The first block not claimed yet.
+ * @field back      The block after the last one not claimed yet.
+ * @field running   The number of runs being hashed.
+ * @field hashed    The number of bytes hashed so far, for the callback.
+ * @field status    The first failure of a run, or 0.
+ * @field digests   The MD4 hash of every block.
+ * @field crcs      The CRC32 of every block, without the final inversion.
+ * @field following The next file on the list of the engine.
+ * @field progress  Keeps the calls to the progress callback of the request
+ *                  from overlapping, and protects reported.
+ * @field reported  The progress last passed to the callback, so runs finishing
+ *                  out of order never report less than before.
+ */
+typedef struct EngineFile {
+    EngineBatch* batch;
+    uint32_t index;
+    int file;
+    uint64_t size;
+    uint32_t blocks;
+    uint32_t span;
+    uint32_t front;
+    uint32_t back;
+    uint32_t running;
+    uint64_t hashed;
+    int status;
+    unsigned char* digests;
+    uint32_t* crcs;
+    struct EngineFile* following;
+    pthread_mutex_t progress;
+    uint64_t reported;
+} EngineFile;
+
+/**
+ * A worker thread of a HasherEngine.
+ * @field engine The engine the worker belongs to.
+ * @field thread The thread running the worker.
+ * @field buffer  The BUFFERSIZE buffer the worker reads its files into.
+ * @field current The batch of the request the worker is hashing, or NULL.
+ * @field lanes   The MD4_LANES buffers of BUFFERSIZE the worker reads runs of
+ *                blocks into, allocated the first time it needs them.
+ */
+typedef struct EngineWorker {
+    struct HasherEngine* engine;
+    pthread_t thread;
+    unsigned char* buffer;
+    EngineBatch* current;
+    unsigned char* lanes;
+} EngineWorker;
+
+/**
+ * A pool of worker threads hashing the requests of the batches queued on it.
+ * @field lock     Protects the rest of the fields in the structure and the
+ *                 batches on the queue.
+ * @field queued   Signaled when a batch is queued or the engine is stopped.
+ * @field finished Signaled when a batch finishes.
+ * @field first    The first batch on the queue with requests left to claim.
+ * @field last     The last batch on the queue.
+ * @field stop     Set by DestroyHasherEngine to stop the workers once the
+ *                 queue is empty.
+ * @field count    The number of workers.
+ * @field workers  The workers.
+ * @field nextJob  The id of the next job passed to SubmitHash.
+ * @field completed     Signaled when a job is added to the completion queue.
+ * @field completedFirst The first finished job not collected yet.
+ * @field completedLast  The last finished job not collected yet.
+ * @field readFd   The descriptor returned by GetCompletionFd, readable while
+ *                 the completion queue isn't empty.
+ * @field writeFd  The descriptor written to make readFd readable. The same as
+ *                 readFd for an eventfd.
+ * @field files    The split files with runs of blocks left to claim.
+ */
+struct HasherEngine {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    EngineBatch* first;
+    EngineBatch* last;
+    char stop;
+    uint32_t count;
+    EngineWorker* workers;
+    uint64_t nextJob;
+    pthread_cond_t completed;
+    EngineBatch* completedFirst;
+    EngineBatch* completedLast;
+    int readFd;
+    int writeFd;
+    EngineFile* files;
+};
+
+/* Makes sure the hash kernels are selected and checked exactly once. */
+static pthread_once_t dispatchOnce = PTHREAD_ONCE_INIT;
+
+/* Holds the job an engine worker is hashing, for the progress callback of
+ * SubmitHash jobs. Created once by InitJobKey. */
+static pthread_once_t jobKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t jobKey;
+
+/* The SIGBUS handler installed once by InitFaultHandler, the handler it
+ * replaced, and where it returns to when a thread faults on a mapped window
+ * of a file that was truncated under it. */
+static pthread_once_t faultHandlerOnce = PTHREAD_ONCE_INIT;
+static struct sigaction previousFaultHandler;
+static __thread sigjmp_buf* mappedFault;
+
+#if !defined(__APPLE__)
+/**
+ * Converts a wide char array string to a multi-byte string using the provided
+ * locale. glibc doesn't have wcstombs_l, so the locale of the calling thread is
+ * switched for the conversion instead.
+ * @param  output The converted output, or NULL to only get the size.
+ * @param  input  The input wide char array to convert.
+ * @param  size   The size of output in bytes.
+ * @param  locale The locale to convert with.
+ * @return        The same values as wcstombs.
+ */
+static size_t wcstombs_l(char* output, const wchar_t* input, size_t size,
+    locale_t locale) {
+    locale_t previous = uselocale(locale);
+    size_t result = wcstombs(output, input, size);
+    uselocale(previous);
+    return result;
+}
+#endif
+
+/**
+ * Converts a wide char array string to a UTF-8 char array string using the
+ * C locale.
+ * @param input  The input wide char array to convert.
+ * @param output The converted output. Can be NULL if the function failed in
+ *               any way.
+ */
+static void ConvertWideToMultiByte(wchar_t* input, char** output);
+
+/**
+ * Selects and checks the hash kernels for the CPU. Called through pthread_once
+ * before the first file is hashed.
+ */
+static void InitDispatch(void);
+
+/**
+ * Hashes the files of a batch built by HashFilesWithSyncIO. The contents of
+ * every file are already in memory and the MD5 hashes are calculated together
+ * with MD5_update_multi.
+ * @param requests The requests passed to HashFilesWithSyncIO.
+ * @param results  The results passed to HashFilesWithSyncIO.
+ * @param batch    The index of each request in the batch.
+ * @param data     The contents of each file in the batch.
+ * @param sizes    The size of each file in the batch.
+ * @param count    The number of files in the batch.
+ * @param callback The optional progress callback.
+ */
+static void HashBatch(HashRequest* requests, int32_t* results,
+    const uint32_t* batch, const void* const* data, const uint32_t* sizes,
+    uint32_t count, HashProgressCallback* callback);
+
+/**
+ * Asks the kernel to start reading the beginning of a file into the page cache
+ * without waiting for it.
+ * @param  request The HashRequest of the file.
+ * @param  budget  The most bytes to read.
+ * @return         The number of bytes requested, or 0 if the file can't be
+ *                 opened, isn't a regular file or bypasses the page cache.
+ */
+static uint64_t PrefetchFile(HashRequest* request, uint64_t budget);
+
+/**
+ * Gets the number of files HashFilesWithSyncIO prefetches ahead of the one
+ * being hashed, from the PREFETCH_ENVIRONMENT variable or PREFETCH_FILES if it
+ * isn't set or is invalid.
+ * @return The number of files, from 0 to PREFETCH_MAXFILES.
+ */
+static uint32_t PrefetchFiles(void);
+
+/**
+ * Calculates the CRC32 of a file by splitting it into ranges that are hashed
+ * on separate threads and merged using CRC32_combine.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  threads  The number of ranges (and threads) to split the file into.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if no thread can be started or the file shrank
+ *                  while it was hashed.
+ */
+static int HashCRC32InParallel(int file, uint64_t size, uint32_t threads,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Thread entry point hashing a single CRC32Range.
+ * @param  param The CRC32Range to hash.
+ * @return       Always returns NULL.
+ */
+static void* HashCRC32Range(void* param);
+
+/**
+ * Calculates the ED2k hash of a file by hashing up to MD4_LANES blocks at once
+ * with MD4_multi_update. Each pass reads the next buffer of every block in the
+ * group before hashing them together.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file. Must be larger than BLOCKSIZE.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file shrank while it was hashed.
+ */
+static int HashED2kInLanes(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Hashes a file while a separate thread reads it ahead into a ring of
+ * READER_BUFFERS buffers, so the device and the CPU are kept busy at the same
+ * time.
+ * @param  file     The open file to hash.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the thread can't be started.
+ */
+static int HashFileWithReader(int file, HashRequest* request,
+    HashProgressCallback* callback);
+
+/**
+ * Thread entry point reading a file into the ring of a ReaderJob.
+ * @param  param The ReaderJob to read.
+ * @return       Always returns NULL.
+ */
+static void* ReadIntoRing(void* param);
+
+/**
+ * Checks whether a file requesting the given hashes should be hashed by
+ * HashFilePipelined.
+ * @param  options The options of the request.
+ * @return         Returns non-zero to hash the file with HashFilePipelined.
+ */
+static int UsePipeline(uint32_t options);
+
+/**
+ * Hashes a file by reading it into a ring of PIPELINE_BUFFERS buffers on the
+ * calling thread, while a separate thread per requested hash updates it from
+ * every buffer, so the hashes run on separate cores and the file takes about
+ * as long as the slowest of them.
+ * @param  file     The open file to hash.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the threads can't be started.
+ */
+static int HashFilePipelined(int file, HashRequest* request,
+    HashProgressCallback* callback);
+
+/**
+ * Thread entry point updating the hash of a PipelineConsumer from every
+ * buffer of its PipelineJob.
+ * @param  param The PipelineConsumer.
+ * @return       Always returns NULL.
+ */
+static void* HashPipelineBuffers(void* param);
+
+/**
+ * Hashes a file on a high latency mount by keeping depth reads in flight
+ * from a pool of stripe threads, and hashing the buffers in file order as
+ * they arrive.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  stripes  The number of stripe threads.
+ * @param  depth    The number of buffers in the reorder ring.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if no thread can be started or the file shrank
+ *                  while it was hashed.
+ */
+static int HashFileStriped(int file, uint64_t size, uint32_t stripes,
+    uint32_t depth, HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Thread entry point reading the buffers of a StripeJob until the file is
+ * read or the job fails.
+ * @param  param The StripeJob to read.
+ * @return       Always returns NULL.
+ */
+static void* ReadStripes(void* param);
+
+/**
+ * Checks whether a file is on a network file system (NFS, SMB and the like).
+ * @param  file The open file to check.
+ * @return      Returns 1 if it is, or 0 if not or it can't be determined.
+ */
+static int IsNetworkFile(int file);
+
+/**
+ * Gets the number of stripe threads and the reorder depth for a file, from
+ * the entry of NETWORK_ENVIRONMENT matching its mount or the defaults.
+ * @param filestats The stats of the open file.
+ * @param stripes   Receives the number of stripes, from 1 to
+ *                  NETWORK_MAXSTRIPES.
+ * @param depth     Receives the depth, from stripes to NETWORK_MAXDEPTH.
+ */
+static void StripeSettings(const struct stat* filestats, uint32_t* stripes,
+    uint32_t* depth);
+
+#if defined(__linux__)
+/**
+ * Hashes a file by keeping QueueDepth() reads into registered buffers in
+ * flight through io_uring, and hashing the buffers in file order as they
+ * complete.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if io_uring can't be used or the file shrank
+ *                  while it was hashed.
+ */
+static int HashFileWithUring(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Gets the number of reads HashFileWithUring keeps in flight, from the
+ * QUEUE_ENVIRONMENT variable or QUEUE_DEPTH if it isn't set or is invalid.
+ * @return The queue depth, from 1 to QUEUE_MAXDEPTH.
+ */
+static uint32_t QueueDepth(void);
+#endif
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+/**
+ * Hashes a sparse file by reading its data and passing the length of every
+ * hole to Hashes_update_zeros instead of reading it.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file has less than SPARSE_MINHOLES
+ *                  percent of holes, the file system can't find them or the
+ *                  file shrank while it was hashed.
+ */
+static int HashSparseFile(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Adds up the length of the holes of a file.
+ * @param  file The open file to check.
+ * @param  size The size of the file.
+ * @return      The total length of the holes, or 0 if the file system can't
+ *              find them.
+ */
+static uint64_t HoleLength(int file, uint64_t size);
+#endif
+
+/**
+ * Tells the kernel a range of a file that was just hashed won't be needed
+ * again, for OPTION_DIRECTIO and OPTION_DROPBEHIND requests.
+ * @param file   The open file.
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ */
+static void DropBehind(int file, uint64_t offset, uint64_t length);
+
+/**
+ * Hashes a file with reads that bypass the page cache (O_DIRECT, or F_NOCACHE
+ * on Mac OS X) into an aligned buffer, for OPTION_DIRECTIO requests.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file system doesn't support it.
+ */
+static int HashFileDirect(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Hashes a file straight out of the page cache by mapping MAPPED_WINDOW bytes
+ * of it at a time. The next window is mapped and read ahead while the current
+ * one is hashed, and dropped from the address space as soon as it's done.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file can't be mapped or shrank while it
+ *                  was hashed.
+ */
+static int HashMappedFile(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Checks whether enough of the first window of a file is in the page cache for
+ * hashing it out of a mapping to pay off.
+ * @param  file The open file to check.
+ * @param  size The size of the file.
+ * @return      Returns 1 if at least MAPPED_RESIDENCY percent of the window is
+ *              resident, or 0 if not or the residency can't be determined.
+ */
+static int IsMostlyCached(int file, uint64_t size);
+
+/**
+ * Maps a window of a file and asks the kernel to read it in sequentially.
+ * @param  file   The open file to map.
+ * @param  size   The size of the file.
+ * @param  offset The offset of the window, a multiple of MAPPED_WINDOW.
+ * @param  window Receives the mapped window.
+ * @return        Returns 0 on success or -1 if the file can't be mapped.
+ */
+static int MapWindow(int file, uint64_t size, uint64_t offset,
+    MappedWindow* window);
+
+/**
+ * Updates the hashes with data from a mapped window. Reading a page of the
+ * mapping past the end of a file that shrank since it was mapped raises
+ * SIGBUS, which is caught instead of killing the process.
+ * @param  hashes The hashes to update.
+ * @param  data   The mapped data.
+ * @param  length The length of the data.
+ * @return        Returns 0 on success or -1 if the data is no longer there.
+ */
+static int HashMappedData(Hashes_Context* hashes, const unsigned char* data,
+    uint32_t length);
+
+/**
+ * Installs HandleFault as the SIGBUS handler. Called through pthread_once
+ * before the first file is hashed out of a mapping.
+ */
+static void InitFaultHandler(void);
+
+/**
+ * Handles SIGBUS. A fault inside HashMappedData returns there, anything else
+ * is passed on to the handler that was installed before.
+ * @param signum  The signal number.
+ * @param info    Details about the signal.
+ * @param context The context of the interrupted thread.
+ */
+static void HandleFault(int signum, siginfo_t* info, void* context);
+
+/**
+ * Reads exactly length bytes from the file at the given offset, retrying
+ * interrupted and partial reads.
+ * @param  file   The open file to read.
+ * @param  buffer The buffer receiving the data.
+ * @param  length The number of bytes to read.
+ * @param  offset The offset in the file to read from.
+ * @return        Returns 0 on success, -8 if the read failed, or NOT_HASHED if
+ *                the file ended early.
+ */
+static int ReadFully(int file, unsigned char* buffer, uint32_t length,
+    uint64_t offset);
+
+/**
+ * Drops a window mapped by MapWindow from the address space.
+ * @param window The window to unmap.
+ */
+static void UnmapWindow(MappedWindow* window);
+
+/**
+ * Hashes a file that was opened by OpenRequest and closes it.
+ * @param  request  The HashRequest containing the options.
+ * @param  file     The open file to hash.
+ * @param  callback The optional progress callback.
+ * @param  asyncIO  Non-zero to keep several reads in flight where the platform
+ *                  supports it, instead of reading one buffer at a time.
+ * @param  buffer   A BUFFERSIZE buffer owned by a HasherEngine worker or a
+ *                  HashFilesByDevice thread, or NULL. Their files are read
+ *                  into the buffer and are never split across more threads,
+ *                  since the other workers keep the rest of the cores busy and
+ *                  the threads of a device are all the reads it should get.
+ * @return          Returns the same values as HashFileWithSyncIO.
+ */
+static int HashOpenFile(HashRequest* request, int file,
+    HashProgressCallback* callback, char asyncIO, unsigned char* buffer);
+
+/**
+ * Hashes the files of a batch for HashFilesWithSyncIO, with every file that
+ * isn't hashed together with others passed to HashOpenFile with the buffer.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional progress callback.
+ * @param  buffer   The buffer passed to HashOpenFile, or NULL.
+ * @return          Returns the number of requests that failed.
+ */
+static int HashFileList(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback, unsigned char* buffer);
+
+/**
+ * Validates a HashRequest, clears its result and opens its file.
+ * @param  request The HashRequest to open the file of.
+ * @param  file    Receives the open file.
+ * @return         Returns 0 on success or the -1 to -4 failures of
+ *                 HashFileWithSyncIO.
+ */
+static int OpenRequest(HashRequest* request, int* file);
+
+/**
+ * Runs a worker of a HasherEngine, hashing the requests it claims from the
+ * queue, and the blocks it steals from the split files of other workers, until
+ * the engine is stopped.
+ * @param  param The EngineWorker.
+ * @return       Always returns NULL.
+ */
+static void* RunEngineWorker(void* param);
+
+/**
+ * Records the result of a request hashed by a HasherEngine, and wakes the
+ * caller of HashFilesBatch or queues the job for collection once its batch is
+ * finished. The engine must be locked.
+ * @param engine The engine.
+ * @param batch  The batch of the request.
+ * @param idx    The index of the request in the batch.
+ * @param status The result of the request.
+ */
+static void FinishRequest(HasherEngine* engine, EngineBatch* batch,
+    uint32_t idx, int status);
+
+/**
+ * Sets up a file to be hashed by a HasherEngine as runs of ED2k blocks, if
+ * it's large enough and only requests hashes that can be calculated that way.
+ * @param  batch The batch of the request.
+ * @param  idx   The index of the request in the batch.
+ * @param  file  The file opened by OpenRequest.
+ * @return       The new EngineFile, or NULL if the file should be hashed whole.
+ */
+static EngineFile* SplitFile(EngineBatch* batch, uint32_t idx, int file);
+
+/**
+ * Claims and hashes runs of blocks of a file split by SplitFile. The engine
+ * must be locked, and is again on return.
+ * @param worker  The worker.
+ * @param chunked The file.
+ * @param steal   Non-zero to steal a single run from the back.
+ */
+static void WorkOnFile(EngineWorker* worker, EngineFile* chunked, char steal);
+
+/**
+ * Claims the next run of blocks of a file split by SplitFile. The engine must
+ * be locked.
+ * @param  engine  The engine.
+ * @param  chunked The file.
+ * @param  steal   Non-zero to claim the run from the back of the file.
+ * @param  first   Receives the first block of the run.
+ * @param  count   Receives the number of blocks in the run.
+ * @return         Returns 1 if a run was claimed, 0 if none are left.
+ */
+static int ClaimRun(HasherEngine* engine, EngineFile* chunked, char steal,
+    uint32_t* first, uint32_t* count);
+
+/**
+ * Hashes a run of blocks of a file split by SplitFile.
+ * @param  worker  The worker.
+ * @param  chunked The file.
+ * @param  first   The first block of the run.
+ * @param  count   The number of blocks in the run.
+ * @param  length  Receives the number of bytes hashed.
+ * @return         Returns 0 on success, -8 if a read failed, or NOT_HASHED if
+ *                 the file shrank since it was split.
+ */
+static int HashRun(EngineWorker* worker, EngineFile* chunked, uint32_t first,
+    uint32_t count, uint64_t* length);
+
+/**
+ * Takes a split file off the list of files with runs left to claim. The
+ * engine must be locked.
+ * @param engine  The engine.
+ * @param chunked The file.
+ */
+static void UnlistFile(HasherEngine* engine, EngineFile* chunked);
+
+/**
+ * Combines the hashes of the blocks of a split file into its result, then
+ * closes and frees it.
+ * @param  worker  The worker that finished the last run.
+ * @param  chunked The file.
+ * @return         Returns the status of the request.
+ */
+static int FinishFile(EngineWorker* worker, EngineFile* chunked);
+
+/**
+ * Adds a batch to the end of the queue of an engine and wakes its workers. The
+ * engine must be locked.
+ * @param engine The engine.
+ * @param batch  The batch to queue.
+ */
+static void QueueBatch(HasherEngine* engine, EngineBatch* batch);
+
+/**
+ * Makes the completion descriptor of an engine readable, or drains it. The
+ * engine must be locked.
+ * @param engine  The engine.
+ * @param pending Non-zero when the completion queue just stopped being empty,
+ *                zero when it just became empty.
+ */
+static void SignalCompletions(HasherEngine* engine, char pending);
+
+/**
+ * The progress callback of the jobs passed to SubmitHash, which cancels the
+ * job once CancelHash is called for it.
+ * @param  tag      The tag of the request.
+ * @param  progress The number of bytes hashed.
+ * @return          Returns non-zero if the job was cancelled.
+ */
+static int32_t JobProgress(int32_t tag, uint64_t progress);
+
+/**
+ * Creates the key holding the job of each engine worker.
+ */
+static void InitJobKey(void);
+
+/**
+ * Thread entry point hashing the requests of a DeviceGroup.
+ * @param  param The DeviceGroup.
+ * @return       Always returns NULL.
+ */
+static void* HashDeviceGroup(void* param);
+
+/**
+ * Finds the device holding the file of a request, and how many of its files
+ * should be read at once.
+ * @param request The HashRequest of the file.
+ * @param device  Receives the device.
+ * @param limit   Receives the number of files to read at once.
+ */
+static void FindDevice(HashRequest* request, dev_t* device, uint32_t* limit);
+
+#if defined(__linux__)
+/**
+ * Resolves a device number to the disk behind it through sysfs, and finds
+ * whether it's rotational.
+ * @param device The device to resolve, which receives the disk.
+ * @param limit  Receives the number of files to read at once.
+ */
+static void ResolveDevice(dev_t* device, uint32_t* limit);
+
+/**
+ * Reads the first line of a sysfs attribute of a device.
+ * @param  directory The sysfs directory of the device.
+ * @param  name      The name of the attribute.
+ * @param  value     Receives the value, without the newline.
+ * @param  size      The size of value.
+ * @return           Returns 1 on success, 0 if it can't be read.
+ */
+static int ReadSysfs(const char* directory, const char* name, char* value,
+    size_t size);
+#endif
+
+/**
+ * Writes a description of the hash kernel selected for each algorithm to
+ * buffer.
+ * @param  buffer The buffer that receives the description.
+ * @param  size   The size of the buffer in bytes.
+ * @return        See the header file for return information.
+ */
+uint32_t DescribeKernels(char* buffer, uint32_t size) {
+    pthread_once(&dispatchOnce, InitDispatch);
+    return Dispatch_describe(buffer, size);
+}
+
+/**
+ * Accepts a HashRequest structure and attempts to calculate the requested hash
+ * of the provided file using synchronous IO.
+ * @param  request  The HashRequest containing the options and the file that
+ *                  should be hashed.
+ * @param  callback An optional callback parameter that will receive the total
+ *                  number of bytes processed by the hashing algorithm and
+ *                  provides the caller a chance to cancel the hash if desired.
+ * @return          See the header file for return information.
+ */
+int HashFileWithSyncIO(HashRequest* request, HashProgressCallback* callback) {
+    int file;
+    int status = OpenRequest(request, &file);
+    if (status != 0) {
+        return status;
+    }
+
+    return HashOpenFile(request, file, callback, 0, NULL);
+}
+
+/**
+ * Accepts a HashRequest structure and attempts to calculate the requested hash
+ * of the provided file, keeping several reads in flight at once.
+ * @param  request  The HashRequest containing the options and the file that
+ *                  should be hashed.
+ * @param  callback An optional callback parameter that will receive the total
+ *                  number of bytes processed by the hashing algorithm and
+ *                  provides the caller a chance to cancel the hash if desired.
+ * @return          See the header file for return information.
+ */
+int HashFileWithAsyncIO(HashRequest* request, HashProgressCallback* callback) {
+    int file;
+    int status = OpenRequest(request, &file);
+    if (status != 0) {
+        return status;
+    }
+
+    return HashOpenFile(request, file, callback, 1, NULL);
+}
+
+/**
+ * Accepts an array of HashRequest structures and calculates the requested
+ * hashes of every file using synchronous IO. Small files that request the MD5
+ * hash are hashed together, every other file is hashed by HashFileWithSyncIO
+ * while the next few files are prefetched.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional progress callback.
+ * @return          See the header file for return information.
+ */
+int HashFilesWithSyncIO(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback) {
+    if (requests == NULL || results == NULL) {
+        return -1;
+    }
+
+    return HashFileList(requests, results, count, callback, NULL);
+}
+
+/**
+ * Hashes the files of a batch for HashFilesWithSyncIO. Small files that request
+ * the MD5 hash are hashed together, every other file is passed to HashOpenFile
+ * with the buffer while the next few files are prefetched.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional progress callback.
+ * @param  buffer   The buffer passed to HashOpenFile, or NULL.
+ * @return          Returns the number of requests that failed.
+ */
+static int HashFileList(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback, unsigned char* buffer) {
+    uint32_t batch[BATCH_FILES];
+    const void* data[BATCH_FILES];
+    uint32_t sizes[BATCH_FILES];
+    uint32_t batched = 0;
+    uint32_t used = 0;
+    uint32_t idx;
+    int failures = 0;
+
+    /* The number of bytes prefetched for each of the files ahead, indexed by
+     * the request index modulo the size of the ring. */
+    uint64_t prefetched[PREFETCH_MAXFILES + 1];
+    uint64_t prefetchUsed = 0;
+    uint32_t prefetchNext = 0;
+    uint32_t prefetchFiles = PrefetchFiles();
+
+    /* Without the batch buffer every file simply goes the regular route. */
+    unsigned char* batchData = (unsigned char*)malloc(BATCH_BUFFERSIZE);
+
+    for (idx = 0; idx < count; ++idx) {
+        HashRequest* request = &requests[idx];
+        struct stat filestats;
+        int file;
+
+        /* The file about to be hashed no longer counts against the budget,
+         * which makes room for the ones after it. */
+        if (idx < prefetchNext) {
+            prefetchUsed -= prefetched[idx % (PREFETCH_MAXFILES + 1)];
+        } else {
+            prefetchNext = idx + 1;
+        }
+
+        while (prefetchNext < count && prefetchNext <= idx + prefetchFiles &&
+            prefetchUsed < PREFETCH_BUDGET) {
+            uint64_t length = PrefetchFile(
+                &requests[prefetchNext], PREFETCH_BUDGET - prefetchUsed);
+
+            prefetched[prefetchNext % (PREFETCH_MAXFILES + 1)] = length;
+            prefetchUsed += length;
+            ++prefetchNext;
+        }
+
+        results[idx] = OpenRequest(request, &file);
+        if (results[idx] != 0) {
+            continue;
+        }
+
+        memset(&filestats, 0, sizeof(struct stat));
+        if (batchData == NULL || !(request->options & OPTION_MD5) ||
+            fstat(file, &filestats) != 0 || !S_ISREG(filestats.st_mode) ||
+            filestats.st_size > BATCH_FILE_MAXSIZE) {
+            results[idx] = HashOpenFile(request, file, callback, 0, buffer);
+            continue;
+        }
+
+        /* Hash what we have so far if this file doesn't fit. */
+        if (batched == BATCH_FILES ||
+            used + filestats.st_size > BATCH_BUFFERSIZE) {
+            HashBatch(requests, results, batch, data, sizes, batched, callback);
+            batched = 0;
+            used = 0;
+        }
+
+        results[idx] = ReadFully(
+            file, &batchData[used], (uint32_t)filestats.st_size, 0);
+
+        /* The file shrank since it was measured, so hash what's left of it
+         * on its own. */
+        if (results[idx] == NOT_HASHED) {
+            results[idx] = HashOpenFile(request, file, callback, 0, buffer);
+            continue;
+        }
+
+        if (request->options & (OPTION_DIRECTIO | OPTION_DROPBEHIND)) {
+            DropBehind(file, 0, filestats.st_size);
+        }
+        close(file);
+        if (results[idx] != 0) {
+            continue;
+        }
+
+        batch[batched] = idx;
+        data[batched] = &batchData[used];
+        sizes[batched] = (uint32_t)filestats.st_size;
+        used += sizes[batched];
+        ++batched;
+    }
+
+    if (batched > 0) {
+        HashBatch(requests, results, batch, data, sizes, batched, callback);
+    }
+    free(batchData);
+
+    for (idx = 0; idx < count; ++idx) {
+        if (results[idx] != 0) {
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+/**
+ * Accepts an array of HashRequest structures and hashes the files of every
+ * device in parallel, with at most one file at a time on each rotational disk.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional progress callback.
+ * @return          See the header file for return information.
+ */
+int HashFilesByDevice(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback) {
+    if (requests == NULL || results == NULL) {
+        return -1;
+    }
+
+    DeviceGroup* groups = (DeviceGroup*)calloc(count + 1, sizeof(DeviceGroup));
+    HashRequest* copies = (HashRequest*)malloc(
+        (count + 1) * sizeof(HashRequest));
+    int32_t* copyResults = (int32_t*)malloc((count + 1) * sizeof(int32_t));
+    uint32_t* indexes = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    uint32_t* membership = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    pthread_t* threads = NULL;
+    uint32_t groupCount = 0;
+    uint32_t threadCount = 0;
+    uint32_t started = 0;
+    uint32_t position = 0;
+    uint32_t group;
+    uint32_t idx;
+    int failures = 0;
+
+    /* Without the bookkeeping, just hash the files one after the other. */
+    if (groups == NULL || copies == NULL || copyResults == NULL ||
+        indexes == NULL || membership == NULL) {
+        free(groups);
+        free(copies);
+        free(copyResults);
+        free(indexes);
+        free(membership);
+        return HashFilesWithSyncIO(requests, results, count, callback);
+    }
+
+    /* Group the requests by the disk (or array) holding their files. */
+    for (idx = 0; idx < count; ++idx) {
+        dev_t device;
+        uint32_t limit;
+
+        FindDevice(&requests[idx], &device, &limit);
+        for (group = 0; group < groupCount; ++group) {
+            if (groups[group].device == device) {
+                break;
+            }
+        }
+
+        if (group == groupCount) {
+            groups[group].device = device;
+            groups[group].threads = limit;
+            ++groupCount;
+        }
+
+        membership[idx] = group;
+        ++groups[group].count;
+    }
+
+    /* Each group gets a contiguous copy of its requests, in their original
+     * order, so a group with a single thread can go through HashFileList. */
+    for (group = 0; group < groupCount; ++group) {
+        DeviceGroup* current = &groups[group];
+
+        current->requests = &copies[position];
+        current->results = &copyResults[position];
+        current->callback = callback;
+        if (current->threads > current->count) {
+            current->threads = current->count;
+        }
+        pthread_mutex_init(&current->lock, NULL);
+
+        position += current->count;
+        threadCount += current->threads;
+        current->count = 0;
+    }
+
+    for (idx = 0; idx < count; ++idx) {
+        DeviceGroup* current = &groups[membership[idx]];
+        uint32_t slot = (uint32_t)(current->requests - copies) + current->count;
+
+        copies[slot] = requests[idx];
+        indexes[slot] = idx;
+        ++current->count;
+    }
+
+    threads = (pthread_t*)malloc((threadCount + 1) * sizeof(pthread_t));
+    for (group = 0; group < groupCount; ++group) {
+        DeviceGroup* current = &groups[group];
+        uint32_t thread;
+
+        for (thread = 0; threads != NULL && thread < current->threads; ++thread) {
+            if (pthread_create(&threads[started], NULL, HashDeviceGroup,
+                current) != 0) {
+                break;
+            }
+            ++started;
+        }
+
+        /* A group without any thread is hashed on this one below. */
+        current->orphaned = thread == 0 || threads == NULL;
+    }
+
+    for (group = 0; group < groupCount; ++group) {
+        if (groups[group].orphaned) {
+            HashDeviceGroup(&groups[group]);
+        }
+    }
+
+    for (idx = 0; idx < started; ++idx) {
+        pthread_join(threads[idx], NULL);
+    }
+
+    for (idx = 0; idx < count; ++idx) {
+        memcpy(requests[indexes[idx]].result, copies[idx].result,
+            sizeof(copies[idx].result));
+        results[indexes[idx]] = copyResults[idx];
+        if (copyResults[idx] != 0) {
+            ++failures;
+        }
+    }
+
+    for (group = 0; group < groupCount; ++group) {
+        pthread_mutex_destroy(&groups[group].lock);
+    }
+
+    free(threads);
+    free(groups);
+    free(copies);
+    free(copyResults);
+    free(indexes);
+    free(membership);
+
+    return failures;
+}
+
+/**
+ * Creates a HasherEngine with a pool of worker threads, each with its own
+ * buffer.
+ * @param  threads The number of workers, or 0 for one per online core.
+ * @return         See the header file for return information.
+ */
+HasherEngine* CreateHasherEngine(uint32_t threads) {
+    HasherEngine* engine;
+    uint32_t idx;
+
+    pthread_once(&dispatchOnce, InitDispatch);
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (threads > ENGINE_MAXTHREADS) {
+        threads = ENGINE_MAXTHREADS;
+    }
+
+    engine = (HasherEngine*)calloc(1, sizeof(HasherEngine));
+    if (engine == NULL) {
+        return NULL;
+    }
+
+    engine->workers = (EngineWorker*)calloc(threads, sizeof(EngineWorker));
+    if (engine->workers == NULL) {
+        free(engine);
+        return NULL;
+    }
+
+    /* An eventfd on Linux, and the two ends of a pipe elsewhere. */
+#if defined(__linux__)
+    engine->readFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    engine->writeFd = engine->readFd;
+    if (engine->readFd == -1) {
+        free(engine->workers);
+        free(engine);
+        return NULL;
+    }
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        free(engine->workers);
+        free(engine);
+        return NULL;
+    }
+    engine->readFd = fds[0];
+    engine->writeFd = fds[1];
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    pthread_once(&jobKeyOnce, InitJobKey);
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->queued, NULL);
+    pthread_cond_init(&engine->finished, NULL);
+    pthread_condattr_t completedClock;
+    pthread_condattr_init(&completedClock);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&completedClock, ENGINE_CLOCK);
+#endif
+    pthread_cond_init(&engine->completed, &completedClock);
+    pthread_condattr_destroy(&completedClock);
+    engine->nextJob = 1;
+
+    for (idx = 0; idx < threads; ++idx) {
+        EngineWorker* worker = &engine->workers[idx];
+
+        worker->engine = engine;
+        worker->buffer = (unsigned char*)malloc(BUFFERSIZE);
+        if (worker->buffer == NULL ||
+            pthread_create(&worker->thread, NULL, RunEngineWorker, worker) != 0) {
+            free(worker->buffer);
+            break;
+        }
+    }
+
+    /* Make do with the workers that could be started. */
+    engine->count = idx;
+    if (engine->count == 0) {
+        DestroyHasherEngine(engine);
+        return NULL;
+    }
+
+    return engine;
+}
+
+/**
+ * Stops the workers of a HasherEngine once they finish the queued requests and
+ * frees it.
+ * @param engine The engine to destroy.
+ */
+void DestroyHasherEngine(HasherEngine* engine) {
+    uint32_t idx;
+
+    if (engine == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    engine->stop = 1;
+    pthread_cond_broadcast(&engine->queued);
+    pthread_mutex_unlock(&engine->lock);
+
+    for (idx = 0; idx < engine->count; ++idx) {
+        pthread_join(engine->workers[idx].thread, NULL);
+        free(engine->workers[idx].buffer);
+    }
+
+    /* Free the jobs that finished but were never collected. */
+    while (engine->completedFirst) {
+        EngineBatch* job = engine->completedFirst;
+        engine->completedFirst = job->following;
+        free(job);
+    }
+
+    if (engine->writeFd != engine->readFd) {
+        close(engine->writeFd);
+    }
+    close(engine->readFd);
+
+    pthread_cond_destroy(&engine->completed);
+    pthread_cond_destroy(&engine->finished);
+    pthread_cond_destroy(&engine->queued);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->workers);
+    free(engine);
+}
+
+/**
+ * Hashes a batch of requests on the workers of a HasherEngine and waits for
+ * all of them to finish.
+ * @param  engine   The engine to hash the requests on.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional progress callback.
+ * @return          See the header file for return information.
+ */
+int HashFilesBatch(HasherEngine* engine, HashRequest* requests,
+    int32_t* results, uint32_t count, HashProgressCallback* callback) {
+    EngineBatch batch;
+    uint32_t idx;
+    int failures = 0;
+
+    if (engine == NULL || requests == NULL || results == NULL) {
+        return -1;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    memset(&batch, 0, sizeof(EngineBatch));
+    batch.requests = requests;
+    batch.results = results;
+    batch.count = count;
+    batch.callback = callback;
+    batch.remaining = count;
+
+    pthread_mutex_lock(&engine->lock);
+    QueueBatch(engine, &batch);
+
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&engine->finished, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    for (idx = 0; idx < count; ++idx) {
+        if (results[idx] != 0) {
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+/**
+ * Queues a single request on the workers of an engine without waiting for it.
+ * @param  engine  The engine created by CreateHasherEngine.
+ * @param  request The HashRequest to process.
+ * @return         See the header file for return information.
+ */
+int64_t SubmitHash(HasherEngine* engine, HashRequest* request) {
+    EngineBatch* job;
+    int64_t id;
+
+    if (engine == NULL || request == NULL) {
+        return -1;
+    }
+
+    job = (EngineBatch*)calloc(1, sizeof(EngineBatch));
+    if (job == NULL) {
+        return -7;
+    }
+
+    job->requests = request;
+    job->results = &job->status;
+    job->count = 1;
+    job->callback = JobProgress;
+    job->remaining = 1;
+
+    pthread_mutex_lock(&engine->lock);
+    job->job = engine->nextJob++;
+    id = (int64_t)job->job;
+    QueueBatch(engine, job);
+    pthread_mutex_unlock(&engine->lock);
+
+    return id;
+}
+
+/**
+ * Cancels a job passed to SubmitHash that hasn't finished yet.
+ * @param  engine The engine the job was passed to.
+ * @param  job    The id returned by SubmitHash.
+ * @return        See the header file for return information.
+ */
+int CancelHash(HasherEngine* engine, int64_t job) {
+    EngineFile* chunked;
+    EngineBatch* batch;
+    uint32_t idx;
+    int status = -1;
+
+    if (engine == NULL || job <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    for (batch = engine->first; batch != NULL; batch = batch->following) {
+        if (batch->job == (uint64_t)job) {
+            batch->cancelled = 1;
+            status = 0;
+        }
+    }
+
+    for (chunked = engine->files; chunked != NULL && status != 0;
+        chunked = chunked->following) {
+        if (chunked->batch->job == (uint64_t)job) {
+            chunked->batch->cancelled = 1;
+            status = 0;
+        }
+    }
+
+    for (idx = 0; idx < engine->count && status != 0; ++idx) {
+        batch = engine->workers[idx].current;
+        if (batch != NULL && batch->job == (uint64_t)job) {
+            batch->cancelled = 1;
+            status = 0;
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return status;
+}
+
+/**
+ * Collects finished jobs from the completion queue of an engine without
+ * waiting.
+ * @param  engine      The engine the jobs were passed to.
+ * @param  completions Receives the finished jobs.
+ * @param  max         The number of entries in completions.
+ * @return             See the header file for return information.
+ */
+int PollCompletions(HasherEngine* engine, HashCompletion* completions,
+    uint32_t max) {
+    int collected = 0;
+
+    if (engine == NULL || completions == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->completedFirst != NULL && (uint32_t)collected < max) {
+        EngineBatch* job = engine->completedFirst;
+
+        engine->completedFirst = job->following;
+        if (engine->completedFirst == NULL) {
+            engine->completedLast = NULL;
+            SignalCompletions(engine, 0);
+        }
+
+        completions[collected].job = (int64_t)job->job;
+        completions[collected].request = job->requests;
+        completions[collected].status = job->status;
+        ++collected;
+        free(job);
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return collected;
+}
+
+/**
+ * Collects finished jobs from the completion queue of an engine, waiting for
+ * at least one if it's empty.
+ * @param  engine      The engine the jobs were passed to.
+ * @param  completions Receives the finished jobs.
+ * @param  max         The number of entries in completions.
+ * @param  timeout     The most milliseconds to wait, or -1 to wait for as long
+ *                     as it takes.
+ * @return             See the header file for return information.
+ */
+int WaitCompletions(HasherEngine* engine, HashCompletion* completions,
+    uint32_t max, int32_t timeout) {
+    struct timespec deadline;
+    int waiting = 0;
+
+    if (engine == NULL || completions == NULL) {
+        return -1;
+    }
+
+    clock_gettime(ENGINE_CLOCK, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->completedFirst == NULL && max > 0 && waiting == 0) {
+        if (timeout < 0) {
+            pthread_cond_wait(&engine->completed, &engine->lock);
+        } else {
+            waiting = pthread_cond_timedwait(
+                &engine->completed, &engine->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return PollCompletions(engine, completions, max);
+}
+
+/**
+ * Gets the descriptor that's readable while an engine has finished jobs to
+ * collect.
+ * @param  engine The engine.
+ * @return        See the header file for return information.
+ */
+int GetCompletionFd(HasherEngine* engine) {
+    return engine ? engine->readFd : -1;
+}
+
+/**
+ * Validates a HashRequest, clears its result and opens its file.
+ * @param  request The HashRequest to open the file of.
+ * @param  file    Receives the open file.
+ * @return         Returns 0 on success or the -1 to -4 failures of
+ *                 HashFileWithSyncIO.
+ */
+static int OpenRequest(HashRequest* request, int* file) {
+    pthread_once(&dispatchOnce, InitDispatch);
+
+    /* Simple guard condition. If we have no request, we can't process. */
+    if (request == NULL) {
+        return -1;
+    }
+
+    /* clear the result buffer */
+    memset(&request->result, 0, 56);
+
+    /* If they didn't pass any valid options (or passed 0) then return since
+     * we can't calculate a hash without knowing which algorithm(s) to use. */
+    if (!(request->options &
+        (OPTION_CRC32 | OPTION_MD5 | OPTION_SHA1 | OPTION_ED2K))) {
+        return -2;
+    }
+
+    /* Convert the filename from a wchar_t* to char* using UTF-8. */
+    char* filename = NULL;
+    ConvertWideToMultiByte(request->filename, &filename);
+    if (filename == NULL) {
+        return -3;
+    }
+
+    /* Try to open the file and free up filename since it isn't needed after
+     * this point and helps reduce the code cleanup on failures. */
+    *file = open(filename, O_RDONLY | O_SHLOCK);
+    free(filename);
+    if (*file == -1) {
+        return -4;
+    }
+
+    return 0;
+}
+
+/**
+ * Hashes a file that was opened by OpenRequest and closes it.
+ * @param  request  The HashRequest containing the options.
+ * @param  file     The open file to hash.
+ * @param  callback The optional progress callback.
+ * @param  asyncIO  Non-zero to keep several reads in flight.
+ * @param  buffer   A BUFFERSIZE buffer owned by a HasherEngine worker, or NULL.
+ * @return          Returns the same values as HashFileWithSyncIO.
+ */
+static int HashOpenFile(HashRequest* request, int file,
+    HashProgressCallback* callback, char asyncIO, unsigned char* buffer) {
+    /* Set our options */
+    char doCRC32 = request->options & OPTION_CRC32;
+    char doMD5 = request->options & OPTION_MD5;
+    char doSHA1 = request->options & OPTION_SHA1;
+    char doED2k = request->options & OPTION_ED2K;
+    char bypassCache = (request->options &
+        (OPTION_DIRECTIO | OPTION_DROPBEHIND)) != 0;
+    char network = (request->options & OPTION_NETWORK) || IsNetworkFile(file);
+    char pooled = buffer != NULL;
+
+    /* Set errno to zero in case we're called many times in the same process. */
+    errno = 0;
+
+    /* Regular files can be hashed without the read loop. Special files (and
+     * files that can't be mapped, queued or read ahead) fall through to it. */
+    struct stat filestats;
+
+    memset(&filestats, 0, sizeof(struct stat));
+    char regular = fstat(file, &filestats) == 0 && S_ISREG(filestats.st_mode);
+
+#if defined(F_NOCACHE)
+    /* There's no posix_fadvise on Mac OS X, so keep the reads out of the
+     * cache altogether instead of dropping them afterwards. */
+    if (bypassCache) {
+        fcntl(file, F_NOCACHE, 1);
+    }
+#endif
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+    /* Holes read back as zeros, so skip them instead of reading and hashing
+     * every zero. Direct reads are asked for to keep the file out of the
+     * cache, and every hole lookup on a network mount is a round trip, so
+     * those are read in full. */
+    if (regular && filestats.st_size > BUFFERSIZE && !network &&
+        !(request->options & OPTION_DIRECTIO)) {
+        int status = HashSparseFile(file, filestats.st_size, request, callback);
+        if (status != NOT_HASHED) {
+            close(file);
+            return status;
+        }
+    }
+#endif
+
+    /* A large file that only needs a CRC32 doesn't have to be hashed
+     * sequentially. Split it across the available cores instead. */
+    if (doCRC32 && !doMD5 && !doSHA1 && !doED2k && !bypassCache && !network &&
+        !pooled) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cpus > 1 && regular && filestats.st_size >= PARALLEL_CRC32_MINSIZE) {
+            uint32_t threads = cpus < PARALLEL_CRC32_THREADS ?
+                (uint32_t)cpus : PARALLEL_CRC32_THREADS;
+            int status = HashCRC32InParallel(
+                file, filestats.st_size, threads, request, callback);
+
+            if (status != NOT_HASHED) {
+                close(file);
+                return status;
+            }
+        }
+    }
+
+    /* An ED2k hash by itself is a list of independent MD4 hashes, one per
+     * block, so several blocks can be hashed at once in vector lanes. */
+    if (doED2k && !doCRC32 && !doMD5 && !doSHA1 && !bypassCache && !network &&
+        regular && filestats.st_size >= LANES_ED2K_MINSIZE &&
+        Dispatch_kernel(DISPATCH_MD4_MULTI) == DISPATCH_AVX2) {
+        int status = HashED2kInLanes(file, filestats.st_size, request, callback);
+
+        if (status != NOT_HASHED) {
+            close(file);
+            return status;
+        }
+    }
+
+    if (regular) {
+        int status = NOT_HASHED;
+        char pipelined = !network && !pooled &&
+            filestats.st_size > BUFFERSIZE &&
+            !(request->options & OPTION_DIRECTIO) &&
+            UsePipeline(request->options);
+
+        /* Reading a file that's in the page cache already only copies it, so
+         * hash it straight out of the cache instead. Unless it can be hashed
+         * on several cores, where the copy costs less than the hashes. */
+        if ((!pipelined || bypassCache) &&
+            filestats.st_size >= MAPPED_MINSIZE &&
+            IsMostlyCached(file, filestats.st_size)) {
+            status = HashMappedFile(file, filestats.st_size, request, callback);
+        }
+
+        /* Several hashes of one file can't share a core without taking turns,
+         * so give each its own thread. */
+        if (status == NOT_HASHED && pipelined) {
+            status = HashFilePipelined(file, request, callback);
+        }
+
+        /* Hide the round trip of every read on a network mount by keeping
+         * several of them in flight. */
+        if (status == NOT_HASHED && network && !pooled &&
+            filestats.st_size > BUFFERSIZE) {
+            uint32_t stripes;
+            uint32_t depth;
+
+            StripeSettings(&filestats, &stripes, &depth);
+            status = HashFileStriped(file, filestats.st_size, stripes, depth,
+                request, callback);
+        }
+
+        if (status == NOT_HASHED && (request->options & OPTION_DIRECTIO)) {
+            status = HashFileDirect(file, filestats.st_size, request, callback);
+        }
+
+#if defined(__linux__)
+        /* Keep the device busy with a queue of reads. Files that fit in a
+         * single buffer have nothing to overlap. */
+        if (status == NOT_HASHED && asyncIO &&
+            filestats.st_size > BUFFERSIZE) {
+            status = HashFileWithUring(
+                file, filestats.st_size, request, callback);
+        }
+#endif
+
+        /* Otherwise overlap reading the next buffers with hashing this one. */
+        if (status == NOT_HASHED && !pooled && filestats.st_size > BUFFERSIZE) {
+            status = HashFileWithReader(file, request, callback);
+        }
+
+        if (status != NOT_HASHED) {
+            close(file);
+            return status;
+        }
+    }
+
+    /* Set up our local variables. */
+    Hashes_Context hashes;
+    ssize_t bytesRead;
+    uint32_t progressLoopCount = 0;
+    uint64_t totalBytesRead = 0;
+    unsigned char* fileData = NULL;
+
+    /* Every selected hash is updated in a single pass over each buffer,
+     * including finishing the ED2k blocks as the data crosses them. */
+    Hashes_init(&hashes, request->options);
+
+    /* Allocate the file buffer, unless the caller has one. */
+    fileData = pooled ? buffer : (unsigned char*)malloc(BUFFERSIZE);
+    if (fileData == NULL && errno == ENOMEM) {
+        close(file);
+        return -7;
+    }
+
+    /* Read the entire file until we hit the end. */
+    while ((bytesRead = read(file, fileData, BUFFERSIZE)) != 0) {
+        /* Double check that we haven't had a file read error. */
+        if (bytesRead == -1) {
+            /* We should never get EAGAIN, but handle it anyway. */
+            if (errno == EAGAIN) {
+                continue;
+            }
+
+            /* We've encountered an unexpected read error. Free up everything
+             * and inform the caller that we've failed. */
+            if (!pooled) {
+                free(fileData);
+            }
+            close(file);
+            return -8;
+        }
+
+        totalBytesRead += bytesRead;
+        if (callback && progressLoopCount % 10 == 0) {
+            if(callback(request->tag, totalBytesRead) != 0) {
+                if (!pooled) {
+                    free(fileData);
+                }
+                close(file);
+                return -9;
+            }
+        }
+        progressLoopCount++;
+
+        /* Update the hashes. */
+        Hashes_update(&hashes, fileData, (uint32_t)bytesRead);
+
+        if (bypassCache) {
+            DropBehind(file, totalBytesRead - bytesRead, bytesRead);
+        }
+    }
+
+    /* Free our file buffer and close the file since we're done with it. */
+    if (!pooled) {
+        free(fileData);
+    }
+    close(file);
+
+    /* If we have a callback, call them one more time informing them of our
+     * completion. We ignore the request to cancel since we're done anyway. */
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    /* Finalize all of the hashes that were selected and store the results in
+     * the request result buffer. The order of the hashes are:
+     *     0 - 15: ED2k
+     *    16 - 19: CRC32
+     *    20 - 35: MD5
+     *    36 - 55: SHA1 */
+    Hashes_final(&hashes, &request->result[0]);
+
+    return 0;
+}
+
+/**
+ * Hashes the files of a batch built by HashFilesWithSyncIO. The contents of
+ * every file are already in memory and the MD5 hashes are calculated together
+ * with MD5_update_multi.
+ * @param requests The requests passed to HashFilesWithSyncIO.
+ * @param results  The results passed to HashFilesWithSyncIO.
+ * @param batch    The index of each request in the batch.
+ * @param data     The contents of each file in the batch.
+ * @param sizes    The size of each file in the batch.
+ * @param count    The number of files in the batch.
+ * @param callback The optional progress callback.
+ */
+static void HashBatch(HashRequest* requests, int32_t* results,
+    const uint32_t* batch, const void* const* data, const uint32_t* sizes,
+    uint32_t count, HashProgressCallback* callback) {
+    MD5_Context md5[BATCH_FILES];
+    MD5_Context* md5s[BATCH_FILES];
+    uint32_t idx;
+
+    /* Point at every context up front, so the whole array is set no matter
+     * how many files the batch has. */
+    for (idx = 0; idx < BATCH_FILES; ++idx) {
+        md5s[idx] = &md5[idx];
+    }
+
+    for (idx = 0; idx < count; ++idx) {
+        HashRequest* request = &requests[batch[idx]];
+
+        /* Batched files are smaller than BLOCKSIZE, so their ED2k hash is
+         * simply the MD4 hash of the data. */
+        if (request->options & OPTION_ED2K) {
+            MD4_Context ed2k;
+            MD4_init(&ed2k);
+            MD4_update(&ed2k, data[idx], sizes[idx]);
+            MD4_final(&ed2k, &request->result[0]);
+        }
+        if (request->options & OPTION_CRC32) {
+            CRC32_Context crc32;
+            CRC32_init(&crc32);
+            CRC32_update(&crc32, data[idx], sizes[idx]);
+            CRC32_final(&crc32, &request->result[16]);
+        }
+        if (request->options & OPTION_SHA1) {
+            SHA1_Context sha1;
+            SHA1_init(&sha1);
+            SHA1_update(&sha1, data[idx], sizes[idx]);
+            SHA1_final(&sha1, &request->result[36]);
+        }
+
+        MD5_init(&md5[idx]);
+    }
+
+    MD5_update_multi(md5s, data, sizes, count);
+
+    for (idx = 0; idx < count; ++idx) {
+        HashRequest* request = &requests[batch[idx]];
+
+        MD5_final(&md5[idx], &request->result[20]);
+        results[batch[idx]] = 0;
+
+        if (callback) {
+            callback(request->tag, sizes[idx]);
+        }
+    }
+}
+
+/**
+ * Runs a worker of a HasherEngine, hashing the requests it claims from the
+ * queue, and the blocks it steals from the split files of other workers, until
+ * the engine is stopped.
+ * @param  param The EngineWorker.
+ * @return       Always returns NULL.
+ */
+static void* RunEngineWorker(void* param) {
+    EngineWorker* worker = (EngineWorker*)param;
+    HasherEngine* engine = worker->engine;
+
+    pthread_mutex_lock(&engine->lock);
+    for (;;) {
+        EngineBatch* batch;
+        uint32_t idx;
+        int status;
+        int file;
+
+        while (engine->first == NULL && engine->files == NULL &&
+            !engine->stop) {
+            pthread_cond_wait(&engine->queued, &engine->lock);
+        }
+
+        /* With no new requests to start, help with the blocks of a large file
+         * someone else is hashing. */
+        if (engine->first == NULL) {
+            if (engine->files == NULL) {
+                break;
+            }
+
+            WorkOnFile(worker, engine->files, 1);
+            continue;
+        }
+
+        /* Take the batch off the queue along with its last request. */
+        batch = engine->first;
+        idx = batch->next++;
+        if (batch->next == batch->count) {
+            engine->first = batch->following;
+            if (engine->first == NULL) {
+                engine->last = NULL;
+            }
+        }
+        worker->current = batch;
+        pthread_mutex_unlock(&engine->lock);
+
+        /* Jobs cancelled while they were queued aren't opened at all. */
+        if (batch->cancelled) {
+            status = -9;
+        } else {
+            pthread_setspecific(jobKey, batch);
+            status = OpenRequest(&batch->requests[idx], &file);
+            if (status == 0) {
+                EngineFile* chunked = SplitFile(batch, idx, file);
+
+                if (chunked != NULL) {
+                    pthread_mutex_lock(&engine->lock);
+                    chunked->following = engine->files;
+                    engine->files = chunked;
+                    pthread_cond_broadcast(&engine->queued);
+                    WorkOnFile(worker, chunked, 0);
+                    worker->current = NULL;
+                    continue;
+                }
+
+                status = HashOpenFile(&batch->requests[idx], file,
+                    batch->callback, 0, worker->buffer);
+            }
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        worker->current = NULL;
+        FinishRequest(engine, batch, idx, status);
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    free(worker->lanes);
+    worker->lanes = NULL;
+
+    return NULL;
+}
+
+/**
+ * Records the result of a request hashed by a HasherEngine, and wakes the
+ * caller of HashFilesBatch or queues the job for collection once its batch is
+ * finished. The engine must be locked.
+ * @param engine The engine.
+ * @param batch  The batch of the request.
+ * @param idx    The index of the request in the batch.
+ * @param status The result of the request.
+ */
+static void FinishRequest(HasherEngine* engine, EngineBatch* batch,
+    uint32_t idx, int status) {
+    batch->results[idx] = status;
+    if (--batch->remaining > 0) {
+        return;
+    }
+
+    if (batch->job == 0) {
+        pthread_cond_broadcast(&engine->finished);
+        return;
+    }
+
+    /* A finished job moves to the completion queue. */
+    batch->following = NULL;
+    if (engine->completedLast) {
+        engine->completedLast->following = batch;
+    } else {
+        engine->completedFirst = batch;
+        SignalCompletions(engine, 1);
+    }
+    engine->completedLast = batch;
+    pthread_cond_broadcast(&engine->completed);
+}
+
+/**
+ * Sets up a file to be hashed by a HasherEngine as runs of ED2k blocks, if
+ * it's large enough and only requests hashes that can be calculated that way.
+ * @param  batch The batch of the request.
+ * @param  idx   The index of the request in the batch.
+ * @param  file  The file opened by OpenRequest.
+ * @return       The new EngineFile, or NULL if the file should be hashed whole
+ *               by HashOpenFile (which closes it).
+ */
+static EngineFile* SplitFile(EngineBatch* batch, uint32_t idx, int file) {
+    HashRequest* request = &batch->requests[idx];
+    EngineFile* chunked;
+    struct stat filestats;
+
+    if (!(request->options & (OPTION_ED2K | OPTION_CRC32)) ||
+        (request->options & (OPTION_MD5 | OPTION_SHA1 | OPTION_DIRECTIO))) {
+        return NULL;
+    }
+
+    memset(&filestats, 0, sizeof(struct stat));
+    if (fstat(file, &filestats) != 0 || !S_ISREG(filestats.st_mode) ||
+        filestats.st_size < ENGINE_CHUNK_MINSIZE) {
+        return NULL;
+    }
+
+    chunked = (EngineFile*)calloc(1, sizeof(EngineFile));
+    if (chunked == NULL) {
+        return NULL;
+    }
+
+    chunked->batch = batch;
+    chunked->index = idx;
+    chunked->file = file;
+    chunked->size = (uint64_t)filestats.st_size;
+    chunked->blocks = (uint32_t)((chunked->size + BLOCKSIZE - 1) / BLOCKSIZE);
+    chunked->back = chunked->blocks;
+    chunked->digests = (unsigned char*)malloc((size_t)chunked->blocks * 16);
+    chunked->crcs = (uint32_t*)malloc((size_t)chunked->blocks * sizeof(uint32_t));
+    if (chunked->digests == NULL || chunked->crcs == NULL) {
+        free(chunked->digests);
+        free(chunked->crcs);
+        free(chunked);
+        return NULL;
+    }
+
+    /* Without the CRC32, whole runs of blocks fit in the vector lanes. */
+    chunked->span = !(request->options & OPTION_CRC32) &&
+        Dispatch_kernel(DISPATCH_MD4_MULTI) == DISPATCH_AVX2 ? MD4_LANES : 1;
+    pthread_mutex_init(&chunked->progress, NULL);
+
+    return chunked;
+}
+
+/**
+ * Claims and hashes runs of blocks of a file split by SplitFile. The worker
+ * that opened the file claims them from the front until none are left, other
+ * workers steal a single run from the back. Whoever finishes the last run
+ * finishes the request. The engine must be locked, and is again on return.
+ * @param worker  The worker.
+ * @param chunked The file.
+ * @param steal   Non-zero to steal a single run from the back.
+ */
+static void WorkOnFile(EngineWorker* worker, EngineFile* chunked, char steal) {
+    HasherEngine* engine = worker->engine;
+    EngineBatch* batch = chunked->batch;
+    HashRequest* request = &batch->requests[chunked->index];
+    uint32_t first;
+    uint32_t count;
+
+    while (ClaimRun(engine, chunked, steal, &first, &count)) {
+        uint64_t length = 0;
+        uint64_t hashed;
+        int status;
+
+        ++chunked->running;
+        worker->current = batch;
+        pthread_mutex_unlock(&engine->lock);
+
+        pthread_setspecific(jobKey, batch);
+        status = HashRun(worker, chunked, first, count, &length);
+
+        pthread_mutex_lock(&engine->lock);
+        chunked->hashed += length;
+        hashed = chunked->hashed;
+        pthread_mutex_unlock(&engine->lock);
+
+        /* Every run is at least one block, or ten buffers, so report the
+         * progress after each one. */
+        if (status == 0 && batch->callback) {
+            pthread_mutex_lock(&chunked->progress);
+            if (hashed > chunked->reported) {
+                chunked->reported = hashed;
+                if (batch->callback(request->tag, hashed) != 0) {
+                    status = -9;
+                }
+            }
+            pthread_mutex_unlock(&chunked->progress);
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        worker->current = NULL;
+        --chunked->running;
+        if (status != 0 && chunked->status == 0) {
+            chunked->status = status;
+        }
+
+        /* Nobody claims anything after a failure. */
+        if (chunked->status != 0) {
+            chunked->back = chunked->front;
+            UnlistFile(engine, chunked);
+        }
+
+        if (chunked->running == 0 && chunked->front == chunked->back) {
+            uint32_t idx = chunked->index;
+
+            pthread_mutex_unlock(&engine->lock);
+            status = FinishFile(worker, chunked);
+            pthread_mutex_lock(&engine->lock);
+            FinishRequest(engine, batch, idx, status);
+            return;
+        }
+
+        if (steal) {
+            return;
+        }
+    }
+}
+
+/**
+ * Claims the next run of blocks of a file split by SplitFile, and takes the
+ * file off the list of the engine once its last run is claimed. The engine
+ * must be locked.
+ * @param  engine  The engine.
+ * @param  chunked The file.
+ * @param  steal   Non-zero to claim the run from the back of the file.
+ * @param  first   Receives the first block of the run.
+ * @param  count   Receives the number of blocks in the run.
+ * @return         Returns 1 if a run was claimed, 0 if none are left.
+ */
+static int ClaimRun(HasherEngine* engine, EngineFile* chunked, char steal,
+    uint32_t* first, uint32_t* count) {
+    char partial = chunked->size % BLOCKSIZE != 0;
+
+    if (chunked->front == chunked->back) {
+        return 0;
+    }
+
+    /* The vector lanes need equal lengths, so a short last block is always a
+     * run by itself. */
+    *count = chunked->back - chunked->front;
+    if (*count > chunked->span) {
+        *count = chunked->span;
+    }
+
+    if (steal) {
+        if (partial && chunked->back == chunked->blocks) {
+            *count = 1;
+        }
+        *first = chunked->back - *count;
+        chunked->back = *first;
+    } else {
+        if (*count > 1 && partial &&
+            chunked->front + *count == chunked->blocks) {
+            --*count;
+        }
+        *first = chunked->front;
+        chunked->front += *count;
+    }
+
+    if (chunked->front == chunked->back) {
+        UnlistFile(engine, chunked);
+    }
+
+    return 1;
+}
+
+/**
+ * Hashes a run of blocks of a file split by SplitFile into the worker's
+ * buffers, storing the MD4 and CRC32 of every block.
+ * @param  worker  The worker.
+ * @param  chunked The file.
+ * @param  first   The first block of the run.
+ * @param  count   The number of blocks in the run.
+ * @param  length  Receives the number of bytes hashed.
+ * @return         Returns 0 on success, -8 if a read failed, or NOT_HASHED if
+ *                 the file shrank since it was split.
+ */
+static int HashRun(EngineWorker* worker, EngineFile* chunked, uint32_t first,
+    uint32_t count, uint64_t* length) {
+    HashRequest* request = &chunked->batch->requests[chunked->index];
+    unsigned char result[56];
+    uint32_t block;
+    int status = 0;
+
+    if (count > 1 && worker->lanes == NULL) {
+        worker->lanes = (unsigned char*)malloc((size_t)MD4_LANES * BUFFERSIZE);
+    }
+
+    /* Full blocks are ten buffers long, read a buffer of each in turn. */
+    if (count > 1 && worker->lanes != NULL) {
+        const unsigned char* laneData[MD4_LANES];
+        MD4_MultiContext lanes;
+        uint32_t piece;
+        uint32_t lane;
+
+        MD4_multi_init(&lanes);
+        for (piece = 0; status == 0 && piece < 10; ++piece) {
+            for (lane = 0; lane < MD4_LANES; ++lane) {
+                laneData[lane] = &worker->lanes[(lane < count ? lane : 0) *
+                    BUFFERSIZE];
+                if (lane < count && status == 0) {
+                    status = ReadFully(chunked->file,
+                        &worker->lanes[lane * BUFFERSIZE], BUFFERSIZE,
+                        (uint64_t)(first + lane) * BLOCKSIZE +
+                        (uint64_t)piece * BUFFERSIZE);
+                }
+            }
+
+            if (status == 0) {
+                MD4_multi_update(&lanes, laneData, BUFFERSIZE);
+            }
+        }
+
+        for (lane = 0; status == 0 && lane < count; ++lane) {
+            MD4_multi_final(&lanes, lane, &chunked->digests[(first + lane) * 16]);
+        }
+
+        *length = (uint64_t)count * BLOCKSIZE;
+    } else {
+        for (block = first; status == 0 && block < first + count; ++block) {
+            uint64_t offset = (uint64_t)block * BLOCKSIZE;
+            uint64_t end = offset + BLOCKSIZE < chunked->size ?
+                offset + BLOCKSIZE : chunked->size;
+            Hashes_Context hashes;
+
+            Hashes_init(&hashes, request->options & (OPTION_ED2K | OPTION_CRC32));
+            while (status == 0 && offset < end) {
+                uint32_t used = end - offset < BUFFERSIZE ?
+                    (uint32_t)(end - offset) : BUFFERSIZE;
+
+                status = ReadFully(chunked->file, worker->buffer, used, offset);
+                if (status == 0) {
+                    Hashes_update(&hashes, worker->buffer, used);
+                    offset += used;
+                    *length += used;
+                }
+            }
+
+            /* Keep the CRC32 of the block as CRC32_final wrote it, which is
+             * what CRC32_combine takes. */
+            Hashes_final(&hashes, result);
+            memcpy(&chunked->digests[block * 16], result, 16);
+            chunked->crcs[block] = (uint32_t)result[16] << 24 |
+                (uint32_t)result[17] << 16 | (uint32_t)result[18] << 8 |
+                (uint32_t)result[19];
+        }
+    }
+
+    if (status == 0 && (request->options & OPTION_DROPBEHIND)) {
+        DropBehind(chunked->file, (uint64_t)first * BLOCKSIZE, *length);
+    }
+
+    return status;
+}
+
+/**
+ * Takes a file split by SplitFile off the list of files with runs left to
+ * claim, if it's still on it. The engine must be locked.
+ * @param engine  The engine.
+ * @param chunked The file.
+ */
+static void UnlistFile(HasherEngine* engine, EngineFile* chunked) {
+    EngineFile** link = &engine->files;
+
+    while (*link != NULL && *link != chunked) {
+        link = &(*link)->following;
+    }
+
+    if (*link == chunked) {
+        *link = chunked->following;
+        chunked->following = NULL;
+    }
+}
+
+/**
+ * Combines the hashes of the blocks of a file split by SplitFile into the
+ * result of its request once every run is finished, then closes and frees it.
+ * A file that shrank since it was split is hashed whole by HashOpenFile
+ * instead.
+ * @param  worker  The worker that finished the last run.
+ * @param  chunked The file.
+ * @return         Returns the status of the request.
+ */
+static int FinishFile(EngineWorker* worker, EngineFile* chunked) {
+    EngineBatch* batch = chunked->batch;
+    HashRequest* request = &batch->requests[chunked->index];
+    int status = chunked->status;
+    uint32_t block;
+
+    if (status == 0) {
+        if (batch->callback) {
+            batch->callback(request->tag, chunked->size);
+        }
+
+        /* Split files always have more than one block. */
+        if (request->options & OPTION_ED2K) {
+            MD4_Context ed2k;
+
+            MD4_init(&ed2k);
+            MD4_update(&ed2k, chunked->digests, chunked->blocks * 16);
+            MD4_final(&ed2k, &request->result[0]);
+        }
+
+        if (request->options & OPTION_CRC32) {
+            CRC32_Context crc32;
+            uint32_t crc = chunked->crcs[0];
+
+            for (block = 1; block < chunked->blocks; ++block) {
+                uint64_t offset = (uint64_t)block * BLOCKSIZE;
+                uint64_t length = chunked->size - offset < BLOCKSIZE ?
+                    chunked->size - offset : BLOCKSIZE;
+
+                crc = CRC32_combine(crc, chunked->crcs[block], length);
+            }
+
+            crc32.digest = crc ^ 0xFFFFFFFFL;
+            CRC32_final(&crc32, &request->result[16]);
+        }
+    }
+
+    /* The runs only use pread, so the file is still at its start. */
+    if (status == NOT_HASHED) {
+        status = HashOpenFile(request, chunked->file, batch->callback, 0,
+            worker->buffer);
+    } else {
+        close(chunked->file);
+    }
+
+    pthread_mutex_destroy(&chunked->progress);
+    free(chunked->digests);
+    free(chunked->crcs);
+    free(chunked);
+
+    return status;
+}
+
+/**
+ * Adds a batch to the end of the queue of an engine and wakes its workers. The
+ * engine must be locked.
+ * @param engine The engine.
+ * @param batch  The batch to queue.
+ */
+static void QueueBatch(HasherEngine* engine, EngineBatch* batch) {
+    batch->following = NULL;
+    if (engine->last) {
+        engine->last->following = batch;
+    } else {
+        engine->first = batch;
+    }
+    engine->last = batch;
+    pthread_cond_broadcast(&engine->queued);
+}
+
+/**
+ * Makes the completion descriptor of an engine readable, or drains it. The
+ * engine must be locked, which keeps the descriptor readable exactly while the
+ * completion queue isn't empty.
+ * @param engine  The engine.
+ * @param pending Non-zero when the completion queue just stopped being empty,
+ *                zero when it just became empty.
+ */
+static void SignalCompletions(HasherEngine* engine, char pending) {
+#if defined(__linux__)
+    uint64_t value = 1;
+    ssize_t result;
+
+    /* Reading an eventfd resets its counter to zero. */
+    if (pending) {
+        result = write(engine->writeFd, &value, sizeof(value));
+    } else {
+        result = read(engine->readFd, &value, sizeof(value));
+    }
+    (void)result;
+#else
+    char value = 1;
+    ssize_t result;
+
+    if (pending) {
+        result = write(engine->writeFd, &value, 1);
+    } else {
+        while ((result = read(engine->readFd, &value, 1)) > 0) {
+        }
+    }
+    (void)result;
+#endif
+}
+
+/**
+ * The progress callback of the jobs passed to SubmitHash, which cancels the
+ * job once CancelHash is called for it.
+ * @param  tag      The tag of the request.
+ * @param  progress The number of bytes hashed.
+ * @return          Returns non-zero if the job was cancelled.
+ */
+static int32_t JobProgress(int32_t tag, uint64_t progress) {
+    EngineBatch* job = (EngineBatch*)pthread_getspecific(jobKey);
+    return job != NULL && job->cancelled;
+}
+
+/**
+ * Creates the key holding the job of each engine worker.
+ */
+static void InitJobKey(void) {
+    pthread_key_create(&jobKey, NULL);
+}
+
+/**
+ * Thread entry point hashing the requests of a DeviceGroup. A group served by
+ * a single thread is hashed like HashFilesWithSyncIO, so its files are still
+ * prefetched and its small files hashed together. Otherwise every thread
+ * claims the next request of the group until none are left. Either way each
+ * file is hashed on the thread that claimed it, through a buffer of its own.
+ * @param  param The DeviceGroup.
+ * @return       Always returns NULL.
+ */
+static void* HashDeviceGroup(void* param) {
+    DeviceGroup* group = (DeviceGroup*)param;
+
+    /* Splitting a file across more threads would read it from several places
+     * at once, which is what the limit of the group is there to prevent.
+     * Without the buffer the files take the regular route. */
+    unsigned char* buffer = (unsigned char*)malloc(BUFFERSIZE);
+
+    if (group->threads <= 1) {
+        HashFileList(group->requests, group->results, group->count,
+            group->callback, buffer);
+        free(buffer);
+        return NULL;
+    }
+
+    while (1) {
+        uint32_t idx;
+        int status;
+        int file;
+
+        pthread_mutex_lock(&group->lock);
+        idx = group->next++;
+        pthread_mutex_unlock(&group->lock);
+        if (idx >= group->count) {
+            break;
+        }
+
+        status = OpenRequest(&group->requests[idx], &file);
+        if (status == 0) {
+            status = HashOpenFile(&group->requests[idx], file,
+                group->callback, 0, buffer);
+        }
+        group->results[idx] = status;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Finds the device holding the file of a request, and how many of its files
+ * should be read at once. Files that can't be found (which fail once they're
+ * hashed anyway) all go to device 0.
+ * @param request The HashRequest of the file.
+ * @param device  Receives the device.
+ * @param limit   Receives the number of files to read at once.
+ */
+static void FindDevice(HashRequest* request, dev_t* device, uint32_t* limit) {
+    struct stat filestats;
+    char* filename = NULL;
+
+    *device = 0;
+    *limit = 1;
+
+    ConvertWideToMultiByte(request->filename, &filename);
+    if (filename == NULL) {
+        return;
+    }
+
+    memset(&filestats, 0, sizeof(struct stat));
+    if (stat(filename, &filestats) != 0) {
+        free(filename);
+        return;
+    }
+    free(filename);
+
+    *device = filestats.st_dev;
+#if defined(__linux__)
+    ResolveDevice(device, limit);
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * Resolves a device number to the disk behind it through sysfs: a partition
+ * to its disk, and a md or dm device built on a single device (such as a
+ * logical volume on one disk) to that device, repeatedly. A device built on
+ * several others (such as a RAID array) is kept as it is. Devices that aren't
+ * in sysfs (such as network and btrfs mounts) are left alone.
+ * @param device The device to resolve, which receives the disk.
+ * @param limit  Receives the number of files to read at once: 1 per member
+ *               disk if it's rotational, otherwise the number of cores (up
+ *               to DEVICE_MAXTHREADS).
+ */
+static void ResolveDevice(dev_t* device, uint32_t* limit) {
+    char path[PATH_MAX];
+    char resolved[PATH_MAX];
+    char value[32];
+    uint32_t members = 1;
+    uint32_t depth;
+    unsigned int majorNumber;
+    unsigned int minorNumber;
+    long cpus;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+        major(*device), minor(*device));
+    if (realpath(path, resolved) == NULL) {
+        return;
+    }
+
+    for (depth = 0; depth < DEVICE_MAXDEPTH; ++depth) {
+        char slave[NAME_MAX + 1];
+        struct dirent* entry;
+        DIR* slaves;
+
+        /* Partitions share the queue of the disk they're on, which is the
+         * directory above them. */
+        if (snprintf(path, sizeof(path), "%s/partition", resolved) >=
+            (int)sizeof(path)) {
+            return;
+        }
+
+        if (access(path, F_OK) == 0) {
+            char* parent = strrchr(resolved, '/');
+            if (parent != NULL) {
+                *parent = '\0';
+            }
+        }
+
+        if (snprintf(path, sizeof(path), "%s/slaves", resolved) >=
+            (int)sizeof(path)) {
+            return;
+        }
+
+        slaves = opendir(path);
+        if (slaves == NULL) {
+            break;
+        }
+
+        members = 0;
+        while ((entry = readdir(slaves)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(slave, sizeof(slave), "%s", entry->d_name);
+                ++members;
+            }
+        }
+        closedir(slaves);
+
+        if (members != 1) {
+            break;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/slaves/%s", resolved, slave) >=
+            (int)sizeof(path) || realpath(path, resolved) == NULL) {
+            return;
+        }
+    }
+
+    if (members == 0) {
+        members = 1;
+    }
+
+    if (ReadSysfs(resolved, "dev", value, sizeof(value)) &&
+        sscanf(value, "%u:%u", &majorNumber, &minorNumber) == 2) {
+        *device = makedev(majorNumber, minorNumber);
+    }
+
+    /* md reports a rotational array when any of its members is. */
+    if (ReadSysfs(resolved, "queue/rotational", value, sizeof(value)) &&
+        value[0] == '1') {
+        *limit = members < DEVICE_MAXTHREADS ? members : DEVICE_MAXTHREADS;
+        return;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    *limit = cpus < 1 ? 1 :
+        cpus < DEVICE_MAXTHREADS ? (uint32_t)cpus : DEVICE_MAXTHREADS;
+}
+
+/**
+ * Reads the first line of a sysfs attribute of a device.
+ * @param  directory The sysfs directory of the device.
+ * @param  name      The name of the attribute.
+ * @param  value     Receives the value, without the newline.
+ * @param  size      The size of value.
+ * @return           Returns 1 on success, 0 if it can't be read.
+ */
+static int ReadSysfs(const char* directory, const char* name, char* value,
+    size_t size) {
+    char path[PATH_MAX];
+    ssize_t length;
+    int file;
+
+    if (snprintf(path, sizeof(path), "%s/%s", directory, name) >=
+        (int)sizeof(path)) {
+        return 0;
+    }
+
+    file = open(path, O_RDONLY);
+    if (file == -1) {
+        return 0;
+    }
+
+    length = read(file, value, size - 1);
+    close(file);
+    if (length <= 0) {
+        return 0;
+    }
+
+    value[length] = '\0';
+    value[strcspn(value, "\n")] = '\0';
+    return 1;
+}
+#endif
+
+/**
+ * Asks the kernel to start reading the beginning of a file into the page cache
+ * without waiting for it. The file is closed straight away, the pages it asked
+ * for are still read in.
+ * @param  request The HashRequest of the file.
+ * @param  budget  The most bytes to read.
+ * @return         The number of bytes requested, or 0 if the file can't be
+ *                 opened, isn't a regular file or bypasses the page cache.
+ */
+static uint64_t PrefetchFile(HashRequest* request, uint64_t budget) {
+    struct stat filestats;
+    char* filename = NULL;
+    uint64_t length;
+    int file;
+
+    if (request->filename == NULL ||
+        (request->options & (OPTION_DIRECTIO | OPTION_DROPBEHIND))) {
+        return 0;
+    }
+
+    ConvertWideToMultiByte(request->filename, &filename);
+    if (filename == NULL) {
+        return 0;
+    }
+
+    file = open(filename, O_RDONLY);
+    free(filename);
+    if (file == -1) {
+        return 0;
+    }
+
+    memset(&filestats, 0, sizeof(struct stat));
+    if (fstat(file, &filestats) != 0 || !S_ISREG(filestats.st_mode)) {
+        close(file);
+        return 0;
+    }
+
+    length = (uint64_t)filestats.st_size;
+    if (length > PREFETCH_LENGTH) {
+        length = PREFETCH_LENGTH;
+    }
+    if (length > budget) {
+        length = budget;
+    }
+
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(file, 0, (off_t)length, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice;
+    advice.ra_offset = 0;
+    advice.ra_count = (int)length;
+    fcntl(file, F_RDADVISE, &advice);
+#else
+    length = 0;
+#endif
+
+    close(file);
+    return length;
+}
+
+/**
+ * Gets the number of files HashFilesWithSyncIO prefetches ahead of the one
+ * being hashed, from the PREFETCH_ENVIRONMENT variable or PREFETCH_FILES if it
+ * isn't set or is invalid.
+ * @return The number of files, from 0 to PREFETCH_MAXFILES.
+ */
+static uint32_t PrefetchFiles(void) {
+    const char* value = getenv(PREFETCH_ENVIRONMENT);
+    char* end;
+    long files;
+
+    if (value == NULL) {
+        return PREFETCH_FILES;
+    }
+
+    files = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || files < 0 || files > PREFETCH_MAXFILES) {
+        return PREFETCH_FILES;
+    }
+
+    return (uint32_t)files;
+}
+
+/**
+ * Calculates the CRC32 of a file by splitting it into ranges that are hashed
+ * on separate threads and merged using CRC32_combine.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  threads  The number of ranges (and threads) to split the file into.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if no thread can be started or the file shrank
+ *                  while it was hashed.
+ */
+static int HashCRC32InParallel(int file, uint64_t size, uint32_t threads,
+    HashRequest* request, HashProgressCallback* callback) {
+    CRC32Job job;
+    CRC32Range ranges[PARALLEL_CRC32_THREADS];
+    uint64_t rangeLength;
+    uint64_t offset = 0;
+    uint32_t nextProgress = 1;
+    uint32_t count;
+    uint32_t started;
+    uint32_t idx;
+    int status;
+
+    memset(&job, 0, sizeof(CRC32Job));
+    job.file = file;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.progressed, NULL);
+
+    /* Split the file into equal ranges rounded up to a multiple of the buffer
+     * size, so every read except the last one of the file is a full buffer. */
+    rangeLength = (size + threads - 1) / threads;
+    rangeLength = (rangeLength + BUFFERSIZE - 1) / BUFFERSIZE * BUFFERSIZE;
+
+    for (count = 0; count < threads && offset < size; ++count) {
+        ranges[count].job = &job;
+        ranges[count].offset = offset;
+        ranges[count].length =
+            size - offset < rangeLength ? size - offset : rangeLength;
+        CRC32_init(&ranges[count].crc32);
+        offset += ranges[count].length;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    for (started = 0; started < count; ++started) {
+        if (pthread_create(&ranges[started].thread, NULL,
+            HashCRC32Range, &ranges[started]) != 0) {
+            break;
+        }
+
+        ++job.running;
+    }
+
+    if (started == 0) {
+        pthread_mutex_unlock(&job.lock);
+        pthread_cond_destroy(&job.progressed);
+        pthread_mutex_destroy(&job.lock);
+        return NOT_HASHED;
+    }
+
+    /* Hash the ranges that didn't get a thread on this one. Their progress is
+     * reported once they're done. */
+    for (idx = started; idx < count; ++idx) {
+        ++job.running;
+        pthread_mutex_unlock(&job.lock);
+        HashCRC32Range(&ranges[idx]);
+        pthread_mutex_lock(&job.lock);
+    }
+
+    /* Report progress and handle cancellation from this thread, so the
+     * callback is never invoked from one of the worker threads. The callback
+     * is called on the same schedule as the sequential loop (every tenth
+     * buffer) and without holding the lock. */
+    while (job.running > 0) {
+        pthread_cond_wait(&job.progressed, &job.lock);
+
+        if (callback && job.status == 0 && job.buffersRead >= nextProgress) {
+            uint64_t bytesRead = job.bytesRead;
+            nextProgress = (job.buffersRead / 10) * 10 + 11;
+
+            pthread_mutex_unlock(&job.lock);
+            int32_t cancel = callback(request->tag, bytesRead);
+            pthread_mutex_lock(&job.lock);
+
+            if (cancel != 0 && job.status == 0) {
+                job.status = -9;
+            }
+        }
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    for (idx = 0; idx < started; ++idx) {
+        pthread_join(ranges[idx].thread, NULL);
+    }
+
+    status = job.status;
+    pthread_cond_destroy(&job.progressed);
+    pthread_mutex_destroy(&job.lock);
+
+    if (status != 0) {
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, job.bytesRead);
+    }
+
+    /* Merge the CRC of each range, in order, into the CRC of the first. */
+    uint32_t crc = ranges[0].crc32.digest ^ 0xFFFFFFFFL;
+    for (idx = 1; idx < count; ++idx) {
+        crc = CRC32_combine(
+            crc, ranges[idx].crc32.digest ^ 0xFFFFFFFFL, ranges[idx].length);
+    }
+
+    ranges[0].crc32.digest = crc ^ 0xFFFFFFFFL;
+    CRC32_final(&ranges[0].crc32, &request->result[16]);
+
+    return 0;
+}
+
+/**
+ * Thread entry point hashing a single CRC32Range.
+ * @param  param The CRC32Range to hash.
+ * @return       Always returns NULL.
+ */
+static void* HashCRC32Range(void* param) {
+    CRC32Range* range = (CRC32Range*)param;
+    CRC32Job* job = range->job;
+    uint64_t position = 0;
+    int status = 0;
+
+    unsigned char* fileData = (unsigned char*)malloc(BUFFERSIZE);
+    if (fileData == NULL) {
+        status = -7;
+    }
+
+    while (status == 0 && position < range->length) {
+        uint64_t remaining = range->length - position;
+        ssize_t bytesRead = pread(job->file, fileData,
+            remaining < BUFFERSIZE ? remaining : BUFFERSIZE,
+            range->offset + position);
+
+        if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+
+            status = -8;
+            break;
+        }
+
+        /* The file was truncated while we were hashing it. The ranges after
+         * this one may have been read in full already, so their CRCs can't be
+         * combined with this one. Leave the file to the read loop. */
+        if (bytesRead == 0) {
+            status = NOT_HASHED;
+            break;
+        }
+
+        CRC32_update(&range->crc32, fileData, (uint32_t)bytesRead);
+        position += bytesRead;
+
+        pthread_mutex_lock(&job->lock);
+        job->bytesRead += bytesRead;
+        ++job->buffersRead;
+        status = job->status;
+        pthread_cond_signal(&job->progressed);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    free(fileData);
+
+    pthread_mutex_lock(&job->lock);
+    if (status != 0 && job->status == 0) {
+        job->status = status;
+    }
+
+    --job->running;
+    pthread_cond_signal(&job->progressed);
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * Calculates the ED2k hash of a file by hashing up to MD4_LANES blocks at once
+ * with MD4_multi_update. Each pass reads the next buffer of every block in the
+ * group before hashing them together.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file. Must be larger than BLOCKSIZE.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file shrank while it was hashed.
+ */
+static int HashED2kInLanes(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback) {
+    MD4_Context ed2k;
+    MD4_MultiContext lanes;
+    const unsigned char* laneData[MD4_LANES];
+    uint64_t totalBytesRead = 0;
+    uint64_t offset;
+    uint32_t progressLoopCount = 0;
+    uint32_t fullBlocks = (uint32_t)(size / BLOCKSIZE);
+    uint32_t tailLength = (uint32_t)(size % BLOCKSIZE);
+    uint32_t ed2kBlocks = fullBlocks + (tailLength > 0 ? 1 : 0);
+    uint32_t ed2kHashLength = ed2kBlocks * 16;
+    uint32_t block;
+    uint32_t used;
+    uint32_t piece;
+    uint32_t lane;
+    int status = 0;
+
+    unsigned char* ed2kHashes = (unsigned char*)malloc(ed2kHashLength);
+    if (ed2kHashes == NULL) {
+        return -6;
+    }
+
+    unsigned char* fileData = (unsigned char*)malloc(MD4_LANES * BUFFERSIZE);
+    if (fileData == NULL) {
+        free(ed2kHashes);
+        return -7;
+    }
+
+    /* Hash the full blocks in groups of up to MD4_LANES. Every block is
+     * exactly ten buffers long, so the lanes always stay the same length. */
+    for (block = 0; status == 0 && block < fullBlocks; block += used) {
+        used = fullBlocks - block < MD4_LANES ? fullBlocks - block : MD4_LANES;
+        MD4_multi_init(&lanes);
+
+        for (piece = 0; status == 0 && piece < 10; ++piece) {
+            for (lane = 0; lane < MD4_LANES; ++lane) {
+                if (lane >= used) {
+                    laneData[lane] = laneData[0];
+                    continue;
+                }
+
+                offset = (uint64_t)(block + lane) * BLOCKSIZE +
+                    (uint64_t)piece * BUFFERSIZE;
+                laneData[lane] = &fileData[lane * BUFFERSIZE];
+                status = ReadFully(file, &fileData[lane * BUFFERSIZE],
+                    BUFFERSIZE, offset);
+                if (status != 0) {
+                    break;
+                }
+
+                totalBytesRead += BUFFERSIZE;
+                if (callback && progressLoopCount % 10 == 0 &&
+                    callback(request->tag, totalBytesRead) != 0) {
+                    status = -9;
+                    break;
+                }
+                progressLoopCount++;
+            }
+
+            if (status == 0) {
+                MD4_multi_update(&lanes, laneData, BUFFERSIZE);
+            }
+        }
+
+        for (lane = 0; status == 0 && lane < used; ++lane) {
+            MD4_multi_final(&lanes, lane, &ed2kHashes[(block + lane) * 16]);
+        }
+    }
+
+    /* The last block is shorter than the rest so it's hashed on its own. */
+    if (status == 0 && tailLength > 0) {
+        MD4_init(&ed2k);
+        for (offset = 0; status == 0 && offset < tailLength; offset += used) {
+            used = tailLength - offset < BUFFERSIZE ?
+                (uint32_t)(tailLength - offset) : BUFFERSIZE;
+            status = ReadFully(file, fileData, used,
+                (uint64_t)fullBlocks * BLOCKSIZE + offset);
+            if (status != 0) {
+                break;
+            }
+
+            totalBytesRead += used;
+            if (callback && progressLoopCount % 10 == 0 &&
+                callback(request->tag, totalBytesRead) != 0) {
+                status = -9;
+                break;
+            }
+            progressLoopCount++;
+
+            MD4_update(&ed2k, fileData, used);
+        }
+
+        if (status == 0) {
+            MD4_final(&ed2k, &ed2kHashes[fullBlocks * 16]);
+        }
+    }
+
+    free(fileData);
+    if (status != 0) {
+        free(ed2kHashes);
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    MD4_init(&ed2k);
+    MD4_update(&ed2k, ed2kHashes, ed2kHashLength);
+    MD4_final(&ed2k, &request->result[0]);
+    free(ed2kHashes);
+
+    return 0;
+}
+
+/**
+ * Hashes a file while a separate thread reads it ahead into a ring of
+ * READER_BUFFERS buffers.
+ * @param  file     The open file to hash.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the thread can't be started.
+ */
+static int HashFileWithReader(int file, HashRequest* request,
+    HashProgressCallback* callback) {
+    Hashes_Context hashes;
+    ReaderJob job;
+    pthread_t thread;
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    int status = 0;
+
+    memset(&job, 0, sizeof(ReaderJob));
+    job.file = file;
+    job.ring = (unsigned char*)malloc((size_t)READER_BUFFERS * BUFFERSIZE);
+    if (job.ring == NULL) {
+        return -7;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.filled, NULL);
+    pthread_cond_init(&job.emptied, NULL);
+
+    if (pthread_create(&thread, NULL, ReadIntoRing, &job) != 0) {
+        pthread_cond_destroy(&job.emptied);
+        pthread_cond_destroy(&job.filled);
+        pthread_mutex_destroy(&job.lock);
+        free(job.ring);
+        return NOT_HASHED;
+    }
+
+    Hashes_init(&hashes, request->options);
+
+    pthread_mutex_lock(&job.lock);
+    while (1) {
+        /* Wait for the next buffer. The buffers read before a failure are
+         * still hashed first, just like the read loop would have. */
+        while (job.hashed == job.read && !job.finished) {
+            pthread_cond_wait(&job.filled, &job.lock);
+        }
+
+        if (job.hashed == job.read) {
+            status = job.status;
+            break;
+        }
+
+        uint32_t slot = (uint32_t)(job.hashed % READER_BUFFERS);
+        uint32_t length = job.lengths[slot];
+
+        /* The reader never touches a filled slot, so hash it unlocked. */
+        pthread_mutex_unlock(&job.lock);
+
+        totalBytesRead += length;
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, totalBytesRead) != 0) {
+            pthread_mutex_lock(&job.lock);
+            status = -9;
+            break;
+        }
+        progressLoopCount++;
+
+        Hashes_update(&hashes, &job.ring[(size_t)slot * BUFFERSIZE], length);
+        if (request->options & (OPTION_DIRECTIO | OPTION_DROPBEHIND)) {
+            DropBehind(file, totalBytesRead - length, length);
+        }
+
+        pthread_mutex_lock(&job.lock);
+        ++job.hashed;
+        pthread_cond_signal(&job.emptied);
+    }
+
+    /* Stop the reader if we're leaving early. It finishes the read it's in
+     * the middle of first. */
+    job.stop = 1;
+    pthread_cond_signal(&job.emptied);
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&job.emptied);
+    pthread_cond_destroy(&job.filled);
+    pthread_mutex_destroy(&job.lock);
+    free(job.ring);
+
+    if (status != 0) {
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
+
+/**
+ * Thread entry point reading a file into the ring of a ReaderJob.
+ * @param  param The ReaderJob to read.
+ * @return       Always returns NULL.
+ */
+static void* ReadIntoRing(void* param) {
+    ReaderJob* job = (ReaderJob*)param;
+    uint64_t next = 0;
+    int status = 0;
+
+    while (1) {
+        /* Wait for a free slot. */
+        pthread_mutex_lock(&job->lock);
+        while (next - job->hashed == READER_BUFFERS && !job->stop) {
+            pthread_cond_wait(&job->emptied, &job->lock);
+        }
+
+        char stop = job->stop;
+        pthread_mutex_unlock(&job->lock);
+        if (stop) {
+            break;
+        }
+
+        uint32_t slot = (uint32_t)(next % READER_BUFFERS);
+        ssize_t bytesRead = read(
+            job->file, &job->ring[(size_t)slot * BUFFERSIZE], BUFFERSIZE);
+
+        if (bytesRead == -1) {
+            /* We should never get EAGAIN, but handle it anyway. */
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+
+            status = -8;
+            break;
+        }
+
+        if (bytesRead == 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->lengths[slot] = (uint32_t)bytesRead;
+        job->read = ++next;
+        pthread_cond_signal(&job->filled);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->status = status;
+    job->finished = 1;
+    pthread_cond_signal(&job->filled);
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * Checks whether a file requesting the given hashes should be hashed by
+ * HashFilePipelined, from the number of hashes requested, the number of cores
+ * and the PIPELINE_ENVIRONMENT variable ("0" never, "1" always).
+ * @param  options The options of the request.
+ * @return         Returns non-zero to hash the file with HashFilePipelined.
+ */
+static int UsePipeline(uint32_t options) {
+    const char* value = getenv(PIPELINE_ENVIRONMENT);
+    uint32_t hashes = 0;
+    uint32_t idx;
+
+    for (idx = 0; idx < 4; ++idx) {
+        if (options & (OPTION_ED2K << idx)) {
+            ++hashes;
+        }
+    }
+
+    if (hashes < 2) {
+        return 0;
+    }
+
+    if (value != NULL && strcmp(value, "0") == 0) {
+        return 0;
+    }
+
+    if (value != NULL && strcmp(value, "1") == 0) {
+        return 1;
+    }
+
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+/**
+ * Hashes a file by reading it into a ring of PIPELINE_BUFFERS buffers on the
+ * calling thread, while a separate thread per requested hash updates it from
+ * every buffer. A buffer is read again once every thread is done with it.
+ * @param  file     The open file to hash.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the threads can't be started.
+ */
+static int HashFilePipelined(int file, HashRequest* request,
+    HashProgressCallback* callback) {
+    PipelineJob job;
+    PipelineConsumer consumers[4];
+    unsigned char result[56];
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    uint32_t started = 0;
+    uint32_t idx;
+    uint64_t next = 0;
+    int status = 0;
+
+    memset(&job, 0, sizeof(PipelineJob));
+    job.file = file;
+    job.dropBehind = (request->options & OPTION_DROPBEHIND) != 0;
+    job.ring = (unsigned char*)malloc((size_t)PIPELINE_BUFFERS * BUFFERSIZE);
+    if (job.ring == NULL) {
+        return -7;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.filled, NULL);
+    pthread_cond_init(&job.emptied, NULL);
+
+    /* One consumer per requested hash, each with a Hashes_Context of its own
+     * that only calculates that hash. */
+    for (idx = 0; idx < 4; ++idx) {
+        uint32_t option = OPTION_ED2K << idx;
+
+        if (!(request->options & option)) {
+            continue;
+        }
+
+        consumers[started].job = &job;
+        Hashes_init(&consumers[started].hashes, option);
+        if (pthread_create(&consumers[started].thread, NULL,
+            HashPipelineBuffers, &consumers[started]) != 0) {
+            status = NOT_HASHED;
+            break;
+        }
+
+        ++started;
+    }
+    job.consumers = started;
+
+    while (status == 0) {
+        uint32_t slot = (uint32_t)(next % PIPELINE_BUFFERS);
+        ssize_t bytesRead;
+
+        /* Wait until every consumer is done with the slot. */
+        pthread_mutex_lock(&job.lock);
+        while (job.references[slot] > 0) {
+            pthread_cond_wait(&job.emptied, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+
+        bytesRead = read(file, &job.ring[(size_t)slot * BUFFERSIZE], BUFFERSIZE);
+        if (bytesRead == -1) {
+            /* We should never get EAGAIN, but handle it anyway. */
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+
+            status = -8;
+            break;
+        }
+
+        if (bytesRead == 0) {
+            break;
+        }
+
+        totalBytesRead += bytesRead;
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, totalBytesRead) != 0) {
+            status = -9;
+            break;
+        }
+        progressLoopCount++;
+
+        pthread_mutex_lock(&job.lock);
+        job.lengths[slot] = (uint32_t)bytesRead;
+        job.offsets[slot] = totalBytesRead - bytesRead;
+        job.references[slot] = job.consumers;
+        job.read = ++next;
+        pthread_cond_broadcast(&job.filled);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    /* The consumers finish the buffers already read, unless we're leaving
+     * early. */
+    pthread_mutex_lock(&job.lock);
+    if (status != 0) {
+        job.stop = 1;
+    }
+    job.finished = 1;
+    pthread_cond_broadcast(&job.filled);
+    pthread_mutex_unlock(&job.lock);
+
+    for (idx = 0; idx < started; ++idx) {
+        pthread_join(consumers[idx].thread, NULL);
+    }
+
+    pthread_cond_destroy(&job.emptied);
+    pthread_cond_destroy(&job.filled);
+    pthread_mutex_destroy(&job.lock);
+    free(job.ring);
+
+    if (status != 0) {
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    /* Every consumer leaves the hashes it didn't calculate at zero, so the
+     * results can just be merged. */
+    for (idx = 0; idx < started; ++idx) {
+        uint32_t byte;
+
+        Hashes_final(&consumers[idx].hashes, result);
+        for (byte = 0; byte < 56; ++byte) {
+            request->result[byte] |= result[byte];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Thread entry point updating the hash of a PipelineConsumer from every
+ * buffer of its PipelineJob, in file order.
+ * @param  param The PipelineConsumer.
+ * @return       Always returns NULL.
+ */
+static void* HashPipelineBuffers(void* param) {
+    PipelineConsumer* consumer = (PipelineConsumer*)param;
+    PipelineJob* job = consumer->job;
+    uint64_t next = 0;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (next == job->read && !job->finished && !job->stop) {
+            pthread_cond_wait(&job->filled, &job->lock);
+        }
+
+        if (job->stop || next == job->read) {
+            break;
+        }
+
+        uint32_t slot = (uint32_t)(next % PIPELINE_BUFFERS);
+        uint32_t length = job->lengths[slot];
+        uint64_t offset = job->offsets[slot];
+
+        /* The reader never touches a slot that's still referenced, so hash it
+         * unlocked. */
+        pthread_mutex_unlock(&job->lock);
+        Hashes_update(&consumer->hashes,
+            &job->ring[(size_t)slot * BUFFERSIZE], length);
+        pthread_mutex_lock(&job->lock);
+
+        ++next;
+        if (--job->references[slot] == 0) {
+            pthread_cond_signal(&job->emptied);
+
+            /* The last consumer done with a buffer drops it from the cache. */
+            if (job->dropBehind) {
+                pthread_mutex_unlock(&job->lock);
+                DropBehind(job->file, offset, length);
+                pthread_mutex_lock(&job->lock);
+            }
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * Hashes a file on a high latency mount by keeping depth reads in flight
+ * from a pool of stripe threads.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  stripes  The number of stripe threads.
+ * @param  depth    The number of buffers in the reorder ring.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if no thread can be started or the file shrank
+ *                  while it was hashed.
+ */
+static int HashFileStriped(int file, uint64_t size, uint32_t stripes,
+    uint32_t depth, HashRequest* request, HashProgressCallback* callback) {
+    Hashes_Context hashes;
+    StripeJob job;
+    pthread_t threads[NETWORK_MAXSTRIPES];
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    uint32_t started;
+    uint32_t idx;
+    int status;
+
+    memset(&job, 0, sizeof(StripeJob));
+    job.file = file;
+    job.size = size;
+    job.buffers = (size + BUFFERSIZE - 1) / BUFFERSIZE;
+    job.depth = job.buffers < depth ? (uint32_t)job.buffers : depth;
+    if (stripes > job.depth) {
+        stripes = job.depth;
+    }
+
+    job.ring = (unsigned char*)malloc((size_t)job.depth * BUFFERSIZE);
+    if (job.ring == NULL) {
+        return -7;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.filled, NULL);
+    pthread_cond_init(&job.emptied, NULL);
+
+    for (started = 0; started < stripes; ++started) {
+        if (pthread_create(&threads[started], NULL, ReadStripes, &job) != 0) {
+            break;
+        }
+    }
+
+    if (started == 0) {
+        pthread_cond_destroy(&job.emptied);
+        pthread_cond_destroy(&job.filled);
+        pthread_mutex_destroy(&job.lock);
+        free(job.ring);
+        return NOT_HASHED;
+    }
+
+    Hashes_init(&hashes, request->options);
+
+    pthread_mutex_lock(&job.lock);
+    while (job.hashed < job.buffers) {
+        uint32_t slot = (uint32_t)(job.hashed % job.depth);
+        uint64_t offset = job.hashed * BUFFERSIZE;
+        uint32_t length = size - offset < BUFFERSIZE ?
+            (uint32_t)(size - offset) : BUFFERSIZE;
+
+        /* Wait for the next buffer in file order. The ones after it that
+         * arrive first stay in their slots until it's their turn. */
+        while (!job.ready[slot] && job.status == 0) {
+            pthread_cond_wait(&job.filled, &job.lock);
+        }
+
+        if (job.status != 0) {
+            break;
+        }
+
+        /* No stripe thread touches a ready slot, so hash it unlocked. */
+        pthread_mutex_unlock(&job.lock);
+
+        totalBytesRead += length;
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, totalBytesRead) != 0) {
+            pthread_mutex_lock(&job.lock);
+            job.status = -9;
+            break;
+        }
+        progressLoopCount++;
+
+        Hashes_update(&hashes, &job.ring[(size_t)slot * BUFFERSIZE], length);
+        if (request->options & (OPTION_DIRECTIO | OPTION_DROPBEHIND)) {
+            DropBehind(file, offset, length);
+        }
+
+        pthread_mutex_lock(&job.lock);
+        job.ready[slot] = 0;
+        ++job.hashed;
+        pthread_cond_broadcast(&job.emptied);
+    }
+
+    /* Stop the stripe threads if we're leaving early. Each finishes the read
+     * it's in the middle of first. */
+    status = job.status;
+    job.stop = 1;
+    pthread_cond_broadcast(&job.emptied);
+    pthread_mutex_unlock(&job.lock);
+
+    for (idx = 0; idx < started; ++idx) {
+        pthread_join(threads[idx], NULL);
+    }
+
+    pthread_cond_destroy(&job.emptied);
+    pthread_cond_destroy(&job.filled);
+    pthread_mutex_destroy(&job.lock);
+    free(job.ring);
+
+    if (status != 0) {
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
+
+/**
+ * Thread entry point reading the buffers of a StripeJob.
+ * @param  param The StripeJob to read.
+ * @return       Always returns NULL.
+ */
+static void* ReadStripes(void* param) {
+    StripeJob* job = (StripeJob*)param;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        /* Claim the next buffer once its slot is free. */
+        while (!job->stop && job->status == 0 && job->next < job->buffers &&
+            job->next - job->hashed >= job->depth) {
+            pthread_cond_wait(&job->emptied, &job->lock);
+        }
+
+        if (job->stop || job->status != 0 || job->next >= job->buffers) {
+            break;
+        }
+
+        uint64_t offset = job->next * BUFFERSIZE;
+        uint32_t slot = (uint32_t)(job->next % job->depth);
+        uint32_t length = job->size - offset < BUFFERSIZE ?
+            (uint32_t)(job->size - offset) : BUFFERSIZE;
+        ++job->next;
+        pthread_mutex_unlock(&job->lock);
+
+        int status = ReadFully(job->file,
+            &job->ring[(size_t)slot * BUFFERSIZE], length, offset);
+
+        pthread_mutex_lock(&job->lock);
+        if (status != 0 && job->status == 0) {
+            job->status = status;
+        }
+
+        job->ready[slot] = 1;
+        pthread_cond_signal(&job->filled);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/**
+ * Checks whether a file is on a network file system.
+ * @param  file The open file to check.
+ * @return      Returns 1 if it is, or 0 if not or it can't be determined.
+ */
+static int IsNetworkFile(int file) {
+    struct statfs fsstats;
+
+    if (fstatfs(file, &fsstats) != 0) {
+        return 0;
+    }
+
+#if defined(__APPLE__)
+    return strcmp(fsstats.f_fstypename, "nfs") == 0 ||
+        strcmp(fsstats.f_fstypename, "smbfs") == 0 ||
+        strcmp(fsstats.f_fstypename, "afpfs") == 0 ||
+        strcmp(fsstats.f_fstypename, "webdav") == 0;
+#else
+    /* The magic numbers of NFS, SMB, CIFS, SMB2, AFS, Ceph and 9P. */
+    switch ((uint32_t)fsstats.f_type) {
+    case 0x6969:
+    case 0x517B:
+    case 0xFF534D42:
+    case 0xFE534D42:
+    case 0x5346414F:
+    case 0x00C36400:
+    case 0x01021997:
+        return 1;
+    default:
+        return 0;
+    }
+#endif
+}
+
+/**
+ * Gets the number of stripe threads and the reorder depth for a file.
+ * @param filestats The stats of the open file.
+ * @param stripes   Receives the number of stripes.
+ * @param depth     Receives the depth.
+ */
+static void StripeSettings(const struct stat* filestats, uint32_t* stripes,
+    uint32_t* depth) {
+    const char* entry = getenv(NETWORK_ENVIRONMENT);
+    char path[1024];
+
+    *stripes = NETWORK_STRIPES;
+    *depth = NETWORK_DEPTH;
+
+    /* An entry for the mount of the file wins over one without a path. */
+    while (entry != NULL && *entry != '\0') {
+        const char* end = strchr(entry, ';');
+        const char* settings = entry;
+        const char* equals = NULL;
+        const char* scan;
+        size_t length = end != NULL ? (size_t)(end - entry) : strlen(entry);
+        char* parsed;
+        int matches = 1;
+
+        /* Paths may contain '=', the settings can't. */
+        for (scan = entry; scan < entry + length; ++scan) {
+            if (*scan == '=') {
+                equals = scan;
+            }
+        }
+
+        if (equals != NULL) {
+            struct stat mountstats;
+            size_t pathLength = (size_t)(equals - entry);
+
+            settings = equals + 1;
+            matches = 2;
+            if (pathLength >= sizeof(path)) {
+                matches = 0;
+            } else {
+                memcpy(path, entry, pathLength);
+                path[pathLength] = '\0';
+                if (stat(path, &mountstats) != 0 ||
+                    mountstats.st_dev != filestats->st_dev) {
+                    matches = 0;
+                }
+            }
+        }
+
+        long width = strtol(settings, &parsed, 10);
+        long slots = 0;
+        if (parsed != settings && *parsed == 'x') {
+            const char* depthValue = parsed + 1;
+            slots = strtol(depthValue, &parsed, 10);
+            if (parsed == depthValue) {
+                slots = 0;
+            }
+        }
+
+        if (matches != 0 && parsed == entry + length && width >= 1 &&
+            width <= NETWORK_MAXSTRIPES && slots >= 1 &&
+            slots <= NETWORK_MAXDEPTH) {
+            *stripes = (uint32_t)width;
+            *depth = (uint32_t)(slots < width ? width : slots);
+            if (matches == 2) {
+                break;
+            }
+        }
+
+        entry = end != NULL ? end + 1 : NULL;
+    }
+}
+
+#if defined(__linux__)
+/**
+ * Hashes a file by keeping QueueDepth() reads into registered buffers in
+ * flight through io_uring, and hashing the buffers in file order as they
+ * complete.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if io_uring can't be used or the file shrank
+ *                  while it was hashed.
+ */
+static int HashFileWithUring(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback) {
+    Uring ring;
+    Hashes_Context hashes;
+    struct iovec buffers[QUEUE_MAXDEPTH];
+    int32_t results[QUEUE_MAXDEPTH];
+    char completed[QUEUE_MAXDEPTH];
+    uint64_t buffersTotal = (size + BUFFERSIZE - 1) / BUFFERSIZE;
+    uint64_t issued = 0;
+    uint64_t next = 0;
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    uint32_t inFlight = 0;
+    uint32_t depth = QueueDepth();
+    uint32_t slot;
+    uint64_t tag;
+    int32_t result;
+    int status = 0;
+
+    if (depth > buffersTotal) {
+        depth = (uint32_t)buffersTotal;
+    }
+
+    unsigned char* fileData = (unsigned char*)malloc((size_t)depth * BUFFERSIZE);
+    if (fileData == NULL) {
+        return -7;
+    }
+
+    /* Registering the buffers saves the kernel from mapping them for every
+     * read. Either call fails when io_uring is missing, disabled or the
+     * buffers exceed the locked memory limit. */
+    for (slot = 0; slot < depth; ++slot) {
+        buffers[slot].iov_base = &fileData[(size_t)slot * BUFFERSIZE];
+        buffers[slot].iov_len = BUFFERSIZE;
+    }
+
+    if (Uring_init(&ring, depth) != 0) {
+        free(fileData);
+        return NOT_HASHED;
+    }
+
+    if (Uring_register_buffers(&ring, buffers, depth) != 0) {
+        Uring_close(&ring);
+        free(fileData);
+        return NOT_HASHED;
+    }
+
+    Hashes_init(&hashes, request->options);
+
+    while (status == 0 && next < buffersTotal) {
+        uint64_t offset = next * BUFFERSIZE;
+        uint32_t length = size - offset < BUFFERSIZE ?
+            (uint32_t)(size - offset) : BUFFERSIZE;
+
+        /* Keep the queue full. Buffer n of the file is always read into slot
+         * n % depth, which frees up as soon as buffer n - depth is hashed. */
+        while (issued < buffersTotal && issued < next + depth) {
+            uint64_t issueOffset = issued * BUFFERSIZE;
+            slot = (uint32_t)(issued % depth);
+            completed[slot] = 0;
+            if (Uring_read_fixed(&ring, file, buffers[slot].iov_base,
+                size - issueOffset < BUFFERSIZE ?
+                    (uint32_t)(size - issueOffset) : BUFFERSIZE,
+                issueOffset, slot, slot) != 0) {
+                status = -8;
+                break;
+            }
+            ++issued;
+            ++inFlight;
+        }
+
+        /* Wait for the next buffer in file order, collecting whichever reads
+         * complete in the meantime. */
+        slot = (uint32_t)(next % depth);
+        while (status == 0 && !completed[slot]) {
+            if (Uring_submit(&ring, 1) != 0) {
+                status = -8;
+                break;
+            }
+
+            while (Uring_complete(&ring, &tag, &result)) {
+                completed[tag] = 1;
+                results[tag] = result;
+                --inFlight;
+            }
+        }
+
+        if (status != 0) {
+            break;
+        }
+
+        result = results[slot];
+        if (result == -EAGAIN || result == -EINTR) {
+            /* Try the same read again. */
+            completed[slot] = 0;
+            if (Uring_read_fixed(&ring, file, buffers[slot].iov_base, length,
+                offset, slot, slot) != 0) {
+                status = -8;
+                break;
+            }
+            ++inFlight;
+            continue;
+        }
+
+        if (result < 0) {
+            status = -8;
+            break;
+        }
+
+        /* Finish a short read synchronously. If the file shrank, that hands it
+         * back to the read loop. */
+        if ((uint32_t)result < length) {
+            status = ReadFully(file, (unsigned char*)buffers[slot].iov_base + result,
+                length - result, offset + result);
+            if (status != 0) {
+                break;
+            }
+        }
+
+        totalBytesRead += length;
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, totalBytesRead) != 0) {
+            status = -9;
+            break;
+        }
+        progressLoopCount++;
+
+        Hashes_update(&hashes, buffers[slot].iov_base, length);
+        if (request->options & (OPTION_DIRECTIO | OPTION_DROPBEHIND)) {
+            DropBehind(file, offset, length);
+        }
+        ++next;
+    }
+
+    /* The kernel writes to the buffers until the reads complete, so wait for
+     * the ones still in flight before freeing them. */
+    while (inFlight > 0 && Uring_submit(&ring, 1) == 0) {
+        while (Uring_complete(&ring, &tag, &result)) {
+            --inFlight;
+        }
+    }
+
+    /* If the wait failed, reads may still land in the buffers after the ring
+     * is closed. Leak them rather than hand them back to malloc. */
+    Uring_close(&ring);
+    if (inFlight == 0) {
+        free(fileData);
+    } else if (status == 0 || status == NOT_HASHED) {
+        status = -8;
+    }
+
+    if (status != 0) {
+        return status;
+    }
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
 
 /**
- * Converts a wide char array string to a UTF-8 char array string using the
- * C locale.
- * @param input  The input wide char array to convert.
- * @param output The converted output. Can be NULL if the function failed in
- *               any way.
+ * Gets the number of reads HashFileWithUring keeps in flight.
+ * @return The queue depth, from 1 to QUEUE_MAXDEPTH.
  */
-static void ConvertWideToMultiByte(wchar_t* input, char** output);
+static uint32_t QueueDepth(void) {
+    const char* value = getenv(QUEUE_ENVIRONMENT);
+    char* end;
+    long depth;
+
+    if (value == NULL) {
+        return QUEUE_DEPTH;
+    }
+
+    depth = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || depth < 1 || depth > QUEUE_MAXDEPTH) {
+        return QUEUE_DEPTH;
+    }
+
+    return (uint32_t)depth;
+}
+#endif
 
 /**
- * Accepts a HashRequest structure and attempts to calculate the requested hash
- * of the provided file using synchronous IO.
- * @param  request  The HashRequest containing the options and the file that
- *                  should be hashed.
- * @param  callback An optional callback parameter that will receive the total
- *                  number of bytes processed by the hashing algorithm and
- *                  provides the caller a chance to cancel the hash if desired.
- * @return          See the header file for return information.
+ * Tells the kernel a range of a file that was just hashed won't be needed
+ * again, along with the DROPBEHIND_WINDOW bytes before it. Linux skips pages
+ * that were read so recently they aren't on its LRU lists yet, and while
+ * other readers keep the cache busy that can be most of each range, so these
+ * get dropped on one of the later calls. Does nothing where posix_fadvise
+ * isn't available.
+ * @param file   The open file.
+ * @param offset The offset of the range.
+ * @param length The length of the range.
  */
-int HashFileWithSyncIO(HashRequest* request, HashProgressCallback* callback) {
-    /* Simple guard condition. If we have no request, we can't process. */
-    if (request == NULL) {
-        return -1;
+static void DropBehind(int file, uint64_t offset, uint64_t length) {
+#if defined(POSIX_FADV_DONTNEED)
+    uint64_t start = offset > DROPBEHIND_WINDOW ? offset - DROPBEHIND_WINDOW : 0;
+    length += offset - start;
+    offset = start;
+    posix_fadvise(file, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+/**
+ * Hashes a sparse file by reading its data and passing the length of every
+ * hole to Hashes_update_zeros instead of reading it.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file has less than SPARSE_MINHOLES
+ *                  percent of holes, the file system can't find them or the
+ *                  file shrank while it was hashed.
+ */
+static int HashSparseFile(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback) {
+    Hashes_Context hashes;
+    struct stat filestats;
+    uint64_t offset = 0;
+    uint32_t progressLoopCount = 0;
+    unsigned char* fileData;
+    char dropBehind = (request->options & OPTION_DROPBEHIND) != 0;
+    int status = 0;
+
+    /* Looking for holes moves the file position, and the read loop the
+     * caller falls back to reads from it. */
+    uint64_t holes = HoleLength(file, size);
+    if (lseek(file, 0, SEEK_SET) == -1 || holes == 0 ||
+        holes < size / 100 * SPARSE_MINHOLES) {
+        return NOT_HASHED;
     }
 
-    /* clear the result buffer */
-    memset(&request->result, 0, 56);
+    fileData = (unsigned char*)malloc(BUFFERSIZE);
+    if (!fileData) {
+        return -7;
+    }
 
-    /* Set our options */
-    char doCRC32 = request->options & OPTION_CRC32;
-    char doMD5 = request->options & OPTION_MD5;
-    char doSHA1 = request->options & OPTION_SHA1;
-    char doED2k = request->options & OPTION_ED2K;
+    Hashes_init(&hashes, request->options);
 
-    /* If they didn't pass any valid options (or passed 0) then return since
-     * we can't calculate a hash without knowing which algorithm(s) to use. */
-    if (!doCRC32 && !doMD5 && !doSHA1 && !doED2k) {
-        return -2;
+    while (status == 0 && offset < size) {
+        off_t data = lseek(file, (off_t)offset, SEEK_DATA);
+        uint64_t length;
+
+        /* ENXIO means there's no data past the offset, the rest of the file
+         * is one hole. Unless the offset is past the end of the file, which
+         * shrank while we were hashing it. */
+        if (data == -1 && errno != ENXIO) {
+            status = -8;
+            break;
+        }
+
+        if (data == -1) {
+            if (fstat(file, &filestats) != 0) {
+                status = -8;
+                break;
+            }
+
+            if ((uint64_t)filestats.st_size < size) {
+                status = NOT_HASHED;
+                break;
+            }
+        }
+
+        if (data == -1 || (uint64_t)data > offset) {
+            length = (data == -1 || (uint64_t)data > size ?
+                size : (uint64_t)data) - offset;
+            Hashes_update_zeros(&hashes, length);
+        } else {
+            off_t hole = lseek(file, (off_t)offset, SEEK_HOLE);
+            if (hole == -1) {
+                status = -8;
+                break;
+            }
+
+            length = ((uint64_t)hole > size ? size : (uint64_t)hole) - offset;
+            if (length > BUFFERSIZE) {
+                length = BUFFERSIZE;
+            }
+
+            status = ReadFully(file, fileData, (uint32_t)length, offset);
+            if (status != 0) {
+                break;
+            }
+
+            Hashes_update(&hashes, fileData, (uint32_t)length);
+            if (dropBehind) {
+                DropBehind(file, offset, length);
+            }
+        }
+
+        offset += length;
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, offset) != 0) {
+            status = -9;
+            break;
+        }
+        progressLoopCount++;
     }
 
-    /* Convert the filename from a wchar_t* to char* using UTF-8. */
-    char* filename = NULL;
-    ConvertWideToMultiByte(request->filename, &filename);
-    if (filename == NULL) {
-        return -3;
+    free(fileData);
+
+    /* The read loop picks up a file that shrank from the file position. */
+    if (status == NOT_HASHED && lseek(file, 0, SEEK_SET) == -1) {
+        status = -8;
     }
 
-    /* Try to open the file and free up filename since it isn't needed after
-     * this point and helps reduce the code cleanup on failures. */
-    int file = open(filename, O_RDONLY | O_SHLOCK);
-    free(filename);
-    if (file == -1) {
-        return -4;
+    if (status != 0) {
+        return status;
     }
 
-    /* Set errno to zero in case we're called many times in the same process. */
-    errno = 0;
+    if (callback) {
+        callback(request->tag, offset);
+    }
 
-    /* Set up our local variables. */
-    CRC32_Context crc32;
-    MD4_Context ed2k;
-    MD5_Context md5;
-    SHA1_Context sha1;
-    uint32_t bytesRead;
-    uint32_t ed2kHashLength = 0;
-    uint32_t ed2kBlockIdx = 0;
-    uint32_t ed2kBlocks = 0;
-    uint32_t progressLoopCount = 0;
-    uint64_t totalBytesRead = 0;
-    uint8_t  ed2kLoopIdx = 0;
-    unsigned char* fileData = NULL;
-    unsigned char* ed2kHashes = NULL;
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
 
-    /* Set up our hashes, also calculate the space needed for the ED2k hash if
-     * we were requested to do that. */
-    if (doED2k) {
-        struct stat filestats;
-        memset(&filestats, 0, sizeof(struct stat));
-        if (fstat(file, &filestats) != 0) {
-            close(file);
-            return -5;
-        }
+/**
+ * Adds up the length of the holes of a file.
+ * @param  file The open file to check.
+ * @param  size The size of the file.
+ * @return      The total length of the holes, or 0 if the file system can't
+ *              find them.
+ */
+static uint64_t HoleLength(int file, uint64_t size) {
+    uint64_t holes = 0;
+    uint64_t offset = 0;
 
-        /* Determine the number of blocks needed for calculating the file's
-         * ED2k hash. If the file isn't an even multiple of BLOCKSIZE then
-         * we add one more block. */
-        ed2kBlocks = filestats.st_size / BLOCKSIZE;
-        if (filestats.st_size % BLOCKSIZE > 0) {
-            ++ed2kBlocks;
+    while (offset < size) {
+        off_t hole = lseek(file, (off_t)offset, SEEK_HOLE);
+        off_t data;
+
+        /* File systems without hole support report a single hole at the end
+         * of the file. */
+        if (hole == -1 || (uint64_t)hole >= size) {
+            break;
         }
 
-        /* Only allocate an array if we have more than one block to hash.
-         * Files that are smaller in size than BLOCKSIZE simply use the
-         * normal computed MD4 hash. */
-        if (ed2kBlocks > 1) {
-            ed2kHashLength = ed2kBlocks * 16;
-            ed2kHashes = (unsigned char*)malloc(ed2kHashLength);
-            if (ed2kHashes == NULL && errno == ENOMEM) {
-                close(file);
-                return -6;
-            }
+        data = lseek(file, hole, SEEK_DATA);
+        if (data == -1 && errno != ENXIO) {
+            return 0;
         }
+
+        offset = data == -1 || (uint64_t)data > size ? size : (uint64_t)data;
+        holes += offset - (uint64_t)hole;
     }
-    if (doCRC32) { CRC32_init(&crc32); }
-    if (doMD5) { MD5_init(&md5); }
-    if (doSHA1) { SHA1_init(&sha1); }
 
-    /* Allocate the file buffer. The BUFFERSIZE constant is a clean multiple of
-     * the BLOCKSIZE for ED2k hashing, which will make looping easier. */
-    fileData = (unsigned char*)malloc(BUFFERSIZE);
-    if (fileData == NULL && errno == ENOMEM) {
-        free(ed2kHashes);
-        close(file);
+    return holes;
+}
+#endif
+
+/**
+ * Hashes a file with reads that bypass the page cache into an aligned buffer.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file system doesn't support it.
+ */
+static int HashFileDirect(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback) {
+    Hashes_Context hashes;
+    ssize_t bytesRead;
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    void* fileData = NULL;
+
+#if defined(O_DIRECT)
+    int flags = fcntl(file, F_GETFL);
+    if (flags == -1 || fcntl(file, F_SETFL, flags | O_DIRECT) == -1) {
+        return NOT_HASHED;
+    }
+#elif defined(F_NOCACHE)
+    if (fcntl(file, F_NOCACHE, 1) == -1) {
+        return NOT_HASHED;
+    }
+#else
+    return NOT_HASHED;
+#endif
+
+    if (posix_memalign(&fileData, DIRECT_ALIGNMENT, DIRECT_BUFFERSIZE) != 0) {
         return -7;
     }
 
-    /* Read the entire file until we hit the end. */
-    while ((bytesRead = read(file, fileData, BUFFERSIZE)) != 0) {
-        /* Double check that we haven't had a file read error. */
+    Hashes_init(&hashes, request->options);
+
+    /* Every read but the last one of the file is a whole buffer, so the file
+     * position stays aligned. The last one is short and ends the loop, since
+     * reading on from an unaligned end of file can fail. */
+    while (totalBytesRead < size) {
+        bytesRead = read(file, fileData, DIRECT_BUFFERSIZE);
         if (bytesRead == -1) {
-            /* We should never get EAGAIN, but handle it anyway. */
-            if (errno == EAGAIN) {
+            if (errno == EAGAIN || errno == EINTR) {
                 continue;
             }
 
-            /* We've encountered an unexpected read error. Free up everything
-             * and inform the caller that we've failed. */
+#if defined(O_DIRECT)
+            /* Some file systems accept O_DIRECT but can't read with this
+             * alignment. Let the caller read the file normally instead. */
+            if (errno == EINVAL && totalBytesRead == 0) {
+                fcntl(file, F_SETFL, flags);
+                free(fileData);
+                return NOT_HASHED;
+            }
+#endif
+
             free(fileData);
-            free(ed2kHashes);
-            close(file);
             return -8;
         }
 
+        /* The file was truncated while we were hashing it. */
+        if (bytesRead == 0) {
+            break;
+        }
+
         totalBytesRead += bytesRead;
-        if (callback && progressLoopCount % 10 == 0) {
-            if(callback(request->tag, totalBytesRead) != 0) {
-                free(fileData);
-                free(ed2kHashes);
-                close(file);
-                return -9;
-            }
+        if (callback && progressLoopCount % 10 == 0 &&
+            callback(request->tag, totalBytesRead) != 0) {
+            free(fileData);
+            return -9;
         }
         progressLoopCount++;
 
-        /* Update the hashes. */
-        if (doED2k) {
-            /* If we've looped 10 times, finish the current MD4 hash, update
-             * the block counter and set the hash to be initialized again. */
-            if (ed2kLoopIdx == 10) {
-                MD4_final(&ed2k, &ed2kHashes[ed2kBlockIdx * 16]);
-                ++ed2kBlockIdx;
-                ed2kLoopIdx = 0;
+        Hashes_update(&hashes, fileData, (uint32_t)bytesRead);
+
+        if (bytesRead < DIRECT_BUFFERSIZE) {
+            break;
+        }
+    }
+
+    free(fileData);
+
+    if (callback) {
+        callback(request->tag, totalBytesRead);
+    }
+
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
+
+/**
+ * Hashes a file straight out of the page cache by mapping MAPPED_WINDOW bytes
+ * of it at a time.
+ * @param  file     The open file to hash.
+ * @param  size     The size of the file.
+ * @param  request  The HashRequest receiving the result.
+ * @param  callback The optional progress callback.
+ * @return          Returns the same values as HashFileWithSyncIO, or
+ *                  NOT_HASHED if the file can't be mapped or shrank while it
+ *                  was hashed.
+ */
+static int HashMappedFile(int file, uint64_t size,
+    HashRequest* request, HashProgressCallback* callback) {
+    Hashes_Context hashes;
+    MappedWindow current;
+    MappedWindow next;
+    uint64_t offset;
+    uint64_t totalBytesRead = 0;
+    uint32_t progressLoopCount = 0;
+    uint32_t position;
+    uint32_t piece;
+    int status = 0;
+
+    if (MapWindow(file, size, 0, &current) != 0) {
+        return NOT_HASHED;
+    }
+
+    pthread_once(&faultHandlerOnce, InitFaultHandler);
+    Hashes_init(&hashes, request->options);
+
+    for (offset = 0; offset < size; offset += MAPPED_WINDOW) {
+        /* Map the next window before hashing this one, so the kernel reads it
+         * ahead of the hash cursor. */
+        next.mapping = NULL;
+        if (offset + MAPPED_WINDOW < size &&
+            MapWindow(file, size, offset + MAPPED_WINDOW, &next) != 0) {
+            status = -8;
+        }
+
+        /* Hash the window in BUFFERSIZE pieces to report progress on the same
+         * schedule as the read loop. */
+        for (position = 0; status == 0 && position < current.length;
+            position += piece) {
+            piece = current.length - position < BUFFERSIZE ?
+                current.length - position : BUFFERSIZE;
+
+            totalBytesRead += piece;
+            if (callback && progressLoopCount % 10 == 0 &&
+                callback(request->tag, totalBytesRead) != 0) {
+                status = -9;
+                break;
             }
+            progressLoopCount++;
 
-            /* If this is the first loop (or we just finished a hash)
-             * initialize the MD4 hash for the next block. */
-            if (ed2kLoopIdx == 0) {
-                MD4_init(&ed2k);
+            /* The file shrank under the mapping. Leave it to the read loop,
+             * which hashes whatever is left from the start again. */
+            if (HashMappedData(&hashes, &current.data[position], piece) != 0) {
+                status = NOT_HASHED;
+                break;
             }
+        }
 
-            ++ed2kLoopIdx;
-            MD4_update(&ed2k, fileData, bytesRead);
+        UnmapWindow(&current);
+        if (status != 0) {
+            if (next.mapping != NULL) {
+                UnmapWindow(&next);
+            }
+            return status;
         }
-        if (doCRC32) { CRC32_update(&crc32, fileData, bytesRead); }
-        if (doMD5) { MD5_update(&md5, fileData, bytesRead); }
-        if (doSHA1) { SHA1_update(&sha1, fileData, bytesRead); }
-    }
 
-    /* Free our file buffer and close the file since we're done with it. */
-    free(fileData);
-    close(file);
+        current = next;
+    }
 
-    /* If we have a callback, call them one more time informing them of our
-     * completion. We ignore the request to cancel since we're done anyway. */
     if (callback) {
         callback(request->tag, totalBytesRead);
     }
 
-    /* Finalize all of the hashes that were selected and store the results in
-     * the request result buffer. The order of the hashes are:
-     *     0 - 15: ED2k
-     *    16 - 19: CRC32
-     *    20 - 35: MD5
-     *    36 - 55: SHA1 */
-    if (doED2k) {
-        /* If we had just one block to process store the result of the block
-         * directly in the result buffer. */
-        if (ed2kBlocks == 1) {
-            MD4_final(&ed2k, &request->result[0]);
-        } else {
-            /* Check to see if we were in a loop and finalize the final pending
-             * block if we were.*/
-            if (ed2kLoopIdx > 0) {
-                MD4_final(&ed2k, &ed2kHashes[ed2kBlockIdx * 16]);
+    Hashes_final(&hashes, &request->result[0]);
+    return 0;
+}
+
+/**
+ * Updates the hashes with data from a mapped window, catching the SIGBUS raised
+ * by reading past the end of a file that shrank since it was mapped.
+ * @param  hashes The hashes to update.
+ * @param  data   The mapped data.
+ * @param  length The length of the data.
+ * @return        Returns 0 on success or -1 if the data is no longer there.
+ */
+static int HashMappedData(Hashes_Context* hashes, const unsigned char* data,
+    uint32_t length) {
+    sigjmp_buf fault;
+
+    /* Save the signal mask, since SIGBUS is still blocked when the handler
+     * jumps back here. */
+    if (sigsetjmp(fault, 1) != 0) {
+        mappedFault = NULL;
+        return -1;
+    }
+
+    mappedFault = &fault;
+    Hashes_update(hashes, data, length);
+    mappedFault = NULL;
+
+    return 0;
+}
+
+/**
+ * Installs HandleFault as the SIGBUS handler, keeping the previous one to pass
+ * other faults on to.
+ */
+static void InitFaultHandler(void) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = HandleFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previousFaultHandler);
+}
+
+/**
+ * Handles SIGBUS, returning to HashMappedData when it's hashing on the
+ * faulting thread and passing the signal on otherwise.
+ * @param signum  The signal number.
+ * @param info    Details about the signal.
+ * @param context The context of the interrupted thread.
+ */
+static void HandleFault(int signum, siginfo_t* info, void* context) {
+    sigjmp_buf* fault = mappedFault;
+
+    if (fault != NULL) {
+        siglongjmp(*fault, 1);
+    }
+
+    if (previousFaultHandler.sa_flags & SA_SIGINFO) {
+        previousFaultHandler.sa_sigaction(signum, info, context);
+    } else if (previousFaultHandler.sa_handler == SIG_DFL) {
+        /* Die the way the process would have without us. */
+        signal(signum, SIG_DFL);
+        raise(signum);
+    } else if (previousFaultHandler.sa_handler == SIG_IGN) {
+        /* A fault can't be ignored. Returning runs the faulting instruction
+         * again, which now gets the default action. */
+        signal(signum, SIG_DFL);
+    } else {
+        previousFaultHandler.sa_handler(signum);
+    }
+}
+
+/**
+ * Checks whether enough of the first window of a file is in the page cache for
+ * hashing it out of a mapping to pay off.
+ * @param  file The open file to check.
+ * @param  size The size of the file.
+ * @return      Returns 1 if at least MAPPED_RESIDENCY percent of the window is
+ *              resident, or 0 otherwise.
+ */
+static int IsMostlyCached(int file, uint64_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = size < MAPPED_WINDOW ? (size_t)size : MAPPED_WINDOW;
+    size_t pages = (length + page - 1) / page;
+    size_t resident = 0;
+    size_t idx;
+
+    /* mincore only works on mapped memory. Mapping without touching the
+     * pages doesn't read anything in. */
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, file, 0);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    unsigned char* residency = (unsigned char*)malloc(pages);
+    if (residency != NULL && mincore(mapping, length, (void*)residency) == 0) {
+        for (idx = 0; idx < pages; ++idx) {
+            resident += residency[idx] & 1;
+        }
+    }
+
+    free(residency);
+    munmap(mapping, length);
+
+    return resident * 100 >= pages * MAPPED_RESIDENCY;
+}
+
+/**
+ * Maps a window of a file and asks the kernel to read it in sequentially.
+ * @param  file   The open file to map.
+ * @param  size   The size of the file.
+ * @param  offset The offset of the window.
+ * @param  window Receives the mapped window.
+ * @return        Returns 0 on success or -1 if the file can't be mapped.
+ */
+static int MapWindow(int file, uint64_t size, uint64_t offset,
+    MappedWindow* window) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    /* MAPPED_WINDOW is only a multiple of the page size for pages up to 16KB,
+     * so start the mapping at the page containing the window. */
+    uint64_t start = offset - offset % page;
+
+    window->length = size - offset < MAPPED_WINDOW ?
+        (uint32_t)(size - offset) : MAPPED_WINDOW;
+    window->mappingLength = (size_t)(offset - start) + window->length;
+    window->mapping = (unsigned char*)mmap(NULL, window->mappingLength,
+        PROT_READ, MAP_SHARED, file, (off_t)start);
+    if (window->mapping == MAP_FAILED) {
+        window->mapping = NULL;
+        return -1;
+    }
+
+    madvise(window->mapping, window->mappingLength, MADV_SEQUENTIAL);
+    madvise(window->mapping, window->mappingLength, MADV_WILLNEED);
+    window->data = window->mapping + (offset - start);
+
+    return 0;
+}
+
+/**
+ * Reads exactly length bytes from the file at the given offset, retrying
+ * interrupted and partial reads.
+ * @param  file   The open file to read.
+ * @param  buffer The buffer receiving the data.
+ * @param  length The number of bytes to read.
+ * @param  offset The offset in the file to read from.
+ * @return        Returns 0 on success, -8 if the read failed, or NOT_HASHED if
+ *                the file ended early.
+ */
+static int ReadFully(int file, unsigned char* buffer, uint32_t length,
+    uint64_t offset) {
+    uint32_t position = 0;
+
+    while (position < length) {
+        ssize_t bytesRead = pread(file, &buffer[position], length - position,
+            offset + position);
+
+        if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
             }
 
-            /* Calculate the MD4 hash of the concatenated hashes from each ED2k
-             * block. The resulting hash is the final ED2k hash. */
-            MD4_init(&ed2k);
-            MD4_update(&ed2k, ed2kHashes, ed2kHashLength);
-            MD4_final(&ed2k, &request->result[0]);
+            return -8;
+        }
 
-            free(ed2kHashes);
+        /* The file was truncated while we were hashing it. */
+        if (bytesRead == 0) {
+            return NOT_HASHED;
         }
+
+        position += bytesRead;
     }
-    if (doCRC32) { CRC32_final(&crc32, &request->result[16]); }
-    if (doMD5) { MD5_final(&md5, &request->result[20]); }
-    if (doSHA1) { SHA1_final(&sha1, &request->result[36]); }
 
     return 0;
 }
 
+/**
+ * Drops a window mapped by MapWindow from the address space. The pages stay in
+ * the page cache, the kernel just doesn't have to keep them mapped.
+ * @param window The window to unmap.
+ */
+static void UnmapWindow(MappedWindow* window) {
+    madvise(window->mapping, window->mappingLength, MADV_DONTNEED);
+    munmap(window->mapping, window->mappingLength);
+    window->mapping = NULL;
+}
+
 /**
  * Converts a wide char array string to a UTF-8 char array string using the
  * C locale.
@@ -260,9 +4579,14 @@ void ConvertWideToMultiByte(wchar_t* input, char** output) {
         return;
     }
 
-    /* Ensure we have the C locale type */
+    /* Ensure we have the C locale type. glibc needs the name of a locale that
+     * can actually encode UTF-8. */
+#if defined(__APPLE__)
     locale_t utf8Locale = newlocale(LC_ALL_MASK, NULL, NULL);
-    if (utf8Locale == NULL) {
+#else
+    locale_t utf8Locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+#endif
+    if (utf8Locale == (locale_t)0) {
         return;
     }
 
@@ -274,13 +4598,14 @@ void ConvertWideToMultiByte(wchar_t* input, char** output) {
         return;
     }
 
-    char* conversion = (char*)malloc(conversionSize * sizeof(char));
-    if (conversion == NULL && errno == ENOMEM) {
+    /* Leave room for the terminator, which isn't part of the size. */
+    char* conversion = (char*)malloc((conversionSize + 1) * sizeof(char));
+    if (conversion == NULL) {
         freelocale(utf8Locale);
         return;
     }
 
-    conversionSize = wcstombs_l(conversion, input, conversionSize, utf8Locale);
+    conversionSize = wcstombs_l(conversion, input, conversionSize + 1, utf8Locale);
     freelocale(utf8Locale);
     if (conversionSize == -1) {
         free(conversion);
@@ -289,3 +4614,11 @@ void ConvertWideToMultiByte(wchar_t* input, char** output) {
 
     *output = conversion;
 }
+
+/**
+ * Selects and checks the hash kernels for the CPU. Kernels that fail the check
+ * are disabled by Dispatch_init and never used.
+ */
+static void InitDispatch(void) {
+    Dispatch_init();
+}
@@ -28,6 +28,9 @@
 #define OPTION_CRC32 0x02
 #define OPTION_MD5   0x04
 #define OPTION_SHA1  0x08
+#define OPTION_DIRECTIO   0x10
+#define OPTION_DROPBEHIND 0x20
+#define OPTION_NETWORK    0x40
 
 /**
  * Structure used to communicate and coordinate the hashing request, hashing
@@ -43,7 +46,22 @@
  *                   0x04: Calculate the MD5 hash.
  *                   0x08: Calculate the SHA1 hash.
  *                 One or more of these options can be combined by performing a
- *                 bitwise OR operation on the values.
+ *                 bitwise OR operation on the values. The way the file is read
+ *                 can be changed by adding one of:
+ *                   0x10: Read the file with O_DIRECT (F_NOCACHE on Mac OS X)
+ *                         into aligned buffers, bypassing the page cache. Falls
+ *                         back to 0x20 where the file system refuses it.
+ *                   0x20: Read the file through the page cache but drop every
+ *                         range from the cache as soon as it's hashed.
+ *                 Either keeps hashing a large archive from pushing everything
+ *                 else out of the page cache. Files that are mostly cached
+ *                 already are still hashed out of the cache, and the parallel
+ *                 CRC32 and ED2k lanes paths aren't used. Adding
+ *                   0x40: Read the file with several reads in flight at once
+ *                         from a pool of threads, as if it's on a network
+ *                         share, instead of with the parallel CRC32 and ED2k
+ *                         lanes paths. Files on NFS and SMB mounts are always
+ *                         read this way.
  * @field filename The full path and name to the file that should be hashed. For
  *                 compatibility with python, this field is defined as a
  *                 wchar_t.
@@ -96,18 +114,276 @@ typedef int32_t HashProgressCallback(int32_t tag, uint64_t progress);
  *                    -3: Failure to convert the filename from a wide char array
  *                        to a multi-byte char array.
  *                    -4: Unable to open the requested file.
- *                    -5: Unable to get the size of the file to determine the
- *                        number of ED2k blocks necessary.
+ *                    -5: Reserved. Returned by earlier versions when the size
+ *                        of the file couldn't be determined, which the ED2k
+ *                        hash no longer needs. Never returned.
  *                    -6: Unable to allocate enough memory to hold the
- *                        intermediate hash results for ED2k.
+ *                        intermediate hash results for ED2k. Only returned
+ *                        for files that request the ED2k hash by itself.
  *                    -7: Unable to allocate a buffer to hold the file data as
  *                        it's being processed.
  *                    -8: An unexpected error occurred while reading the file.
+ *                        A file that shrinks while it's hashed isn't an error:
+ *                        whatever is left of it is hashed. Every way of
+ *                        reading a file that doesn't read it from start to
+ *                        end in order reads it again from the start instead,
+ *                        so the progress passed to the callback starts over.
  *                    -9: A cancellation request was returned by the callback
  *                        function provided in the callback parameter. (A non-
  *                        zero value was returned from the callback)
+ * @remarks
+ * Sparse files with at least 10% of their size in holes only have their data
+ * read. The holes are hashed as runs of zeros without reading them. This takes
+ * precedence over every other way of reading a file described below, except
+ * for files on network mounts (or requested with option 0x40) and files
+ * requested with option 0x10, which are always read in full.
+ *
+ * Large files that only request the CRC32 are split into ranges that are hashed
+ * on separate threads and combined afterwards. The callback is still only ever
+ * invoked from the calling thread. Files larger than one ED2k block that only
+ * request the ED2k hash have several blocks hashed at once in vector lanes when
+ * the CPU supports AVX2. Other regular files of at least 4 buffers that are
+ * mostly in the page cache already (judging by their first 37MB) are hashed
+ * straight out of a mapping instead of being read. The rest of the regular files larger
+ * than a buffer are read ahead by a second thread while the calling thread
+ * hashes them.
+ *
+ * On a machine with more than one core, regular files larger than a buffer
+ * that request more than one hash are read by the calling thread into a ring
+ * of buffers instead, and each requested hash is calculated from every buffer
+ * on a thread of its own, so the file takes about as long as the slowest of
+ * the hashes. Setting the JMMHASHER_PIPELINE environment variable to "0" or
+ * "1" turns this off or on regardless of the number of cores.
+ *
+ * Files on network mounts (or requested with option 0x40) are read by a pool
+ * of stripe threads instead, each reading the next buffer not yet claimed,
+ * with up to depth buffers read ahead of the one being hashed. The default of
+ * 4 stripes and a depth of 8 can be changed for every mount through the
+ * JMMHASHER_STRIPES environment variable, a list of entries separated by ';'
+ * such as "/mnt/nas=8x16;/mnt/smb=2x4;4x8". Each entry is the path of a
+ * directory on the mount, '=', the number of stripes (1 to 16), 'x' and the
+ * depth (1 to 32, and at least the number of stripes). An entry without a path
+ * applies to every other mount.
  */
 EXPORT int HashFileWithSyncIO(
     HashRequest* request, HashProgressCallback* callback);
 
+/**
+ * Accepts an array of HashRequest structures and calculates the requested
+ * hashes of every file using synchronous IO. Small files that request the MD5
+ * hash are read whole and have their MD5 hashes calculated together in vector
+ * lanes, which is much faster than hashing them one after the other when there
+ * are many of them. Every other file is hashed by HashFileWithSyncIO, while
+ * the kernel is asked to read the start of the next 4 files (up to 37MB of
+ * each and 74MB in all) into the page cache, so the device goes straight on to
+ * the next file instead of waiting for it to be opened. The
+ * JMMHASHER_PREFETCH environment variable changes the number of files, from 0
+ * (no prefetching) to 16. Files requested with options 0x10 or 0x20 aren't
+ * prefetched.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request, with the same
+ *                  meaning as the return value of HashFileWithSyncIO.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional callback parameter. Small files that are hashed
+ *                  together only report their final progress (and can't be
+ *                  cancelled).
+ * @return          Returns the number of requests that failed, or -1 if either
+ *                  requests or results is NULL.
+ */
+EXPORT int HashFilesWithSyncIO(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback);
+
+/**
+ * Accepts an array of HashRequest structures and hashes the files of every
+ * device at the same time, so a batch spread over several disks is read from
+ * all of them at once instead of one after the other. Each file is mapped to
+ * the device it's on (through sysfs on Linux, resolving partitions to their
+ * disk and md or dm devices built on a single device to that device) and the
+ * files of each device are hashed on threads of their own, in their original
+ * order: one file at a time on a rotational disk (one per member disk of a
+ * rotational array), and one per core (up to 16) on SSDs and NVMe drives.
+ * Devices that can't be resolved (such as network mounts, and every device on
+ * Mac OS X) are read one file at a time. A device hashed one file at a time
+ * is hashed like HashFilesWithSyncIO, so its files are prefetched and its small
+ * files hashed together. Every file is hashed on the thread that picked it up,
+ * without the threads HashFileWithSyncIO adds to read ahead, split a CRC32 or
+ * calculate each hash on a core of its own.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request, with the same
+ *                  meaning as the return value of HashFileWithSyncIO.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional callback parameter. It's invoked from several
+ *                  threads, for several requests at the same time (but never
+ *                  for the same request twice at once). Use the tag of each
+ *                  request to tell them apart.
+ * @return          Returns the number of requests that failed, or -1 if either
+ *                  requests or results is NULL.
+ */
+EXPORT int HashFilesByDevice(HashRequest* requests, int32_t* results,
+    uint32_t count, HashProgressCallback* callback);
+
+/**
+ * Accepts a HashRequest structure and attempts to calculate the requested hash
+ * of the provided file while keeping several reads in flight, so devices that
+ * serve requests in parallel (such as NVMe drives) are never left idle while
+ * the hashes are calculated. See the HashFileWithSyncIO function for details
+ * of the parameters and return values.
+ * @remarks
+ * On Linux the reads are issued through io_uring into registered buffers,
+ * JMMHASHER_QUEUE_DEPTH (1 to 64, 8 by default) of them at a time, and hashed
+ * in file order as they complete. When io_uring isn't available (including on
+ * Mac OS X), and for the files HashFileWithSyncIO splits across threads or
+ * vector lanes, this is the same as HashFileWithSyncIO.
+ */
+EXPORT int HashFileWithAsyncIO(
+    HashRequest* request, HashProgressCallback* callback);
+
+/**
+ * Writes a description of the hash kernel selected for each algorithm on this
+ * CPU to buffer, such as "crc32=pclmul md4=scalar md4-lanes=avx2 ...". The
+ * kernels are selected from the CPU features (restricted by the JMMHASHER_CPU
+ * environment variable, see cpu.h) and checked against known results the first
+ * time the library is used. A kernel that fails the check is replaced by the
+ * next best one and is never used.
+ * @param  buffer The buffer that receives the description. The description is
+ *                truncated, but always terminated, if it doesn't fit.
+ * @param  size   The size of the buffer in bytes.
+ * @return        Returns the length of the full description, not counting the
+ *                terminator.
+ */
+EXPORT uint32_t DescribeKernels(char* buffer, uint32_t size);
+
+/**
+ * A persistent hashing engine with a pool of worker threads, each with its own
+ * buffer, created by CreateHasherEngine. Its contents are private.
+ */
+typedef struct HasherEngine HasherEngine;
+
+/**
+ * Creates a HasherEngine and starts its worker threads. An engine is meant to
+ * be kept for the life of the caller and used for every batch of files, so
+ * the threads and buffers are only set up once.
+ * @param  threads The number of worker threads, or 0 for one per online core.
+ *                 At most 64 threads are started.
+ * @return         Returns the new engine, or NULL if it couldn't be created.
+ */
+EXPORT HasherEngine* CreateHasherEngine(uint32_t threads);
+
+/**
+ * Destroys a HasherEngine created by CreateHasherEngine, after its workers
+ * finish any requests still queued on it. Jobs queued by SubmitHash that
+ * weren't collected are discarded.
+ * @param engine The engine to destroy. NULL is ignored.
+ */
+EXPORT void DestroyHasherEngine(HasherEngine* engine);
+
+/**
+ * Accepts an array of HashRequest structures and calculates the requested
+ * hashes of every file on the worker threads of an engine, several files at
+ * once, and returns once all of them are finished. The results are stored in
+ * each request, just like HashFileWithSyncIO. Several threads can pass batches
+ * to the same engine, which hashes them in the order they were passed.
+ * @param  engine   The engine created by CreateHasherEngine.
+ * @param  requests The HashRequest structures to process.
+ * @param  results  Receives the return value for each request, with the same
+ *                  meaning as the return value of HashFileWithSyncIO.
+ * @param  count    The number of entries in requests and results.
+ * @param  callback An optional callback parameter. It's invoked from the
+ *                  worker threads, for several requests at the same time
+ *                  (but never for the same request twice at once). Use the
+ *                  tag of each request to tell them apart.
+ * @return          Returns the number of requests that failed, or -1 if
+ *                  engine, requests or results is NULL.
+ * @remarks
+ * Every worker hashes its files on its own thread and reads them into its own
+ * buffer. Files that HashFileWithSyncIO would split across more threads, or
+ * read ahead on a second thread, are read one buffer at a time instead, since
+ * the other workers keep the rest of the cores busy. Files of at least four
+ * ED2k blocks that only request the ED2k and CRC32 hashes are split into runs
+ * of blocks instead, and workers with nothing left to start steal runs from
+ * the end of the file, so a batch ending with a few large files still keeps
+ * every worker busy. The block hashes are combined once every run is done.
+ */
+EXPORT int HashFilesBatch(HasherEngine* engine, HashRequest* requests,
+    int32_t* results, uint32_t count, HashProgressCallback* callback);
+
+/**
+ * A job passed to SubmitHash that finished, collected by PollCompletions or
+ * WaitCompletions.
+ * @field job     The id returned by SubmitHash.
+ * @field request The HashRequest passed to SubmitHash, which holds the result.
+ * @field status  The same value HashFileWithSyncIO would have returned, or -9
+ *                if the job was cancelled by CancelHash.
+ */
+typedef struct HashCompletion {
+    int64_t job;
+    HashRequest* request;
+    int32_t status;
+} HashCompletion;
+
+/**
+ * Queues a request on the worker threads of an engine and returns straight
+ * away, without a thread of the caller's waiting for it. The finished job is
+ * collected from the completion queue of the engine with PollCompletions or
+ * WaitCompletions, once GetCompletionFd becomes readable for example. Any
+ * number of jobs can be queued, they're hashed in the order they're queued by
+ * as many files at a time as the engine has workers.
+ * @param  engine  The engine created by CreateHasherEngine.
+ * @param  request The HashRequest to process. It has to stay valid (and not
+ *                 be changed) until its job is collected.
+ * @return         Returns the id of the job (1 or more), -1 if engine or
+ *                 request is NULL, or -7 if the job couldn't be allocated.
+ */
+EXPORT int64_t SubmitHash(HasherEngine* engine, HashRequest* request);
+
+/**
+ * Cancels a job queued by SubmitHash. A job that hasn't started yet finishes
+ * straight away, one that's being hashed stops at its next progress update
+ * (every 10 buffers). Either way it's still collected from the completion
+ * queue, with a status of -9. A job being finalized when it's cancelled can
+ * still finish successfully.
+ * @param  engine The engine the job was queued on.
+ * @param  job    The id returned by SubmitHash.
+ * @return        Returns 0 if the job was cancelled, or -1 if it isn't queued
+ *                or being hashed (it finished already or doesn't exist).
+ */
+EXPORT int CancelHash(HasherEngine* engine, int64_t job);
+
+/**
+ * Collects the jobs that finished from the completion queue of an engine, in
+ * the order they finished, without waiting for any.
+ * @param  engine      The engine the jobs were queued on.
+ * @param  completions Receives the finished jobs.
+ * @param  max         The number of entries in completions.
+ * @return             Returns the number of jobs collected (0 if none are
+ *                     finished), or -1 if engine or completions is NULL.
+ */
+EXPORT int PollCompletions(HasherEngine* engine, HashCompletion* completions,
+    uint32_t max);
+
+/**
+ * Collects the jobs that finished from the completion queue of an engine, like
+ * PollCompletions, but first waits for a job to finish if none have.
+ * @param  engine      The engine the jobs were queued on.
+ * @param  completions Receives the finished jobs.
+ * @param  max         The number of entries in completions.
+ * @param  timeout     The most milliseconds to wait, or -1 to wait for as long
+ *                     as it takes.
+ * @return             Returns the number of jobs collected (0 if the timeout
+ *                     expired), or -1 if engine or completions is NULL.
+ */
+EXPORT int WaitCompletions(HasherEngine* engine, HashCompletion* completions,
+    uint32_t max, int32_t timeout);
+
+/**
+ * Gets a descriptor that's readable exactly while the completion queue of an
+ * engine isn't empty, to wait for jobs with poll, epoll, kqueue or an asyncio
+ * loop. It's an eventfd on Linux and the end of a pipe elsewhere. Don't read
+ * from it or close it, collect the jobs with PollCompletions instead. It's
+ * closed by DestroyHasherEngine.
+ * @param  engine The engine.
+ * @return        Returns the descriptor, or -1 if engine is NULL.
+ */
+EXPORT int GetCompletionFd(HasherEngine* engine);
+
 #endif
@@ -19,15 +19,1485 @@
 /*** NOTE: This file is simply a quick and dirty test program for
            ensuring the library is working properly. */
 #include "libhasher.h"
+#include "core/cpu.h"
+#include "core/crc32.h"
+#include "core/md4.h"
+#include "core/md5.h"
+#include "core/sha1.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <memory.h>
 
+#if defined(__APPLE__)
 #include <xlocale.h>
+#else
+#include <locale.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <stdint.h>
 
+/**
+ * Drops the cached pages of the file where the platform allows it, so the next
+ * hash has to read the file from the device.
+ * @param filename The name of the file.
+ */
+static void drop_cache(const char* filename) {
+#if defined(POSIX_FADV_DONTNEED)
+    int file = open(filename, O_RDONLY);
+    if (file != -1) {
+        posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+        close(file);
+    }
+#endif
+}
+
+/**
+ * State shared with the cached reader thread of cache_benchmark.
+ * @field file    The open file the thread keeps reading.
+ * @field stop    Set to stop the thread.
+ * @field bytes   The number of bytes the thread read.
+ */
+typedef struct CachedReader {
+    int file;
+    volatile int stop;
+    uint64_t bytes;
+} CachedReader;
+
+/**
+ * Keeps reading a (cached) file from start to end until told to stop, like a
+ * streaming server serving it would.
+ * @param  param The CachedReader.
+ * @return       Always returns NULL.
+ */
+static void* cached_reader(void* param) {
+    CachedReader* reader = (CachedReader*)param;
+    static unsigned char buffer[1024 * 1024];
+    off_t offset = 0;
+
+    while (!reader->stop) {
+        ssize_t bytesRead = pread(reader->file, buffer, sizeof(buffer), offset);
+        if (bytesRead <= 0) {
+            offset = 0;
+            continue;
+        }
+
+        reader->bytes += bytesRead;
+        offset += bytesRead;
+    }
+
+    return NULL;
+}
+
+/**
+ * Gets the percentage of a file that is in the page cache.
+ * @param  filename The name of the file.
+ * @return          The percentage, or -1 if it can't be determined.
+ */
+static int cached_percent(const char* filename) {
+    struct stat filestats;
+    int percent = -1;
+    int file = open(filename, O_RDONLY);
+
+    if (file == -1 || fstat(file, &filestats) != 0 || filestats.st_size == 0) {
+        if (file != -1) {
+            close(file);
+        }
+        return -1;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (filestats.st_size + page - 1) / page;
+    unsigned char* residency = (unsigned char*)malloc(pages);
+    void* mapping = mmap(NULL, filestats.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (residency != NULL && mapping != MAP_FAILED &&
+        mincore(mapping, filestats.st_size, (void*)residency) == 0) {
+        size_t resident = 0;
+        for (size_t idx = 0; idx < pages; ++idx) {
+            resident += residency[idx] & 1;
+        }
+        percent = (int)(resident * 100 / pages);
+    }
+
+    if (mapping != MAP_FAILED) {
+        munmap(mapping, filestats.st_size);
+    }
+    free(residency);
+    close(file);
+    return percent;
+}
+
+/**
+ * Hashes a file with the regular, OPTION_DROPBEHIND and OPTION_DIRECTIO reads
+ * while another thread keeps reading a cached file, and reports how fast each
+ * went and how much of the hashed file was left in the page cache.
+ * @param filename  The name of the file to hash.
+ * @param wfilename The same name as a wide char array.
+ * @param hotname   The name of the file kept cached by the other thread.
+ * @param options   The hashes to calculate.
+ */
+static void cache_benchmark(const char* filename, wchar_t* wfilename,
+    const char* hotname, int32_t options) {
+    const int32_t modes[] = { 0, OPTION_DROPBEHIND, OPTION_DIRECTIO };
+    const char* names[] = { "cached", "dropbehind", "directio" };
+    HashRequest request;
+    CachedReader reader;
+    pthread_t thread;
+    struct timeval start;
+    struct timeval end;
+
+    memset(&request, 0, sizeof(HashRequest));
+    request.filename = wfilename;
+
+    for (int mode = 0; mode < 3; ++mode) {
+        memset(&reader, 0, sizeof(CachedReader));
+        reader.file = open(hotname, O_RDONLY);
+        if (reader.file == -1) {
+            fprintf(stderr, "Unable to open %s.\n", hotname);
+            return;
+        }
+
+        request.options = options | modes[mode];
+        drop_cache(filename);
+        pthread_create(&thread, NULL, cached_reader, &reader);
+
+        gettimeofday(&start, NULL);
+        int result = HashFileWithSyncIO(&request, NULL);
+        gettimeofday(&end, NULL);
+
+        reader.stop = 1;
+        pthread_join(thread, NULL);
+        close(reader.file);
+
+        double elapsed =
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("%-10s result %d: %8.3f s, reader %8.1f MB/s, %3d%% left cached\n",
+            names[mode], result, elapsed, reader.bytes / elapsed / 1e6,
+            cached_percent(filename));
+    }
+}
+
+/**
+ * Times HashFileWithSyncIO against HashFileWithAsyncIO at several queue depths
+ * and the striped network reads at several widths on a file, dropping the file
+ * from the cache before each run. The last run hashes the file again while
+ * it's cached, which hashes it out of a mapping. Preload latencyshim to see
+ * how each copes with a high latency mount.
+ * @param filename  The name of the file to hash.
+ * @param wfilename The same name as a wide char array.
+ * @param options   The hashes to calculate.
+ */
+static void benchmark(const char* filename, wchar_t* wfilename, int32_t options) {
+    const char* depths[] = { "1", "2", "4", "8", "16", "32" };
+    const char* stripes[] = { "1x1", "2x4", "4x8", "8x16", "16x32" };
+    HashRequest request;
+    struct timeval start;
+    struct timeval end;
+
+    memset(&request, 0, sizeof(HashRequest));
+    request.filename = wfilename;
+    request.options = options;
+
+    for (int run = -1; run < (int)(sizeof(depths) / sizeof(depths[0])); ++run) {
+        drop_cache(filename);
+        gettimeofday(&start, NULL);
+        int result;
+        if (run < 0) {
+            result = HashFileWithSyncIO(&request, NULL);
+        } else {
+            setenv("JMMHASHER_QUEUE_DEPTH", depths[run], 1);
+            result = HashFileWithAsyncIO(&request, NULL);
+        }
+        gettimeofday(&end, NULL);
+
+        printf("%-12s %-6s result %d: %8.3f s\n",
+            run < 0 ? "sync" : "async depth", run < 0 ? "" : depths[run], result,
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+    }
+
+    request.options = options | OPTION_NETWORK;
+    for (int run = 0; run < (int)(sizeof(stripes) / sizeof(stripes[0])); ++run) {
+        drop_cache(filename);
+        setenv("JMMHASHER_STRIPES", stripes[run], 1);
+        gettimeofday(&start, NULL);
+        int result = HashFileWithSyncIO(&request, NULL);
+        gettimeofday(&end, NULL);
+
+        printf("%-12s %-6s result %d: %8.3f s\n", "striped", stripes[run], result,
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+    }
+
+    request.options = options;
+    gettimeofday(&start, NULL);
+    int result = HashFileWithSyncIO(&request, NULL);
+    gettimeofday(&end, NULL);
+    printf("%-12s %-6s result %d: %8.3f s\n", "sync cached", "", result,
+        (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+/**
+ * Times HashFilesWithSyncIO on a list of files with a range of prefetch
+ * settings, then HashFilesBatch and SubmitHash on an engine with one worker
+ * per core, then HashFilesByDevice, dropping every file from the cache before
+ * each run.
+ * @param filenames  The names of the files to hash.
+ * @param wfilenames The same names as wide char arrays.
+ * @param count      The number of files.
+ * @param options    The hashes to calculate.
+ */
+static void batch_benchmark(char** filenames, wchar_t** wfilenames,
+    uint32_t count, int32_t options) {
+    const char* prefetch[] = { "0", "1", "4", "16" };
+    HashRequest* requests = (HashRequest*)calloc(count, sizeof(HashRequest));
+    int32_t* results = (int32_t*)calloc(count, sizeof(int32_t));
+    struct timeval start;
+    struct timeval end;
+    uint64_t total = 0;
+
+    if (requests == NULL || results == NULL) {
+        fprintf(stderr, "Unable to allocate the requests.\n");
+        free(requests);
+        free(results);
+        return;
+    }
+
+    for (uint32_t idx = 0; idx < count; ++idx) {
+        struct stat filestats;
+
+        requests[idx].tag = (int32_t)idx;
+        requests[idx].filename = wfilenames[idx];
+        requests[idx].options = options;
+        if (stat(filenames[idx], &filestats) == 0) {
+            total += (uint64_t)filestats.st_size;
+        }
+    }
+
+    for (int run = 0; run < (int)(sizeof(prefetch) / sizeof(prefetch[0])); ++run) {
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            drop_cache(filenames[idx]);
+        }
+
+        setenv("JMMHASHER_PREFETCH", prefetch[run], 1);
+        gettimeofday(&start, NULL);
+        int failures = HashFilesWithSyncIO(requests, results, count, NULL);
+        gettimeofday(&end, NULL);
+
+        double elapsed =
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("prefetch %-3s failures %d: %8.3f s, %8.1f MB/s\n",
+            prefetch[run], failures, elapsed, total / elapsed / 1e6);
+    }
+
+    HasherEngine* engine = CreateHasherEngine(0);
+    if (engine != NULL) {
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            drop_cache(filenames[idx]);
+        }
+
+        gettimeofday(&start, NULL);
+        int failures = HashFilesBatch(engine, requests, results, count, NULL);
+        gettimeofday(&end, NULL);
+        DestroyHasherEngine(engine);
+
+        double elapsed =
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("engine       failures %d: %8.3f s, %8.1f MB/s\n",
+            failures, elapsed, total / elapsed / 1e6);
+    }
+
+    /* The same again with every file submitted as a job, collected as the
+     * completion descriptor becomes readable. */
+    engine = CreateHasherEngine(0);
+    if (engine != NULL) {
+        HashCompletion completions[16];
+        struct pollfd completionFd;
+        uint32_t collected = 0;
+        int failures = 0;
+
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            drop_cache(filenames[idx]);
+        }
+
+        gettimeofday(&start, NULL);
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            SubmitHash(engine, &requests[idx]);
+        }
+
+        completionFd.fd = GetCompletionFd(engine);
+        completionFd.events = POLLIN;
+        while (collected < count && poll(&completionFd, 1, -1) > 0) {
+            int finished = PollCompletions(engine, completions, 16);
+            for (int idx = 0; idx < finished; ++idx) {
+                failures += completions[idx].status != 0;
+            }
+            collected += finished;
+        }
+        gettimeofday(&end, NULL);
+        DestroyHasherEngine(engine);
+
+        double elapsed =
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("jobs         failures %d: %8.3f s, %8.1f MB/s\n",
+            failures, elapsed, total / elapsed / 1e6);
+    }
+
+    /* And once more with the files of every device hashed in parallel. */
+    for (uint32_t idx = 0; idx < count; ++idx) {
+        drop_cache(filenames[idx]);
+    }
+
+    gettimeofday(&start, NULL);
+    int failures = HashFilesByDevice(requests, results, count, NULL);
+    gettimeofday(&end, NULL);
+
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("devices      failures %d: %8.3f s, %8.1f MB/s\n",
+        failures, elapsed, total / elapsed / 1e6);
+
+    free(requests);
+    free(results);
+}
+
+/**
+ * Converts a file name to a wide char array, the way the library expects it.
+ * @param  filename The name to convert.
+ * @return          The converted name (to be freed), or NULL on failure.
+ */
+static wchar_t* wide_name(const char* filename) {
+#if defined(__APPLE__)
+    locale_t utf8 = newlocale(LC_ALL_MASK, NULL, NULL);
+    size_t size = mbstowcs_l(NULL, filename, 0, utf8);
+    wchar_t* wfilename = (wchar_t*)malloc((size + 1) * sizeof(wchar_t));
+    size = mbstowcs_l(wfilename, filename, size + 1, utf8);
+#else
+    size_t size = mbstowcs(NULL, filename, 0);
+    wchar_t* wfilename = (wchar_t*)malloc((size + 1) * sizeof(wchar_t));
+    size = mbstowcs(wfilename, filename, size + 1);
+#endif
+    if (size == (size_t)-1) {
+        free(wfilename);
+        return NULL;
+    }
+
+    return wfilename;
+}
+
+/* The size of an ED2k block, and of the buffers the library reads. */
+#define TEST_BLOCKSIZE  9728000
+#define TEST_BUFFERSIZE (TEST_BLOCKSIZE / 10)
+
+/* The files written by run_tests: a batched small file, one a few buffers
+ * long, and two large enough for the engine to split into runs of blocks. */
+#define TEST_FILES 4
+static const uint64_t testSizes[TEST_FILES] = {
+    1000, TEST_BUFFERSIZE * 3 + 5, TEST_BLOCKSIZE * 4, TEST_BLOCKSIZE * 5 + 123
+};
+
+/* Every hash, and the combinations the engine splits into blocks. */
+static const int32_t testOptions[] = {
+    OPTION_ED2K | OPTION_CRC32 | OPTION_MD5 | OPTION_SHA1,
+    OPTION_ED2K, OPTION_CRC32, OPTION_ED2K | OPTION_CRC32
+};
+#define TEST_OPTIONS (sizeof(testOptions) / sizeof(testOptions[0]))
+
+/**
+ * Writes a file of pseudo-random data for run_tests.
+ * @param  filename The name of the file.
+ * @param  size     The size of the file.
+ * @param  seed     The seed of the data, so every file is different.
+ * @return          Returns 0 on success, -1 on failure.
+ */
+static int write_test_file(const char* filename, uint64_t size, uint32_t seed) {
+    static uint32_t buffer[256 * 1024];
+    uint32_t state = seed * 2654435761u + 1;
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (file == -1) {
+        return -1;
+    }
+
+    while (size > 0) {
+        size_t length = size < sizeof(buffer) ? (size_t)size : sizeof(buffer);
+
+        for (size_t idx = 0; idx < sizeof(buffer) / sizeof(buffer[0]); ++idx) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            buffer[idx] = state;
+        }
+
+        if (write(file, buffer, length) != (ssize_t)length) {
+            close(file);
+            return -1;
+        }
+        size -= length;
+    }
+
+    /* Dirty pages can't be dropped from the cache, so write them out for
+     * drop_cache. */
+    fsync(file);
+    close(file);
+    return 0;
+}
+
+/**
+ * Calculates every hash of a file with the core hash functions, one hash at a
+ * time, as the reference the library is checked against. run_tests restricts
+ * the core functions to their portable kernels first, so the reference shares
+ * neither the read paths nor the vector kernels of the library.
+ * @param  filename The name of the file.
+ * @param  result   Receives the hashes, laid out like HashRequest.result.
+ * @return          Returns 0 on success, -1 if the file can't be read.
+ */
+static int reference_hashes(const char* filename, unsigned char* result) {
+    static unsigned char buffer[TEST_BUFFERSIZE];
+    MD4_Context block;
+    MD4_Context root;
+    CRC32_Context crc32;
+    MD5_Context md5;
+    SHA1_Context sha1;
+    unsigned char digest[16];
+    uint32_t used = 0;
+    uint32_t blocks = 0;
+    ssize_t bytesRead;
+    int file = open(filename, O_RDONLY);
+
+    if (file == -1) {
+        return -1;
+    }
+
+    MD4_init(&block);
+    MD4_init(&root);
+    CRC32_init(&crc32);
+    MD5_init(&md5);
+    SHA1_init(&sha1);
+
+    while ((bytesRead = read(file, buffer, sizeof(buffer))) > 0) {
+        const unsigned char* data = buffer;
+        uint32_t length = (uint32_t)bytesRead;
+
+        CRC32_update(&crc32, buffer, length);
+        MD5_update(&md5, buffer, length);
+        SHA1_update(&sha1, buffer, length);
+
+        /* A block is only finished once more data follows it, so a file that
+         * ends on a block boundary doesn't get an empty block. */
+        while (length > 0) {
+            uint32_t piece = TEST_BLOCKSIZE - used < length ?
+                TEST_BLOCKSIZE - used : length;
+
+            if (used == TEST_BLOCKSIZE) {
+                MD4_final(&block, digest);
+                MD4_update(&root, digest, 16);
+                MD4_init(&block);
+                used = 0;
+                ++blocks;
+                continue;
+            }
+
+            MD4_update(&block, data, piece);
+            used += piece;
+            data += piece;
+            length -= piece;
+        }
+    }
+
+    close(file);
+    if (bytesRead != 0) {
+        return -1;
+    }
+
+    /* The ED2k hash of a single block is the hash of the block itself. */
+    MD4_final(&block, digest);
+    if (blocks == 0) {
+        memcpy(&result[0], digest, 16);
+    } else {
+        MD4_update(&root, digest, 16);
+        MD4_final(&root, &result[0]);
+    }
+
+    CRC32_final(&crc32, &result[16]);
+    MD5_final(&md5, &result[20]);
+    SHA1_final(&sha1, &result[36]);
+    return 0;
+}
+
+/**
+ * Copies the hashes a request asks for out of a reference_hashes result, and
+ * zeros the rest, as the library does.
+ * @param reference The result of reference_hashes.
+ * @param options   The hashes requested.
+ * @param result    Receives the expected result of the request.
+ */
+static void select_hashes(const unsigned char* reference, int32_t options,
+    unsigned char* result) {
+    memset(result, 0, 56);
+    if (options & OPTION_ED2K) {
+        memcpy(&result[0], &reference[0], 16);
+    }
+    if (options & OPTION_CRC32) {
+        memcpy(&result[16], &reference[16], 4);
+    }
+    if (options & OPTION_MD5) {
+        memcpy(&result[20], &reference[20], 16);
+    }
+    if (options & OPTION_SHA1) {
+        memcpy(&result[36], &reference[36], 20);
+    }
+}
+
+/**
+ * Checks whether a result is all zeros, as it is for a request that failed.
+ * @param  result The result of a request.
+ * @return        Returns 1 if every byte is zero.
+ */
+static int is_empty(const unsigned char* result) {
+    for (int idx = 0; idx < 56; ++idx) {
+        if (result[idx] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Checks that HashFileWithSyncIO gives the reference results for every file
+ * and option.
+ * @param  wfilenames The test files.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_sync(wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    int failures = 0;
+
+    for (size_t option = 0; option < TEST_OPTIONS; ++option) {
+        for (int idx = 0; idx < TEST_FILES; ++idx) {
+            HashRequest request;
+
+            memset(&request, 0, sizeof(HashRequest));
+            request.filename = wfilenames[idx];
+            request.options = testOptions[option];
+            failures += HashFileWithSyncIO(&request, NULL) != 0 ||
+                memcmp(request.result, expected[option][idx], 56) != 0;
+        }
+    }
+
+    printf("Sync: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks that HashFileWithAsyncIO gives the reference results for the files
+ * larger than a buffer with one read in flight and with several, dropping
+ * each file from the cache first so the reads go through the queue rather
+ * than a mapping. The pipeline is turned off, so every hash and the ED2k and
+ * CRC32 pair are read through the queue as well.
+ * @param  filenames  The test files.
+ * @param  wfilenames The same names as wide char arrays.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_async(char** filenames, wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const char* depths[] = { "1", "8" };
+    const size_t options[] = { 0, TEST_OPTIONS - 1 };
+    int failures = 0;
+
+    setenv("JMMHASHER_PIPELINE", "0", 1);
+    for (int depth = 0; depth < 2; ++depth) {
+        setenv("JMMHASHER_QUEUE_DEPTH", depths[depth], 1);
+
+        for (int option = 0; option < 2; ++option) {
+            for (int idx = 1; idx < TEST_FILES; ++idx) {
+                HashRequest request;
+
+                memset(&request, 0, sizeof(HashRequest));
+                request.filename = wfilenames[idx];
+                request.options = testOptions[options[option]];
+                drop_cache(filenames[idx]);
+                failures += HashFileWithAsyncIO(&request, NULL) != 0 ||
+                    memcmp(request.result, expected[options[option]][idx], 56) != 0;
+            }
+        }
+    }
+    unsetenv("JMMHASHER_QUEUE_DEPTH");
+    unsetenv("JMMHASHER_PIPELINE");
+
+    printf("Async: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/* The calls counting_callback has seen, the progress of the last one, and the
+ * call to cancel on (0 to never cancel). */
+static uint32_t callbackCalls;
+static uint64_t callbackProgress;
+static uint32_t cancelCall;
+
+/**
+ * Progress callback counting its calls, and cancelling on call cancelCall.
+ * @param  tag      The optional tag.
+ * @param  progress The total number of bytes read.
+ * @return          Returns 1 on call cancelCall and 0 otherwise.
+ */
+static int counting_callback(int tag, uint64_t progress) {
+    callbackProgress = progress;
+    return ++callbackCalls == cancelCall;
+}
+
+/**
+ * Hashes a file with HashFileWithSyncIO through counting_callback.
+ * @param  wfilename The file to hash.
+ * @param  options   The hashes to calculate.
+ * @param  cancel    The call to cancel on, or 0 to hash the whole file.
+ * @param  result    Receives the result of the request.
+ * @return           The value returned by HashFileWithSyncIO.
+ */
+static int counted_hash(wchar_t* wfilename, int32_t options, uint32_t cancel,
+    unsigned char* result) {
+    HashRequest request;
+    int status;
+
+    memset(&request, 0, sizeof(HashRequest));
+    request.filename = wfilename;
+    request.options = options;
+    callbackCalls = 0;
+    callbackProgress = 0;
+    cancelCall = cancel;
+    status = HashFileWithSyncIO(&request, counting_callback);
+    memcpy(result, request.result, 56);
+
+    return status;
+}
+
+/**
+ * Checks the thread reading files ahead of HashFileWithSyncIO. The files larger
+ * than a buffer are dropped from the cache and hashed with more than one hash
+ * and the pipeline turned off, so they're read by the thread rather than
+ * mapped. Each gives the reference result and reports its size at the end.
+ * Cancelling on the first few progress callbacks gives -9 and no result
+ * without calling back again, as it does for a cached file hashed without
+ * the thread.
+ * @param  filenames  The test files.
+ * @param  wfilenames The same names as wide char arrays.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_reader(char** filenames, wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const size_t options[] = { 0, TEST_OPTIONS - 1 };
+    unsigned char result[56];
+    int failures = 0;
+
+    setenv("JMMHASHER_PIPELINE", "0", 1);
+    for (int option = 0; option < 2; ++option) {
+        for (int idx = 1; idx < TEST_FILES; ++idx) {
+            drop_cache(filenames[idx]);
+            failures += counted_hash(wfilenames[idx],
+                testOptions[options[option]], 0, result) != 0 ||
+                memcmp(result, expected[options[option]][idx], 56) != 0 ||
+                callbackProgress != testSizes[idx];
+        }
+    }
+
+    /* The callback runs every 10 buffers, five times before the end of the
+     * last file. */
+    for (int cached = 0; cached < 2; ++cached) {
+        /* Hashing the whole file reads all of it back into the cache. */
+        if (cached) {
+            failures += counted_hash(wfilenames[TEST_FILES - 1],
+                testOptions[0], 0, result) != 0;
+        }
+
+        for (uint32_t cancel = 1; cancel <= 3; ++cancel) {
+            if (!cached) {
+                drop_cache(filenames[TEST_FILES - 1]);
+            }
+
+            failures += counted_hash(wfilenames[TEST_FILES - 1],
+                testOptions[0], cancel, result) != -9 || !is_empty(result) ||
+                callbackCalls != cancel ||
+                callbackProgress != (uint64_t)TEST_BUFFERSIZE * (10 * cancel - 9);
+        }
+    }
+    unsetenv("JMMHASHER_PIPELINE");
+
+    printf("Reader: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Counts the threads of the process where the platform allows it.
+ * @return The number of threads, or 0 if they can't be counted.
+ */
+static int count_threads(void) {
+    int threads = 0;
+#if defined(__linux__)
+    char line[256];
+    FILE* status = fopen("/proc/self/status", "r");
+
+    if (status == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Threads: %d", &threads) == 1) {
+            break;
+        }
+    }
+    fclose(status);
+#endif
+    return threads;
+}
+
+/**
+ * Checks the pipeline that hashes every requested hash of a file on a thread
+ * of its own, forced on with JMMHASHER_PIPELINE. The files larger than a
+ * buffer give the reference results for all four hashes and for the ED2k and
+ * CRC32 pair, merged from one consumer per hash, both cold and cached, and
+ * cold with OPTION_DROPBEHIND. Cancelling on the second and third progress
+ * callbacks, with buffers still in the ring, gives -9 and no result, and
+ * every consumer thread is gone when the call returns.
+ * @param  filenames  The test files.
+ * @param  wfilenames The same names as wide char arrays.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_pipeline(char** filenames, wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const size_t options[] = { 0, TEST_OPTIONS - 1 };
+    unsigned char result[56];
+    int threads = count_threads();
+    int failures = 0;
+
+    setenv("JMMHASHER_PIPELINE", "1", 1);
+    for (int cached = 0; cached < 2; ++cached) {
+        for (int option = 0; option < 2; ++option) {
+            for (int idx = 1; idx < TEST_FILES; ++idx) {
+                if (!cached) {
+                    drop_cache(filenames[idx]);
+                }
+
+                failures += counted_hash(wfilenames[idx],
+                    testOptions[options[option]], 0, result) != 0 ||
+                    memcmp(result, expected[options[option]][idx], 56) != 0 ||
+                    callbackProgress != testSizes[idx];
+            }
+        }
+    }
+
+    /* Files that bypass the cache are only mapped when they're cached. */
+    for (int idx = 1; idx < TEST_FILES; ++idx) {
+        drop_cache(filenames[idx]);
+        failures += counted_hash(wfilenames[idx],
+            testOptions[0] | OPTION_DROPBEHIND, 0, result) != 0 ||
+            memcmp(result, expected[0][idx], 56) != 0;
+    }
+
+    for (uint32_t cancel = 2; cancel <= 3; ++cancel) {
+        drop_cache(filenames[TEST_FILES - 1]);
+        failures += counted_hash(wfilenames[TEST_FILES - 1], testOptions[0],
+            cancel, result) != -9 || !is_empty(result) ||
+            callbackCalls != cancel || count_threads() != threads;
+    }
+    unsetenv("JMMHASHER_PIPELINE");
+
+    printf("Pipeline: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks the striped reads of files on network mounts by hashing the files
+ * larger than a buffer with OPTION_NETWORK, cold so they aren't mapped, under
+ * several JMMHASHER_STRIPES settings: none, the smallest and largest stripes
+ * and depth, a depth below the number of stripes, a list of malformed entries
+ * that all fall back to the defaults, and an entry for a directory with '='
+ * in its name. Each gives the reference result.
+ * @param  directory  The directory of the test files.
+ * @param  filenames  The test files.
+ * @param  wfilenames The same names as wide char arrays.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_striped(const char* directory, char** filenames,
+    wchar_t** wfilenames, unsigned char expected[][TEST_FILES][56]) {
+    char equalsPath[PATH_MAX];
+    char equalsEntry[PATH_MAX + 64];
+    const char* settings[] = {
+        NULL, "1x1", "16x32", "8x2", "abc;0x4;17x2;4x;x3;2x33;;3x", equalsEntry
+    };
+    const size_t count = sizeof(settings) / sizeof(settings[0]);
+    int failures = 0;
+
+    /* The last '=' of an entry ends the path. */
+    snprintf(equalsPath, sizeof(equalsPath), "%s/libhashertest=stripes",
+        directory);
+    snprintf(equalsEntry, sizeof(equalsEntry),
+        "%s=2x3;/nonexistent/libhashertest=1x1;16x16", equalsPath);
+    if (mkdir(equalsPath, 0700) != 0 && errno != EEXIST) {
+        printf("Striped: FAILED (unable to create %s)\n", equalsPath);
+        return 1;
+    }
+
+    for (size_t setting = 0; setting < count; ++setting) {
+        if (settings[setting] != NULL) {
+            setenv("JMMHASHER_STRIPES", settings[setting], 1);
+        }
+
+        /* Every option with the defaults, all of the hashes with the rest. */
+        for (size_t option = 0; option < (setting == 0 ? TEST_OPTIONS : 1);
+            ++option) {
+            for (int idx = 1; idx < TEST_FILES; ++idx) {
+                HashRequest request;
+
+                memset(&request, 0, sizeof(HashRequest));
+                request.filename = wfilenames[idx];
+                request.options = testOptions[option] | OPTION_NETWORK;
+                drop_cache(filenames[idx]);
+                failures += HashFileWithSyncIO(&request, NULL) != 0 ||
+                    memcmp(request.result, expected[option][idx], 56) != 0;
+            }
+        }
+    }
+    unsetenv("JMMHASHER_STRIPES");
+    rmdir(equalsPath);
+
+    printf("Striped: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks that HashFilesWithSyncIO gives the reference results for every
+ * option.
+ * @param  wfilenames The test files.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_batches(wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    HashRequest requests[TEST_FILES];
+    int32_t results[TEST_FILES];
+    int failures = 0;
+
+    for (size_t option = 0; option < TEST_OPTIONS; ++option) {
+        memset(requests, 0, sizeof(requests));
+        for (int idx = 0; idx < TEST_FILES; ++idx) {
+            requests[idx].tag = idx;
+            requests[idx].filename = wfilenames[idx];
+            requests[idx].options = testOptions[option];
+        }
+
+        failures += HashFilesWithSyncIO(requests, results, TEST_FILES, NULL) != 0;
+        for (int idx = 0; idx < TEST_FILES; ++idx) {
+            failures += results[idx] != 0 ||
+                memcmp(requests[idx].result, expected[option][idx], 56) != 0;
+        }
+    }
+
+    printf("Batches: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/* The most threads threads_callback has seen. */
+static int callbackThreads;
+
+/**
+ * Progress callback recording the most threads the process had while it was
+ * hashing.
+ * @param  tag      The optional tag.
+ * @param  progress The total number of bytes read.
+ * @return          Return 0 to continue hashing.
+ */
+static int threads_callback(int tag, uint64_t progress) {
+    int threads = count_threads();
+
+    if (threads > callbackThreads) {
+        callbackThreads = threads;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that HashFilesByDevice gives the reference results for every option,
+ * and hashes each file on the one thread of its device rather than splitting
+ * it: a large file by itself, hashed for the CRC32 alone, with the pipeline
+ * forced on, and cold with it off, never runs more than the device's thread
+ * next to this one.
+ * @param  filenames  The test files.
+ * @param  wfilenames The same names as wide char arrays.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_devices(char** filenames, wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const char* pipeline[] = { NULL, "1", "0" };
+    const size_t options[] = { 2, 0, 0 };
+    HashRequest requests[TEST_FILES];
+    int32_t results[TEST_FILES];
+    int threads = count_threads();
+    int failures = 0;
+
+    for (size_t option = 0; option < TEST_OPTIONS; ++option) {
+        memset(requests, 0, sizeof(requests));
+        for (int idx = 0; idx < TEST_FILES; ++idx) {
+            requests[idx].tag = idx;
+            requests[idx].filename = wfilenames[idx];
+            requests[idx].options = testOptions[option];
+        }
+
+        failures += HashFilesByDevice(requests, results, TEST_FILES, NULL) != 0;
+        for (int idx = 0; idx < TEST_FILES; ++idx) {
+            failures += results[idx] != 0 ||
+                memcmp(requests[idx].result, expected[option][idx], 56) != 0;
+        }
+    }
+
+    for (int mode = 0; mode < 3; ++mode) {
+        if (pipeline[mode] != NULL) {
+            setenv("JMMHASHER_PIPELINE", pipeline[mode], 1);
+        }
+        if (mode == 2) {
+            drop_cache(filenames[TEST_FILES - 1]);
+        }
+
+        memset(requests, 0, sizeof(HashRequest));
+        requests[0].filename = wfilenames[TEST_FILES - 1];
+        requests[0].options = testOptions[options[mode]];
+        callbackThreads = 0;
+        failures += HashFilesByDevice(requests, results, 1,
+            threads_callback) != 0 ||
+            memcmp(requests[0].result,
+                expected[options[mode]][TEST_FILES - 1], 56) != 0 ||
+            callbackThreads > threads + 1;
+    }
+    unsetenv("JMMHASHER_PIPELINE");
+
+    printf("Devices: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Hashes every test file with HashFilesBatch on a new engine and checks the
+ * results against the reference.
+ * @param  workers    The number of workers of the engine.
+ * @param  wfilenames The test files.
+ * @param  options    The hashes to calculate.
+ * @param  expected   The reference results for each file.
+ * @return            The number of failures found.
+ */
+static int check_engine_batch(uint32_t workers, wchar_t** wfilenames,
+    int32_t options, unsigned char expected[][56]) {
+    HashRequest requests[TEST_FILES];
+    int32_t results[TEST_FILES];
+    int failures;
+
+    HasherEngine* engine = CreateHasherEngine(workers);
+    if (engine == NULL) {
+        return 1;
+    }
+
+    memset(requests, 0, sizeof(requests));
+    for (int idx = 0; idx < TEST_FILES; ++idx) {
+        requests[idx].tag = idx;
+        requests[idx].filename = wfilenames[idx];
+        requests[idx].options = options;
+    }
+
+    failures = HashFilesBatch(engine, requests, results, TEST_FILES, NULL) != 0;
+    DestroyHasherEngine(engine);
+
+    for (int idx = 0; idx < TEST_FILES; ++idx) {
+        failures += results[idx] != 0 ||
+            memcmp(requests[idx].result, expected[idx], 56) != 0;
+    }
+
+    return failures;
+}
+
+/**
+ * Checks that HashFilesBatch gives the reference results on engines of one and
+ * three workers, for the hashes that keep every file whole.
+ * @param  wfilenames The test files.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_engine(wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const uint32_t workers[] = { 1, 3 };
+    int failures = 0;
+
+    for (int engine = 0; engine < 2; ++engine) {
+        failures += check_engine_batch(workers[engine], wfilenames,
+            testOptions[0], expected[0]);
+    }
+
+    printf("Engine: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks the files HashFilesBatch splits into runs of ED2k blocks: the two
+ * large files hashed for the ED2k hash, the CRC32 or both give the reference
+ * results on an engine of one worker, which hashes every run itself, and on
+ * one of three, whose idle workers steal the runs of the file another worker
+ * is hashing.
+ * @param  wfilenames The test files.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_runs(wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    const uint32_t workers[] = { 1, 3 };
+    int failures = 0;
+
+    for (size_t option = 1; option < TEST_OPTIONS; ++option) {
+        for (int engine = 0; engine < 2; ++engine) {
+            failures += check_engine_batch(workers[engine], wfilenames,
+                testOptions[option], expected[option]);
+        }
+    }
+
+    printf("Runs: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks a job collected from an engine against the expected result: cancelled
+ * jobs end with -9 and no result, the rest with the reference result.
+ * @param  completion The collected job.
+ * @param  cancelled  Non-zero if the job was cancelled.
+ * @param  expected   The expected result.
+ * @return            The number of failures found.
+ */
+static int check_job(const HashCompletion* completion, int cancelled,
+    const unsigned char* expected) {
+    if (cancelled) {
+        return completion->status != -9 || !is_empty(completion->request->result);
+    }
+
+    return completion->status != 0 ||
+        memcmp(completion->request->result, expected, 56) != 0;
+}
+
+/**
+ * Checks the jobs of SubmitHash: they're collected through the completion
+ * descriptor with the reference results, queued and running jobs can be
+ * cancelled, WaitCompletions waits out its timeout once nothing is left, and
+ * finished jobs can't be cancelled.
+ * @param  wfilenames The test files.
+ * @param  expected   The reference results for each option of testOptions and
+ *                    each file.
+ * @return            The number of failures found.
+ */
+static int test_jobs(wchar_t** wfilenames,
+    unsigned char expected[][TEST_FILES][56]) {
+    HashRequest requests[TEST_FILES * TEST_OPTIONS];
+    int64_t ids[TEST_FILES * TEST_OPTIONS];
+    HashCompletion completions[8];
+    struct pollfd completionFd;
+    struct timespec start;
+    struct timespec end;
+    uint32_t count = TEST_FILES * TEST_OPTIONS;
+    uint32_t collected = 0;
+    int failures = 0;
+
+    /* Every file with every option, harvested as the descriptor becomes
+     * readable. */
+    HasherEngine* engine = CreateHasherEngine(2);
+    if (engine == NULL) {
+        printf("Jobs: FAILED (no engine)\n");
+        return 1;
+    }
+
+    memset(requests, 0, sizeof(requests));
+    for (uint32_t idx = 0; idx < count; ++idx) {
+        requests[idx].tag = (int32_t)idx;
+        requests[idx].filename = wfilenames[idx % TEST_FILES];
+        requests[idx].options = testOptions[idx / TEST_FILES];
+        ids[idx] = SubmitHash(engine, &requests[idx]);
+        failures += ids[idx] <= 0;
+    }
+
+    completionFd.fd = GetCompletionFd(engine);
+    completionFd.events = POLLIN;
+    while (collected < count && poll(&completionFd, 1, 10000) > 0) {
+        int finished = PollCompletions(engine, completions, 8);
+
+        failures += finished <= 0;
+        for (int idx = 0; idx < finished; ++idx) {
+            uint32_t job = (uint32_t)completions[idx].request->tag;
+
+            failures += completions[idx].job != ids[job];
+            failures += check_job(&completions[idx], 0,
+                expected[job / TEST_FILES][job % TEST_FILES]);
+        }
+        collected += finished > 0 ? (uint32_t)finished : 0;
+    }
+
+    failures += collected != count;
+    failures += poll(&completionFd, 1, 0) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    failures += WaitCompletions(engine, completions, 8, 50) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long waited = (end.tv_sec - start.tv_sec) * 1000L +
+        (end.tv_nsec - start.tv_nsec) / 1000000L;
+    failures += waited < 45 || waited > 5000;
+    failures += CancelHash(engine, ids[0]) != -1;
+    failures += CancelHash(engine, 0) != -1;
+    DestroyHasherEngine(engine);
+
+    /* With a single worker busy on the largest file, the jobs behind it are
+     * still queued when they're cancelled. Then cancel a running job, once on
+     * the regular path and once while it's split into runs of blocks. */
+    for (size_t option = 0; option < 2; ++option) {
+        int32_t options = testOptions[option == 0 ? 0 : TEST_OPTIONS - 1];
+        int cancelled[3];
+
+        engine = CreateHasherEngine(1);
+        if (engine == NULL) {
+            ++failures;
+            continue;
+        }
+
+        memset(requests, 0, sizeof(requests));
+        for (uint32_t idx = 0; idx < 3; ++idx) {
+            requests[idx].tag = (int32_t)idx;
+            requests[idx].filename = wfilenames[TEST_FILES - 1];
+            requests[idx].options = options;
+            ids[idx] = SubmitHash(engine, &requests[idx]);
+        }
+
+        cancelled[2] = CancelHash(engine, ids[2]) == 0;
+        failures += !cancelled[2];
+        cancelled[1] = 0;
+
+        /* The first job is running by now, unless it's finished already. */
+        usleep(20000);
+        cancelled[0] = PollCompletions(engine, completions, 8) == 0 &&
+            CancelHash(engine, ids[0]) == 0;
+
+        for (collected = 0; collected < 3;) {
+            int finished = WaitCompletions(engine, completions, 8, 10000);
+            if (finished <= 0) {
+                ++failures;
+                break;
+            }
+
+            for (int idx = 0; idx < finished; ++idx) {
+                uint32_t job = (uint32_t)completions[idx].request->tag;
+                size_t expectedOption = option == 0 ? 0 : TEST_OPTIONS - 1;
+
+                failures += check_job(&completions[idx], cancelled[job],
+                    expected[expectedOption][TEST_FILES - 1]);
+            }
+            collected += (uint32_t)finished;
+        }
+
+        DestroyHasherEngine(engine);
+    }
+
+    printf("Jobs: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks that a sparse file, a few extents of data with holes between them and
+ * at the end, gives the reference results for every option with the holes
+ * skipped, and with option 0x10 and OPTION_NETWORK, which read them instead.
+ * @param  directory The directory to write the test file to.
+ * @return           The number of failures found.
+ */
+static int test_sparse(const char* directory) {
+    static unsigned char data[200000];
+    const uint64_t size = TEST_BLOCKSIZE * 5 + 123;
+    const uint64_t extents[][2] = {
+        { 0, 100000 },
+        { TEST_BLOCKSIZE * 2 - 50000, 100000 },
+        { TEST_BLOCKSIZE * 3 + 12345, 200000 },
+        { size - 5000, 5000 }
+    };
+    const int32_t readOptions[] = { 0, OPTION_DIRECTIO, OPTION_NETWORK };
+    unsigned char reference[56];
+    unsigned char expected[56];
+    char filename[PATH_MAX];
+    uint32_t state = 12345;
+    int failures = 0;
+
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        state = state * 1103515245u + 12345u;
+        data[idx] = (unsigned char)(state >> 24);
+    }
+
+    snprintf(filename, sizeof(filename), "%s/libhashertest.sparse", directory);
+    wchar_t* wfilename = wide_name(filename);
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (wfilename == NULL || file == -1 || ftruncate(file, (off_t)size) != 0) {
+        printf("Sparse: FAILED (unable to write %s)\n", filename);
+        if (file != -1) {
+            close(file);
+        }
+        free(wfilename);
+        return 1;
+    }
+
+    for (size_t idx = 0; idx < sizeof(extents) / sizeof(extents[0]); ++idx) {
+        failures += pwrite(file, data, (size_t)extents[idx][1],
+            (off_t)extents[idx][0]) != (ssize_t)extents[idx][1];
+    }
+    fsync(file);
+    close(file);
+
+    failures += reference_hashes(filename, reference) != 0;
+    for (size_t read = 0; read < 3; ++read) {
+        for (size_t option = 0; option < (read == 0 ? TEST_OPTIONS : 1);
+            ++option) {
+            HashRequest request;
+
+            memset(&request, 0, sizeof(HashRequest));
+            request.filename = wfilename;
+            request.options = testOptions[option] | readOptions[read];
+            select_hashes(reference, testOptions[option], expected);
+            drop_cache(filename);
+            failures += HashFileWithSyncIO(&request, NULL) != 0 ||
+                memcmp(request.result, expected, 56) != 0;
+        }
+    }
+
+    unlink(filename);
+    free(wfilename);
+
+    printf("Sparse: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/* The file truncate_callback shrinks, and whether it has yet. */
+static const char* truncateName;
+static int truncated;
+
+/**
+ * Progress callback for test_truncated. Shrinks the file to a little over two
+ * buffers the first time it's called.
+ * @param  tag      The optional tag.
+ * @param  progress The total number of bytes read.
+ * @return          Return 0 to continue hashing.
+ */
+static int truncate_callback(int tag, uint64_t progress) {
+    if (!truncated) {
+        truncated = 1;
+        if (truncate(truncateName, TEST_BUFFERSIZE * 2 + 100) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * A way of hashing a file for check_truncated.
+ * @field options The options of the request.
+ * @field how     's' to hash it with HashFileWithSyncIO, 'a' with
+ *                HashFileWithAsyncIO, 'e' with HashFilesBatch.
+ * @field cold    Non-zero to drop the file from the cache before hashing it.
+ * @field sparse  Non-zero to leave everything past the first three buffers of
+ *                the file in a hole.
+ */
+typedef struct TruncatedCase {
+    int32_t options;
+    char how;
+    char cold;
+    char sparse;
+} TruncatedCase;
+
+/**
+ * Writes a file of four ED2k blocks, hashes it the way a TruncatedCase asks
+ * while truncate_callback shrinks it, and checks the result against the
+ * reference results of what's left of it.
+ * @param  filename  The name of the file.
+ * @param  wfilename The same name as a wide char array.
+ * @param  test      The way of hashing the file.
+ * @return           The number of failures found.
+ */
+static int check_truncated(const char* filename, wchar_t* wfilename,
+    const TruncatedCase* test) {
+    unsigned char reference[56];
+    unsigned char expected[56];
+    HashRequest request;
+    int32_t result = 0;
+    int status;
+
+    if (write_test_file(filename, test->sparse ? TEST_BUFFERSIZE * 3 :
+        TEST_BLOCKSIZE * 4, TEST_FILES) != 0 ||
+        truncate(filename, TEST_BLOCKSIZE * 4) != 0) {
+        return 1;
+    }
+
+    if (test->cold) {
+        drop_cache(filename);
+    }
+
+    truncateName = filename;
+    truncated = 0;
+    memset(&request, 0, sizeof(HashRequest));
+    request.filename = wfilename;
+    request.options = test->options;
+    if (test->how == 'a') {
+        status = HashFileWithAsyncIO(&request, truncate_callback);
+    } else if (test->how == 'e') {
+        HasherEngine* engine = CreateHasherEngine(1);
+        if (engine == NULL) {
+            return 1;
+        }
+
+        status = HashFilesBatch(engine, &request, &result, 1, truncate_callback);
+        status = status != 0 ? status : result;
+        DestroyHasherEngine(engine);
+    } else {
+        status = HashFileWithSyncIO(&request, truncate_callback);
+    }
+
+    if (reference_hashes(filename, reference) != 0) {
+        return 1;
+    }
+
+    select_hashes(reference, test->options, expected);
+    return !truncated || status != 0 || memcmp(request.result, expected, 56) != 0;
+}
+
+/**
+ * Checks that a file that shrinks while it's hashed gives the reference results
+ * of what's left of it on every way of reading it that doesn't read it in
+ * order: out of a mapping, in parallel ranges, in vector lanes, in stripes,
+ * with io_uring, around holes and in runs of blocks on an engine. Each of them
+ * hands the file back to the read loop instead of hashing a mix of what was
+ * read before and after it shrank.
+ * @param  directory The directory to write the test file to.
+ * @return           The number of failures found.
+ */
+static int test_truncated(const char* directory) {
+    /* A single hash isn't pipelined, so the freshly written file is mapped.
+     * The CRC32 alone is split into ranges on a machine with several cores,
+     * the ED2k alone into lanes on one with AVX2. The rest of the paths only
+     * read files that aren't cached. */
+    const TruncatedCase tests[] = {
+        { OPTION_SHA1, 's', 0, 0 },
+        { OPTION_CRC32, 's', 0, 0 },
+        { OPTION_ED2K, 's', 0, 0 },
+        { OPTION_SHA1 | OPTION_NETWORK, 's', 1, 0 },
+        { OPTION_SHA1, 'a', 1, 0 },
+        { OPTION_SHA1, 's', 1, 1 },
+        { OPTION_ED2K | OPTION_CRC32, 'e', 1, 0 }
+    };
+    char filename[PATH_MAX];
+    int failures = 0;
+
+    snprintf(filename, sizeof(filename), "%s/libhashertest.truncated", directory);
+    wchar_t* wfilename = wide_name(filename);
+    if (wfilename == NULL) {
+        printf("Truncated: FAILED (unable to convert %s)\n", filename);
+        return 1;
+    }
+
+    for (size_t idx = 0; idx < sizeof(tests) / sizeof(tests[0]); ++idx) {
+        failures += check_truncated(filename, wfilename, &tests[idx]);
+    }
+
+    unlink(filename);
+    free(wfilename);
+
+    printf("Truncated: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Writes the test files to a directory and checks the library against the
+ * results of the core hash functions.
+ * @param  directory The directory to write the test files to.
+ * @return           The number of failures found.
+ */
+static int run_tests(const char* directory) {
+    static unsigned char expected[TEST_OPTIONS][TEST_FILES][56];
+    unsigned char reference[56];
+    char* filenames[TEST_FILES];
+    wchar_t* wfilenames[TEST_FILES];
+    int failures = 0;
+
+    for (int idx = 0; idx < TEST_FILES; ++idx) {
+        size_t length = strlen(directory) + 32;
+
+        filenames[idx] = (char*)malloc(length);
+        if (filenames[idx] == NULL) {
+            fprintf(stderr, "Unable to allocate the file list.\n");
+            return 1;
+        }
+
+        snprintf(filenames[idx], length, "%s/libhashertest.%d", directory, idx);
+        wfilenames[idx] = wide_name(filenames[idx]);
+        if (wfilenames[idx] == NULL ||
+            write_test_file(filenames[idx], testSizes[idx], idx) != 0) {
+            fprintf(stderr, "Unable to write %s.\n", filenames[idx]);
+            return 1;
+        }
+    }
+
+    /* Only this program's copy of the core functions is restricted, the
+     * library still picks the best kernels for the CPU. */
+    CPU_restrict(0);
+    for (int idx = 0; idx < TEST_FILES; ++idx) {
+        if (reference_hashes(filenames[idx], reference) != 0) {
+            fprintf(stderr, "Unable to read %s.\n", filenames[idx]);
+            return 1;
+        }
+
+        for (size_t option = 0; option < TEST_OPTIONS; ++option) {
+            select_hashes(reference, testOptions[option], expected[option][idx]);
+        }
+    }
+
+    failures += test_sync(wfilenames, expected);
+    failures += test_async(filenames, wfilenames, expected);
+    failures += test_reader(filenames, wfilenames, expected);
+    failures += test_pipeline(filenames, wfilenames, expected);
+    failures += test_striped(directory, filenames, wfilenames, expected);
+    failures += test_sparse(directory);
+    failures += test_batches(wfilenames, expected);
+    failures += test_devices(filenames, wfilenames, expected);
+    failures += test_engine(wfilenames, expected);
+    failures += test_runs(wfilenames, expected);
+    failures += test_jobs(wfilenames, expected);
+    failures += test_truncated(directory);
+
+    for (int idx = 0; idx < TEST_FILES; ++idx) {
+        unlink(filenames[idx]);
+        free(filenames[idx]);
+        free(wfilenames[idx]);
+    }
+
+    return failures;
+}
+
 /**
  * Receives the callback from the hasher. Simply prints a *
  * to stdout for every call and flushes the buffer.
@@ -59,25 +1529,84 @@ static void print_hash(char* hash, unsigned char* result, uint32_t length) {
 
 /**
  * Main entry point for the test program.
- * @param  argc Unused.
- * @param  argv argv[1] contains the file to hash.
+ * @param  argc The number of arguments.
+ * @param  argv argv[1] contains the file to hash. Passing --bench as argv[2]
+ *              times the synchronous and asynchronous IO instead, calculating
+ *              the hashes selected by the options in argv[3] (all of them by
+ *              default). Passing --cache as argv[2] and the name of another
+ *              (cached) file as argv[3] measures the effect of the cache
+ *              bypassing options instead, with the options in argv[4].
+ *              Passing --batch as argv[2] times HashFilesWithSyncIO on
+ *              argv[1] and every file after --batch with several prefetch
+ *              settings, HashFilesBatch, SubmitHash and HashFilesByDevice
+ *              on the same files, calculating all of the hashes. Passing
+ *              --test as argv[1] writes test files to the directory in
+ *              argv[2] (/tmp by default) and checks the library against
+ *              the core hash functions.
  * @return      Returns negative on failure, zero on success.
  */
 int main(int argc, char** argv) {
     char* mbsfilename = argv[1];
 
+    if (argc < 2) {
+        fprintf(stderr, "NO INPUT FILE\n");
+        return -1;
+    }
+
     /* Convert the filename from char* to wchar_t* to test the
      * library. It's a pain, but it's designed to be called from
      * python, not C. */
-    locale_t utf8 = newlocale(LC_ALL_MASK, NULL, NULL);
-    size_t size = mbstowcs_l(NULL, mbsfilename, 0, utf8);
-    wchar_t* wfilename = (wchar_t*)malloc(size * sizeof(wchar_t));
-    size = mbstowcs_l(wfilename, mbsfilename, size, utf8);
-    if (size == -1) {
+#if !defined(__APPLE__)
+    setlocale(LC_CTYPE, "C.UTF-8");
+#endif
+    if (strcmp(argv[1], "--test") == 0) {
+        return run_tests(argc > 2 ? argv[2] : "/tmp") ? -1 : 0;
+    }
+
+    wchar_t* wfilename = wide_name(mbsfilename);
+    if (wfilename == NULL) {
         fprintf(stderr, "Error converting string.\n");
         return -1;
     }
 
+    if (argc > 3 && strcmp(argv[2], "--batch") == 0) {
+        uint32_t count = (uint32_t)argc - 2;
+        char** filenames = (char**)malloc(count * sizeof(char*));
+        wchar_t** wfilenames = (wchar_t**)malloc(count * sizeof(wchar_t*));
+
+        if (filenames == NULL || wfilenames == NULL) {
+            fprintf(stderr, "Unable to allocate the file list.\n");
+            return -1;
+        }
+
+        filenames[0] = mbsfilename;
+        wfilenames[0] = wfilename;
+        for (uint32_t idx = 1; idx < count; ++idx) {
+            filenames[idx] = argv[idx + 2];
+            wfilenames[idx] = wide_name(argv[idx + 2]);
+            if (wfilenames[idx] == NULL) {
+                fprintf(stderr, "Error converting string.\n");
+                return -1;
+            }
+        }
+
+        batch_benchmark(filenames, wfilenames, count,
+            OPTION_ED2K | OPTION_CRC32 | OPTION_MD5 | OPTION_SHA1);
+        return 0;
+    }
+
+    if (argc > 2 && strcmp(argv[2], "--bench") == 0) {
+        benchmark(mbsfilename, wfilename, argc > 3 ? atoi(argv[3]) :
+            OPTION_ED2K | OPTION_CRC32 | OPTION_MD5 | OPTION_SHA1);
+        return 0;
+    }
+
+    if (argc > 3 && strcmp(argv[2], "--cache") == 0) {
+        cache_benchmark(mbsfilename, wfilename, argv[3], argc > 4 ? atoi(argv[4]) :
+            OPTION_ED2K | OPTION_CRC32 | OPTION_MD5 | OPTION_SHA1);
+        return 0;
+    }
+
     /* Set up our hash request. */
     HashRequest request;
     memset(&request, 0, sizeof(HashRequest));
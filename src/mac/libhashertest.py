@@ -61,7 +61,8 @@ HashSyncIOPrototype = CFUNCTYPE(c_int32, POINTER(HashRequest),
     HashProgressCallbackPrototype)
 
 # Find the library (which is expected to be next to the script) and load it.
-libpath = "{0}/libhasher.dylib".format(os.path.dirname(os.path.realpath(__file__)))
+libname = "libhasher.dylib" if sys.platform == "darwin" else "libhasher.so"
+libpath = "{0}/{1}".format(os.path.dirname(os.path.realpath(__file__)), libname)
 libhasher = cdll.LoadLibrary(libpath)
 
 # Create a reference to the exported HashFileWithSyncIO function with the the
@@ -1,7 +1,11 @@
+#include "core/cpu.h"
 #include "core/crc32.h"
+#include "core/dispatch.h"
+#include "core/hashes.h"
 #include "core/md5.h"
 #include "core/md4.h"
 #include "core/sha1.h"
+#include "core/stitch.h"
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,6 +15,1211 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <time.h>
+
+#if defined(CPU_X86)
+#include <x86intrin.h> /* __rdtsc */
+#endif
+
+#define BLOCKSIZE 9728000 //9520 * 1024
+#define BUFFERSIZE (BLOCKSIZE / 10)
+
+/**
+ * Reference byte-at-a-time CRC32 used as the baseline when benchmarking the
+ * core CRC32 implementation. Returns the digest before the final inversion.
+ * @param digest The running digest (0xFFFFFFFF for a new CRC).
+ * @param data   The data to process.
+ * @param length The length of the data to process.
+ */
+static uint32_t crc32_bytewise(uint32_t digest, const unsigned char* data, size_t length) {
+    static uint32_t table[256];
+    uint32_t idx;
+
+    if (table[1] == 0) {
+        for (idx = 0; idx < 256; ++idx) {
+            uint32_t value = idx;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value >> 1) ^ (value & 1 ? 0xEDB88320L : 0);
+            }
+            table[idx] = value;
+        }
+    }
+
+    while (length--) {
+        digest = table[(digest ^ *data++) & 0xFF] ^ (digest >> 8);
+    }
+
+    return digest;
+}
+
+/**
+ * Times rounds calls of CRC32_update over size bytes of data.
+ * @param data   The data to hash.
+ * @param size   The number of bytes to hash per call.
+ * @param rounds The number of calls to make.
+ * @param digest Receives the resulting digest.
+ * @returns The elapsed CPU time in seconds.
+ */
+static double time_crc32(const unsigned char* data, size_t size, size_t rounds, uint32_t* digest) {
+    CRC32_Context crc32;
+    CRC32_init(&crc32);
+
+    clock_t start = clock();
+    for (size_t round = 0; round < rounds; ++round) {
+        CRC32_update(&crc32, data, size);
+    }
+
+    *digest = crc32.digest;
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/**
+ * Compares the throughput of CRC32_update, with and without the accelerated
+ * kernels, against the byte-at-a-time loop on small (4 KiB), read buffer sized
+ * (BUFFERSIZE) and large (1 GiB) inputs. The 1 GiB input is streamed through a
+ * 64 MiB buffer so it doesn't fit in cache.
+ */
+void benchmark_crc32() {
+    static const size_t sizes[] = { 4096, BUFFERSIZE, 64 << 20 };
+    static const char* names[] = { "4 KiB", "972800 B", "1 GiB" };
+    const size_t total = (size_t)1 << 30;
+    unsigned char* data = (unsigned char*)malloc(sizes[2]);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    srand(1);
+    for (size_t idx = 0; idx < sizes[2]; ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    printf("CRC32 throughput (MB/s)\n");
+    for (int size = 0; size < 3; ++size) {
+        size_t rounds = total / sizes[size];
+        uint32_t reference = 0xFFFFFFFFL;
+        uint32_t portable;
+        uint32_t accelerated;
+
+        clock_t start = clock();
+        for (size_t round = 0; round < rounds; ++round) {
+            reference = crc32_bytewise(reference, data, sizes[size]);
+        }
+        double bytewise = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        CPU_restrict(0);
+        double sliced = time_crc32(data, sizes[size], rounds, &portable);
+        CPU_restrict(CPU_ALL);
+        double folded = time_crc32(data, sizes[size], rounds, &accelerated);
+
+        printf("  %-9s bytewise: %8.1f  sliced: %8.1f  pclmul: %8.1f  %s\n",
+            names[size],
+            total / bytewise / 1e6,
+            total / sliced / 1e6,
+            total / folded / 1e6,
+            reference == portable && reference == accelerated ? "ok" : "MISMATCH");
+    }
+
+    free(data);
+}
+
+/**
+ * Checks the accelerated CRC32 kernels against the portable code on random
+ * buffers, offsets, lengths and update splits.
+ * @returns The number of mismatches found.
+ */
+int test_crc32() {
+    unsigned char data[8192];
+    unsigned char portable[4];
+    unsigned char accelerated[4];
+    int failures = 0;
+
+    srand(2);
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (int test = 0; test < 100000; ++test) {
+        uint32_t offset = rand() % 64;
+        uint32_t length = rand() % (sizeof(data) - 64);
+        uint32_t split = length ? rand() % length : 0;
+        CRC32_Context crc32;
+
+        CPU_restrict(0);
+        CRC32_init(&crc32);
+        CRC32_update(&crc32, &data[offset], split);
+        CRC32_update(&crc32, &data[offset + split], length - split);
+        CRC32_final(&crc32, portable);
+
+        CPU_restrict(CPU_ALL);
+        CRC32_init(&crc32);
+        CRC32_update(&crc32, &data[offset], split);
+        CRC32_update(&crc32, &data[offset + split], length - split);
+        CRC32_final(&crc32, accelerated);
+
+        if (memcmp(portable, accelerated, 4) != 0 ||
+            crc32_bytewise(0xFFFFFFFFL, &data[offset], length) !=
+            ~(((uint32_t)portable[0] << 24) | ((uint32_t)portable[1] << 16) |
+              ((uint32_t)portable[2] << 8) | portable[3])) {
+            ++failures;
+        }
+    }
+
+    printf("CRC32 kernels: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * The SHA1 transforms that can be selected by restricting the CPU features,
+ * from the portable transform to the fastest one.
+ */
+static const uint32_t sha1Kernels[] = {
+    0, CPU_SSSE3, CPU_SSSE3 | CPU_AVX2 | CPU_BMI2, CPU_ALL
+};
+static const char* sha1KernelNames[] = { "scalar", "ssse3", "avx2", "sha-ni" };
+
+/**
+ * Compares the throughput of SHA1_update using each of the SHA1 transforms
+ * supported by the CPU on a BUFFERSIZE input, in MB/s and cycles per byte.
+ */
+void benchmark_sha1() {
+    const size_t rounds = 64;
+    const double bytes = (double)rounds * BUFFERSIZE;
+    unsigned char result[20];
+    unsigned char* data = (unsigned char*)malloc(BUFFERSIZE);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    memset(data, 0xA5, BUFFERSIZE);
+
+    printf("SHA1 throughput\n");
+    for (int kernel = 0; kernel < 4; ++kernel) {
+        SHA1_Context sha1;
+        uint64_t cycles = 0;
+        double elapsed = 0;
+
+        CPU_restrict(CPU_ALL);
+        if ((CPU_features() & sha1Kernels[kernel]) != sha1Kernels[kernel]) {
+            continue;
+        }
+
+        /* Keep the best of a few passes to filter out noise from the rest
+         * of the system. */
+        CPU_restrict(sha1Kernels[kernel]);
+        for (int pass = 0; pass < 5; ++pass) {
+            uint64_t passCycles = 0;
+            SHA1_init(&sha1);
+
+            clock_t start = clock();
+#if defined(CPU_X86)
+            passCycles = __rdtsc();
+#endif
+            for (size_t round = 0; round < rounds; ++round) {
+                SHA1_update(&sha1, data, BUFFERSIZE);
+            }
+            SHA1_final(&sha1, result);
+#if defined(CPU_X86)
+            passCycles = __rdtsc() - passCycles;
+#endif
+            double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            if (pass == 0 || passElapsed < elapsed) {
+                elapsed = passElapsed;
+                cycles = passCycles;
+            }
+        }
+
+        printf("  %-9s %8.1f MB/s  %5.2f cycles/byte\n",
+            sha1KernelNames[kernel], bytes / elapsed / 1e6, cycles / bytes);
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(data);
+}
+
+/**
+ * Measures how many short messages SHA1 can hash per second with each of the
+ * SHA1 transforms supported by the CPU, which is dominated by the cost of
+ * SHA1_init and SHA1_final rather than by the transform itself.
+ */
+void benchmark_sha1_small() {
+    const uint32_t sizes[] = { 0, 55, 100 };
+    const size_t rounds = 1000000;
+    unsigned char data[100];
+    unsigned char result[20];
+
+    memset(data, 0xA5, sizeof(data));
+
+    printf("SHA1 short messages\n");
+    for (int kernel = 0; kernel < 4; ++kernel) {
+        CPU_restrict(CPU_ALL);
+        if ((CPU_features() & sha1Kernels[kernel]) != sha1Kernels[kernel]) {
+            continue;
+        }
+
+        CPU_restrict(sha1Kernels[kernel]);
+        printf("  %-9s", sha1KernelNames[kernel]);
+        for (size_t idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); ++idx) {
+            SHA1_Context sha1;
+
+            clock_t start = clock();
+            for (size_t round = 0; round < rounds; ++round) {
+                SHA1_init(&sha1);
+                SHA1_update(&sha1, data, sizes[idx]);
+                SHA1_final(&sha1, result);
+            }
+            double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            printf(" %3u bytes: %6.2f M/s", sizes[idx], rounds / elapsed / 1e6);
+        }
+        printf("\n");
+    }
+
+    CPU_restrict(CPU_ALL);
+}
+
+/**
+ * Checks the accelerated SHA1 transforms against the portable transform on
+ * random buffers, offsets, lengths and update splits, and both against a known
+ * test vector.
+ * @returns The number of mismatches found.
+ */
+int test_sha1() {
+    static const unsigned char abc[20] = {
+        0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+        0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+    };
+    unsigned char data[8192];
+    unsigned char portable[20];
+    unsigned char accelerated[20];
+    int failures = 0;
+
+    srand(3);
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (int kernel = 0; kernel < 4; ++kernel) {
+        SHA1_Context sha1;
+
+        CPU_restrict(sha1Kernels[kernel]);
+        SHA1_init(&sha1);
+        SHA1_update(&sha1, "abc", 3);
+        SHA1_final(&sha1, portable);
+        if (memcmp(portable, abc, 20) != 0) {
+            ++failures;
+        }
+    }
+
+    for (int test = 0; test < 20000; ++test) {
+        uint32_t offset = rand() % 64;
+        uint32_t length = rand() % (sizeof(data) - 64);
+        uint32_t split = length ? rand() % length : 0;
+        SHA1_Context sha1;
+
+        CPU_restrict(0);
+        SHA1_init(&sha1);
+        SHA1_update(&sha1, &data[offset], split);
+        SHA1_update(&sha1, &data[offset + split], length - split);
+        SHA1_final(&sha1, portable);
+
+        for (int kernel = 1; kernel < 4; ++kernel) {
+            CPU_restrict(sha1Kernels[kernel]);
+            SHA1_init(&sha1);
+            SHA1_update(&sha1, &data[offset], split);
+            SHA1_update(&sha1, &data[offset + split], length - split);
+            SHA1_final(&sha1, accelerated);
+
+            if (memcmp(portable, accelerated, 20) != 0) {
+                ++failures;
+            }
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    printf("SHA1 kernels: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Compares the throughput of hashing MD4_LANES buffers of BUFFERSIZE with
+ * MD4_update one after the other and with MD4_multi_update, in MB/s.
+ */
+void benchmark_md4() {
+    const size_t rounds = 8;
+    const double bytes = (double)rounds * MD4_LANES * BUFFERSIZE;
+    const unsigned char* laneData[MD4_LANES];
+    unsigned char result[16];
+    unsigned char* data = (unsigned char*)malloc(MD4_LANES * BUFFERSIZE);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    memset(data, 0xA5, MD4_LANES * BUFFERSIZE);
+    for (int lane = 0; lane < MD4_LANES; ++lane) {
+        laneData[lane] = &data[lane * BUFFERSIZE];
+    }
+
+    printf("MD4 throughput\n");
+    for (int kernel = 0; kernel < 3; ++kernel) {
+        double elapsed = 0;
+
+        CPU_restrict(CPU_ALL);
+        if (kernel == 2 && !(CPU_features() & CPU_AVX2)) {
+            continue;
+        }
+
+        CPU_restrict(kernel == 1 ? 0 : CPU_ALL);
+        for (int pass = 0; pass < 5; ++pass) {
+            clock_t start = clock();
+            for (size_t round = 0; round < rounds; ++round) {
+                if (kernel == 0) {
+                    for (int lane = 0; lane < MD4_LANES; ++lane) {
+                        MD4_Context md4;
+                        MD4_init(&md4);
+                        MD4_update(&md4, laneData[lane], BUFFERSIZE);
+                        MD4_final(&md4, result);
+                    }
+                } else {
+                    MD4_MultiContext lanes;
+                    MD4_multi_init(&lanes);
+                    MD4_multi_update(&lanes, laneData, BUFFERSIZE);
+                    for (int lane = 0; lane < MD4_LANES; ++lane) {
+                        MD4_multi_final(&lanes, lane, result);
+                    }
+                }
+            }
+            double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            if (pass == 0 || passElapsed < elapsed) {
+                elapsed = passElapsed;
+            }
+        }
+
+        printf("  %-9s %8.1f MB/s\n",
+            kernel == 0 ? "single" : kernel == 1 ? "lanes" : "avx2",
+            bytes / elapsed / 1e6);
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(data);
+}
+
+/**
+ * Checks every lane of MD4_multi_update, with and without AVX2, against
+ * MD4_update on random buffers of random block counts.
+ * @returns The number of mismatches found.
+ */
+int test_md4() {
+    unsigned char data[MD4_LANES * 4096];
+    const unsigned char* laneData[MD4_LANES];
+    unsigned char single[16];
+    unsigned char multi[16];
+    int failures = 0;
+
+    srand(4);
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (int test = 0; test < 2000; ++test) {
+        uint32_t length = (rand() % 64) * 64;
+        uint32_t split = length ? (rand() % (length / 64)) * 64 : 0;
+        MD4_MultiContext lanes;
+
+        for (int lane = 0; lane < MD4_LANES; ++lane) {
+            laneData[lane] = &data[lane * 4096 + rand() % 64];
+        }
+
+        for (int kernel = 0; kernel < 2; ++kernel) {
+            const unsigned char* tails[MD4_LANES];
+
+            CPU_restrict(kernel ? CPU_ALL : 0);
+            MD4_multi_init(&lanes);
+            MD4_multi_update(&lanes, laneData, split);
+            for (int lane = 0; lane < MD4_LANES; ++lane) {
+                tails[lane] = laneData[lane] + split;
+            }
+            MD4_multi_update(&lanes, tails, length - split);
+
+            for (int lane = 0; lane < MD4_LANES; ++lane) {
+                MD4_Context md4;
+                MD4_init(&md4);
+                MD4_update(&md4, laneData[lane], length);
+                MD4_final(&md4, single);
+                MD4_multi_final(&lanes, lane, multi);
+
+                if (memcmp(single, multi, 16) != 0) {
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    printf("MD4 lanes: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/* The MD5 paths that can be selected by restricting the CPU features. */
+static const uint32_t md5Kernels[] = { 0, CPU_SSE2, CPU_SSE2 | CPU_AVX2 };
+static const char* md5KernelNames[] = { "scalar", "sse2", "avx2" };
+
+/**
+ * Compares the throughput of hashing 4096 separate 4 KiB inputs with MD5_update
+ * one after the other and with MD5_update_multi using each lane width, in MB/s.
+ */
+void benchmark_md5() {
+    const uint32_t count = 4096;
+    const uint32_t size = 4096;
+    const double bytes = (double)count * size;
+    MD5_Context* contexts = (MD5_Context*)malloc(count * sizeof(MD5_Context));
+    MD5_Context** md5 = (MD5_Context**)malloc(count * sizeof(MD5_Context*));
+    const void** data = (const void**)malloc(count * sizeof(void*));
+    uint32_t* lengths = (uint32_t*)malloc(count * sizeof(uint32_t));
+    unsigned char* buffer = (unsigned char*)malloc((size_t)count * size);
+    unsigned char result[16];
+
+    if (!contexts || !md5 || !data || !lengths || !buffer) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        free(contexts); free(md5); free(data); free(lengths); free(buffer);
+        return;
+    }
+
+    memset(buffer, 0xA5, (size_t)count * size);
+    for (uint32_t idx = 0; idx < count; ++idx) {
+        md5[idx] = &contexts[idx];
+        data[idx] = &buffer[(size_t)idx * size];
+        lengths[idx] = size;
+    }
+
+    printf("MD5 throughput (%u inputs of %u bytes)\n", count, size);
+    for (int kernel = 0; kernel < 3; ++kernel) {
+        double elapsed = 0;
+
+        CPU_restrict(CPU_ALL);
+        if ((CPU_features() & md5Kernels[kernel]) != md5Kernels[kernel]) {
+            continue;
+        }
+
+        CPU_restrict(md5Kernels[kernel]);
+        for (int pass = 0; pass < 5; ++pass) {
+            clock_t start = clock();
+            for (uint32_t idx = 0; idx < count; ++idx) {
+                MD5_init(md5[idx]);
+            }
+            MD5_update_multi(md5, data, lengths, count);
+            for (uint32_t idx = 0; idx < count; ++idx) {
+                MD5_final(md5[idx], result);
+            }
+            double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            if (pass == 0 || passElapsed < elapsed) {
+                elapsed = passElapsed;
+            }
+        }
+
+        printf("  %-9s %8.1f MB/s\n", md5KernelNames[kernel], bytes / elapsed / 1e6);
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(contexts);
+    free(md5);
+    free(data);
+    free(lengths);
+    free(buffer);
+}
+
+/**
+ * Checks MD5_update_multi with each lane width against MD5_update on random
+ * batches of inputs with random lengths, offsets and already buffered bytes.
+ * @returns The number of mismatches found.
+ */
+int test_md5() {
+    unsigned char data[16384];
+    MD5_Context contexts[40];
+    MD5_Context* md5[40];
+    const void* inputs[40];
+    uint32_t lengths[40];
+    uint32_t heads[40];
+    unsigned char single[16];
+    unsigned char multi[16];
+    int failures = 0;
+
+    srand(5);
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (int test = 0; test < 500; ++test) {
+        uint32_t count = rand() % 40 + 1;
+
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            md5[idx] = &contexts[idx];
+            heads[idx] = rand() % 3 == 0 ? rand() % 64 : 0;
+            lengths[idx] = rand() % 4 == 0 ? rand() % 64 : rand() % 8192;
+            inputs[idx] = &data[rand() % 8192];
+        }
+
+        for (int kernel = 0; kernel < 3; ++kernel) {
+            CPU_restrict(md5Kernels[kernel]);
+            for (uint32_t idx = 0; idx < count; ++idx) {
+                MD5_init(md5[idx]);
+                MD5_update(md5[idx], data, heads[idx]);
+            }
+
+            MD5_update_multi(md5, inputs, lengths, count);
+
+            for (uint32_t idx = 0; idx < count; ++idx) {
+                MD5_Context md5single;
+                MD5_init(&md5single);
+                MD5_update(&md5single, data, heads[idx]);
+                MD5_update(&md5single, inputs[idx], lengths[idx]);
+                MD5_final(&md5single, single);
+                MD5_final(md5[idx], multi);
+
+                if (memcmp(single, multi, 16) != 0) {
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    printf("MD5 lanes: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/* The CPU features each stitched kernel is benchmarked and tested with. The
+ * MD5+SHA1 stitch uses SHA-NI when allowed and scalar SHA1 otherwise. The
+ * MD4+CRC32 stitch only interleaves when PCLMULQDQ isn't allowed. */
+static const uint32_t stitchKernels[] = { 0, CPU_ALL & ~(CPU_SHA | CPU_PCLMUL), CPU_ALL };
+static const char* stitchKernelNames[] = { "scalar", "no sha/pclmul", "all" };
+
+/**
+ * Compares the throughput of MD5+SHA1 and MD4+CRC32 calculated one after the
+ * other against the stitched updates, in MB/s, for each set of CPU features.
+ * The buffer stays in the cache so only the computation is measured.
+ */
+void benchmark_stitch() {
+    const size_t size = 256 * 1024;
+    const size_t rounds = 256;
+    const double bytes = (double)size * rounds;
+    unsigned char result[20];
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    memset(data, 0xA5, size);
+
+    printf("Stitched throughput (%u byte buffer)\n", (uint32_t)size);
+    for (int kernel = 0; kernel < 3; ++kernel) {
+        for (int test = 0; test < 4; ++test) {
+            double elapsed = 0;
+
+            CPU_restrict(stitchKernels[kernel]);
+            for (int pass = 0; pass < 5; ++pass) {
+                clock_t start = clock();
+                if (test < 2) {
+                    MD5_Context md5;
+                    SHA1_Context sha1;
+                    MD5_init(&md5);
+                    SHA1_init(&sha1);
+                    for (size_t round = 0; round < rounds; ++round) {
+                        if (test) {
+                            Stitch_MD5_SHA1_update(&md5, &sha1, data, size);
+                        } else {
+                            MD5_update(&md5, data, size);
+                            SHA1_update(&sha1, data, size);
+                        }
+                    }
+                    MD5_final(&md5, result);
+                    SHA1_final(&sha1, result);
+                } else {
+                    MD4_Context md4;
+                    CRC32_Context crc32;
+                    MD4_init(&md4);
+                    CRC32_init(&crc32);
+                    for (size_t round = 0; round < rounds; ++round) {
+                        if (test == 3) {
+                            Stitch_MD4_CRC32_update(&md4, &crc32, data, size);
+                        } else {
+                            MD4_update(&md4, data, size);
+                            CRC32_update(&crc32, data, size);
+                        }
+                    }
+                    MD4_final(&md4, result);
+                    CRC32_final(&crc32, result);
+                }
+                double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+                if (pass == 0 || passElapsed < elapsed) {
+                    elapsed = passElapsed;
+                }
+            }
+
+            printf("  %-14s %-9s %-10s %8.1f MB/s\n", stitchKernelNames[kernel],
+                test < 2 ? "md5+sha1" : "md4+crc32", test & 1 ? "stitched" : "separate",
+                bytes / elapsed / 1e6);
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(data);
+}
+
+/**
+ * Checks the stitched updates against the separate updates for random lengths
+ * split into random pieces, with each set of CPU features. Some pieces also
+ * update the states on their own first so they start at different offsets.
+ * @returns The number of mismatches found.
+ */
+int test_stitch() {
+    unsigned char data[16384];
+    unsigned char expected[56];
+    unsigned char result[56];
+    int failures = 0;
+
+    srand(9);
+    for (size_t idx = 0; idx < sizeof(data); ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (int test = 0; test < 300; ++test) {
+        uint32_t size = rand() % 2 ? rand() % sizeof(data) : rand() % 256;
+        uint32_t apart = rand() % 4 == 0 ? rand() % 64 + 1 : 0;
+
+        for (int kernel = 0; kernel < 3; ++kernel) {
+            MD4_Context md4[2];
+            CRC32_Context crc32[2];
+            MD5_Context md5[2];
+            SHA1_Context sha1[2];
+            uint32_t position = 0;
+
+            CPU_restrict(stitchKernels[kernel]);
+            for (int idx = 0; idx < 2; ++idx) {
+                MD4_init(&md4[idx]);
+                CRC32_init(&crc32[idx]);
+                MD5_init(&md5[idx]);
+                SHA1_init(&sha1[idx]);
+
+                /* Put the MD4 and MD5 a few bytes ahead of the others. */
+                MD4_update(&md4[idx], data, apart);
+                MD5_update(&md5[idx], data, apart);
+            }
+
+            MD4_update(&md4[0], data, size);
+            CRC32_update(&crc32[0], data, size);
+            MD5_update(&md5[0], data, size);
+            SHA1_update(&sha1[0], data, size);
+
+            while (position < size) {
+                uint32_t piece = rand() % 3 ? rand() % 1024 : rand() % 64;
+                if (piece > size - position) {
+                    piece = size - position;
+                }
+
+                Stitch_MD4_CRC32_update(&md4[1], &crc32[1], &data[position], piece);
+                Stitch_MD5_SHA1_update(&md5[1], &sha1[1], &data[position], piece);
+                position += piece;
+            }
+
+            MD4_final(&md4[0], &expected[0]);
+            CRC32_final(&crc32[0], &expected[16]);
+            MD5_final(&md5[0], &expected[20]);
+            SHA1_final(&sha1[0], &expected[36]);
+            MD4_final(&md4[1], &result[0]);
+            CRC32_final(&crc32[1], &result[16]);
+            MD5_final(&md5[1], &result[20]);
+            SHA1_final(&sha1[1], &result[36]);
+
+            if (memcmp(expected, result, 56) != 0) {
+                ++failures;
+            }
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    printf("Stitched: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * The update loop Hashes_update used before it was specialized for each
+ * combination of hashes, testing the options for every tile. Only used by
+ * benchmark_specialized, which doesn't select the ED2k hash.
+ * @param hashes The structure containing the intermediate state to update.
+ * @param ptr    The data used to update the hashes.
+ * @param length The length of the data to digest.
+ */
+static void update_generic(Hashes_Context* hashes, const unsigned char* ptr, uint32_t length) {
+    uint32_t options = hashes->options;
+    uint32_t tileSize = HASHES_TILESIZE;
+    uint32_t tile;
+
+    if ((options & (options - 1)) == 0) {
+        tileSize = length;
+    }
+
+    while (length > 0) {
+        tile = length < tileSize ? length : tileSize;
+
+        if (options & HASHES_CRC32) { CRC32_update(&hashes->crc32, ptr, tile); }
+        if ((options & (HASHES_MD5 | HASHES_SHA1)) == (HASHES_MD5 | HASHES_SHA1)) {
+            Stitch_MD5_SHA1_update(&hashes->md5, &hashes->sha1, ptr, tile);
+        } else {
+            if (options & HASHES_MD5) { MD5_update(&hashes->md5, ptr, tile); }
+            if (options & HASHES_SHA1) { SHA1_update(&hashes->sha1, ptr, tile); }
+        }
+
+        ptr += tile;
+        length -= tile;
+    }
+}
+
+/**
+ * Compares the update loop that tests the options for every call against the
+ * loop Hashes_update specializes for each combination of hashes, in MB/s, for
+ * small and large buffers. The buffer stays in the cache so the per-call
+ * overhead isn't hidden by memory reads.
+ */
+void benchmark_specialized() {
+    const uint32_t options[] = {
+        HASHES_CRC32, HASHES_MD5 | HASHES_SHA1, HASHES_CRC32 | HASHES_MD5 | HASHES_SHA1
+    };
+    const char* optionNames[] = { "crc32", "md5+sha1", "crc32+md5+sha1" };
+    const uint32_t sizes[] = { 64, 4096, 1024 * 1024 };
+    const size_t total = 64 * 1024 * 1024;
+    unsigned char result[56];
+    unsigned char* data = (unsigned char*)malloc(sizes[2]);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    memset(data, 0xA5, sizes[2]);
+
+    printf("Specialized update loops (MB/s, generic / specialized)\n");
+    for (size_t option = 0; option < sizeof(options) / sizeof(options[0]); ++option) {
+        printf("  %-15s", optionNames[option]);
+        for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); ++size) {
+            /* Less data for the slow hashes keeps the run short. */
+            size_t rounds = (option ? total / 8 : total) / sizes[size];
+            double rates[2];
+
+            for (int specialized = 0; specialized < 2; ++specialized) {
+                double elapsed = 0;
+
+                for (int pass = 0; pass < 3; ++pass) {
+                    Hashes_Context hashes;
+                    clock_t start = clock();
+
+                    Hashes_init(&hashes, options[option]);
+                    for (size_t round = 0; round < rounds; ++round) {
+                        if (specialized) {
+                            Hashes_update(&hashes, data, sizes[size]);
+                        } else {
+                            update_generic(&hashes, data, sizes[size]);
+                        }
+                    }
+                    Hashes_final(&hashes, result);
+
+                    double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+                    if (pass == 0 || passElapsed < elapsed) {
+                        elapsed = passElapsed;
+                    }
+                }
+
+                rates[specialized] = (double)rounds * sizes[size] / elapsed / 1e6;
+            }
+
+            printf("  %7u B: %7.1f / %7.1f", sizes[size], rates[0], rates[1]);
+        }
+        printf("\n");
+    }
+
+    free(data);
+}
+
+/**
+ * Compares hashing BUFFERSIZE buffers with all four hashes one after the other
+ * against Hashes_update, which feeds each HASHES_TILESIZE tile of the buffer to
+ * every hash before moving on. The buffers cycle through 64 MiB so they come
+ * from memory rather than the cache. The sequential calls stream every buffer
+ * from memory four times while the tiles only stream it once.
+ */
+void benchmark_hashes() {
+    const size_t total = 64 * 1024 * 1024;
+    const size_t buffers = total / BUFFERSIZE;
+    const size_t rounds = buffers * 2;
+    const double bytes = (double)rounds * BUFFERSIZE;
+    unsigned char result[56];
+    unsigned char* data = (unsigned char*)malloc(total);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    memset(data, 0xA5, total);
+
+    printf("All four hashes over %u byte buffers (tiles of %u bytes)\n",
+        (uint32_t)BUFFERSIZE, (uint32_t)HASHES_TILESIZE);
+    for (int fused = 0; fused < 2; ++fused) {
+        double elapsed = 0;
+        uint64_t cycles = 0;
+
+        for (int pass = 0; pass < 5; ++pass) {
+            uint64_t passCycles = 0;
+            clock_t start = clock();
+#if defined(CPU_X86)
+            passCycles = __rdtsc();
+#endif
+            if (fused) {
+                Hashes_Context hashes;
+                Hashes_init(&hashes, HASHES_ED2K | HASHES_CRC32 | HASHES_MD5 | HASHES_SHA1);
+                for (size_t round = 0; round < rounds; ++round) {
+                    Hashes_update(&hashes, &data[(round % buffers) * BUFFERSIZE], BUFFERSIZE);
+                }
+                Hashes_final(&hashes, result);
+            } else {
+                CRC32_Context crc32;
+                MD4_Context md4;
+                MD5_Context md5;
+                SHA1_Context sha1;
+                CRC32_init(&crc32);
+                MD4_init(&md4);
+                MD5_init(&md5);
+                SHA1_init(&sha1);
+                for (size_t round = 0; round < rounds; ++round) {
+                    unsigned char* buffer = &data[(round % buffers) * BUFFERSIZE];
+                    MD4_update(&md4, buffer, BUFFERSIZE);
+                    CRC32_update(&crc32, buffer, BUFFERSIZE);
+                    MD5_update(&md5, buffer, BUFFERSIZE);
+                    SHA1_update(&sha1, buffer, BUFFERSIZE);
+                }
+                MD4_final(&md4, result);
+                CRC32_final(&crc32, result);
+                MD5_final(&md5, result);
+                SHA1_final(&sha1, result);
+            }
+#if defined(CPU_X86)
+            passCycles = __rdtsc() - passCycles;
+#endif
+            double passElapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+            if (pass == 0 || passElapsed < elapsed) {
+                elapsed = passElapsed;
+                cycles = passCycles;
+            }
+        }
+
+        printf("  %-10s %8.1f MB/s  %5.2f cycles/byte  %6.0f MB read from memory\n",
+            fused ? "tiled" : "sequential", bytes / elapsed / 1e6, cycles / bytes,
+            (fused ? 1 : 4) * bytes / 1e6);
+    }
+
+    free(data);
+}
+
+/**
+ * Checks Hashes_update against each hash calculated on its own for random
+ * sizes around the ED2k block boundaries, split into random pieces.
+ * @returns The number of mismatches found.
+ */
+int test_hashes() {
+    const uint32_t sizes[] = {
+        0, 1, 63, 64, 8191, 8193, 100000, BLOCKSIZE - 1, BLOCKSIZE, BLOCKSIZE + 1,
+        BLOCKSIZE * 2, BLOCKSIZE * 2 + 4097, BLOCKSIZE * 3 - 1
+    };
+    const uint32_t maxSize = BLOCKSIZE * 3;
+    unsigned char expected[56];
+    unsigned char result[56];
+    int failures = 0;
+
+    unsigned char* data = (unsigned char*)malloc(maxSize);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate test buffer.\n");
+        return 1;
+    }
+
+    srand(6);
+    for (uint32_t idx = 0; idx < maxSize; ++idx) {
+        data[idx] = rand() & 0xFF;
+    }
+
+    for (size_t test = 0; test < sizeof(sizes) / sizeof(sizes[0]); ++test) {
+        uint32_t size = sizes[test];
+        uint32_t blocks = size / BLOCKSIZE + 1;
+        unsigned char* ed2kHashes = (unsigned char*)malloc(blocks * 16);
+        CRC32_Context crc32;
+        MD4_Context md4;
+        MD5_Context md5;
+        SHA1_Context sha1;
+        Hashes_Context hashes;
+
+        /* The ED2k hash of each block, then of the block hashes unless there
+         * is only a single block. */
+        blocks = size / BLOCKSIZE + (size % BLOCKSIZE > 0 || size == 0);
+        for (uint32_t block = 0; block < blocks; ++block) {
+            uint32_t start = block * BLOCKSIZE;
+            MD4_init(&md4);
+            MD4_update(&md4, &data[start], size - start < BLOCKSIZE ? size - start : BLOCKSIZE);
+            MD4_final(&md4, &ed2kHashes[block * 16]);
+        }
+        memset(expected, 0, 56);
+        if (blocks == 1) {
+            memcpy(expected, ed2kHashes, 16);
+        } else {
+            MD4_init(&md4);
+            MD4_update(&md4, ed2kHashes, blocks * 16);
+            MD4_final(&md4, expected);
+        }
+        free(ed2kHashes);
+
+        CRC32_init(&crc32);
+        CRC32_update(&crc32, data, size);
+        CRC32_final(&crc32, &expected[16]);
+        MD5_init(&md5);
+        MD5_update(&md5, data, size);
+        MD5_final(&md5, &expected[20]);
+        SHA1_init(&sha1);
+        SHA1_update(&sha1, data, size);
+        SHA1_final(&sha1, &expected[36]);
+
+        for (uint32_t options = 1; options < 16; ++options) {
+            uint32_t position = 0;
+
+            Hashes_init(&hashes, options);
+            while (position < size) {
+                uint32_t piece = (uint32_t)rand() % (BUFFERSIZE * 2) + 1;
+                if (piece > size - position) {
+                    piece = size - position;
+                }
+
+                Hashes_update(&hashes, &data[position], piece);
+                position += piece;
+            }
+            Hashes_final(&hashes, result);
+
+            if (((options & HASHES_ED2K) && memcmp(result, expected, 16) != 0) ||
+                ((options & HASHES_CRC32) && memcmp(&result[16], &expected[16], 4) != 0) ||
+                ((options & HASHES_MD5) && memcmp(&result[20], &expected[20], 16) != 0) ||
+                ((options & HASHES_SHA1) && memcmp(&result[36], &expected[36], 20) != 0)) {
+                ++failures;
+            }
+        }
+    }
+
+    free(data);
+    printf("Tiled hashes: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Checks that the *_update_large functions give the same results as feeding
+ * the same data to the *_update functions in smaller pieces, on an input
+ * larger than the pieces they split the data into.
+ * @returns The number of mismatches found.
+ */
+int test_large() {
+    const size_t size = 0x10000000 + 4097;
+    const uint32_t piece = BUFFERSIZE + 13;
+    unsigned char expected[56];
+    unsigned char result[56];
+    int failures = 0;
+
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate test buffer.\n");
+        return 1;
+    }
+
+    for (size_t idx = 0; idx < size; ++idx) {
+        data[idx] = (unsigned char)(idx * 167 + (idx >> 12));
+    }
+
+    CRC32_Context crc32;
+    MD4_Context md4;
+    MD5_Context md5;
+    SHA1_Context sha1;
+    Hashes_Context hashes;
+
+    CRC32_init(&crc32);
+    MD4_init(&md4);
+    MD5_init(&md5);
+    SHA1_init(&sha1);
+    for (size_t position = 0; position < size; position += piece) {
+        uint32_t length = size - position < piece ? (uint32_t)(size - position) : piece;
+        CRC32_update(&crc32, &data[position], length);
+        MD4_update(&md4, &data[position], length);
+        MD5_update(&md5, &data[position], length);
+        SHA1_update(&sha1, &data[position], length);
+    }
+    CRC32_final(&crc32, &expected[0]);
+    MD4_final(&md4, &expected[4]);
+    MD5_final(&md5, &expected[20]);
+    SHA1_final(&sha1, &expected[36]);
+
+    CRC32_init(&crc32);
+    CRC32_update_large(&crc32, data, size);
+    CRC32_final(&crc32, &result[0]);
+    MD4_init(&md4);
+    MD4_update_large(&md4, data, size);
+    MD4_final(&md4, &result[4]);
+    MD5_init(&md5);
+    MD5_update_large(&md5, data, size);
+    MD5_final(&md5, &result[20]);
+    SHA1_init(&sha1);
+    SHA1_update_large(&sha1, data, size);
+    SHA1_final(&sha1, &result[36]);
+
+    failures += memcmp(&result[0], &expected[0], 4) != 0;
+    failures += memcmp(&result[4], &expected[4], 16) != 0;
+    failures += memcmp(&result[20], &expected[20], 16) != 0;
+    failures += memcmp(&result[36], &expected[36], 20) != 0;
+
+    /* Hashes_update_large has to match the CRC32, MD5 and SHA1 above. */
+    Hashes_init(&hashes, HASHES_CRC32 | HASHES_MD5 | HASHES_SHA1);
+    Hashes_update_large(&hashes, data, size);
+    Hashes_final(&hashes, result);
+    failures += memcmp(&result[16], &expected[0], 4) != 0;
+    failures += memcmp(&result[20], &expected[20], 36) != 0;
+
+    free(data);
+    printf("Large updates: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
+
+/**
+ * Compares hashing 64MB of zeros with Hashes_update, a buffer at a time, and
+ * with a single Hashes_update_zeros call for each hash, with the portable and the fastest
+ * kernels, in MB/s.
+ */
+void benchmark_zeros() {
+    const uint32_t options[] = { HASHES_ED2K, HASHES_CRC32, HASHES_MD5, HASHES_SHA1 };
+    const char* optionNames[] = { "ed2k", "crc32", "md5", "sha1" };
+    const size_t total = 64 * 1024 * 1024;
+    unsigned char result[56];
+    unsigned char* data = (unsigned char*)calloc(BUFFERSIZE, 1);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate benchmark buffer.\n");
+        return;
+    }
+
+    printf("Zero runs (MB/s, update / update_zeros)\n");
+    for (int kernel = 0; kernel < 2; ++kernel) {
+        CPU_restrict(kernel ? CPU_ALL : 0);
+
+        for (size_t option = 0; option < sizeof(options) / sizeof(options[0]); ++option) {
+            double rates[2];
+
+            for (int zeros = 0; zeros < 2; ++zeros) {
+                Hashes_Context hashes;
+                clock_t start = clock();
+
+                Hashes_init(&hashes, options[option]);
+                if (zeros) {
+                    Hashes_update_zeros(&hashes, total);
+                } else {
+                    for (size_t done = 0; done < total; done += BUFFERSIZE) {
+                        Hashes_update(&hashes, data, BUFFERSIZE);
+                    }
+                }
+                Hashes_final(&hashes, result);
+
+                double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+                rates[zeros] = elapsed > 0 ? total / elapsed / 1e6 : 0;
+            }
+
+            printf("  %-8s %-6s %9.1f / %9.1f\n", kernel ? "fastest" : "portable",
+                optionNames[option], rates[0], rates[1]);
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(data);
+}
+
+/**
+ * Checks that Hashes_update_zeros gives the same results as Hashes_update over
+ * the same number of zero bytes, for runs of zeros that start and end inside
+ * and on the boundaries of blocks and ED2k blocks, with both the portable and
+ * the fastest kernels.
+ * @returns The number of mismatches found.
+ */
+int test_zeros() {
+    const uint32_t prefixes[] = { 0, 1, 100, BLOCKSIZE - 3, BLOCKSIZE };
+    const uint32_t runs[] = {
+        0, 1, 63, 64, 65, 4095, BLOCKSIZE - 1, BLOCKSIZE, BLOCKSIZE + 7,
+        BLOCKSIZE * 2 + 100, BLOCKSIZE * 3
+    };
+    const uint32_t options[] = {
+        HASHES_ED2K, HASHES_ED2K | HASHES_CRC32 | HASHES_MD5 | HASHES_SHA1
+    };
+    const uint32_t suffix = 777;
+    const size_t size = BLOCKSIZE * 5;
+    unsigned char expected[56];
+    unsigned char result[56];
+    int failures = 0;
+
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate test buffer.\n");
+        return 1;
+    }
+
+    for (int kernel = 0; kernel < 2; ++kernel) {
+        CPU_restrict(kernel ? CPU_ALL : 0);
+
+        for (size_t prefix = 0; prefix < sizeof(prefixes) / sizeof(prefixes[0]); ++prefix) {
+            for (size_t run = 0; run < sizeof(runs) / sizeof(runs[0]); ++run) {
+                uint32_t zeroStart = prefixes[prefix];
+                uint32_t zeroEnd = zeroStart + runs[run];
+
+                for (size_t idx = 0; idx < zeroEnd + suffix; ++idx) {
+                    data[idx] = idx < zeroStart || idx >= zeroEnd ?
+                        (unsigned char)(idx * 31 + 7) : 0;
+                }
+
+                for (size_t option = 0; option < 2; ++option) {
+                    Hashes_Context hashes;
+
+                    Hashes_init(&hashes, options[option]);
+                    Hashes_update(&hashes, data, zeroEnd + suffix);
+                    Hashes_final(&hashes, expected);
+
+                    Hashes_init(&hashes, options[option]);
+                    Hashes_update(&hashes, data, zeroStart);
+                    Hashes_update_zeros(&hashes, runs[run]);
+                    Hashes_update(&hashes, &data[zeroEnd], suffix);
+                    Hashes_final(&hashes, result);
+                    failures += memcmp(result, expected, 56) != 0;
+
+                    /* A run that ends the data has nothing after it. */
+                    Hashes_init(&hashes, options[option]);
+                    Hashes_update(&hashes, data, zeroEnd);
+                    Hashes_final(&hashes, expected);
+
+                    Hashes_init(&hashes, options[option]);
+                    Hashes_update(&hashes, data, zeroStart);
+                    Hashes_update_zeros(&hashes, runs[run]);
+                    Hashes_final(&hashes, result);
+                    failures += memcmp(result, expected, 56) != 0;
+                }
+            }
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    free(data);
+    printf("Zero runs: %s (%d mismatches)\n", failures ? "FAILED" : "ok", failures);
+    return failures;
+}
 
 /**
  * Computes the CRC32 on the contents of the provided file.
@@ -51,8 +1260,6 @@ void hash_file_ed2k(char* filename) {
         return;
     }
 
-    #define BLOCKSIZE 9728000 //9520 * 1024
-
     struct stat stat;
     memset(&stat, 0, sizeof(struct stat));
 
@@ -61,7 +1268,7 @@ void hash_file_ed2k(char* filename) {
         return;
     }
 
-    printf("File: %s\n  Size: %llu\n", filename, stat.st_size);
+    printf("File: %s\n  Size: %llu\n", filename, (unsigned long long)stat.st_size);
     uint32_t blocks = stat.st_size / BLOCKSIZE;
     if (stat.st_size % BLOCKSIZE > 0) {
         blocks++;
@@ -214,6 +1421,34 @@ void hash_file_sha1(char* filename) {
     printf(" %s\n", filename);
 }
 
+/**
+ * Runs the kernel self-test for every set of CPU features the benchmarks use
+ * and checks that restricting the features selects the portable kernels.
+ * @returns The number of failures found.
+ */
+int test_dispatch() {
+    const uint32_t masks[] = { CPU_ALL, CPU_SSE2 | CPU_SSSE3, 0 };
+    char kernels[256];
+    int failures = 0;
+
+    for (size_t idx = 0; idx < sizeof(masks) / sizeof(masks[0]); ++idx) {
+        CPU_restrict(masks[idx]);
+        failures += Dispatch_init();
+    }
+
+    /* Nothing but the scalar kernels should be left without any features. */
+    for (uint32_t algorithm = 0; algorithm < DISPATCH_ALGORITHMS; ++algorithm) {
+        if (Dispatch_kernel(algorithm) != DISPATCH_SCALAR) {
+            ++failures;
+        }
+    }
+
+    CPU_restrict(CPU_ALL);
+    Dispatch_describe(kernels, sizeof(kernels));
+    printf("Dispatch: %s (%d failures)\n  %s\n", failures ? "FAILED" : "ok", failures, kernels);
+    return failures;
+}
+
 /**
  * Main entry point for the mac test program.
  * @param  argc The number of arguments the program was called with.
@@ -227,6 +1462,32 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    if (strcmp("--bench", argv[1]) == 0) {
+        benchmark_crc32();
+        benchmark_sha1();
+        benchmark_sha1_small();
+        benchmark_md4();
+        benchmark_md5();
+        benchmark_stitch();
+        benchmark_hashes();
+        benchmark_specialized();
+        benchmark_zeros();
+        return 0;
+    }
+
+    if (strcmp("--test", argv[1]) == 0) {
+        int failures = test_dispatch();
+        failures += test_crc32();
+        failures += test_sha1();
+        failures += test_md4();
+        failures += test_md5();
+        failures += test_stitch();
+        failures += test_hashes();
+        failures += test_large();
+        failures += test_zeros();
+        return failures ? -1 : 0;
+    }
+
     for (int i = 1; i < argc; ++i) {
         //hash_file_crc32(argv[i]);
         //hash_file_ed2k(argv[i]);
@@ -0,0 +1,231 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#include "uring.h"
+
+#include <errno.h>            /* errno */
+#include <linux/io_uring.h>   /* io_uring structures and flags */
+#include <string.h>           /* memset */
+#include <sys/mman.h>         /* mmap, munmap */
+#include <sys/syscall.h>      /* __NR_io_uring_* */
+#include <unistd.h>           /* syscall, close */
+
+/* The kernel and the library share the ring heads and tails, so they're read
+ * and written with the acquire and release ordering the io_uring ABI needs. */
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Releases the io_uring instance and unmaps its rings.
+ * @param ring The structure to release.
+ */
+void Uring_close(Uring* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+/**
+ * Takes the next completed read off the completion queue, if there is one.
+ * @param ring   The io_uring instance.
+ * @param tag    Receives the tag the read was queued with.
+ * @param result Receives the number of bytes read or a negated errno value.
+ * @returns 1 if a completion was returned or 0 if there are none waiting.
+ */
+int Uring_complete(Uring* ring, uint64_t* tag, int32_t* result) {
+    uint32_t head = *ring->cqHead;
+    struct io_uring_cqe* cqe;
+
+    if (head == LOAD_ACQUIRE(ring->cqTail)) {
+        return 0;
+    }
+
+    cqe = &((struct io_uring_cqe*)ring->cqes)[head & *ring->cqMask];
+    *tag = cqe->user_data;
+    *result = cqe->res;
+
+    STORE_RELEASE(ring->cqHead, head + 1);
+    return 1;
+}
+
+/**
+ * Sets up a new io_uring instance and maps its rings.
+ * @param ring    The structure to set up.
+ * @param entries The number of submission queue entries.
+ * @returns 0 on success or -1 on failure.
+ */
+int Uring_init(Uring* ring, uint32_t entries) {
+    struct io_uring_params params;
+    unsigned char* sq;
+    unsigned char* cq;
+    int error;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqRingSize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single mmap. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        goto failed;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            goto failed;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto failed;
+    }
+
+    sq = (unsigned char*)ring->sqRing;
+    cq = (unsigned char*)ring->cqRing;
+    ring->sqHead = (uint32_t*)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sqMask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t*)(sq + params.sq_off.array);
+    ring->cqHead = (uint32_t*)(cq + params.cq_off.head);
+    ring->cqTail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cqMask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    return 0;
+
+failed:
+    error = errno;
+    Uring_close(ring);
+    errno = error;
+    return -1;
+}
+
+/**
+ * Queues a read into a registered buffer.
+ * @param ring   The io_uring instance.
+ * @param file   The open file to read.
+ * @param buffer The buffer receiving the data.
+ * @param length The number of bytes to read.
+ * @param offset The offset in the file to read from.
+ * @param index  The index of the registered buffer containing buffer.
+ * @param tag    A value returned with the completion of the read.
+ * @returns 0 on success or -1 if the submission queue is full.
+ */
+int Uring_read_fixed(Uring* ring, int file, void* buffer, uint32_t length,
+    uint64_t offset, uint32_t index, uint64_t tag) {
+    uint32_t tail = *ring->sqTail + ring->pending;
+    uint32_t slot;
+    struct io_uring_sqe* sqe;
+
+    if (tail - LOAD_ACQUIRE(ring->sqHead) > *ring->sqMask) {
+        return -1;
+    }
+
+    /* Every entry uses the submission queue slot of the same index, so the
+     * array simply maps each slot to itself. */
+    slot = tail & *ring->sqMask;
+    sqe = &((struct io_uring_sqe*)ring->sqes)[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = file;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->buf_index = (uint16_t)index;
+    sqe->user_data = tag;
+    ring->sqArray[slot] = slot;
+
+    ++ring->pending;
+    return 0;
+}
+
+/**
+ * Registers the buffers used by Uring_read_fixed.
+ * @param ring    The io_uring instance.
+ * @param buffers The buffers to register.
+ * @param count   The number of buffers.
+ * @returns 0 on success or -1 on failure.
+ */
+int Uring_register_buffers(Uring* ring, const struct iovec* buffers,
+    uint32_t count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+        buffers, count) == 0 ? 0 : -1;
+}
+
+/**
+ * Submits the queued reads and optionally waits for reads to complete.
+ * @param ring The io_uring instance.
+ * @param wait The number of completions to wait for.
+ * @returns 0 on success or -1 on failure.
+ */
+int Uring_submit(Uring* ring, uint32_t wait) {
+    uint32_t submit = ring->pending;
+    long result;
+
+    /* Publish the new entries to the kernel before telling it about them. */
+    STORE_RELEASE(ring->sqTail, *ring->sqTail + submit);
+    ring->pending = 0;
+
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result > 0) {
+            submit -= (uint32_t)result;
+        }
+    } while ((result == -1 && errno == EINTR) || (result > 0 && submit > 0));
+
+    return result == -1 ? -1 : 0;
+}
@@ -0,0 +1,135 @@
+/* This file is part of jmmhasher.
+ * Copyright (C) 2014 Joshua Harley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt. If not, see
+ * http://www.gnu.org/licenses/.
+ */
+
+#ifndef __JMMHASHER_URING_H_
+#define __JMMHASHER_URING_H_
+
+/* A minimal io_uring wrapper built directly on the Linux system calls, so the
+ * library doesn't depend on liburing. Only what libhasher needs is provided:
+ * fixed (registered) buffers and reads into them. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Structure containing an io_uring instance and the mappings of its rings.
+ * @field fd        The io_uring file descriptor, or -1 when not set up.
+ * @field pending   The number of reads queued by Uring_read_fixed that haven't
+ *                  been submitted to the kernel yet.
+ * @field sqRing    The mapping of the submission queue ring.
+ * @field cqRing    The mapping of the completion queue ring. Can be the same
+ *                  as sqRing when the kernel maps both rings at once.
+ * @field sqes      The mapping of the submission queue entries.
+ * @field sqRingSize The size of the sqRing mapping.
+ * @field cqRingSize The size of the cqRing mapping.
+ * @field sqesSize   The size of the sqes mapping.
+ * @field sqHead     The head of the submission queue, moved by the kernel.
+ * @field sqTail     The tail of the submission queue, moved by Uring_submit.
+ * @field sqMask     The mask applied to the submission queue head and tail.
+ * @field sqArray    The indexes of the queued submission queue entries.
+ * @field cqHead     The head of the completion queue, moved by Uring_complete.
+ * @field cqTail     The tail of the completion queue, moved by the kernel.
+ * @field cqMask     The mask applied to the completion queue head and tail.
+ * @field cqes       The completion queue entries.
+ */
+typedef struct Uring {
+    int fd;
+    uint32_t pending;
+    void* sqRing;
+    void* cqRing;
+    void* sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t* sqMask;
+    uint32_t* sqArray;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t* cqMask;
+    void* cqes;
+} Uring;
+
+/**
+ * Releases the io_uring instance and unmaps its rings. Reads still in flight
+ * should be waited for with Uring_submit and Uring_complete first, since their
+ * buffers are written to until they complete.
+ * @param ring The structure to release. Does nothing if it wasn't set up.
+ */
+void Uring_close(Uring* ring);
+
+/**
+ * Takes the next completed read off the completion queue, if there is one.
+ * @param ring   The io_uring instance.
+ * @param tag    Receives the tag the read was queued with.
+ * @param result Receives the number of bytes read, or a negated errno value
+ *               if the read failed.
+ * @returns 1 if a completion was returned or 0 if there are none waiting.
+ */
+int Uring_complete(Uring* ring, uint64_t* tag, int32_t* result);
+
+/**
+ * Sets up a new io_uring instance.
+ * @param ring    The structure to set up.
+ * @param entries The number of submission queue entries, which is the largest
+ *                number of reads that can be queued between submits.
+ * @returns 0 on success or -1 if the kernel doesn't support io_uring (or
+ *          refuses it), with errno set.
+ */
+int Uring_init(Uring* ring, uint32_t entries);
+
+/**
+ * Queues a read into a registered buffer. The read is only started by the next
+ * Uring_submit.
+ * @param ring   The io_uring instance.
+ * @param file   The open file to read.
+ * @param buffer The buffer receiving the data. Must lie within the registered
+ *               buffer selected by index.
+ * @param length The number of bytes to read.
+ * @param offset The offset in the file to read from.
+ * @param index  The index of the registered buffer containing buffer.
+ * @param tag    A value returned with the completion of the read.
+ * @returns 0 on success or -1 if the submission queue is full.
+ */
+int Uring_read_fixed(Uring* ring, int file, void* buffer, uint32_t length,
+    uint64_t offset, uint32_t index, uint64_t tag);
+
+/**
+ * Registers the buffers used by Uring_read_fixed, so the kernel maps them once
+ * instead of for every read.
+ * @param ring    The io_uring instance.
+ * @param buffers The buffers to register.
+ * @param count   The number of buffers.
+ * @returns 0 on success or -1 on failure (such as the buffers exceeding the
+ *          locked memory limit), with errno set.
+ */
+int Uring_register_buffers(Uring* ring, const struct iovec* buffers,
+    uint32_t count);
+
+/**
+ * Submits the queued reads to the kernel and optionally waits for reads to
+ * complete. Interrupted waits are retried.
+ * @param ring The io_uring instance.
+ * @param wait The number of completions to wait for, or 0 to return at once.
+ * @returns 0 on success or -1 on failure, with errno set.
+ */
+int Uring_submit(Uring* ring, uint32_t wait);
+
+#endif
@@ -133,6 +133,21 @@ EXPORT int HashFileWithAsyncIO(
 EXPORT int HashFileWithSyncIO(
     HashRequest* request, HashProgressCallback* callback);
 
+/**
+ * Writes a description of the hash kernel selected for each algorithm on this
+ * CPU to buffer, such as "crc32=pclmul md4=scalar md4-lanes=avx2 ...". The
+ * kernels are selected from the CPU features (restricted by the JMMHASHER_CPU
+ * environment variable, see cpu.h) and checked against known results the first
+ * time the library is used. A kernel that fails the check is replaced by the
+ * next best one and is never used.
+ * @param  buffer The buffer that receives the description. The description is
+ *                truncated, but always terminated, if it doesn't fit.
+ * @param  size   The size of the buffer in bytes.
+ * @return        Returns the length of the full description, not counting the
+ *                terminator.
+ */
+EXPORT uint32_t DescribeKernels(char* buffer, uint32_t size);
+
 #ifdef __cplusplus
 }
 #endif